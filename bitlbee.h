@@ -144,6 +144,7 @@ extern "C" {
 #include "sock.h"
 #include "misc.h"
 #include "proxy.h"
+#include "dns.h"
 
 typedef struct global {
 	/* In forked mode, child processes store the fd of the IPC socket here. */
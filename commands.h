@@ -41,6 +41,7 @@ extern command_t root_commands[];
 #define IRC_CMD_LOGGED_IN       2
 #define IRC_CMD_OPER_ONLY       4
 #define IRC_CMD_TO_MASTER       8
+#define IRC_CMD_AUTOMATIC       16
 
 #define IPC_CMD_TO_CHILDREN     1
 
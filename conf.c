@@ -68,6 +68,7 @@ conf_t *conf_load(int argc, char *argv[])
 	conf->ft_listen = NULL;
 	conf->protocols = NULL;
 	conf->cafile = NULL;
+	conf->ktls = FALSE;
 	proxytype = 0;
 
 	i = conf_loadini(conf, global.conf_file);
@@ -324,6 +325,12 @@ static int conf_loadini(conf_t *conf, char *file)
 			} else if (g_strcasecmp(ini->key, "cafile") == 0) {
 				g_free(conf->cafile);
 				conf->cafile = g_strdup(ini->value);
+			} else if (g_strcasecmp(ini->key, "kerneltls") == 0) {
+				if (!is_bool(ini->value)) {
+					fprintf(stderr, "Invalid %s value: %s\n", ini->key, ini->value);
+					return 0;
+				}
+				conf->ktls = bool2int(ini->value);
 			} else {
 				fprintf(stderr, "Error: Unknown setting `%s` in configuration file (line %d).\n",
 				        ini->key, ini->line);
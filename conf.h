@@ -53,6 +53,7 @@ typedef struct conf {
 	char *ft_listen;
 	char **protocols;
 	char *cafile;
+	gboolean ktls;
 } conf_t;
 
 G_GNUC_MALLOC conf_t *conf_load(int argc, char *argv[]);
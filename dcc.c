@@ -561,9 +561,10 @@ file_transfer_t *dcc_request(struct im_connection *ic, char* const* ctcp)
 		port = ctcp[4];
 		filesize = atoll(ctcp[5]);
 
+		/* Only addresses here, a hostname would need a DNS lookup. */
 		memset(&hints, 0, sizeof(struct addrinfo));
 		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_flags = AI_NUMERICSERV;
+		hints.ai_flags = AI_NUMERICSERV | AI_NUMERICHOST;
 
 		if ((gret = getaddrinfo(host, port, &hints, &rp))) {
 			imcb_log(ic, "DCC: getaddrinfo() failed with %s "
@@ -27,6 +27,7 @@
 #include "bitlbee.h"
 #include "ipc.h"
 #include "commands.h"
+#include "ssl_client.h"
 #include <sys/uio.h>
 #include <sys/un.h>
 
@@ -113,6 +114,8 @@ void ipc_master_cmd_rehash(irc_t *data, char **cmd)
 		global.conf->runmode = oldmode;
 	}
 
+	ssl_reload();
+
 	if (global.conf->runmode == RUNMODE_FORKDAEMON) {
 		ipc_to_children(cmd);
 	}
@@ -289,6 +292,8 @@ static void ipc_child_cmd_rehash(irc_t *irc, char **cmd)
 	global.conf = conf_load(0, NULL);
 
 	global.conf->runmode = oldmode;
+
+	ssl_reload();
 }
 
 static void ipc_child_cmd_kill(irc_t *irc, char **cmd)
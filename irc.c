@@ -32,6 +32,7 @@ GSList *irc_connection_list;
 GSList *irc_plugins;
 
 static gboolean irc_userping(gpointer _irc, gint fd, b_input_condition cond);
+static char *set_eval_idle_timeout(set_t *set, char *value);
 static char *set_eval_charset(set_t *set, char *value);
 static char *set_eval_password(set_t *set, char *value);
 static char *set_eval_bw_compat(set_t *set, char *value);
@@ -56,7 +57,7 @@ irc_t *irc_new(int fd)
 	irc->r_watch_source_id = b_input_add(irc->fd, B_EV_IO_READ, bitlbee_io_current_client_read, irc);
 
 	irc->status = USTATUS_OFFLINE;
-	irc->last_pong = gettime();
+	irc->last_pong = irc->last_input = gettime();
 
 	irc->nick_user_hash = g_hash_table_new(g_str_hash, g_str_equal);
 	irc->watches = g_hash_table_new(g_str_hash, g_str_equal);
@@ -110,6 +111,7 @@ irc_t *irc_new(int fd)
 	s = set_add(&b->set, "display_namechanges", "false", set_eval_bool, irc);
 	s = set_add(&b->set, "display_timestamps", "true", set_eval_bool, irc);
 	s = set_add(&b->set, "handle_unknown", "add_channel", NULL, irc);
+	s = set_add(&b->set, "idle_timeout", "600", set_eval_idle_timeout, irc);
 	s = set_add(&b->set, "last_version", "0", NULL, irc);
 	s->flags |= SET_HIDDEN;
 	s = set_add(&b->set, "lcnicks", "true", set_eval_bool, irc);
@@ -217,6 +219,10 @@ void irc_abort(irc_t *irc, int immed, char *format, ...)
 	} else {
 		b_event_remove(irc->ping_source_id);
 		irc->ping_source_id = b_timeout_add(1, (b_event_handler) irc_free, irc);
+		if (irc->idle_source_id > 0) {
+			b_event_remove(irc->idle_source_id);
+			irc->idle_source_id = 0;
+		}
 	}
 }
 
@@ -265,6 +271,9 @@ void irc_free(irc_t * irc)
 	if (irc->ping_source_id > 0) {
 		b_event_remove(irc->ping_source_id);
 	}
+	if (irc->idle_source_id > 0) {
+		b_event_remove(irc->idle_source_id);
+	}
 	if (irc->r_watch_source_id > 0) {
 		b_event_remove(irc->r_watch_source_id);
 	}
@@ -880,6 +889,66 @@ static gboolean irc_userping(gpointer _irc, gint fd, b_input_condition cond)
 	return TRUE;
 }
 
+static gboolean irc_idle_check(gpointer _irc, gint fd, b_input_condition cond)
+{
+	irc_t *irc = _irc;
+	int idle = set_getint(&irc->b->set, "idle_timeout");
+	double left = irc->last_input + idle - gettime();
+
+	irc->idle_source_id = 0;
+	if (idle <= 0) {
+		return FALSE;
+	}
+
+	if (left > 0) {
+		/* There was input since we started, try again later. */
+		irc->idle_source_id = b_timeout_add(left * 1000 + 1, irc_idle_check, irc);
+	} else {
+		bee_set_idle(irc->b, TRUE);
+	}
+
+	return FALSE;
+}
+
+/* Starts the idle_timeout timer unless it's running already. It's not
+   restarted for every line, irc_idle_check() just looks at last_input. */
+static void irc_idle_start(irc_t *irc)
+{
+	int idle = set_getint(&irc->b->set, "idle_timeout");
+
+	if (irc->idle_source_id == 0 && idle > 0) {
+		irc->idle_source_id = b_timeout_add(idle * 1000, irc_idle_check, irc);
+	}
+}
+
+/* For every command the user sent (and not the client by itself). */
+void irc_set_active(irc_t *irc)
+{
+	irc->last_input = gettime();
+	bee_set_idle(irc->b, FALSE);
+	irc_idle_start(irc);
+}
+
+static char *set_eval_idle_timeout(set_t *set, char *value)
+{
+	irc_t *irc = set->data;
+
+	if (set_eval_int(set, value) == SET_INVALID) {
+		return SET_INVALID;
+	}
+
+	/* Restart with the new value, counting from the last input. */
+	if (irc->idle_source_id > 0) {
+		b_event_remove(irc->idle_source_id);
+		irc->idle_source_id = 0;
+	}
+	if (atoi(value) > 0) {
+		irc->idle_source_id = b_timeout_add(1, irc_idle_check, irc);
+	}
+
+	return value;
+}
+
 static char *set_eval_charset(set_t *set, char *value)
 {
 	irc_t *irc = (irc_t *) set->data;
@@ -112,6 +112,9 @@ typedef struct irc {
 
 	struct bee *b;
 	guint32 caps;
+
+	double last_input; /* Not counting IRC_CMD_AUTOMATIC, for the idle_timeout setting. */
+	gint idle_source_id;
 } irc_t;
 
 typedef enum {
@@ -273,6 +276,7 @@ void irc_free(irc_t *irc);
 void irc_setpass(irc_t *irc, const char *pass);
 
 void irc_process(irc_t *irc);
+void irc_set_active(irc_t *irc);
 char **irc_parse_line(char *line);
 char *irc_build_line(char **cmd);
 
@@ -298,6 +302,7 @@ irc_channel_t *irc_channel_get(irc_t *irc, char *id);
 int irc_channel_free(irc_channel_t *ic);
 void irc_channel_free_soon(irc_channel_t *ic);
 int irc_channel_add_user(irc_channel_t *ic, irc_user_t *iu);
+int irc_channel_add_users(irc_channel_t *ic, GSList *users);
 int irc_channel_del_user(irc_channel_t *ic, irc_user_t *iu, irc_channel_del_user_type_t type, const char *msg);
 irc_channel_user_t *irc_channel_has_user(irc_channel_t *ic, irc_user_t *iu);
 struct irc_channel *irc_channel_with_user(irc_t *irc, irc_user_t *iu);
@@ -254,6 +254,64 @@ int irc_channel_add_user(irc_channel_t *ic, irc_user_t *iu)
 	return 1;
 }
 
+/* Same as irc_channel_add_user() for a list of users, but adds them to the
+   (sorted) user list in one go. If this list includes the user, the others
+   are just part of the NAMES reply instead of getting a JOIN each. */
+int irc_channel_add_users(irc_channel_t *ic, GSList *users)
+{
+	irc_t *irc = ic->irc;
+	GHashTable *seen;
+	GSList *added = NULL, *l;
+	gboolean self = FALSE;
+	int n = 0;
+
+	/* Can't rely on the order of ic->users for this, renames don't
+	   re-sort it. */
+	seen = g_hash_table_new(NULL, NULL);
+	for (l = ic->users; l; l = l->next) {
+		irc_user_t *iu = ((irc_channel_user_t *) l->data)->iu;
+		g_hash_table_insert(seen, iu, iu);
+	}
+
+	for (l = users; l; l = l->next) {
+		irc_user_t *iu = l->data;
+		irc_channel_user_t *icu;
+
+		if (g_hash_table_lookup(seen, iu)) {
+			continue;
+		}
+		g_hash_table_insert(seen, iu, iu);
+
+		icu = g_new0(irc_channel_user_t, 1);
+		icu->iu = iu;
+		added = g_slist_prepend(added, icu);
+
+		if (iu == irc->user) {
+			self = TRUE;
+		}
+		n++;
+	}
+	g_hash_table_destroy(seen);
+
+	added = g_slist_reverse(added);
+	ic->users = g_slist_sort(g_slist_concat(ic->users, g_slist_copy(added)),
+	                         irc_channel_user_cmp);
+
+	irc_channel_update_ops(ic, set_getstr(&irc->b->set, "ops"));
+
+	if (ic->flags & IRC_CHANNEL_JOINED) {
+		for (l = added; l; l = l->next) {
+			irc_send_join(ic, ((irc_channel_user_t *) l->data)->iu);
+		}
+	} else if (self) {
+		ic->flags |= IRC_CHANNEL_JOINED;
+		irc_send_join(ic, irc->user);
+	}
+	g_slist_free(added);
+
+	return n;
+}
+
 int irc_channel_del_user(irc_channel_t *ic, irc_user_t *iu, irc_channel_del_user_type_t type, const char *msg)
 {
 	irc_channel_user_t *icu;
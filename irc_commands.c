@@ -28,6 +28,7 @@
 #include "help.h"
 #include "ipc.h"
 #include "base64.h"
+#include "ssl_client.h"
 
 static void irc_cmd_pass(irc_t *irc, char **cmd)
 {
@@ -764,6 +765,24 @@ static void irc_cmd_list(irc_t *irc, char **cmd)
 	irc_send_num(irc, 323, ":%s", "End of /LIST");
 }
 
+static void irc_cmd_stats(irc_t *irc, char **cmd)
+{
+	char *what = cmd[1] ? cmd[1] : "*";
+
+	if (g_strcasecmp(what, "t") == 0) {
+		struct ssl_cache_stats st;
+
+		ssl_cache_stats(&st);
+		irc_send_num(irc, 249, "t :TLS handshakes: %d, resumed: %d (%d%%), sessions cached: %d, kernel TLS: %d",
+		             st.handshakes, st.resumed,
+		             st.handshakes ? st.resumed * 100 / st.handshakes : 0, st.entries, st.ktls);
+		irc_send_num(irc, 249, "t :Certificates verified: %d cached, %d verifications skipped",
+		             st.verified, st.verify_hits);
+	}
+
+	irc_send_num(irc, 219, "%s :End of /STATS report", what);
+}
+
 static void irc_cmd_version(irc_t *irc, char **cmd)
 {
 	irc_send_num(irc, 351, "%s-%s. %s :%s/%s ",
@@ -810,8 +829,8 @@ static const command_t irc_commands[] = {
 	{ "user",        4, irc_cmd_user,        IRC_CMD_PRE_LOGIN },
 	{ "nick",        1, irc_cmd_nick,        0 },
 	{ "quit",        0, irc_cmd_quit,        0 },
-	{ "ping",        0, irc_cmd_ping,        0 },
-	{ "pong",        0, irc_cmd_pong,        IRC_CMD_LOGGED_IN },
+	{ "ping",        0, irc_cmd_ping,        IRC_CMD_AUTOMATIC },
+	{ "pong",        0, irc_cmd_pong,        IRC_CMD_LOGGED_IN | IRC_CMD_AUTOMATIC },
 	{ "join",        1, irc_cmd_join,        IRC_CMD_LOGGED_IN },
 	{ "names",       1, irc_cmd_names,       IRC_CMD_LOGGED_IN },
 	{ "part",        1, irc_cmd_part,        IRC_CMD_LOGGED_IN },
@@ -819,7 +838,7 @@ static const command_t irc_commands[] = {
 	{ "whowas",      1, irc_cmd_whowas,      IRC_CMD_LOGGED_IN },
 	{ "motd",        0, irc_cmd_motd,        IRC_CMD_LOGGED_IN },
 	{ "mode",        1, irc_cmd_mode,        IRC_CMD_LOGGED_IN },
-	{ "who",         0, irc_cmd_who,         IRC_CMD_LOGGED_IN },
+	{ "who",         0, irc_cmd_who,         IRC_CMD_LOGGED_IN | IRC_CMD_AUTOMATIC },
 	{ "privmsg",     1, irc_cmd_privmsg,     IRC_CMD_LOGGED_IN },
 	{ "notice",      1, irc_cmd_notice,      IRC_CMD_LOGGED_IN },
 	{ "nickserv",    1, irc_cmd_nickserv,    IRC_CMD_LOGGED_IN },
@@ -827,14 +846,15 @@ static const command_t irc_commands[] = {
 	{ "away",        0, irc_cmd_away,        IRC_CMD_LOGGED_IN },
 	{ "version",     0, irc_cmd_version,     IRC_CMD_LOGGED_IN },
 	{ "completions", 0, irc_cmd_completions, IRC_CMD_LOGGED_IN },
-	{ "userhost",    1, irc_cmd_userhost,    IRC_CMD_LOGGED_IN },
-	{ "ison",        1, irc_cmd_ison,        IRC_CMD_LOGGED_IN },
-	{ "watch",       1, irc_cmd_watch,       IRC_CMD_LOGGED_IN },
+	{ "userhost",    1, irc_cmd_userhost,    IRC_CMD_LOGGED_IN | IRC_CMD_AUTOMATIC },
+	{ "ison",        1, irc_cmd_ison,        IRC_CMD_LOGGED_IN | IRC_CMD_AUTOMATIC },
+	{ "watch",       1, irc_cmd_watch,       IRC_CMD_LOGGED_IN | IRC_CMD_AUTOMATIC },
 	{ "invite",      2, irc_cmd_invite,      IRC_CMD_LOGGED_IN },
 	{ "kick",        2, irc_cmd_kick,        IRC_CMD_LOGGED_IN },
 	{ "topic",       1, irc_cmd_topic,       IRC_CMD_LOGGED_IN },
 	{ "oper",        2, irc_cmd_oper,        IRC_CMD_LOGGED_IN },
 	{ "list",        0, irc_cmd_list,        IRC_CMD_LOGGED_IN },
+	{ "stats",       0, irc_cmd_stats,       IRC_CMD_LOGGED_IN },
 	{ "die",         0, NULL,                IRC_CMD_OPER_ONLY | IRC_CMD_TO_MASTER },
 	{ "deaf",        0, NULL,                IRC_CMD_OPER_ONLY | IRC_CMD_TO_MASTER },
 	{ "wallops",     1, NULL,                IRC_CMD_OPER_ONLY | IRC_CMD_TO_MASTER },
@@ -862,6 +882,12 @@ void irc_exec(irc_t *irc, char *cmd[])
 			}
 			n_arg--;
 
+			/* Clients send these by themselves, so they don't
+			   mean the user's around. */
+			if (!(irc_commands[i].flags & IRC_CMD_AUTOMATIC)) {
+				irc_set_active(irc);
+			}
+
 			if (irc_commands[i].flags & IRC_CMD_PRE_LOGIN && irc->status & USTATUS_LOGGED_IN) {
 				irc_send_num(irc, 462, ":Only allowed before logging in");
 			} else if (irc_commands[i].flags & IRC_CMD_LOGGED_IN && !(irc->status & USTATUS_LOGGED_IN)) {
@@ -882,6 +908,7 @@ void irc_exec(irc_t *irc, char *cmd[])
 		}
 	}
 
+	irc_set_active(irc);
 	if (irc->status & USTATUS_LOGGED_IN) {
 		irc_send_num(irc, 421, "%s :Unknown command", cmd[0]);
 	}
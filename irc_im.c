@@ -697,6 +697,27 @@ static gboolean bee_irc_chat_add_user(bee_t *bee, struct groupchat *c, bee_user_
 	return TRUE;
 }
 
+static gboolean bee_irc_chat_add_users(bee_t *bee, struct groupchat *c, GSList *users)
+{
+	irc_t *irc = bee->ui_data;
+	irc_channel_t *ic = c->ui_data;
+	GSList *ius = NULL, *l;
+
+	if (ic == NULL) {
+		return FALSE;
+	}
+
+	for (l = users; l; l = l->next) {
+		bee_user_t *bu = l->data;
+
+		ius = g_slist_prepend(ius, bu == bee->user ? irc->user : bu->ui_data);
+	}
+	irc_channel_add_users(ic, ius);
+	g_slist_free(ius);
+
+	return TRUE;
+}
+
 static gboolean bee_irc_chat_remove_user(bee_t *bee, struct groupchat *c, bee_user_t *bu, const char *reason)
 {
 	irc_t *irc = bee->ui_data;
@@ -1115,6 +1136,28 @@ static void bee_irc_log(bee_t *bee, const char *tag, const char *msg)
 	irc_rootmsg(irc, "%s - %s", tag, msg);
 }
 
+/* Files go next to the user's own .xml file, as long as there is one. */
+static char *bee_irc_data_path(bee_t *bee, const char *name)
+{
+	irc_t *irc = (irc_t *) bee->ui_data;
+	char *nick, *path;
+
+	if (!(irc->status & USTATUS_IDENTIFIED)) {
+		return NULL;
+	}
+
+	nick = g_strdup(irc->user->nick);
+	nick_lc(NULL, nick);
+
+	/* Nicks can't contain dots, so this can't clash with anything else
+	   in the config directory. storage_xml cleans these up when the
+	   user drops the account. */
+	path = g_strdup_printf("%s%s.%s", global.conf->configdir, nick, name);
+	g_free(nick);
+
+	return path;
+}
+
 const struct bee_ui_funcs irc_ui_funcs = {
 	bee_irc_imc_connected,
 	bee_irc_imc_disconnected,
@@ -1145,4 +1188,7 @@ const struct bee_ui_funcs irc_ui_funcs = {
 	bee_irc_ft_finished,
 
 	bee_irc_log,
+	bee_irc_data_path,
+
+	bee_irc_chat_add_users,
 };
@@ -0,0 +1,1181 @@
+/********************************************************************\
+  * BitlBee -- An IRC to other IM-networks gateway                     *
+  *                                                                    *
+  * Copyright 2002-2013 Wilmer van der Gaast and others                *
+  \********************************************************************/
+
+/* Asynchronous DNS resolver                                            */
+
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License with
+  the Debian GNU/Linux distribution in /usr/share/common-licenses/GPL;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St.,
+  Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* getaddrinfo() and res_query() block until the nameserver answers, and
+   since everything runs in one thread that means every connection of
+   every user has to wait for it. This does the same thing from the event
+   loop instead: every question goes out in a UDP packet on its own socket
+   (so it gets a random source port), and the answer gets parsed when it
+   comes back, or the next nameserver gets asked after DNS_TIMEOUT.
+
+   A lookup can need more than one question (A and AAAA, or more names
+   because of search domains). Questions that are already on their way get
+   shared by all lookups that need them, and the answers are cached per
+   question for as long as their TTL, so it doesn't matter whether they
+   came from an address or an SRV lookup.
+
+   It doesn't do TCP, so answers that don't fit in a UDP packet, like
+   everything else the nameservers can't answer, go to getaddrinfo() in a
+   child process. That's also the only time nsswitch.conf gets a say. */
+
+#define BITLBEE_CORE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bitlbee.h"
+#include "dns.h"
+
+#define DNS_T_A 1
+#define DNS_T_CNAME 5
+#define DNS_T_SOA 6
+#define DNS_T_AAAA 28
+#define DNS_T_SRV 33
+#define DNS_C_IN 1
+
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_PACKET_MAX 4096
+#define DNS_NAME_MAX 255
+#define DNS_MAX_SERVERS 3
+
+#define DNS_RESOLV_CONF "/etc/resolv.conf"
+#define DNS_HOSTS "/etc/hosts"
+
+#define DNS_GET16(p) (((p)[0] << 8) | (p)[1])
+#define DNS_GET32(p) (((guint32) (p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8) | (p)[3])
+
+struct dns_answer {
+	int type;
+	int len;
+	unsigned char data[];   /* The address, or for SRV records priority,
+	                           weight, port and the target as a string */
+};
+
+struct dns_cache_entry {
+	time_t expires;
+	GSList *answers;        /* Empty for negative answers */
+};
+
+/* One question for the nameservers, on behalf of one or more lookups. */
+struct dns_query {
+	char *key;
+	char *name;
+	int type;
+	guint16 id;
+	int fd;
+	gint inpa, timer;
+	int attempt;
+	GSList *requests;       /* IDs, some of them may be cancelled already */
+};
+
+struct dns_request {
+	gint id;
+	int type;               /* DNS_T_A (means A and/or AAAA) or DNS_T_SRV */
+	int family, port;
+	dns_addr_func addr_func;
+	dns_srv_func srv_func;
+	gpointer data;
+	char **names;           /* To try in this order, because of search domains */
+	int name;
+	int pending;            /* Questions still unanswered for names[name] */
+	GSList *answers;        /* The answers for names[name] so far */
+	struct addrinfo *res;   /* From /etc/hosts or a numeric address */
+	gint timer;
+	char *host;             /* As asked, for the getaddrinfo() fallback */
+	gboolean failed;        /* Some question didn't get any answer */
+	int fallback_fd;
+	gint fallback_inpa;
+	GString *fallback_buf;
+};
+
+static struct sockaddr_storage dns_servers[DNS_MAX_SERVERS];
+static socklen_t dns_server_len[DNS_MAX_SERVERS];
+static int dns_server_count;
+static char **dns_search;
+static int dns_ndots = 1;
+static gboolean dns_conf_read, dns_conf_fixed;
+static time_t dns_conf_mtime;
+
+static GHashTable *dns_cache;           /* Key -> struct dns_cache_entry */
+static GHashTable *dns_queries;         /* Key -> struct dns_query */
+static GHashTable *dns_requests;        /* ID -> struct dns_request */
+static gint dns_next_id = 1;
+static int dns_query_count, dns_hit_count;
+
+static void dns_query_send(struct dns_query *q);
+static void dns_request_next(struct dns_request *r);
+
+static void dns_add_server(const char *spec)
+{
+	char *addr = g_strdup(spec), *host = addr, *port = NULL, *s;
+	struct sockaddr_in *sin = (struct sockaddr_in *) &dns_servers[dns_server_count];
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &dns_servers[dns_server_count];
+
+	if (dns_server_count >= DNS_MAX_SERVERS) {
+		g_free(addr);
+		return;
+	}
+
+	/* [v6]:port, v4:port or just an address. */
+	if (*host == '[' && (s = strchr(host, ']'))) {
+		*s = '\0';
+		host++;
+		if (s[1] == ':') {
+			port = s + 2;
+		}
+	} else if ((s = strchr(host, ':')) && !strchr(s + 1, ':')) {
+		*s = '\0';
+		port = s + 1;
+	}
+
+	memset(&dns_servers[dns_server_count], 0, sizeof(struct sockaddr_storage));
+	if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port ? atoi(port) : 53);
+		dns_server_len[dns_server_count++] = sizeof(struct sockaddr_in);
+	} else if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port ? atoi(port) : 53);
+		dns_server_len[dns_server_count++] = sizeof(struct sockaddr_in6);
+	}
+
+	g_free(addr);
+}
+
+/* (Re)reads /etc/resolv.conf if it changed. Only the nameserver, search,
+   domain and ndots settings matter here. */
+static void dns_read_conf(void)
+{
+	struct stat st;
+	time_t mtime = stat(DNS_RESOLV_CONF, &st) == 0 ? st.st_mtime : 0;
+	char line[1024], *key, *value;
+	GPtrArray *search;
+	FILE *f;
+
+	if (dns_conf_fixed || (dns_conf_read && mtime == dns_conf_mtime)) {
+		return;
+	}
+	dns_conf_read = TRUE;
+	dns_conf_mtime = mtime;
+
+	dns_server_count = 0;
+	g_strfreev(dns_search);
+	dns_search = NULL;
+	dns_ndots = 1;
+
+	if ((f = fopen(DNS_RESOLV_CONF, "r"))) {
+		while (fgets(line, sizeof(line), f)) {
+			if (!(key = strtok(line, " \t\r\n")) || *key == '#' || *key == ';') {
+				continue;
+			}
+
+			if (strcmp(key, "nameserver") == 0 && (value = strtok(NULL, " \t\r\n"))) {
+				dns_add_server(value);
+			} else if (strcmp(key, "search") == 0 || strcmp(key, "domain") == 0) {
+				/* Whichever comes last wins. */
+				search = g_ptr_array_new();
+				while ((value = strtok(NULL, " \t\r\n"))) {
+					g_ptr_array_add(search, g_strdup(value));
+				}
+				g_ptr_array_add(search, NULL);
+				g_strfreev(dns_search);
+				dns_search = (char **) g_ptr_array_free(search, FALSE);
+			} else if (strcmp(key, "options") == 0) {
+				while ((value = strtok(NULL, " \t\r\n"))) {
+					if (g_str_has_prefix(value, "ndots:")) {
+						dns_ndots = atoi(value + 6);
+					}
+				}
+			}
+		}
+		fclose(f);
+	}
+
+	/* Same default as libc. */
+	if (dns_server_count == 0) {
+		dns_add_server("127.0.0.1");
+	}
+}
+
+void dns_set_servers(const char *servers)
+{
+	char **list;
+	int i;
+
+	dns_cache_flush();
+
+	if (servers == NULL) {
+		dns_conf_fixed = dns_conf_read = FALSE;
+		return;
+	}
+
+	dns_conf_fixed = TRUE;
+	dns_server_count = 0;
+	g_strfreev(dns_search);
+	dns_search = NULL;
+	dns_ndots = 1;
+
+	list = g_strsplit(servers, " ", 0);
+	for (i = 0; list[i]; i++) {
+		if (*list[i]) {
+			dns_add_server(list[i]);
+		}
+	}
+	g_strfreev(list);
+
+	if (dns_server_count == 0) {
+		dns_add_server("127.0.0.1");
+	}
+}
+
+static struct addrinfo *dns_addrinfo_new(int family, const void *addr, int port)
+{
+	struct addrinfo *ai = g_malloc0(sizeof(struct addrinfo) + sizeof(struct sockaddr_in6));
+
+	ai->ai_family = family;
+	ai->ai_socktype = SOCK_STREAM;
+	ai->ai_protocol = IPPROTO_TCP;
+	ai->ai_addr = (struct sockaddr *) (ai + 1);
+
+	if (family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *) ai->ai_addr;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		memcpy(&sin->sin_addr, addr, 4);
+		ai->ai_addrlen = sizeof(struct sockaddr_in);
+	} else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ai->ai_addr;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		memcpy(&sin6->sin6_addr, addr, 16);
+		ai->ai_addrlen = sizeof(struct sockaddr_in6);
+	}
+
+	return ai;
+}
+
+void dns_freeaddrinfo(struct addrinfo *res)
+{
+	struct addrinfo *next;
+
+	while (res) {
+		next = res->ai_next;
+		g_free(res);
+		res = next;
+	}
+}
+
+/* TRUE if host is a numeric address, *res is set to it if it's also of
+   the right family. */
+static gboolean dns_numeric(const char *host, int port, int family, struct addrinfo **res)
+{
+	unsigned char addr[16];
+
+	if (inet_pton(AF_INET, host, addr) == 1) {
+		*res = family != AF_INET6 ? dns_addrinfo_new(AF_INET, addr, port) : NULL;
+	} else if (inet_pton(AF_INET6, host, addr) == 1) {
+		*res = family != AF_INET ? dns_addrinfo_new(AF_INET6, addr, port) : NULL;
+	} else {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static struct addrinfo *dns_hosts_lookup(const char *name, int port, int family)
+{
+	struct addrinfo *res = NULL, **tail = &res;
+	char line[1024], *addr, *alias, *s;
+	FILE *f;
+
+	if (!(f = fopen(DNS_HOSTS, "r"))) {
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if ((s = strchr(line, '#'))) {
+			*s = '\0';
+		}
+		if (!(addr = strtok(line, " \t\r\n"))) {
+			continue;
+		}
+
+		while ((alias = strtok(NULL, " \t\r\n"))) {
+			if (g_ascii_strcasecmp(alias, name) == 0) {
+				if (dns_numeric(addr, port, family, tail) && *tail) {
+					tail = &(*tail)->ai_next;
+				}
+				break;
+			}
+		}
+	}
+	fclose(f);
+
+	return res;
+}
+
+static char *dns_key(int type, const char *name)
+{
+	char *lower = g_ascii_strdown(name, -1), *key;
+
+	key = g_strdup_printf("%d %s", type, lower);
+	g_free(lower);
+	return key;
+}
+
+static struct dns_answer *dns_answer_new(int type, const void *data, int len)
+{
+	struct dns_answer *a = g_malloc(sizeof(struct dns_answer) + len);
+
+	a->type = type;
+	a->len = len;
+	memcpy(a->data, data, len);
+	return a;
+}
+
+static GSList *dns_answers_copy(GSList *answers, GSList *to)
+{
+	struct dns_answer *a;
+
+	for (; answers; answers = answers->next) {
+		a = answers->data;
+		to = g_slist_append(to, dns_answer_new(a->type, a->data, a->len));
+	}
+
+	return to;
+}
+
+static void dns_answers_free(GSList *answers)
+{
+	GSList *l;
+
+	for (l = answers; l; l = l->next) {
+		g_free(l->data);
+	}
+	g_slist_free(answers);
+}
+
+static void dns_cache_entry_free(gpointer data)
+{
+	struct dns_cache_entry *e = data;
+
+	dns_answers_free(e->answers);
+	g_free(e);
+}
+
+static gboolean dns_cache_expired(gpointer key, gpointer value, gpointer now)
+{
+	return ((struct dns_cache_entry *) value)->expires <= *(time_t *) now;
+}
+
+static void dns_cache_store(const char *key, GSList *answers, int ttl)
+{
+	struct dns_cache_entry *e;
+	time_t now = time(NULL);
+
+	if (ttl <= 0) {
+		return;
+	}
+
+	if (dns_cache == NULL) {
+		dns_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, dns_cache_entry_free);
+	}
+
+	if (g_hash_table_size(dns_cache) >= DNS_CACHE_MAX_ENTRIES) {
+		g_hash_table_foreach_remove(dns_cache, dns_cache_expired, &now);
+		if (g_hash_table_size(dns_cache) >= DNS_CACHE_MAX_ENTRIES) {
+			g_hash_table_remove_all(dns_cache);
+		}
+	}
+
+	e = g_new0(struct dns_cache_entry, 1);
+	e->expires = now + MIN(ttl, DNS_CACHE_MAX_TTL);
+	e->answers = dns_answers_copy(answers, NULL);
+	g_hash_table_replace(dns_cache, g_strdup(key), e);
+}
+
+static struct dns_cache_entry *dns_cache_lookup(const char *key)
+{
+	struct dns_cache_entry *e;
+
+	if (dns_cache == NULL || !(e = g_hash_table_lookup(dns_cache, key))) {
+		return NULL;
+	}
+
+	if (e->expires <= time(NULL)) {
+		g_hash_table_remove(dns_cache, key);
+		return NULL;
+	}
+
+	return e;
+}
+
+void dns_cache_flush(void)
+{
+	if (dns_cache) {
+		g_hash_table_remove_all(dns_cache);
+	}
+}
+
+void dns_stats(struct dns_stats *st)
+{
+	st->entries = dns_cache ? g_hash_table_size(dns_cache) : 0;
+	st->queries = dns_query_count;
+	st->hits = dns_hit_count;
+}
+
+/* Puts a question for name in buf. Returns its length, or 0 if that's
+   not a valid name. */
+static int dns_build_query(unsigned char *buf, guint16 id, const char *name, int type)
+{
+	int pos = 12, len;
+	const char *s;
+
+	memset(buf, 0, 12);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 0x01;          /* Recursion desired */
+	buf[5] = 1;             /* One question */
+
+	for (s = name; *s; s += len + (s[len] == '.')) {
+		len = strcspn(s, ".");
+		if (len == 0 || len > 63 || pos - 12 + len + 2 > DNS_NAME_MAX) {
+			return 0;
+		}
+		buf[pos++] = len;
+		memcpy(buf + pos, s, len);
+		pos += len;
+	}
+	if (pos == 12) {
+		return 0;
+	}
+
+	buf[pos++] = 0;
+	buf[pos++] = type >> 8;
+	buf[pos++] = type & 0xff;
+	buf[pos++] = 0;
+	buf[pos++] = DNS_C_IN;
+
+	return pos;
+}
+
+/* Reads the (possibly compressed) name at pos into out, without the final
+   dot. Returns the position after it, or -1 if it's broken. */
+static int dns_read_name(const unsigned char *msg, int len, int pos, char *out, int out_len)
+{
+	int ret = -1, jumps = 0, n = 0, l;
+
+	while (TRUE) {
+		if (pos >= len) {
+			return -1;
+		}
+		l = msg[pos];
+
+		if ((l & 0xc0) == 0xc0) {
+			if (pos + 1 >= len || ++jumps > 16) {
+				return -1;
+			}
+			if (ret < 0) {
+				ret = pos + 2;
+			}
+			pos = ((l & 0x3f) << 8) | msg[pos + 1];
+		} else if (l & 0xc0) {
+			return -1;
+		} else if (l == 0) {
+			break;
+		} else {
+			if (pos + 1 + l > len || n + l + 2 > out_len) {
+				return -1;
+			}
+			if (n > 0) {
+				out[n++] = '.';
+			}
+			memcpy(out + n, msg + pos + 1, l);
+			n += l;
+			pos += l + 1;
+		}
+	}
+	out[n] = '\0';
+
+	return ret < 0 ? pos + 1 : ret;
+}
+
+static struct dns_answer *dns_parse_rdata(const unsigned char *msg, int len, int pos, int rdlen, int type)
+{
+	unsigned char buf[6 + DNS_NAME_MAX + 2];
+
+	if (type == DNS_T_A && rdlen == 4) {
+		return dns_answer_new(type, msg + pos, 4);
+	} else if (type == DNS_T_AAAA && rdlen == 16) {
+		return dns_answer_new(type, msg + pos, 16);
+	} else if (type == DNS_T_SRV && rdlen >= 7) {
+		memcpy(buf, msg + pos, 6);
+		if (dns_read_name(msg, len, pos + 6, (char *) buf + 6, sizeof(buf) - 6) < 0) {
+			return NULL;
+		}
+		return dns_answer_new(type, buf, 6 + strlen((char *) buf + 6) + 1);
+	}
+
+	return NULL;
+}
+
+/* Returns -1 if this isn't an answer to q (or garbage), 1 if the server
+   couldn't answer it, 2 if the answer didn't fit in the packet, and 0 if it
+   did. Then *answers has all the records of the type that was asked for
+   (following CNAMEs), or none if the name or the records don't exist, and
+   *ttl says how long that's true. */
+static int dns_parse(struct dns_query *q, const unsigned char *msg, int len, GSList **answers, int *ttl)
+{
+	char name[DNS_NAME_MAX + 2];
+	int pos, i, an, ns, type, rdlen, rcode;
+	guint32 rr_ttl, neg_ttl = DNS_NEGATIVE_TTL;
+	struct dns_answer *a;
+
+	if (len < 12 || DNS_GET16(msg) != q->id || !(msg[2] & 0x80) || DNS_GET16(msg + 4) != 1) {
+		return -1;
+	}
+	an = DNS_GET16(msg + 6);
+	ns = DNS_GET16(msg + 8);
+
+	/* Same question? Otherwise it may be spoofed. */
+	if ((pos = dns_read_name(msg, len, 12, name, sizeof(name))) < 0 || pos + 4 > len ||
+	    g_ascii_strcasecmp(name, q->name) != 0 || DNS_GET16(msg + pos) != q->type) {
+		return -1;
+	}
+	pos += 4;
+
+	rcode = msg[3] & 0x0f;
+	if (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN) {
+		return 1;
+	}
+
+	*answers = NULL;
+	*ttl = DNS_CACHE_MAX_TTL;
+
+	/* Stops early if the packet is truncated, what's there is still ok. */
+	for (i = 0; i < an + ns; i++) {
+		if ((pos = dns_read_name(msg, len, pos, name, sizeof(name))) < 0 || pos + 10 > len) {
+			break;
+		}
+		type = DNS_GET16(msg + pos);
+		rr_ttl = DNS_GET32(msg + pos + 4);
+		rdlen = DNS_GET16(msg + pos + 8);
+		pos += 10;
+		if (pos + rdlen > len) {
+			break;
+		}
+		if (rr_ttl > 0x7fffffff) {
+			rr_ttl = 0;
+		}
+
+		if (DNS_GET16(msg + pos - 8) != DNS_C_IN) {
+			/* Not interested. */
+		} else if (i < an && (type == q->type || type == DNS_T_CNAME)) {
+			if (type == q->type && (a = dns_parse_rdata(msg, len, pos, rdlen, type))) {
+				*answers = g_slist_append(*answers, a);
+			}
+			*ttl = MIN(*ttl, rr_ttl);
+		} else if (i >= an && type == DNS_T_SOA && rdlen >= 22) {
+			/* RFC 2308: the lower of the SOA TTL and its minimum field. */
+			neg_ttl = MIN(rr_ttl, DNS_GET32(msg + pos + rdlen - 4));
+		}
+		pos += rdlen;
+	}
+
+	if (*answers == NULL) {
+		if (msg[2] & 0x02) {
+			/* Truncated, so it's not really a negative answer. The
+			   other servers won't fit it in a packet either. */
+			return 2;
+		}
+		*ttl = MIN(neg_ttl, DNS_CACHE_MAX_TTL);
+	} else if (msg[2] & 0x02) {
+		/* Use it, but it's incomplete so don't cache it. */
+		*ttl = 0;
+	}
+
+	return 0;
+}
+
+static void dns_query_close(struct dns_query *q)
+{
+	if (q->inpa > 0) {
+		b_event_remove(q->inpa);
+		q->inpa = 0;
+	}
+	if (q->timer > 0) {
+		b_event_remove(q->timer);
+		q->timer = 0;
+	}
+	if (q->fd >= 0) {
+		closesocket(q->fd);
+		q->fd = -1;
+	}
+}
+
+static void dns_request_check(struct dns_request *r);
+
+/* Hands the answer to every lookup that's waiting for it. ok is FALSE if
+   no server could answer, then there are no answers but they're not
+   cached as negative either. */
+static void dns_query_done(struct dns_query *q, GSList *answers, int ttl, gboolean ok)
+{
+	struct dns_request *r;
+	GSList *l;
+
+	g_hash_table_remove(dns_queries, q->key);
+	dns_query_close(q);
+
+	if (ok) {
+		dns_cache_store(q->key, answers, ttl);
+	}
+
+	/* First give everyone the answers, and only then call back, since
+	   the callbacks can do anything to the cache or other lookups. */
+	for (l = q->requests; l; l = l->next) {
+		if ((r = g_hash_table_lookup(dns_requests, l->data))) {
+			r->answers = dns_answers_copy(answers, r->answers);
+			r->failed |= !ok;
+			r->pending--;
+		}
+	}
+	dns_answers_free(answers);
+
+	for (l = q->requests; l; l = l->next) {
+		if ((r = g_hash_table_lookup(dns_requests, l->data))) {
+			dns_request_check(r);
+		}
+	}
+
+	for (l = q->requests; l; l = l->next) {
+		g_free(l->data);
+	}
+	g_slist_free(q->requests);
+	g_free(q->key);
+	g_free(q->name);
+	g_free(q);
+}
+
+/* Asks the next server, or gives up. */
+static void dns_query_retry(struct dns_query *q)
+{
+	if (++q->attempt < dns_server_count * DNS_ATTEMPTS) {
+		dns_query_send(q);
+	} else {
+		dns_query_done(q, NULL, 0, FALSE);
+	}
+}
+
+static gboolean dns_query_timeout(gpointer data, gint fd, b_input_condition cond)
+{
+	struct dns_query *q = data;
+
+	q->timer = 0;
+	dns_query_retry(q);
+
+	return FALSE;
+}
+
+static gboolean dns_query_read(gpointer data, gint fd, b_input_condition cond)
+{
+	struct dns_query *q = data;
+	unsigned char buf[DNS_PACKET_MAX];
+	GSList *answers;
+	int len, ttl, st;
+
+	if ((len = recv(fd, buf, sizeof(buf), 0)) < 0) {
+		if (sockerr_again()) {
+			return TRUE;
+		}
+		/* Probably an ICMP error, this server isn't going to answer. */
+		dns_query_retry(q);
+		return FALSE;
+	}
+
+	if ((st = dns_parse(q, buf, len, &answers, &ttl)) < 0) {
+		return TRUE;
+	} else if (st == 2) {
+		dns_query_done(q, NULL, 0, FALSE);
+	} else if (st > 0) {
+		dns_query_retry(q);
+	} else {
+		dns_query_done(q, answers, ttl, TRUE);
+	}
+
+	return FALSE;
+}
+
+static void dns_query_send(struct dns_query *q)
+{
+	unsigned char buf[12 + DNS_NAME_MAX + 4];
+	int server = q->attempt % dns_server_count, len;
+	struct sockaddr *sa = (struct sockaddr *) &dns_servers[server];
+
+	dns_query_close(q);
+
+	q->id = g_random_int() & 0xffff;
+	len = dns_build_query(buf, q->id, q->name, q->type);
+
+	if (len > 0 && (q->fd = socket(sa->sa_family, SOCK_DGRAM, 0)) >= 0) {
+		sock_make_nonblocking(q->fd);
+		if (connect(q->fd, sa, dns_server_len[server]) == 0 && send(q->fd, buf, len, 0) == len) {
+			q->inpa = b_input_add(q->fd, B_EV_IO_READ, dns_query_read, q);
+			dns_query_count++;
+		} else {
+			event_debug("dns_query_send( \"%s\" ) failed: %s\n", q->name, strerror(errno));
+			closesocket(q->fd);
+			q->fd = -1;
+		}
+	}
+
+	if (len == 0) {
+		q->attempt = dns_server_count * DNS_ATTEMPTS;
+	}
+
+	/* If that didn't work, go to the next server right away (from the
+	   event loop, so nobody gets called back from here). */
+	q->timer = b_timeout_add(q->fd >= 0 ? DNS_TIMEOUT * 1000 : 0, dns_query_timeout, q);
+}
+
+/* Gets an answer for name/type from the cache or from an existing or new
+   query. In the last two cases, r->pending is decremented later. */
+static void dns_request_ask(struct dns_request *r, const char *name, int type)
+{
+	struct dns_cache_entry *e;
+	struct dns_query *q;
+	char *key = dns_key(type, name);
+
+	if ((e = dns_cache_lookup(key))) {
+		r->answers = dns_answers_copy(e->answers, r->answers);
+		r->pending--;
+		dns_hit_count++;
+		g_free(key);
+		return;
+	}
+
+	if (dns_queries == NULL) {
+		dns_queries = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+
+	if (!(q = g_hash_table_lookup(dns_queries, key))) {
+		q = g_new0(struct dns_query, 1);
+		q->key = key;
+		q->name = g_strdup(name);
+		q->type = type;
+		q->fd = -1;
+		g_hash_table_insert(dns_queries, q->key, q);
+		dns_query_send(q);
+	} else {
+		g_free(key);
+	}
+
+	q->requests = g_slist_prepend(q->requests, g_memdup(&r->id, sizeof(r->id)));
+}
+
+static void dns_request_next(struct dns_request *r)
+{
+	const char *name = r->names[r->name];
+
+	if (r->type == DNS_T_SRV) {
+		r->pending = 1;
+		dns_request_ask(r, name, DNS_T_SRV);
+	} else {
+		r->pending = r->family == AF_UNSPEC ? 2 : 1;
+		if (r->family != AF_INET) {
+			dns_request_ask(r, name, DNS_T_AAAA);
+		}
+		if (r->family != AF_INET6) {
+			dns_request_ask(r, name, DNS_T_A);
+		}
+	}
+}
+
+static void dns_request_free(struct dns_request *r)
+{
+	g_hash_table_remove(dns_requests, &r->id);
+	if (r->timer > 0) {
+		b_event_remove(r->timer);
+	}
+	if (r->fallback_inpa > 0) {
+		b_event_remove(r->fallback_inpa);
+	}
+	if (r->fallback_fd >= 0) {
+		close(r->fallback_fd);
+	}
+	if (r->fallback_buf) {
+		g_string_free(r->fallback_buf, TRUE);
+	}
+	g_free(r->host);
+	g_strfreev(r->names);
+	dns_answers_free(r->answers);
+	dns_freeaddrinfo(r->res);
+	g_free(r);
+}
+
+static struct addrinfo *dns_request_addrinfo(struct dns_request *r)
+{
+	struct addrinfo *res = NULL, **tail = &res;
+	struct dns_answer *a;
+	GSList *l;
+	int i;
+
+	/* IPv6 first, like getaddrinfo() usually does. */
+	for (i = 0; i < 2; i++) {
+		for (l = r->answers; l; l = l->next) {
+			a = l->data;
+			if (a->type == (i == 0 ? DNS_T_AAAA : DNS_T_A)) {
+				*tail = dns_addrinfo_new(a->type == DNS_T_A ? AF_INET : AF_INET6, a->data, r->port);
+				tail = &(*tail)->ai_next;
+			}
+		}
+	}
+
+	return res;
+}
+
+static struct ns_srv_reply **dns_request_srv(struct dns_request *r)
+{
+	struct ns_srv_reply **replies, *reply;
+	struct dns_answer *a;
+	GSList *l;
+	int n = 0;
+
+	replies = g_new0(struct ns_srv_reply *, g_slist_length(r->answers) + 1);
+	for (l = r->answers; l; l = l->next) {
+		a = l->data;
+
+		/* A target of "." means the service isn't there. */
+		if (a->data[6] == '\0') {
+			continue;
+		}
+
+		reply = g_malloc(sizeof(struct ns_srv_reply) + a->len - 6);
+		reply->prio = DNS_GET16(a->data);
+		reply->weight = DNS_GET16(a->data + 2);
+		reply->port = DNS_GET16(a->data + 4);
+		memcpy(reply->name, a->data + 6, a->len - 6);
+		replies[n++] = reply;
+	}
+
+	if (n == 0) {
+		g_free(replies);
+		return NULL;
+	}
+
+	return replies;
+}
+
+static void dns_request_finish(struct dns_request *r)
+{
+	dns_addr_func addr_func = r->addr_func;
+	dns_srv_func srv_func = r->srv_func;
+	gpointer data = r->data;
+	struct addrinfo *res = NULL;
+	struct ns_srv_reply **srv = NULL;
+
+	if (r->type == DNS_T_SRV) {
+		srv = dns_request_srv(r);
+	} else if (r->res) {
+		res = r->res;
+		r->res = NULL;
+	} else {
+		res = dns_request_addrinfo(r);
+	}
+
+	/* Free it first, the callback may want to cancel it too. */
+	dns_request_free(r);
+
+	if (srv_func) {
+		srv_func(data, srv);
+	} else {
+		addr_func(data, res);
+	}
+}
+
+/* Runs in the child process, writes the addresses to fd as the type
+   (DNS_T_A or DNS_T_AAAA) in one byte followed by the address. */
+static void dns_fallback_child(const char *host, int family, int fd)
+{
+	struct addrinfo hints, *res, *ai;
+	unsigned char rec[17];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+
+	if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+		return;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (ai->ai_family == AF_INET) {
+			rec[0] = DNS_T_A;
+			memcpy(rec + 1, &((struct sockaddr_in *) ai->ai_addr)->sin_addr, 4);
+			write(fd, rec, 5);
+		} else if (ai->ai_family == AF_INET6) {
+			rec[0] = DNS_T_AAAA;
+			memcpy(rec + 1, &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr, 16);
+			write(fd, rec, 17);
+		}
+	}
+	freeaddrinfo(res);
+}
+
+static gboolean dns_fallback_read(gpointer data, gint fd, b_input_condition cond)
+{
+	struct dns_request *r = data;
+	char buf[512];
+	int len, pos, n;
+
+	if ((len = read(fd, buf, sizeof(buf))) > 0) {
+		g_string_append_len(r->fallback_buf, buf, len);
+		return TRUE;
+	} else if (len < 0 && errno == EINTR) {
+		return TRUE;
+	}
+
+	/* The child is done. Not cached, there's no TTL. */
+	for (pos = 0; pos < r->fallback_buf->len; pos += n) {
+		n = r->fallback_buf->str[pos] == DNS_T_A ? 4 : 16;
+		if (pos + 1 + n > r->fallback_buf->len) {
+			break;
+		}
+		r->answers = g_slist_append(r->answers, dns_answer_new(r->fallback_buf->str[pos],
+		                                                       r->fallback_buf->str + pos + 1, n));
+		n++;
+	}
+
+	r->fallback_inpa = 0;
+	dns_request_finish(r);
+
+	return FALSE;
+}
+
+/* For when the nameservers didn't answer, or the answer didn't fit in a
+   UDP packet: getaddrinfo() may still know, but it blocks, so it runs in
+   a child process. */
+static void dns_request_fallback(struct dns_request *r)
+{
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) != 0) {
+		dns_request_finish(r);
+		return;
+	}
+
+	if ((pid = fork()) < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		dns_request_finish(r);
+		return;
+	} else if (pid == 0) {
+		close(fds[0]);
+		dns_fallback_child(r->host, r->family, fds[1]);
+		_exit(0);
+	}
+
+	event_debug("dns_request_fallback( \"%s\" ) = %d\n", r->host, (int) pid);
+
+	close(fds[1]);
+	r->fallback_fd = fds[0];
+	r->fallback_buf = g_string_new("");
+	r->fallback_inpa = b_input_add(r->fallback_fd, B_EV_IO_READ, dns_fallback_read, r);
+}
+
+/* Moves on to the next name if nothing was found for this one, or calls
+   back if that was the last one (or if something was found). */
+static void dns_request_check(struct dns_request *r)
+{
+	while (r->pending == 0) {
+		if (!r->answers && r->names[r->name + 1] == NULL && r->failed && r->host) {
+			dns_request_fallback(r);
+			return;
+		} else if (r->answers || r->names[r->name + 1] == NULL) {
+			dns_request_finish(r);
+			return;
+		}
+
+		r->name++;
+		dns_request_next(r);
+	}
+}
+
+static gboolean dns_request_start(gpointer data, gint fd, b_input_condition cond)
+{
+	struct dns_request *r = data;
+
+	r->timer = 0;
+
+	if (r->names) {
+		dns_request_next(r);
+		dns_request_check(r);
+	} else {
+		dns_request_finish(r);
+	}
+
+	return FALSE;
+}
+
+static struct dns_request *dns_request_new(int type, gpointer data)
+{
+	struct dns_request *r = g_new0(struct dns_request, 1);
+
+	if (dns_requests == NULL) {
+		dns_requests = g_hash_table_new(g_int_hash, g_int_equal);
+	}
+
+	if (dns_next_id <= 0) {
+		dns_next_id = 1;
+	}
+	r->id = dns_next_id++;
+	r->type = type;
+	r->data = data;
+	r->fallback_fd = -1;
+	g_hash_table_insert(dns_requests, &r->id, r);
+
+	dns_read_conf();
+
+	r->timer = b_timeout_add(0, dns_request_start, r);
+
+	return r;
+}
+
+/* Like AI_ADDRCONFIG: AF_UNSPEC only asks for the address families this
+   machine has an address for, not counting loopback and link-local ones.
+   Not for fixed nameservers (tests), which should get the same answers on
+   every machine. */
+static int dns_addrconfig(int family)
+{
+	struct ifaddrs *ifa, *i;
+	gboolean v4 = FALSE, v6 = FALSE;
+
+	if (family != AF_UNSPEC || dns_conf_fixed || getifaddrs(&ifa) != 0) {
+		return family;
+	}
+
+	for (i = ifa; i; i = i->ifa_next) {
+		if (i->ifa_addr == NULL || (i->ifa_flags & IFF_LOOPBACK)) {
+			continue;
+		} else if (i->ifa_addr->sa_family == AF_INET) {
+			v4 = TRUE;
+		} else if (i->ifa_addr->sa_family == AF_INET6 &&
+		           !IN6_IS_ADDR_LINKLOCAL(&((struct sockaddr_in6 *) i->ifa_addr)->sin6_addr)) {
+			v6 = TRUE;
+		}
+	}
+	freeifaddrs(ifa);
+
+	if (v4 && !v6) {
+		return AF_INET;
+	} else if (v6 && !v4) {
+		return AF_INET6;
+	}
+	return AF_UNSPEC;
+}
+
+/* The names to try for host, with the search domains from resolv.conf
+   before or after host itself, depending on how many dots it has. */
+static char **dns_search_names(const char *host)
+{
+	GPtrArray *names = g_ptr_array_new();
+	int len = strlen(host), dots = 0, i;
+	const char *s;
+
+	if (len > 0 && host[len - 1] == '.') {
+		g_ptr_array_add(names, g_strndup(host, len - 1));
+	} else {
+		for (s = host; *s; s++) {
+			dots += *s == '.';
+		}
+
+		if (dots >= dns_ndots) {
+			g_ptr_array_add(names, g_strdup(host));
+		}
+		for (i = 0; dns_search && dns_search[i]; i++) {
+			g_ptr_array_add(names, g_strdup_printf("%s.%s", host, dns_search[i]));
+		}
+		if (dots < dns_ndots) {
+			g_ptr_array_add(names, g_strdup(host));
+		}
+	}
+	g_ptr_array_add(names, NULL);
+
+	return (char **) g_ptr_array_free(names, FALSE);
+}
+
+gint dns_lookup(const char *host, int port, int family, dns_addr_func func, gpointer data)
+{
+	struct dns_request *r = dns_request_new(DNS_T_A, data);
+
+	r->addr_func = func;
+	r->family = family;
+	r->port = port;
+
+	/* Without names, it just calls back with whatever is in r->res. */
+	if (host == NULL || *host == '\0' || dns_numeric(host, port, family, &r->res)) {
+		return r->id;
+	}
+
+	r->family = family = dns_addrconfig(family);
+	if (!(r->res = dns_hosts_lookup(host, port, family))) {
+		r->names = dns_search_names(host);
+		r->host = g_strdup(host);
+	}
+
+	return r->id;
+}
+
+gint dns_lookup_srv(const char *service, const char *protocol, const char *domain,
+                    dns_srv_func func, gpointer data)
+{
+	struct dns_request *r = dns_request_new(DNS_T_SRV, data);
+
+	r->srv_func = func;
+
+	/* Like res_query(), no search domains for these. */
+	r->names = g_new0(char *, 2);
+	r->names[0] = g_strdup_printf("_%s._%s.%s", service, protocol, domain);
+
+	return r->id;
+}
+
+void dns_cancel(gint id)
+{
+	struct dns_request *r;
+
+	if (dns_requests && (r = g_hash_table_lookup(dns_requests, &id))) {
+		dns_request_free(r);
+	}
+}
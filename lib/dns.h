@@ -0,0 +1,86 @@
+/********************************************************************\
+  * BitlBee -- An IRC to other IM-networks gateway                     *
+  *                                                                    *
+  * Copyright 2002-2013 Wilmer van der Gaast and others                *
+  \********************************************************************/
+
+/* Asynchronous DNS resolver                                            */
+
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License with
+  the Debian GNU/Linux distribution in /usr/share/common-licenses/GPL;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St.,
+  Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Looks up hostnames and SRV records without blocking the event loop, by
+   talking to the nameservers from /etc/resolv.conf directly over UDP.
+   Answers (also negative ones) are cached for as long as their TTL says,
+   and shared between all lookups. /etc/hosts and numeric addresses work
+   like they do with getaddrinfo(), and it falls back to getaddrinfo() (in
+   a child process) for names the nameservers can't answer. */
+
+#ifndef _DNS_H
+#define _DNS_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <glib.h>
+#include <gmodule.h>
+
+#include "misc.h"
+
+/* Seconds to wait for an answer before asking the next server, and how
+   many times to go through the list of servers. */
+#define DNS_TIMEOUT 3
+#define DNS_ATTEMPTS 2
+
+#define DNS_CACHE_MAX_ENTRIES 256
+/* Upper limit for TTLs, and the TTL for negative answers without one. */
+#define DNS_CACHE_MAX_TTL 3600
+#define DNS_NEGATIVE_TTL 60
+
+/* The result is a list of addresses with the port already filled in, or
+   NULL if the name couldn't be resolved. It's yours, free it with
+   dns_freeaddrinfo(). */
+typedef void (*dns_addr_func)(gpointer data, struct addrinfo *res);
+
+/* NULL if there aren't any records. Free with srv_free(). */
+typedef void (*dns_srv_func)(gpointer data, struct ns_srv_reply **srv);
+
+struct dns_stats {
+	int entries;            /* In the cache right now */
+	int queries;            /* Sent to a nameserver */
+	int hits;               /* Answered from the cache */
+};
+
+/* Both return an ID for dns_cancel(). The callback is always called from
+   the event loop, never before these return. family can be AF_UNSPEC,
+   AF_INET or AF_INET6. */
+G_MODULE_EXPORT gint dns_lookup(const char *host, int port, int family, dns_addr_func func, gpointer data);
+G_MODULE_EXPORT gint dns_lookup_srv(const char *service, const char *protocol, const char *domain,
+                                    dns_srv_func func, gpointer data);
+/* The callback won't be called anymore after this. */
+G_MODULE_EXPORT void dns_cancel(gint id);
+G_MODULE_EXPORT void dns_freeaddrinfo(struct addrinfo *res);
+
+/* Use these nameservers ("127.0.0.1:5353 ::1 [::1]:5353") instead of the
+   ones from /etc/resolv.conf, without search domains, and without leaving
+   out address families this machine has no address for. NULL goes back to
+   /etc/resolv.conf. Also empties the cache. */
+G_MODULE_EXPORT void dns_set_servers(const char *servers);
+G_MODULE_EXPORT void dns_cache_flush(void);
+G_MODULE_EXPORT void dns_stats(struct dns_stats *st);
+
+#endif /* _DNS_H */
@@ -30,38 +30,315 @@
 #include "url.h"
 #include "sock.h"
 
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
 
 static gboolean http_connected(gpointer data, int source, b_input_condition cond);
 static gboolean http_ssl_connected(gpointer data, int returncode, void *source, b_input_condition cond);
 static gboolean http_incoming_data(gpointer data, int source, b_input_condition cond);
 static void http_free(struct http_request *req);
+static void http_inflate_free(struct http_request *req);
+
+/* Connections are kept open after a response if the server allows it, and
+   reused for the next request to the same server (with the same proxy
+   settings). No more than HTTP_POOL_MAX_PER_HOST connections are made to a
+   server, other requests wait in line for one of those to become free. */
+struct http_pool {
+	char *host;
+	int port;
+	int ssl;
+	int conns;              /* Open connections, idle or not. */
+	GSList *idle;           /* struct http_pool_conn, most recent first */
+	GQueue *waiting;        /* struct http_request */
+};
+
+struct http_pool_conn {
+	struct http_pool *pool;
+	void *ssl;
+	int fd;
+	int inpa;
+	int timeout;
+};
+
+static GHashTable *http_pools;
+
+static struct http_pool *http_pool_get(const char *host, int port, int ssl)
+{
+	struct http_pool *pool;
+	char *key;
 
+	if (http_pools == NULL) {
+		http_pools = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
 
-struct http_request *http_dorequest(char *host, int port, int ssl, char *request, http_input_function func,
-                                    gpointer data)
+	key = g_strdup_printf("%s:%d:%d:%d:%s:%d", host, port, ssl, proxytype, proxyhost, proxyport);
+	if ((pool = g_hash_table_lookup(http_pools, key))) {
+		g_free(key);
+		return pool;
+	}
+
+	pool = g_new0(struct http_pool, 1);
+	pool->host = g_strdup(host);
+	pool->port = port;
+	pool->ssl = ssl;
+	pool->waiting = g_queue_new();
+	g_hash_table_insert(http_pools, key, pool);
+
+	return pool;
+}
+
+/* Closes the connection of req, without any pool bookkeeping. */
+static void http_conn_close(struct http_request *req)
 {
-	struct http_request *req;
-	int error = 0;
+	if (req->inpa > 0) {
+		b_event_remove(req->inpa);
+		req->inpa = 0;
+	}
 
-	req = g_new0(struct http_request, 1);
+	if (req->ssl) {
+		ssl_disconnect(req->ssl);
+	} else if (req->fd >= 0) {
+		proxy_disconnect(req->fd);
+	}
+
+	req->ssl = NULL;
+	req->fd = -1;
+}
+
+static void http_pool_conn_free(struct http_pool_conn *conn)
+{
+	struct http_pool *pool = conn->pool;
+
+	if (conn->inpa > 0) {
+		b_event_remove(conn->inpa);
+	}
+	if (conn->timeout > 0) {
+		b_event_remove(conn->timeout);
+	}
+	if (conn->ssl) {
+		ssl_disconnect(conn->ssl);
+	} else {
+		closesocket(conn->fd);
+	}
+
+	pool->idle = g_slist_remove(pool->idle, conn);
+	pool->conns--;
+	g_free(conn);
+}
+
+/* Idle connections aren't supposed to say anything, so this is most likely
+   the server closing it. */
+static gboolean http_pool_idle_input(gpointer data, int source, b_input_condition cond)
+{
+	struct http_pool_conn *conn = data;
+
+	conn->inpa = 0;
+	http_pool_conn_free(conn);
+
+	return FALSE;
+}
+
+static gboolean http_pool_idle_timeout(gpointer data, gint source, b_input_condition cond)
+{
+	struct http_pool_conn *conn = data;
+
+	conn->timeout = 0;
+	http_pool_conn_free(conn);
+
+	return FALSE;
+}
+
+/* Gets req going on an idle connection if there is one, or a new one. */
+static gboolean http_pool_connect(struct http_request *req)
+{
+	struct http_pool *pool = req->pool;
 
-	if (ssl) {
-		req->ssl = ssl_connect(host, port, TRUE, http_ssl_connected, req);
+	req->bytes_written = 0;
+
+	if (pool->idle) {
+		struct http_pool_conn *conn = pool->idle->data;
+
+		pool->idle = g_slist_remove(pool->idle, conn);
+		b_event_remove(conn->inpa);
+		b_event_remove(conn->timeout);
+		req->fd = conn->fd;
+		req->ssl = conn->ssl;
+		req->reused = TRUE;
+		g_free(conn);
+
+		/* Don't send anything before the caller had a chance to
+		   look at req. */
+		req->inpa = b_input_add(req->fd, B_EV_IO_WRITE, http_connected, req);
+		return TRUE;
+	}
+
+	req->reused = FALSE;
+
+	if (pool->ssl) {
+		req->ssl = ssl_connect(pool->host, pool->port, TRUE, http_ssl_connected, req);
 		if (req->ssl == NULL) {
-			error = 1;
+			return FALSE;
 		}
 	} else {
-		req->fd = proxy_connect(host, port, http_connected, req);
+		req->fd = proxy_connect(pool->host, pool->port, http_connected, req);
 		if (req->fd < 0) {
-			error = 1;
+			return FALSE;
 		}
 	}
 
-	if (error) {
-		http_free(req);
-		return NULL;
+	pool->conns++;
+	return TRUE;
+}
+
+/* Starts the requests waiting for a connection, as far as possible. */
+static void http_pool_next(struct http_pool *pool)
+{
+	struct http_request *req;
+
+	while ((pool->idle || pool->conns < HTTP_POOL_MAX_PER_HOST) &&
+	       (req = g_queue_pop_head(pool->waiting))) {
+		if (!http_pool_connect(req)) {
+			req->pool = NULL;
+			req->status_string = g_strdup("Connection problem");
+			if (req->func != NULL) {
+				req->func(req);
+			}
+			http_free(req);
+		}
+	}
+}
+
+/* Gets req going to host:port, now or as soon as a connection is free.
+   Returns FALSE if that's not going to happen. */
+static gboolean http_start(struct http_request *req, const char *host, int port, int ssl)
+{
+	struct http_pool *pool = http_pool_get(host, port, ssl);
+
+	req->pool = pool;
+
+	if (pool->idle || pool->conns < HTTP_POOL_MAX_PER_HOST) {
+		if (!http_pool_connect(req)) {
+			req->pool = NULL;
+			return FALSE;
+		}
+	} else {
+		g_queue_push_tail(pool->waiting, req);
+	}
+
+	return TRUE;
+}
+
+/* Done with the connection of req. If reuse is set it goes back into the
+   pool, otherwise it's closed. */
+static void http_pool_release(struct http_request *req, gboolean reuse)
+{
+	struct http_pool *pool = req->pool;
+
+	if (pool == NULL) {
+		http_conn_close(req);
+		return;
+	}
+
+	if (reuse && !ssl_pending(req->ssl)) {
+		struct http_pool_conn *conn = g_new0(struct http_pool_conn, 1);
+
+		if (req->inpa > 0) {
+			b_event_remove(req->inpa);
+			req->inpa = 0;
+		}
+
+		conn->pool = pool;
+		conn->fd = req->fd;
+		conn->ssl = req->ssl;
+		conn->inpa = b_input_add(conn->fd, B_EV_IO_READ, http_pool_idle_input, conn);
+		conn->timeout = b_timeout_add(HTTP_POOL_IDLE_TIMEOUT * 1000, http_pool_idle_timeout, conn);
+		pool->idle = g_slist_prepend(pool->idle, conn);
+
+		req->fd = -1;
+		req->ssl = NULL;
+	} else {
+		http_conn_close(req);
+		pool->conns--;
+	}
+
+	req->pool = NULL;
+	http_pool_next(pool);
+}
+
+/* A reused connection may have been closed by the server right before we
+   sent our request. If nothing came back at all, try again on another.
+   Only for requests that can safely be sent twice (RFC 7230 6.3.1), since
+   the server may have gotten and processed this one already. */
+static gboolean http_retry(struct http_request *req)
+{
+	struct http_pool *pool = req->pool;
+
+	if (!req->reused || req->bytes_read > 0 || pool == NULL) {
+		return FALSE;
+	}
+
+	if (strncmp(req->request, "GET ", 4) != 0 &&
+	    strncmp(req->request, "HEAD ", 5) != 0) {
+		return FALSE;
 	}
 
+	if (getenv("BITLBEE_DEBUG")) {
+		printf("Reused HTTP connection was closed, retrying\n");
+	}
+
+	http_conn_close(req);
+	pool->conns--;
+
+	if (!http_pool_connect(req)) {
+		req->pool = NULL;
+		http_pool_next(pool);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Streams don't give their connection back, so they shouldn't count. */
+static void http_pool_detach(struct http_request *req)
+{
+	struct http_pool *pool = req->pool;
+
+	if (pool) {
+		pool->conns--;
+		req->pool = NULL;
+		http_pool_next(pool);
+	}
+}
+
+static void http_finish(struct http_request *req, gboolean reuse)
+{
+	http_pool_release(req, reuse);
+	req->flags |= HTTPC_EOF;
+
+	if (getenv("BITLBEE_DEBUG")) {
+		printf("Finishing HTTP request with status: %s\n",
+		       req->status_string ? req->status_string : "NULL");
+		if (req->zlib) {
+			printf("Body was %zu bytes compressed, %zu bytes decompressed\n",
+			       req->body_wire, req->body_decoded);
+		}
+	}
+
+	if (req->func != NULL) {
+		req->func(req);
+	}
+	http_free(req);
+}
+
+struct http_request *http_dorequest(char *host, int port, int ssl, char *request, http_input_function func,
+                                    gpointer data)
+{
+	struct http_request *req;
+
+	req = g_new0(struct http_request, 1);
+	req->fd = -1;
 	req->func = func;
 	req->data = data;
 	req->request = g_strdup(request);
@@ -69,6 +346,11 @@ struct http_request *http_dorequest(char *host, int port, int ssl, char *request
 	req->redir_ttl = 3;
 	req->content_length = -1;
 
+	if (!http_start(req, host, port, ssl)) {
+		http_free(req);
+		return NULL;
+	}
+
 	if (getenv("BITLBEE_DEBUG")) {
 		printf("About to send HTTP request:\n%s\n", req->request);
 	}
@@ -92,7 +374,7 @@ struct http_request *http_dorequest_url(char *url_string, http_input_function fu
 		return NULL;
 	}
 
-	request = g_strdup_printf("GET %s HTTP/1.0\r\n"
+	request = g_strdup_printf("GET %s HTTP/1.1\r\n"
 	                          "Host: %s\r\n"
 	                          "User-Agent: BitlBee " BITLBEE_VERSION " " ARCH "/" CPU "\r\n"
 	                          "\r\n", url->file, url->host);
@@ -105,6 +387,33 @@ struct http_request *http_dorequest_url(char *url_string, http_input_function fu
 	return ret;
 }
 
+/* Adds Accept-Encoding to the request, unless the caller did already. */
+static void http_accept_encoding(struct http_request *req)
+{
+#ifdef WITH_ZLIB
+	char *eol, *eoh, *new;
+	gboolean have;
+
+	if (!(eol = strstr(req->request, "\r\n")) ||
+	    !(eoh = strstr(req->request, "\r\n\r\n"))) {
+		return;
+	}
+
+	*eoh = '\0';
+	have = strcasestr(req->request, "\r\nAccept-Encoding:") != NULL;
+	*eoh = '\r';
+	if (have) {
+		return;
+	}
+
+	new = g_strdup_printf("%.*s\r\nAccept-Encoding: gzip, deflate%s",
+	                      (int) (eol - req->request), req->request, eol);
+	g_free(req->request);
+	req->request = new;
+	req->request_length = strlen(new);
+#endif
+}
+
 /* This one is actually pretty simple... Might get more calls if we can't write
    the whole request at once. */
 static gboolean http_connected(gpointer data, int source, b_input_condition cond)
@@ -113,11 +422,22 @@ static gboolean http_connected(gpointer data, int source, b_input_condition cond
 	int st;
 
 	if (source < 0) {
+		/* Whatever was there is gone already. */
+		req->fd = -1;
 		goto error;
 	}
 
 	if (req->inpa > 0) {
 		b_event_remove(req->inpa);
+		req->inpa = 0;
+	}
+
+	if (req->flags & HTTPC_STREAMING) {
+		http_pool_detach(req);
+	}
+
+	if ((req->flags & HTTPC_COMPRESS) && req->bytes_written == 0) {
+		http_accept_encoding(req);
 	}
 
 	sock_make_nonblocking(req->fd);
@@ -127,7 +447,6 @@ static gboolean http_connected(gpointer data, int source, b_input_condition cond
 		               req->request_length - req->bytes_written);
 		if (st < 0) {
 			if (ssl_errno != SSL_AGAIN) {
-				ssl_disconnect(req->ssl);
 				goto error;
 			}
 		}
@@ -136,7 +455,6 @@ static gboolean http_connected(gpointer data, int source, b_input_condition cond
 		           req->request_length - req->bytes_written);
 		if (st < 0) {
 			if (!sockerr_again()) {
-				closesocket(req->fd);
 				goto error;
 			}
 		}
@@ -157,14 +475,15 @@ static gboolean http_connected(gpointer data, int source, b_input_condition cond
 	return FALSE;
 
 error:
+	if (source >= 0 && http_retry(req)) {
+		return FALSE;
+	}
+
 	if (req->status_string == NULL) {
 		req->status_string = g_strdup("Error while writing HTTP request");
 	}
 
-	if (req->func != NULL) {
-		req->func(req);
-	}
-	http_free(req);
+	http_finish(req, FALSE);
 	return FALSE;
 }
 
@@ -173,6 +492,8 @@ static gboolean http_ssl_connected(gpointer data, int returncode, void *source,
 	struct http_request *req = data;
 
 	if (source == NULL) {
+		/* The SSL module cleans up after itself. */
+		req->ssl = NULL;
 		if (returncode != 0) {
 			char *err = ssl_verify_strerror(returncode);
 			req->status_string = g_strdup_printf(
@@ -195,9 +516,27 @@ typedef enum {
 	CR_ABORT,
 } http_ret_t;
 
+/* Where the response parser is (req->parse_state). */
+typedef enum {
+	HTTP_PARSE_HEADERS,
+	HTTP_PARSE_BODY,        /* body_left bytes, or until EOF */
+	HTTP_PARSE_CHUNK_SIZE,
+	HTTP_PARSE_CHUNK_EXT,   /* Rest of the chunk size line */
+	HTTP_PARSE_CHUNK_DATA,
+	HTTP_PARSE_CHUNK_CR,    /* CRLF after the chunk data */
+	HTTP_PARSE_CHUNK_LF,
+	HTTP_PARSE_TRAILER,
+	HTTP_PARSE_DONE,
+} http_parse_state_t;
+
+/* Don't trust Content-Length too much when preallocating. */
+#define HTTP_BODY_PREALLOC_MAX 65536
+
 static gboolean http_handle_headers(struct http_request *req);
-static http_ret_t http_process_chunked_data(struct http_request *req, const char *buffer, int len);
-static http_ret_t http_process_data(struct http_request *req, const char *buffer, int len);
+static gboolean http_keepalive(struct http_request *req);
+static void http_error(struct http_request *req, const char *msg);
+static http_ret_t http_parse(struct http_request *req, const char *buffer, int len);
+static gboolean http_complete(struct http_request *req);
 
 static gboolean http_incoming_data(gpointer data, int source, b_input_condition cond)
 {
@@ -229,6 +568,10 @@ static gboolean http_incoming_data(gpointer data, int source, b_input_condition
 		st = read(req->fd, buffer, sizeof(buffer));
 		if (st < 0) {
 			if (!sockerr_again()) {
+				if (http_retry(req)) {
+					return FALSE;
+				}
+				g_free(req->status_string);
 				req->status_string = g_strdup(strerror(errno));
 				goto cleanup;
 			}
@@ -240,22 +583,21 @@ static gboolean http_incoming_data(gpointer data, int source, b_input_condition
 	if (st > 0) {
 		http_ret_t c;
 
-		if (req->flags & HTTPC_CHUNKED) {
-			c = http_process_chunked_data(req, buffer, st);
-		} else {
-			c = http_process_data(req, buffer, st);
-		}
+		req->bytes_read += st;
+		c = http_parse(req, buffer, st);
 
 		if (c == CR_EOF) {
-			goto eof;
-		} else if (c == CR_ERROR || c == CR_ABORT) {
+			goto done;
+		} else if (c == CR_ERROR) {
+			goto cleanup;
+		} else if (c == CR_ABORT) {
 			return FALSE;
 		}
-	}
 
-	if (req->content_length != -1 &&
-	    req->body_size >= req->content_length) {
-		goto eof;
+		if (req->fd < 0) {
+			/* Redirect failed, nothing to read from anymore. */
+			goto cleanup;
+		}
 	}
 
 	if (ssl_pending(req->ssl)) {
@@ -270,8 +612,18 @@ static gboolean http_incoming_data(gpointer data, int source, b_input_condition
 	return FALSE;
 
 eof:
-	req->flags |= HTTPC_EOF;
+	if (req->bytes_read == 0 && http_retry(req)) {
+		return FALSE;
+	}
 
+	/* Obviously not, if the server closed it. */
+	req->keepalive = FALSE;
+
+	if (req->bytes_read > 0 && !http_complete(req)) {
+		http_error(req, "Response truncated");
+	}
+
+done:
 	/* Maybe if the webserver is overloaded, or when there's bad SSL
 	   support... */
 	if (req->bytes_read == 0) {
@@ -280,190 +632,399 @@ eof:
 	}
 
 cleanup:
-	/* Avoid g_source_remove warnings */
-	req->inpa = 0;
+	/* The connection can be reused if the server said so, and we got
+	   exactly one complete response. */
+	http_finish(req, req->keepalive && req->parse_state == HTTP_PARSE_DONE);
+	return FALSE;
+}
 
-	if (req->ssl) {
-		ssl_disconnect(req->ssl);
-	} else {
-		closesocket(req->fd);
+/* Grows a buffer so it can hold at least need bytes. Doubles it every
+   time so appending a byte at a time is still cheap. */
+static char *http_buf_grow(char *buf, size_t *size, size_t need)
+{
+	if (need > *size) {
+		*size = MAX(need, *size * 2);
+		buf = g_realloc(buf, *size);
 	}
 
-	if (req->body_size < req->content_length) {
-		req->status_code = -1;
-		g_free(req->status_string);
-		req->status_string = g_strdup("Response truncated");
+	return buf;
+}
+
+static void http_headers_append(struct http_request *req, const char *s, size_t len)
+{
+	req->reply_headers = http_buf_grow(req->reply_headers, &req->headers_size,
+	                                   req->headers_len + len + 1);
+	memcpy(req->reply_headers + req->headers_len, s, len);
+	req->headers_len += len;
+	req->reply_headers[req->headers_len] = '\0';
+}
+
+/* Hands body data to body_func, or adds it to reply_body. */
+static gboolean http_body_append(struct http_request *req, const char *s, size_t len)
+{
+	size_t pos = req->reply_body - req->sbuf;
+
+	if (req->body_func) {
+		if (!req->body_func(req, s, len)) {
+			http_error(req, "Aborted by receiver");
+			return FALSE;
+		}
+		req->body_decoded += len;
+		return TRUE;
 	}
 
-	if (getenv("BITLBEE_DEBUG") && req) {
-		printf("Finishing HTTP request with status: %s\n",
-		       req->status_string ? req->status_string : "NULL");
+	if (req->body_max > 0 && req->body_size + len > (size_t) req->body_max) {
+		http_error(req, "Response too large");
+		return FALSE;
 	}
 
-	if (req->func != NULL) {
-		req->func(req);
+	/* Move the data the caller didn't flush yet to the start instead
+	   of growing, as long as that's cheaper than what was flushed. */
+	if (pos > 0 && pos >= req->body_size && req->sblen + len + 1 > req->sbsize) {
+		memmove(req->sbuf, req->reply_body, req->body_size);
+		req->sblen = req->body_size;
+		pos = 0;
 	}
-	http_free(req);
-	return FALSE;
+
+	req->sbuf = http_buf_grow(req->sbuf, &req->sbsize, req->sblen + len + 1);
+	memcpy(req->sbuf + req->sblen, s, len);
+	req->sblen += len;
+	req->sbuf[req->sblen] = '\0';
+	req->reply_body = req->sbuf + pos;
+	req->body_size = req->sblen - pos;
+	req->body_decoded += len;
+
+	return TRUE;
 }
 
-static http_ret_t http_process_chunked_data(struct http_request *req, const char *buffer, int len)
+#ifdef WITH_ZLIB
+
+struct http_inflate {
+	z_stream z;
+	gboolean done;
+};
+
+/* Looks at Content-Encoding, if we asked for compression. */
+static void http_inflate_start(struct http_request *req)
 {
-	char *chunk, *eos, *s;
+	struct http_inflate *inf;
+	char *s;
 
-	if (len < 0) {
-		return TRUE;
+	if (!(req->flags & HTTPC_COMPRESS) ||
+	    !(s = get_rfc822_header(req->reply_headers, "Content-Encoding", 0))) {
+		return;
 	}
 
-	if (len > 0) {
-		req->cbuf = g_realloc(req->cbuf, req->cblen + len + 1);
-		memcpy(req->cbuf + req->cblen, buffer, len);
-		req->cblen += len;
-		req->cbuf[req->cblen] = '\0';
+	if (g_strcasecmp(s, "gzip") == 0 || g_strcasecmp(s, "x-gzip") == 0 ||
+	    g_strcasecmp(s, "deflate") == 0) {
+		inf = g_new0(struct http_inflate, 1);
+
+		/* +32 means it figures out itself whether it's gzip or zlib. */
+		if (inflateInit2(&inf->z, 15 + 32) == Z_OK) {
+			req->zlib = inf;
+		} else {
+			g_free(inf);
+		}
 	}
+	g_free(s);
+}
 
-	/* Turns out writing a proper chunked-encoding state machine is not
-	   that simple. :-( I've tested this one feeding it byte by byte so
-	   I hope it's solid now. */
-	chunk = req->cbuf;
-	eos = req->cbuf + req->cblen;
-	while (TRUE) {
-		int clen = 0;
+static void http_inflate_free(struct http_request *req)
+{
+	struct http_inflate *inf = req->zlib;
 
-		/* Might be a \r\n from the last chunk. */
-		s = chunk;
-		while (g_ascii_isspace(*s)) {
-			s++;
-		}
-		/* Chunk length. Might be incomplete. */
-		if (s < eos && sscanf(s, "%x", &clen) != 1) {
-			return CR_ERROR;
-		}
-		while (g_ascii_isxdigit(*s)) {
-			s++;
-		}
+	if (inf) {
+		inflateEnd(&inf->z);
+		g_free(inf);
+		req->zlib = NULL;
+	}
+}
 
-		/* If we read anything here, it *must* be \r\n. */
-		if (strncmp(s, "\r\n", MIN(2, eos - s)) != 0) {
-			return CR_ERROR;
-		}
-		s += 2;
+/* Decompresses what we got so far, as far as possible. Anything after the
+   end of the compressed data is ignored. */
+static gboolean http_inflate(struct http_request *req, const char *s, size_t len)
+{
+	struct http_inflate *inf = req->zlib;
+	char out[4096];
+	int st;
 
-		if (s >= eos) {
-			break;
+	inf->z.next_in = (Bytef *) s;
+	inf->z.avail_in = len;
+
+	while (!inf->done) {
+		inf->z.next_out = (Bytef *) out;
+		inf->z.avail_out = sizeof(out);
+
+		st = inflate(&inf->z, Z_SYNC_FLUSH);
+		if (st == Z_STREAM_END) {
+			inf->done = TRUE;
+		} else if (st != Z_OK && st != Z_BUF_ERROR) {
+			http_error(req, "Malformed compressed HTTP reply");
+			return FALSE;
 		}
 
-		/* 0-length chunk means end of response. */
-		if (clen == 0) {
-			return CR_EOF;
+		if (inf->z.avail_out < sizeof(out) &&
+		    !http_body_append(req, out, sizeof(out) - inf->z.avail_out)) {
+			return FALSE;
 		}
 
-		/* Wait for the whole chunk to arrive. */
-		if (s + clen > eos) {
+		/* If there's space left, it's waiting for more input. */
+		if (inf->z.avail_out > 0 && (st != Z_OK || inf->z.avail_in == 0)) {
 			break;
 		}
-		if (http_process_data(req, s, clen) != CR_OK) {
-			return CR_ABORT;
-		}
+	}
+
+	return TRUE;
+}
+
+/* An empty chunked body is fine too, there's just nothing to decompress. */
+static gboolean http_inflate_complete(struct http_request *req)
+{
+	return req->zlib == NULL || req->body_wire == 0 ||
+	       ((struct http_inflate *) req->zlib)->done;
+}
+
+#else
+
+static void http_inflate_start(struct http_request *req)
+{
+}
+
+static void http_inflate_free(struct http_request *req)
+{
+}
+
+static gboolean http_inflate(struct http_request *req, const char *s, size_t len)
+{
+	return FALSE;
+}
 
-		chunk = s + clen;
+static gboolean http_inflate_complete(struct http_request *req)
+{
+	return TRUE;
+}
+
+#endif
+
+/* Whether the connection can close now without losing anything. Only a
+   body without a length is allowed to end like that. */
+static gboolean http_complete(struct http_request *req)
+{
+	if (!http_inflate_complete(req)) {
+		return FALSE;
 	}
 
-	if (chunk != req->cbuf) {
-		req->cblen = eos - chunk;
-		s = g_memdup(chunk, req->cblen + 1);
-		g_free(req->cbuf);
-		req->cbuf = s;
+	return req->parse_state == HTTP_PARSE_DONE ||
+	       (req->parse_state == HTTP_PARSE_BODY && req->body_left < 0);
+}
+
+/* Body data as it came off the wire (minus chunked encoding). */
+static gboolean http_body_data(struct http_request *req, const char *s, size_t len)
+{
+	req->body_wire += len;
+
+	if (req->zlib) {
+		return http_inflate(req, s, len);
 	}
 
-	return CR_OK;
+	return http_body_append(req, s, len);
 }
 
-static http_ret_t http_process_data(struct http_request *req, const char *buffer, int len)
+/* Called once the headers are in, to figure out how the body will end.
+   If we know how big it is, the buffer is allocated only once. */
+static gboolean http_body_start(struct http_request *req)
 {
-	if (len <= 0) {
-		return CR_OK;
+	/* HEAD, 204, 304 or just empty: nothing to decompress, even if
+	   Content-Encoding says otherwise. */
+	if (req->content_length != 0) {
+		http_inflate_start(req);
 	}
 
-	if (!req->reply_body) {
-		req->reply_headers = g_realloc(req->reply_headers, req->bytes_read + len + 1);
-		memcpy(req->reply_headers + req->bytes_read, buffer, len);
-		req->bytes_read += len;
-		req->reply_headers[req->bytes_read] = '\0';
+	if (req->body_func) {
+		req->sbsize = 1;
+	} else if (req->body_max > 0 && req->content_length > req->body_max &&
+	           !(req->flags & HTTPC_STREAMING)) {
+		http_error(req, "Response too large");
+		return FALSE;
+	} else if (req->content_length > 0) {
+		req->sbsize = MIN(req->content_length, HTTP_BODY_PREALLOC_MAX) + 1;
+	} else {
+		req->sbsize = 256;
+	}
+	req->reply_body = req->sbuf = g_malloc(req->sbsize);
+	req->sbuf[0] = '\0';
+	req->sblen = req->body_size = 0;
+
+	req->line_len = 0;
+	if (req->flags & HTTPC_CHUNKED) {
+		req->parse_state = HTTP_PARSE_CHUNK_SIZE;
+		req->body_left = 0;
+	} else if (req->content_length == 0) {
+		req->parse_state = HTTP_PARSE_DONE;
+	} else {
+		req->parse_state = HTTP_PARSE_BODY;
+		req->body_left = req->content_length;
+	}
+
+	return TRUE;
+}
+
+/* Feeds everything we read to the response parser. It remembers where it
+   was between calls so every byte is looked at only once, and body data
+   (minus the chunked encoding) is copied straight into reply_body. */
+static http_ret_t http_parse(struct http_request *req, const char *buffer, int len)
+{
+	const char *s, *end = buffer + len;
+	gboolean got_body = FALSE;
+	size_t n;
+	int d;
+
+	while (buffer < end && req->parse_state != HTTP_PARSE_DONE) {
+		switch (req->parse_state) {
+		case HTTP_PARSE_HEADERS:
+		case HTTP_PARSE_TRAILER:
+			/* Look for the empty line, keeping stupid webservers
+			   that use just \n in mind. */
+			for (s = buffer; s < end; s++) {
+				if (*s == '\n') {
+					if (req->line_len == 0) {
+						break;
+					}
+					req->line_len = 0;
+				} else if (*s != '\r') {
+					req->line_len++;
+				}
+			}
+
+			if (req->parse_state == HTTP_PARSE_TRAILER) {
+				/* Nobody cares about those. */
+				if (s < end) {
+					req->parse_state = HTTP_PARSE_DONE;
+				}
+				buffer = s + 1;
+				break;
+			}
+
+			if (s == end) {
+				http_headers_append(req, buffer, s - buffer);
+				buffer = end;
+				break;
+			}
+
+			/* Keep the headers but not the empty line after them. */
+			n = s - buffer;
+			if (n > 0 && s[-1] == '\r') {
+				n--;
+			}
+			http_headers_append(req, buffer, n);
+			if (n == 0 && req->headers_len > 0 &&
+			    req->reply_headers[req->headers_len - 1] == '\r') {
+				req->reply_headers[--req->headers_len] = '\0';
+			}
+			buffer = s + 1;
 
-		if (strstr(req->reply_headers, "\r\n\r\n") ||
-		    strstr(req->reply_headers, "\n\n")) {
-			/* We've now received all headers. Look for something
-			   interesting. */
 			if (!http_handle_headers(req)) {
 				return CR_ABORT;
 			}
+			if (!http_body_start(req)) {
+				return CR_ERROR;
+			}
+			got_body = TRUE;
+			break;
+
+		case HTTP_PARSE_BODY:
+		case HTTP_PARSE_CHUNK_DATA:
+			n = end - buffer;
+			if (req->body_left >= 0 && n > (size_t) req->body_left) {
+				n = req->body_left;
+			}
+			if (!http_body_data(req, buffer, n)) {
+				return CR_ERROR;
+			}
+			buffer += n;
+			got_body = TRUE;
+
+			if (req->body_left >= 0 && (req->body_left -= n) == 0) {
+				req->parse_state = req->parse_state == HTTP_PARSE_BODY ?
+				                   HTTP_PARSE_DONE : HTTP_PARSE_CHUNK_CR;
+			}
+			break;
+
+		case HTTP_PARSE_CHUNK_SIZE:
+			if ((d = g_ascii_xdigit_value(*buffer)) >= 0) {
+				if (req->body_left > (G_MAXINT >> 4)) {
+					http_error(req, "Malformed HTTP reply");
+					return CR_ERROR;
+				}
+				req->body_left = req->body_left * 16 + d;
+				req->line_len++;
+				buffer++;
+				break;
+			} else if (req->line_len == 0) {
+				http_error(req, "Malformed HTTP reply");
+				return CR_ERROR;
+			}
+			req->parse_state = HTTP_PARSE_CHUNK_EXT;
+			/* Fall through, for the CR/LF or whatever comes next. */
 
-			/* Start parsing the body as chunked if required. */
-			if (req->flags & HTTPC_CHUNKED) {
-				return http_process_chunked_data(req, NULL, 0);
+		case HTTP_PARSE_CHUNK_EXT:
+			if (!(s = memchr(buffer, '\n', end - buffer))) {
+				buffer = end;
+				break;
 			}
+			buffer = s + 1;
+
+			/* 0-length chunk means end of response. Only the
+			   (usually empty) trailer is left. */
+			req->line_len = 0;
+			req->parse_state = req->body_left > 0 ?
+			                   HTTP_PARSE_CHUNK_DATA : HTTP_PARSE_TRAILER;
+			break;
+
+		case HTTP_PARSE_CHUNK_CR:
+		case HTTP_PARSE_CHUNK_LF:
+			if (*buffer == '\r' && req->parse_state == HTTP_PARSE_CHUNK_CR) {
+				req->parse_state = HTTP_PARSE_CHUNK_LF;
+			} else if (*buffer == '\n') {
+				req->parse_state = HTTP_PARSE_CHUNK_SIZE;
+				req->line_len = 0;
+			} else {
+				http_error(req, "Malformed HTTP reply");
+				return CR_ERROR;
+			}
+			buffer++;
+			break;
 		}
-	} else {
-		int pos = req->reply_body - req->sbuf;
-		req->sbuf = g_realloc(req->sbuf, req->sblen + len + 1);
-		memcpy(req->sbuf + req->sblen, buffer, len);
-		req->bytes_read += len;
-		req->sblen += len;
-		req->sbuf[req->sblen] = '\0';
-		req->reply_body = req->sbuf + pos;
-		req->body_size = req->sblen - pos;
 	}
 
-	if ((req->flags & HTTPC_STREAMING) && req->reply_body && req->func != NULL) {
+	/* Anything after the response means we're out of sync. */
+	if (buffer < end) {
+		req->keepalive = FALSE;
+	}
+
+	if (req->parse_state == HTTP_PARSE_DONE && !http_inflate_complete(req)) {
+		http_error(req, "Malformed compressed HTTP reply");
+		return CR_ERROR;
+	}
+
+	if ((req->flags & HTTPC_STREAMING) && got_body && req->func != NULL) {
 		req->func(req);
 	}
 
-	return CR_OK;
+	return req->parse_state == HTTP_PARSE_DONE ? CR_EOF : CR_OK;
 }
 
-/* Splits headers and body. Checks result code, in case of 300s it'll handle
-   redirects. If this returns FALSE, don't call any callbacks! */
+/* Called by the parser once all headers are in. Checks result code, in
+   case of 300s it'll handle redirects. If this returns FALSE, don't call
+   any callbacks! */
 static gboolean http_handle_headers(struct http_request *req)
 {
-	char *end1, *end2, *s;
-	int evil_server = 0;
-
-	/* Zero termination is very convenient. */
-	req->reply_headers[req->bytes_read] = '\0';
-
-	/* Find the separation between headers and body, and keep stupid
-	   webservers in mind. */
-	end1 = strstr(req->reply_headers, "\r\n\r\n");
-	end2 = strstr(req->reply_headers, "\n\n");
-
-	if (end2 && end2 < end1) {
-		end1 = end2 + 1;
-		evil_server = 1;
-	} else if (end1) {
-		end1 += 2;
-	} else {
-		req->status_string = g_strdup("Malformed HTTP reply");
-		return TRUE;
-	}
-
-	*end1 = '\0';
+	char *end1, *s;
 
 	if (getenv("BITLBEE_DEBUG")) {
 		printf("HTTP response headers:\n%s\n", req->reply_headers);
 	}
 
-	if (evil_server) {
-		req->reply_body = end1 + 1;
-	} else {
-		req->reply_body = end1 + 2;
-	}
-
-	/* Separately allocated space for headers and body. */
-	req->sblen = req->body_size = req->reply_headers + req->bytes_read - req->reply_body;
-	req->sbuf = req->reply_body = g_memdup(req->reply_body, req->body_size + 1);
-	req->reply_headers = g_realloc(req->reply_headers, end1 - req->reply_headers + 1);
-
 	if ((end1 = strchr(req->reply_headers, ' ')) != NULL) {
 		if (sscanf(end1 + 1, "%hd", &req->status_code) != 1) {
 			req->status_string = g_strdup("Can't parse status code");
@@ -471,21 +1032,10 @@ static gboolean http_handle_headers(struct http_request *req)
 		} else {
 			char *eol;
 
-			if (evil_server) {
-				eol = strchr(end1, '\n');
-			} else {
-				eol = strchr(end1, '\r');
+			if ((eol = strpbrk(end1, "\r\n")) == NULL) {
+				eol = end1 + strlen(end1);
 			}
-
 			req->status_string = g_strndup(end1 + 1, eol - end1 - 1);
-
-			/* Just to be sure... */
-			if ((eol = strchr(req->status_string, '\r'))) {
-				*eol = 0;
-			}
-			if ((eol = strchr(req->status_string, '\n'))) {
-				*eol = 0;
-			}
 		}
 	} else {
 		req->status_string = g_strdup("Can't locate status code");
@@ -557,14 +1107,10 @@ static gboolean http_handle_headers(struct http_request *req)
 			}
 			headers = s;
 
-			/* More or less HTTP/1.0 compliant, from my reading of RFC 2616.
-			   Always perform a GET request unless we received a 301. 303 was
-			   meant for this but it's HTTP/1.1-only and we're specifically
-			   speaking HTTP/1.0. ...
-
-			   Well except someone at identi.ca's didn't bother reading any
-			   RFCs and just return HTTP/1.1-specific status codes to HTTP/1.0
-			   requests. Fuckers. So here we are, handle 301..303,307. */
+			/* Requests are HTTP/1.1 now, so follow RFC 2616: 303 always
+			   becomes a GET, 307 keeps the method. 302 should keep it too
+			   but everybody turns it into a GET, and 301 keeps POSTs as
+			   POSTs. So here we are, handle 301..303,307. */
 			if (strncmp(req->request, "GET", 3) == 0) {
 				/* GETs never become POSTs. */
 				new_method = "GET";
@@ -581,7 +1127,7 @@ static gboolean http_handle_headers(struct http_request *req)
 				version++;
 				version = g_strndup(version, s - version);
 			} else {
-				version = g_strdup("HTTP/1.0");
+				version = g_strdup("HTTP/1.1");
 			}
 
 			/* Okay, this isn't fun! We have to rebuild the request... :-( */
@@ -603,30 +1149,16 @@ static gboolean http_handle_headers(struct http_request *req)
 			g_free(version);
 		}
 
-		if (req->ssl) {
-			ssl_disconnect(req->ssl);
-		} else {
-			closesocket(req->fd);
-		}
-
-		req->fd = -1;
-		req->ssl = NULL;
+		/* Not worth keeping, the new request most likely goes
+		   somewhere else. */
+		http_pool_release(req, FALSE);
 
 		if (getenv("BITLBEE_DEBUG")) {
 			printf("New headers for redirected HTTP request:\n%s\n", new_request);
 		}
 
-		if (new_proto == PROTO_HTTPS) {
-			req->ssl = ssl_connect(new_host, new_port, TRUE, http_ssl_connected, req);
-			if (req->ssl == NULL) {
-				error = 1;
-			}
-		} else {
-			req->fd = proxy_connect(new_host, new_port, http_connected, req);
-			if (req->fd < 0) {
-				error = 1;
-			}
-		}
+		req->bytes_read = 0;
+		error = !http_start(req, new_host, new_port, new_proto == PROTO_HTTPS);
 		g_free(new_host);
 
 		if (error) {
@@ -637,13 +1169,11 @@ static gboolean http_handle_headers(struct http_request *req)
 
 		g_free(req->request);
 		g_free(req->reply_headers);
-		g_free(req->sbuf);
 		req->request = new_request;
 		req->request_length = strlen(new_request);
-		req->bytes_read = req->bytes_written = req->inpa = 0;
-		req->reply_headers = req->reply_body = NULL;
-		req->sbuf = req->cbuf = NULL;
-		req->sblen = req->cblen = 0;
+		req->reply_headers = NULL;
+		req->headers_len = req->headers_size = 0;
+		req->line_len = 0;
 
 		return FALSE;
 	}
@@ -654,21 +1184,59 @@ static gboolean http_handle_headers(struct http_request *req)
 	}
 	g_free(s);
 
+	/* These never have a body. */
+	if (strncmp(req->request, "HEAD ", 5) == 0 ||
+	    req->status_code == 204 || req->status_code == 304) {
+		req->content_length = 0;
+	}
+
 	if ((s = get_rfc822_header(req->reply_headers, "Transfer-Encoding", 0))) {
 		if (strcasestr(s, "chunked")) {
 			req->flags |= HTTPC_CHUNKED;
-			req->cbuf = req->sbuf;
-			req->cblen = req->sblen;
-
-			req->reply_body = req->sbuf = g_strdup("");
-			req->body_size = req->sblen = 0;
+			req->content_length = -1;
 		}
 		g_free(s);
 	}
 
+	req->keepalive = http_keepalive(req);
+
 	return TRUE;
 }
 
+/* Whether the server will keep the connection open after this response,
+   and we can tell where the response ends without it closing. */
+static gboolean http_keepalive(struct http_request *req)
+{
+	gboolean close = FALSE, keep = FALSE;
+	char *s;
+
+	if (!(req->flags & HTTPC_CHUNKED) && req->content_length < 0) {
+		return FALSE;
+	}
+
+	if ((s = get_rfc822_header(req->reply_headers, "Connection", 0))) {
+		close = strcasestr(s, "close") != NULL;
+		keep = strcasestr(s, "keep-alive") != NULL;
+		g_free(s);
+	}
+
+	if (close || keep) {
+		return !close;
+	}
+
+	/* HTTP/1.1 does keep-alive by default, if both sides speak it. */
+	return strncmp(req->reply_headers, "HTTP/1.1 ", 9) == 0 &&
+	       (s = strstr(req->request, "\r\n")) && s - req->request >= 9 &&
+	       strncmp(s - 9, " HTTP/1.1", 9) == 0;
+}
+
+static void http_error(struct http_request *req, const char *msg)
+{
+	req->status_code = -1;
+	g_free(req->status_string);
+	req->status_string = g_strdup(msg);
+}
+
 void http_flush_bytes(struct http_request *req, size_t len)
 {
 	if (len <= 0 || len > req->body_size || !(req->flags & HTTPC_STREAMING)) {
@@ -678,30 +1246,32 @@ void http_flush_bytes(struct http_request *req, size_t len)
 	req->reply_body += len;
 	req->body_size -= len;
 
-	if (req->reply_body - req->sbuf >= 512) {
-		char *new = g_memdup(req->reply_body, req->body_size + 1);
-		g_free(req->sbuf);
-		req->reply_body = req->sbuf = new;
+	/* Only move what's left if that's no more than what we just got rid
+	   of, so it costs no more than reading it in did. */
+	if (req->body_size == 0 ||
+	    (req->reply_body - req->sbuf >= 512 && req->reply_body - req->sbuf >= req->body_size)) {
+		memmove(req->sbuf, req->reply_body, req->body_size + 1);
+		req->reply_body = req->sbuf;
 		req->sblen = req->body_size;
 	}
 }
 
 void http_close(struct http_request *req)
 {
+	GList *l;
+
 	if (!req) {
 		return;
 	}
 
-	if (req->inpa > 0) {
-		b_event_remove(req->inpa);
-	}
-
-	if (req->ssl) {
-		ssl_disconnect(req->ssl);
-	} else {
-		proxy_disconnect(req->fd);
+	/* Might still be waiting for a connection. */
+	if (req->pool && (l = g_queue_find(req->pool->waiting, req))) {
+		g_queue_delete_link(req->pool->waiting, l);
+		req->pool = NULL;
 	}
 
+	/* Can't be reused in the middle of a response. */
+	http_pool_release(req, FALSE);
 	http_free(req);
 }
 
@@ -711,6 +1281,6 @@ static void http_free(struct http_request *req)
 	g_free(req->reply_headers);
 	g_free(req->status_string);
 	g_free(req->sbuf);
-	g_free(req->cbuf);
+	http_inflate_free(req);
 	g_free(req);
 }
@@ -29,18 +29,25 @@
    but used for many other things now like OAuth and Twitter.
 
    It's very useful for doing quick requests without blocking the whole
-   program. Unfortunately it doesn't support fancy stuff like HTTP keep-
-   alives. */
+   program. Connections are kept open (if the server agrees) and reused for
+   later requests to the same server. */
 
 #include <glib.h>
 #include "ssl_client.h"
 
 struct http_request;
+struct http_pool;
+
+/* Idle connections are closed after this many seconds. */
+#define HTTP_POOL_IDLE_TIMEOUT 60
+/* Open connections per server. More requests have to wait their turn. */
+#define HTTP_POOL_MAX_PER_HOST 4
 
 typedef enum http_client_flags {
 	HTTPC_STREAMING = 1,
 	HTTPC_EOF = 2,
 	HTTPC_CHUNKED = 4,
+	HTTPC_COMPRESS = 8,     /* Ask for gzip/deflate, and decompress it */
 
 	/* Let's reserve 0x1000000+ for lib users. */
 } http_client_flags_t;
@@ -48,9 +55,16 @@ typedef enum http_client_flags {
 /* Your callback function should look like this: */
 typedef void (*http_input_function)(struct http_request *);
 
+/* Optional, gets the body in pieces as it comes in, straight from the
+   read buffer, instead of it being collected in reply_body. Return FALSE
+   to abort the request. Don't http_close() from in here! */
+typedef gboolean (*http_body_function)(struct http_request *, const char *data, int len);
+
 /* This structure will be filled in by the http_dorequest* functions, and
    it will be passed to the callback function. Use the data field to add
-   your own data. */
+   your own data. Flags, body_func and body_max can be set right after
+   the request was made, before any data comes in. The last call to func
+   always has HTTPC_EOF set. */
 struct http_request {
 	char *request;          /* The request to send to the server. */
 	int request_length;     /* Its size. */
@@ -77,13 +91,31 @@ struct http_request {
 	int bytes_read;
 	int content_length;     /* "Content-Length:" header or -1 */
 
-	/* Used in streaming mode. Caller should read from reply_body. */
+	/* Body buffer, reply_body points into it. In streaming mode the
+	   part before reply_body was already flushed by the caller. */
 	char *sbuf;
 	size_t sblen;
-
-	/* Chunked encoding only. Raw chunked stream is decoded from here. */
-	char *cbuf;
-	size_t cblen;
+	size_t sbsize;          /* Bytes allocated for sbuf */
+
+	/* Response parser state, all of it. Nothing is ever parsed twice. */
+	int parse_state;
+	int line_len;           /* Current header/trailer line, minus CR/LF */
+	size_t headers_len;     /* Bytes in reply_headers */
+	size_t headers_size;    /* Bytes allocated for reply_headers */
+	gint64 body_left;       /* Of the body or current chunk, -1 = till EOF */
+	void *zlib;             /* Decompressor, if Content-Encoding is used */
+
+	struct http_pool *pool; /* Where the connection goes when we're done */
+	gboolean reused;        /* Connection was used for an earlier request */
+	gboolean keepalive;     /* Server will keep the connection open */
+
+	/* These are for you again. They're down here so that code built
+	   against older versions of this struct still works. */
+	http_body_function body_func;
+	int body_max;           /* Give up if we'd have to keep more than this
+	                           much of the body around. 0 = no limit. */
+	size_t body_wire;       /* Body bytes received, possibly compressed */
+	size_t body_decoded;    /* Body bytes after decompressing */
 };
 
 /* The _url variant is probably more useful than the raw version. The raw
@@ -40,6 +40,7 @@
 #include <ctype.h>
 #include <glib.h>
 #include <time.h>
+#include <unistd.h>
 
 #ifdef HAVE_RESOLV_A
 #include <arpa/nameser.h>
@@ -786,3 +787,25 @@ char *str_reject_chars(char *string, const char *reject, char replacement)
 
 	return string;
 }
+
+/* Replaces the file at path with data, in a way that nobody ever sees a
+   half-written file: write a temporary one next to it, and rename() it
+   over the old one when it's all on disk. */
+gboolean write_file_atomic(const char *path, const char *data, size_t len)
+{
+	char *tmp = g_strdup_printf("%s.XXXXXX", path);
+	gboolean ok = FALSE;
+	int fd;
+
+	if ((fd = mkstemp(tmp)) >= 0) {
+		ok = write(fd, data, len) == len && fsync(fd) == 0;
+
+		if (close(fd) != 0 || !ok || rename(tmp, path) != 0) {
+			unlink(tmp);
+			ok = FALSE;
+		}
+	}
+
+	g_free(tmp);
+	return ok;
+}
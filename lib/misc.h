@@ -139,6 +139,7 @@ G_MODULE_EXPORT void random_bytes(unsigned char *buf, int count);
 G_MODULE_EXPORT int is_bool(char *value);
 G_MODULE_EXPORT int bool2int(char *value);
 
+/* Blocks until the nameserver answers, dns_lookup_srv() doesn't. */
 G_MODULE_EXPORT struct ns_srv_reply **srv_lookup(char *service, char *protocol, char *domain);
 G_MODULE_EXPORT void srv_free(struct ns_srv_reply **srv);
 
@@ -150,5 +151,6 @@ G_MODULE_EXPORT char *get_rfc822_header(const char *text, const char *header, in
 G_MODULE_EXPORT int truncate_utf8(char *string, int maxlen);
 G_MODULE_EXPORT gboolean parse_int64(char *string, int base, guint64 *number);
 G_MODULE_EXPORT char *str_reject_chars(char *string, const char *reject, char replacement);
+G_MODULE_EXPORT gboolean write_file_atomic(const char *path, const char *data, size_t len);
 
 #endif
@@ -255,7 +255,7 @@ static void *oauth_post_request(const char *url, GSList **params_, http_input_fu
 	g_free(params_s);
 	g_free(s);
 
-	s = g_strdup_printf("POST %s HTTP/1.0\r\n"
+	s = g_strdup_printf("POST %s HTTP/1.1\r\n"
 	                    "Host: %s\r\n"
 	                    "Content-Type: application/x-www-form-urlencoded\r\n"
 	                    "Content-Length: %zd\r\n"
@@ -88,7 +88,7 @@ int oauth2_access_token(const struct oauth2_service *sp,
 	args_s = oauth_params_string(args);
 	oauth_params_free(&args);
 
-	s = g_strdup_printf("POST %s HTTP/1.0\r\n"
+	s = g_strdup_printf("POST %s HTTP/1.1\r\n"
 	                    "Host: %s\r\n"
 	                    "Content-Type: application/x-www-form-urlencoded\r\n"
 	                    "Content-Length: %zd\r\n"
@@ -42,16 +42,12 @@ int proxytype = PROXY_NONE;
 char proxyuser[128] = "";
 char proxypass[128] = "";
 
-/* Some systems don't know this one. It's not essential, so set it to 0 then. */
-#ifndef AI_NUMERICSERV
-#define AI_NUMERICSERV 0
-#endif
-#ifndef AI_ADDRCONFIG
-#define AI_ADDRCONFIG 0
-#endif
-
 static GHashTable *phb_hash = NULL;
 
+/* RFC 8305 "Connection Attempt Delay": how long one connection attempt
+   gets to itself before the next address is tried alongside it. */
+#define PROXY_CONNECT_DELAY 250
+
 struct PHB {
 	b_event_handler func, proxy_func;
 	gpointer data, proxy_data;
@@ -59,17 +55,51 @@ struct PHB {
 	int port;
 	int fd;
 	gint inpa;
+	gint dns;
+	gint delay;
+	GSList *attempts;
 	struct addrinfo *gai, *gai_cur;
 };
 
+/* One of possibly several connections in progress at the same time, to
+   different addresses of the same host. */
+struct proxy_attempt {
+	struct PHB *phb;
+	int fd;
+	gint inpa;
+};
+
 typedef int (*proxy_connect_func)(const char *host, unsigned short port_, struct PHB *phb);
 
-static int proxy_connect_none(const char *host, unsigned short port_, struct PHB *phb);
+static gboolean proxy_connected(gpointer data, gint source, b_input_condition cond);
+
+static void proxy_attempt_free(struct proxy_attempt *a)
+{
+	a->phb->attempts = g_slist_remove(a->phb->attempts, a);
+	b_event_remove(a->inpa);
+	closesocket(a->fd);
+	g_free(a);
+}
+
+static void proxy_attempts_free(struct PHB *phb)
+{
+	while (phb->attempts) {
+		proxy_attempt_free(phb->attempts->data);
+	}
+	if (phb->delay) {
+		b_event_remove(phb->delay);
+		phb->delay = 0;
+	}
+}
 
 static gboolean phb_free(struct PHB *phb, gboolean success)
 {
 	g_hash_table_remove(phb_hash, &phb->fd);
 
+	if (phb->dns) {
+		dns_cancel(phb->dns);
+	}
+	proxy_attempts_free(phb);
 	if (!success) {
 		if (phb->fd > 0) {
 			closesocket(phb->fd);
@@ -79,7 +109,7 @@ static gboolean phb_free(struct PHB *phb, gboolean success)
 		}
 	}
 	if (phb->gai) {
-		freeaddrinfo(phb->gai);
+		dns_freeaddrinfo(phb->gai);
 	}
 	g_free(phb->host);
 	g_free(phb);
@@ -105,73 +135,17 @@ static gboolean phb_connected(struct PHB *phb, gint source)
 	return FALSE;
 }
 
-static gboolean proxy_connected(gpointer data, gint source, b_input_condition cond)
-{
-	struct PHB *phb = data;
-	socklen_t len;
-	int error = ETIMEDOUT;
-
-	len = sizeof(error);
-
-	if (getsockopt(source, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
-		if ((phb->gai_cur = phb->gai_cur->ai_next)) {
-			int new_fd;
-			b_event_remove(phb->inpa);
-			if ((new_fd = proxy_connect_none(NULL, 0, phb))) {
-				b_event_remove(phb->inpa);
-				closesocket(source);
-				dup2(new_fd, source);
-				closesocket(new_fd);
-				phb->fd = source;
-				phb->inpa = b_input_add(source, B_EV_IO_WRITE, proxy_connected, phb);
-				return FALSE;
-			}
-		}
-		closesocket(source);
-		source = -1;
-		/* socket is dead, but continue to clean up */
-	} else {
-		sock_make_blocking(source);
-	}
-
-	freeaddrinfo(phb->gai);
-	phb->gai = NULL;
-
-	b_event_remove(phb->inpa);
-	phb->inpa = 0;
-
-	if (phb->proxy_func) {
-		phb->proxy_func(phb->proxy_data, source, B_EV_IO_READ);
-	} else {
-		phb_connected(phb, source);
-	}
-
-	return FALSE;
-}
+static gboolean proxy_connect_delay(gpointer data, gint fd, b_input_condition cond);
 
-static int proxy_connect_none(const char *host, unsigned short port_, struct PHB *phb)
+/* Starts connecting to the first address from phb->gai_cur onwards that
+   doesn't fail right away, without giving up on the attempts that are
+   already in progress. If that one doesn't connect within
+   PROXY_CONNECT_DELAY, the next address gets its turn. */
+static gboolean proxy_connect_next(struct PHB *phb)
 {
+	struct proxy_attempt *a;
 	struct sockaddr_in me;
-	int fd = -1;
-
-	if (phb->gai_cur == NULL) {
-		int ret;
-		char port[6];
-		struct addrinfo hints;
-
-		g_snprintf(port, sizeof(port), "%d", port_);
-
-		memset(&hints, 0, sizeof(struct addrinfo));
-		hints.ai_family = AF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
-
-		if (!(ret = getaddrinfo(host, port, &hints, &phb->gai))) {
-			phb->gai_cur = phb->gai;
-		} else {
-			event_debug("gai(): %s\n", gai_strerror(ret));
-		}
-	}
+	int fd;
 
 	for (; phb->gai_cur; phb->gai_cur = phb->gai_cur->ai_next) {
 		if ((fd = socket(phb->gai_cur->ai_family, phb->gai_cur->ai_socktype, phb->gai_cur->ai_protocol)) < 0) {
@@ -191,26 +165,153 @@ static int proxy_connect_none(const char *host, unsigned short port_, struct PHB
 			}
 		}
 
-		event_debug("proxy_connect_none( \"%s\", %d ) = %d\n", host, port_, fd);
+		event_debug("proxy_connect_next( %d ) = %d\n", phb->fd, fd);
 
 		if (connect(fd, phb->gai_cur->ai_addr, phb->gai_cur->ai_addrlen) < 0 && !sockerr_again()) {
 			event_debug("connect failed: %s\n", strerror(errno));
 			closesocket(fd);
-			fd = -1;
 			continue;
+		}
+
+		a = g_new0(struct proxy_attempt, 1);
+		a->phb = phb;
+		a->fd = fd;
+		a->inpa = b_input_add(fd, B_EV_IO_WRITE, proxy_connected, a);
+		phb->attempts = g_slist_prepend(phb->attempts, a);
+
+		if ((phb->gai_cur = phb->gai_cur->ai_next)) {
+			phb->delay = b_timeout_add(PROXY_CONNECT_DELAY, proxy_connect_delay, phb);
+		}
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gboolean proxy_connect_delay(gpointer data, gint fd, b_input_condition cond)
+{
+	struct PHB *phb = data;
+
+	phb->delay = 0;
+	proxy_connect_next(phb);
+
+	return FALSE;
+}
+
+static gboolean proxy_connected(gpointer data, gint source, b_input_condition cond)
+{
+	struct proxy_attempt *a = data;
+	struct PHB *phb = a->phb;
+	socklen_t len;
+	int error = ETIMEDOUT;
+
+	len = sizeof(error);
+
+	if (getsockopt(source, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+		event_debug("proxy_connected( %d ): %s\n", source, strerror(error));
+		proxy_attempt_free(a);
+
+		/* No point in waiting for the delay, try the next one now. */
+		if (phb->delay) {
+			b_event_remove(phb->delay);
+			phb->delay = 0;
+		}
+		if (!proxy_connect_next(phb) && phb->attempts == NULL) {
+			phb_free(phb, FALSE);
+		}
+		return FALSE;
+	}
+
+	/* We have a winner. Put it in place of the fd the caller already has,
+	   and forget about the others. */
+	phb->attempts = g_slist_remove(phb->attempts, a);
+	b_event_remove(a->inpa);
+	proxy_attempts_free(phb);
+
+	dup2(a->fd, phb->fd);
+	closesocket(a->fd);
+	g_free(a);
+
+	sock_make_blocking(phb->fd);
+
+	dns_freeaddrinfo(phb->gai);
+	phb->gai = NULL;
+
+	if (phb->proxy_func) {
+		phb->proxy_func(phb->proxy_data, phb->fd, B_EV_IO_READ);
+	} else {
+		phb_connected(phb, phb->fd);
+	}
+
+	return FALSE;
+}
+
+/* Reorders the list so that address families take turns, starting with
+   whichever one came first (IPv6, usually). That way an IPv6 route that's
+   broken doesn't keep IPv4 waiting for more than one attempt. */
+static struct addrinfo *proxy_interleave(struct addrinfo *res)
+{
+	struct addrinfo *first = NULL, *other = NULL, *ret = NULL;
+	struct addrinfo **ft = &first, **ot = &other, **rt = &ret;
+	struct addrinfo *ai, *next;
+
+	for (ai = res; ai; ai = next) {
+		next = ai->ai_next;
+		ai->ai_next = NULL;
+		if (ai->ai_family == res->ai_family) {
+			*ft = ai;
+			ft = &ai->ai_next;
 		} else {
-			phb->inpa = b_input_add(fd, B_EV_IO_WRITE, proxy_connected, phb);
-			phb->fd = fd;
+			*ot = ai;
+			ot = &ai->ai_next;
+		}
+	}
 
-			break;
+	while (first || other) {
+		if (first) {
+			*rt = first;
+			rt = &first->ai_next;
+			first = first->ai_next;
+		}
+		if (other) {
+			*rt = other;
+			rt = &other->ai_next;
+			other = other->ai_next;
 		}
 	}
 
-	if (fd < 0 && host) {
+	return ret;
+}
+
+static void proxy_resolved(gpointer data, struct addrinfo *res)
+{
+	struct PHB *phb = data;
+
+	phb->dns = 0;
+	phb->gai = phb->gai_cur = proxy_interleave(res);
+
+	if (!proxy_connect_next(phb)) {
+		event_debug("proxy_resolved( %d ): no address to connect to\n", phb->fd);
+		phb_free(phb, FALSE);
+	}
+}
+
+static int proxy_connect_none(const char *host, unsigned short port_, struct PHB *phb)
+{
+	/* The caller gets this fd right away, while the hostname is still
+	   being looked up. The real socket replaces it later. */
+	if ((phb->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		event_debug("socket failed: %d\n", errno);
 		phb_free(phb, TRUE);
+		return -1;
 	}
 
-	return fd;
+	event_debug("proxy_connect_none( \"%s\", %d ) = %d\n", host, port_, phb->fd);
+
+	phb->dns = dns_lookup(host, port_, AF_UNSPEC, proxy_resolved, phb);
+
+	return phb->fd;
 }
 
 
@@ -317,27 +418,11 @@ static gboolean s4_canread(gpointer data, gint source, b_input_condition cond)
 	return phb_free(phb, FALSE);
 }
 
-static gboolean s4_canwrite(gpointer data, gint source, b_input_condition cond)
+/* addr is the IPv4 address to connect to, or NULL for SOCKS4A. */
+static void s4_sendconnect(struct PHB *phb, gint source, const unsigned char *addr)
 {
 	unsigned char packet[12];
-	struct hostent *hp;
-	struct PHB *phb = data;
-	socklen_t len;
-	int error = ETIMEDOUT;
-	gboolean is_socks4a = (proxytype == PROXY_SOCKS4A);
-
-	if (phb->inpa > 0) {
-		b_event_remove(phb->inpa);
-	}
-	len = sizeof(error);
-	if (getsockopt(source, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
-		return phb_free(phb, FALSE);
-	}
-	sock_make_blocking(source);
-
-	if (!is_socks4a && !(hp = gethostbyname(phb->host))) {
-		return phb_free(phb, FALSE);
-	}
+	gboolean is_socks4a = (addr == NULL);
 
 	packet[0] = 4;
 	packet[1] = 1;
@@ -349,25 +434,63 @@ static gboolean s4_canwrite(gpointer data, gint source, b_input_condition cond)
 		packet[6] = 0;
 		packet[7] = 1;
 	} else {
-		packet[4] = (unsigned char) (hp->h_addr_list[0])[0];
-		packet[5] = (unsigned char) (hp->h_addr_list[0])[1];
-		packet[6] = (unsigned char) (hp->h_addr_list[0])[2];
-		packet[7] = (unsigned char) (hp->h_addr_list[0])[3];
+		memcpy(packet + 4, addr, 4);
 	}
 	packet[8] = 0;
 	if (write(source, packet, 9) != 9) {
-		return phb_free(phb, FALSE);
+		phb_free(phb, FALSE);
+		return;
 	}
 
 	if (is_socks4a) {
 		size_t host_len = strlen(phb->host) + 1; /* include the \0 */
 
 		if (write(source, phb->host, host_len) != host_len) {
-			return phb_free(phb, FALSE);
+			phb_free(phb, FALSE);
+			return;
 		}
 	}
 
 	phb->inpa = b_input_add(source, B_EV_IO_READ, s4_canread, phb);
+}
+
+static void s4_resolved(gpointer data, struct addrinfo *res)
+{
+	struct PHB *phb = data;
+
+	phb->dns = 0;
+
+	if (res == NULL) {
+		phb_free(phb, FALSE);
+		return;
+	}
+
+	s4_sendconnect(phb, phb->fd, (unsigned char *) &((struct sockaddr_in *) res->ai_addr)->sin_addr);
+	dns_freeaddrinfo(res);
+}
+
+static gboolean s4_canwrite(gpointer data, gint source, b_input_condition cond)
+{
+	struct PHB *phb = data;
+	socklen_t len;
+	int error = ETIMEDOUT;
+
+	if (phb->inpa > 0) {
+		b_event_remove(phb->inpa);
+		phb->inpa = 0;
+	}
+	len = sizeof(error);
+	if (getsockopt(source, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+		return phb_free(phb, FALSE);
+	}
+	sock_make_blocking(source);
+
+	if (proxytype == PROXY_SOCKS4A) {
+		s4_sendconnect(phb, source, NULL);
+	} else {
+		/* Plain SOCKS4 only does IPv4 addresses, which we have to look up. */
+		phb->dns = dns_lookup(phb->host, phb->port, AF_INET, s4_resolved, phb);
+	}
 
 	return FALSE;
 }
@@ -0,0 +1,266 @@
+/********************************************************************\
+  * BitlBee -- An IRC to other IM-networks gateway                     *
+  *                                                                    *
+  * Copyright 2002-2013 Wilmer van der Gaast and others                *
+  \********************************************************************/
+
+/* SSL module - session and verification caches, shared by SSL modules */
+
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License with
+  the Debian GNU/Linux distribution in /usr/share/common-licenses/GPL;
+  if not, write to the Free Software Foundation, Inc., 51 Franklin St.,
+  Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Remembers the (serialized) TLS session of the last connection to every
+   server, so the next connection can resume it instead of doing a full
+   handshake. The SSL module decides what goes in there, this file only
+   keeps it around for a while, and throws out the oldest entries if
+   there are too many.
+
+   It also remembers which server certificates were verified successfully
+   recently, so reconnecting to the same server doesn't need to check the
+   whole chain again. Those entries are keyed by a fingerprint of the leaf
+   certificate and the hostname it was checked against, and forgotten when
+   the trust store gets reloaded. */
+
+#include <string.h>
+#include <time.h>
+
+#include "ssl_client.h"
+
+struct ssl_cache_entry {
+	char *key;
+	time_t stored;
+	GList *link;            /* In ssl_cache_order */
+	size_t len;
+	char data[];
+};
+
+static GHashTable *ssl_cache;
+static GQueue *ssl_cache_order;     /* Oldest first */
+static int ssl_cache_handshakes, ssl_cache_resumed, ssl_cache_ktls;
+
+static GHashTable *ssl_verify_cache;    /* Key -> expiry time (time_t *) */
+static int ssl_verify_hits;
+
+static void ssl_cache_entry_free(struct ssl_cache_entry *e)
+{
+	g_queue_delete_link(ssl_cache_order, e->link);
+	g_hash_table_remove(ssl_cache, e->key);
+	g_free(e->key);
+	g_free(e);
+}
+
+/* STARTTLS connections don't know the port, they use 0. The verification
+   setting is part of the key because a resumed session skips sending the
+   certificate again. */
+char *ssl_cache_key(const char *host, int port, gboolean verify)
+{
+	if (host == NULL) {
+		return NULL;
+	}
+
+	return g_strdup_printf("%s:%d:%d", host, port, verify ? 1 : 0);
+}
+
+void ssl_cache_store(const char *key, const void *data, size_t len)
+{
+	struct ssl_cache_entry *e;
+
+	if (key == NULL) {
+		return;
+	}
+
+	if (ssl_cache == NULL) {
+		ssl_cache = g_hash_table_new(g_str_hash, g_str_equal);
+		ssl_cache_order = g_queue_new();
+	}
+
+	if ((e = g_hash_table_lookup(ssl_cache, key))) {
+		ssl_cache_entry_free(e);
+	}
+
+	e = g_malloc(sizeof(struct ssl_cache_entry) + len);
+	e->key = g_strdup(key);
+	e->stored = time(NULL);
+	e->len = len;
+	memcpy(e->data, data, len);
+
+	g_queue_push_tail(ssl_cache_order, e);
+	e->link = ssl_cache_order->tail;
+	g_hash_table_insert(ssl_cache, e->key, e);
+
+	while (g_queue_get_length(ssl_cache_order) > SSL_CACHE_MAX_ENTRIES) {
+		ssl_cache_entry_free(g_queue_peek_head(ssl_cache_order));
+	}
+}
+
+/* Returns the cached session data or NULL. Only valid until the next call
+   to any of these functions. */
+const void *ssl_cache_lookup(const char *key, size_t *len)
+{
+	struct ssl_cache_entry *e;
+
+	if (key == NULL || ssl_cache == NULL ||
+	    !(e = g_hash_table_lookup(ssl_cache, key))) {
+		return NULL;
+	}
+
+	if (time(NULL) - e->stored > SSL_CACHE_TTL) {
+		ssl_cache_entry_free(e);
+		return NULL;
+	}
+
+	*len = e->len;
+	return e->data;
+}
+
+/* For sessions the server didn't want to resume anymore. */
+void ssl_cache_remove(const char *key)
+{
+	struct ssl_cache_entry *e;
+
+	if (key && ssl_cache && (e = g_hash_table_lookup(ssl_cache, key))) {
+		ssl_cache_entry_free(e);
+	}
+}
+
+/* For when the trust store changed: a resumed session skips verifying the
+   certificate chain, so sessions that were verified against the old one
+   can't be used anymore. The others don't depend on it. */
+void ssl_cache_flush(void)
+{
+	GList *l, *next;
+
+	if (ssl_cache == NULL) {
+		return;
+	}
+
+	for (l = ssl_cache_order->head; l; l = next) {
+		struct ssl_cache_entry *e = l->data;
+
+		next = l->next;
+		if (g_str_has_suffix(e->key, ":1")) {
+			ssl_cache_entry_free(e);
+		}
+	}
+}
+
+/* Called by the SSL modules after every successful handshake. */
+void ssl_cache_count(gboolean resumed, gboolean ktls)
+{
+	ssl_cache_handshakes++;
+	if (resumed) {
+		ssl_cache_resumed++;
+	}
+	if (ktls) {
+		ssl_cache_ktls++;
+	}
+}
+
+static char *ssl_verify_cache_key(const unsigned char *fp, size_t fp_len, const char *hostname)
+{
+	GString *key = g_string_sized_new(fp_len * 2 + 64);
+	size_t i;
+
+	for (i = 0; i < fp_len; i++) {
+		g_string_append_printf(key, "%02x", fp[i]);
+	}
+	g_string_append_c(key, ' ');
+	if (hostname) {
+		char *host = g_ascii_strdown(hostname, -1);
+		g_string_append(key, host);
+		g_free(host);
+	}
+
+	return g_string_free(key, FALSE);
+}
+
+static gboolean ssl_verify_cache_expired(gpointer key, gpointer value, gpointer now)
+{
+	return *(time_t *) value <= *(time_t *) now;
+}
+
+/* Remembers a successful verification of a leaf certificate (identified
+   by its fingerprint) for hostname, until the certificate expires or for
+   SSL_VERIFY_CACHE_TTL seconds, whichever comes first. */
+void ssl_verify_cache_store(const unsigned char *fp, size_t fp_len, const char *hostname, time_t not_after)
+{
+	time_t now = time(NULL), *expires;
+
+	if (fp_len == 0 || not_after <= now) {
+		return;
+	}
+
+	if (ssl_verify_cache == NULL) {
+		ssl_verify_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	}
+
+	if (g_hash_table_size(ssl_verify_cache) >= SSL_CACHE_MAX_ENTRIES) {
+		g_hash_table_foreach_remove(ssl_verify_cache, ssl_verify_cache_expired, &now);
+		if (g_hash_table_size(ssl_verify_cache) >= SSL_CACHE_MAX_ENTRIES) {
+			/* Nothing to be clever about here, just start over. */
+			g_hash_table_remove_all(ssl_verify_cache);
+		}
+	}
+
+	expires = g_new(time_t, 1);
+	*expires = MIN(not_after, now + SSL_VERIFY_CACHE_TTL);
+	g_hash_table_replace(ssl_verify_cache, ssl_verify_cache_key(fp, fp_len, hostname), expires);
+}
+
+/* TRUE if this certificate was verified successfully for hostname not too
+   long ago. */
+gboolean ssl_verify_cache_lookup(const unsigned char *fp, size_t fp_len, const char *hostname)
+{
+	time_t *expires;
+	char *key;
+
+	if (fp_len == 0 || ssl_verify_cache == NULL) {
+		return FALSE;
+	}
+
+	key = ssl_verify_cache_key(fp, fp_len, hostname);
+	if ((expires = g_hash_table_lookup(ssl_verify_cache, key)) && *expires <= time(NULL)) {
+		g_hash_table_remove(ssl_verify_cache, key);
+		expires = NULL;
+	}
+	g_free(key);
+
+	if (expires) {
+		ssl_verify_hits++;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* For when the trust store changed. */
+void ssl_verify_cache_flush(void)
+{
+	if (ssl_verify_cache) {
+		g_hash_table_remove_all(ssl_verify_cache);
+	}
+}
+
+void ssl_cache_stats(struct ssl_cache_stats *st)
+{
+	st->entries = ssl_cache ? g_hash_table_size(ssl_cache) : 0;
+	st->handshakes = ssl_cache_handshakes;
+	st->resumed = ssl_cache_resumed;
+	st->ktls = ssl_cache_ktls;
+	st->verified = ssl_verify_cache ? g_hash_table_size(ssl_verify_cache) : 0;
+	st->verify_hits = ssl_verify_hits;
+}
@@ -32,6 +32,7 @@
    is completed. */
 
 #include <glib.h>
+#include <time.h>
 #include "proxy.h"
 
 /* Some generic error codes. Especially SSL_AGAIN is important if you
@@ -58,16 +59,24 @@ typedef gboolean (*ssl_input_function)(gpointer, int, void*, b_input_condition);
 /* Perform any global initialization the SSL library might need. */
 G_MODULE_EXPORT void ssl_init(void);
 
+/* Loads the trust store (the CAfile setting) again, after a rehash.
+   Connections that exist already keep using the old one. */
+G_MODULE_EXPORT void ssl_reload(void);
+
 /* Connect to host:port, call the given function when the connection is
    ready to be used for SSL traffic. This is all done asynchronously, no
-   blocking I/O! (Except for the DNS lookups, for now...) */
+   blocking I/O! (DNS lookups included, see dns.c.) */
 G_MODULE_EXPORT void *ssl_connect(char *host, int port, gboolean verify, ssl_input_function func, gpointer data);
 
 /* Start an SSL session on an existing fd. Useful for STARTTLS functionality,
    for example in Jabber. */
 G_MODULE_EXPORT void *ssl_starttls(int fd, char *hostname, gboolean verify, ssl_input_function func, gpointer data);
 
-/* Obviously you need special read/write functions to read data. */
+/* Obviously you need special read/write functions to read data. The
+   socket stays non-blocking after the handshake, so be prepared for
+   SSL_AGAIN and short writes. After SSL_AGAIN from ssl_write(), call it
+   again with (at least) the same data, the SSL library may have taken
+   part of it already. */
 G_MODULE_EXPORT int ssl_read(void *conn, char *buf, int len);
 G_MODULE_EXPORT int ssl_write(void *conn, const char *buf, int len);
 
@@ -102,5 +111,33 @@ G_MODULE_EXPORT b_input_condition ssl_getdirection(void *conn);
    a more useful string. Or NULL if it had no useful bits set. */
 G_MODULE_EXPORT char *ssl_verify_strerror(int code);
 
+/* Client session cache (ssl_cache.c), so reconnects to the same server
+   can resume the TLS session instead of doing a full handshake. There's
+   a cache of recently verified certificates in there as well. Used by
+   the SSL modules, not meant for anyone else except for the stats. */
+#define SSL_CACHE_MAX_ENTRIES 256
+#define SSL_CACHE_TTL 3600
+#define SSL_VERIFY_CACHE_TTL 3600
+
+struct ssl_cache_stats {
+	int entries;            /* Sessions in the cache right now */
+	int handshakes;         /* Successful handshakes so far */
+	int resumed;            /* How many of those resumed a session */
+	int ktls;               /* How many of those use kernel TLS */
+	int verified;           /* Verified certificates in the cache */
+	int verify_hits;        /* Chain verifications skipped thanks to it */
+};
+
+char *ssl_cache_key(const char *host, int port, gboolean verify);
+void ssl_cache_store(const char *key, const void *data, size_t len);
+const void *ssl_cache_lookup(const char *key, size_t *len);
+void ssl_cache_remove(const char *key);
+void ssl_cache_flush(void);
+void ssl_cache_count(gboolean resumed, gboolean ktls);
+G_MODULE_EXPORT void ssl_cache_stats(struct ssl_cache_stats *st);
+void ssl_verify_cache_store(const unsigned char *fp, size_t fp_len, const char *hostname, time_t not_after);
+gboolean ssl_verify_cache_lookup(const unsigned char *fp, size_t fp_len, const char *hostname);
+void ssl_verify_cache_flush(void);
+
 G_MODULE_EXPORT size_t ssl_des3_encrypt(const unsigned char *key, size_t key_len, const unsigned char *input,
                                         size_t input_len, const unsigned char *iv, unsigned char **res);
@@ -25,6 +25,9 @@
 
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+#include <gnutls/socket.h>
+#endif
 #include <gcrypt.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -37,7 +40,15 @@
 int ssl_errno = 0;
 
 static gboolean initialized = FALSE;
-gnutls_certificate_credentials_t xcred;
+
+/* GnuTLS sessions don't hold a reference to their credentials, so count
+   them here. After a reload the old set stays until its last session is
+   gone. */
+struct ssl_creds {
+	gnutls_certificate_credentials_t xcred;
+	int ref;
+};
+static struct ssl_creds *creds;
 
 #include <limits.h>
 
@@ -56,13 +67,13 @@ struct scd {
 	gboolean established;
 	int inpa;
 	char *hostname;
+	char *cache_key;
 	gboolean verify;
 
 	gnutls_session_t session;
+	struct ssl_creds *creds;
 };
 
-static GHashTable *session_cache;
-
 static gboolean ssl_connected(gpointer data, gint source, b_input_condition cond);
 static gboolean ssl_starttls_real(gpointer data, gint source, b_input_condition cond);
 static gboolean ssl_handshake(gpointer data, gint source, b_input_condition cond);
@@ -74,13 +85,12 @@ static void ssl_log(int level, const char *line)
 	printf("%d %s", level, line);
 }
 
-void ssl_init(void)
+/* All connections share one set of credentials, so the CA file is only
+   parsed once. */
+static void ssl_load_credentials(void)
 {
-	if (initialized) {
-		return;
-	}
+	gnutls_certificate_credentials_t xcred;
 
-	gnutls_global_init();
 	gnutls_certificate_allocate_credentials(&xcred);
 	if (global.conf->cafile) {
 		gnutls_certificate_set_x509_trust_file(xcred, global.conf->cafile, GNUTLS_X509_FMT_PEM);
@@ -91,6 +101,28 @@ void ssl_init(void)
 			gnutls_certificate_set_verify_flags(xcred, GNUTLS_VERIFY_ALLOW_X509_V1_CA_CRT);
 		}
 	}
+
+	creds = g_new0(struct ssl_creds, 1);
+	creds->xcred = xcred;
+	creds->ref = 1;         /* Until the next reload */
+}
+
+static void ssl_creds_unref(struct ssl_creds *c)
+{
+	if (--c->ref == 0) {
+		gnutls_certificate_free_credentials(c->xcred);
+		g_free(c);
+	}
+}
+
+void ssl_init(void)
+{
+	if (initialized) {
+		return;
+	}
+
+	gnutls_global_init();
+	ssl_load_credentials();
 	initialized = TRUE;
 
 	gnutls_global_set_log_function(ssl_log);
@@ -98,17 +130,26 @@ void ssl_init(void)
 	gnutls_global_set_log_level( 3 );
 	*/
 
-	session_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
-
 	atexit(ssl_deinit);
 }
 
 static void ssl_deinit(void)
 {
+	ssl_creds_unref(creds);
+	creds = NULL;
 	gnutls_global_deinit();
-	gnutls_certificate_free_credentials(xcred);
-	g_hash_table_destroy(session_cache);
-	session_cache = NULL;
+}
+
+void ssl_reload(void)
+{
+	if (!initialized) {
+		return;
+	}
+
+	ssl_creds_unref(creds);
+	ssl_load_credentials();
+	ssl_cache_flush();
+	ssl_verify_cache_flush();
 }
 
 void *ssl_connect(char *host, int port, gboolean verify, ssl_input_function func, gpointer data)
@@ -120,10 +161,12 @@ void *ssl_connect(char *host, int port, gboolean verify, ssl_input_function func
 	conn->inpa = -1;
 	conn->hostname = g_strdup(host);
 	conn->verify = verify && global.conf->cafile;
+	conn->cache_key = ssl_cache_key(host, port, conn->verify);
 	conn->fd = proxy_connect(host, port, ssl_connected, conn);
 
 	if (conn->fd < 0) {
 		g_free(conn->hostname);
+		g_free(conn->cache_key);
 		g_free(conn);
 		return NULL;
 	}
@@ -146,6 +189,7 @@ void *ssl_starttls(int fd, char *hostname, gboolean verify, ssl_input_function f
 	   not everyone has this file in the same place and plenty of folks
 	   may not have the cert of their private Jabber server in it. */
 	conn->verify = verify && global.conf->cafile;
+	conn->cache_key = ssl_cache_key(hostname, 0, conn->verify);
 
 	/* This function should be called via a (short) timeout instead of
 	   directly from here, because these SSL calls are *supposed* to be
@@ -177,9 +221,24 @@ static int verify_certificate_callback(gnutls_session_t session)
 	int verifyret = 0;
 	gnutls_x509_crt_t cert;
 	struct scd *conn;
+	unsigned char fp[32];
+	size_t fp_size = 0;
 
 	conn = gnutls_session_get_ptr(session);
 
+	/* Skip checking the whole chain if we did that for this certificate
+	   and hostname recently. */
+	cert_list = gnutls_certificate_get_peers(session, &cert_list_size);
+	if (cert_list != NULL) {
+		fp_size = sizeof(fp);
+		if (gnutls_fingerprint(GNUTLS_DIG_SHA256, &cert_list[0], fp, &fp_size) < 0) {
+			fp_size = 0;
+		}
+	}
+	if (ssl_verify_cache_lookup(fp, fp_size, conn->hostname)) {
+		return 0;
+	}
+
 	gnutlsret = gnutls_certificate_verify_peers2(session, &status);
 	if (gnutlsret < 0) {
 		return VERIFY_CERT_ERROR;
@@ -221,7 +280,6 @@ static int verify_certificate_callback(gnutls_session_t session)
 		return VERIFY_CERT_ERROR;
 	}
 
-	cert_list = gnutls_certificate_get_peers(session, &cert_list_size);
 	if (cert_list == NULL || gnutls_x509_crt_import(cert, &cert_list[0], GNUTLS_X509_FMT_DER) < 0) {
 		return VERIFY_CERT_ERROR;
 	}
@@ -231,46 +289,47 @@ static int verify_certificate_callback(gnutls_session_t session)
 		verifyret |= VERIFY_CERT_WRONG_HOSTNAME;
 	}
 
+	if (verifyret == 0) {
+		ssl_verify_cache_store(fp, fp_size, conn->hostname,
+		                       gnutls_x509_crt_get_expiration_time(cert));
+	}
+
 	gnutls_x509_crt_deinit(cert);
 
 	return verifyret;
 }
 
-struct ssl_session {
-	size_t size;
-	char data[];
-};
-
-static void ssl_cache_add(struct scd *conn)
+static void ssl_session_save(struct scd *conn)
 {
 	size_t data_size = 0;
-	struct ssl_session *data;
-	char *hostname;
+	char *data;
+	int st;
 
-	if (!conn->hostname ||
-	    gnutls_session_get_data(conn->session, NULL, &data_size) != 0) {
+	/* Depending on the version, asking for the size is an error. */
+	st = gnutls_session_get_data(conn->session, NULL, &data_size);
+	if ((st != 0 && st != GNUTLS_E_SHORT_MEMORY_BUFFER) || data_size == 0) {
 		return;
 	}
 
-	data = g_malloc(sizeof(struct ssl_session) + data_size);
-	if (gnutls_session_get_data(conn->session, data->data, &data_size) != 0) {
-		g_free(data);
-		return;
+	data = g_malloc(data_size);
+	if (gnutls_session_get_data(conn->session, data, &data_size) == 0) {
+		ssl_cache_store(conn->cache_key, data, data_size);
 	}
-
-	hostname = g_strdup(conn->hostname);
-	g_hash_table_insert(session_cache, hostname, data);
+	g_free(data);
 }
 
-static void ssl_cache_resume(struct scd *conn)
+static void ssl_session_resume(struct scd *conn)
 {
-	struct ssl_session *data;
+	const void *data;
+	size_t data_size;
 
-	if (conn->hostname &&
-	    (data = g_hash_table_lookup(session_cache, conn->hostname))) {
-		gnutls_session_set_data(conn->session, data->data, data->size);
-		g_hash_table_remove(session_cache, conn->hostname);
+	if ((data = ssl_cache_lookup(conn->cache_key, &data_size))) {
+		gnutls_session_set_data(conn->session, data, data_size);
 	}
+
+	/* Use it only once (RFC 8446 C.4), ssl_handshake() stores whatever
+	   the server hands out this time. */
+	ssl_cache_remove(conn->cache_key);
 }
 
 char *ssl_verify_strerror(int code)
@@ -315,6 +374,7 @@ static gboolean ssl_connected(gpointer data, gint source, b_input_condition cond
 	if (source == -1) {
 		conn->func(conn->data, 0, NULL, cond);
 		g_free(conn->hostname);
+		g_free(conn->cache_key);
 		g_free(conn);
 		return FALSE;
 	}
@@ -327,7 +387,9 @@ static gboolean ssl_connected(gpointer data, gint source, b_input_condition cond
 	gnutls_transport_set_lowat(conn->session, 0);
 #endif
 	gnutls_set_default_priority(conn->session);
-	gnutls_credentials_set(conn->session, GNUTLS_CRD_CERTIFICATE, xcred);
+	conn->creds = creds;
+	conn->creds->ref++;
+	gnutls_credentials_set(conn->session, GNUTLS_CRD_CERTIFICATE, conn->creds->xcred);
 	if (conn->hostname && !g_ascii_isdigit(conn->hostname[0])) {
 		gnutls_server_name_set(conn->session, GNUTLS_NAME_DNS,
 		                       conn->hostname, strlen(conn->hostname));
@@ -336,11 +398,22 @@ static gboolean ssl_connected(gpointer data, gint source, b_input_condition cond
 	sock_make_nonblocking(conn->fd);
 	gnutls_transport_set_ptr(conn->session, (gnutls_transport_ptr_t) GNUTLS_STUPID_CAST conn->fd);
 
-	ssl_cache_resume(conn);
+	ssl_session_resume(conn);
 
 	return ssl_handshake(data, source, cond);
 }
 
+/* GnuTLS decides about kernel TLS by itself, based on its system-wide
+   config file. We can only ask whether it happened. */
+static gboolean ssl_ktls_active(struct scd *conn)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+	return gnutls_transport_is_ktls_enabled(conn->session) != 0;
+#else
+	return FALSE;
+#endif
+}
+
 static gboolean ssl_handshake(gpointer data, gint source, b_input_condition cond)
 {
 	struct scd *conn = data;
@@ -354,6 +427,8 @@ static gboolean ssl_handshake(gpointer data, gint source, b_input_condition cond
 			conn->inpa = b_input_add(conn->fd, ssl_getdirection(conn),
 			                         ssl_handshake, data);
 		} else {
+			/* Maybe it didn't like the session we offered. */
+			ssl_cache_remove(conn->cache_key);
 			conn->func(conn->data, 0, NULL, cond);
 
 			ssl_disconnect(conn);
@@ -364,10 +439,8 @@ static gboolean ssl_handshake(gpointer data, gint source, b_input_condition cond
 
 			ssl_disconnect(conn);
 		} else {
-			/* For now we can't handle non-blocking perfectly everywhere... */
-			sock_make_blocking(conn->fd);
-
-			ssl_cache_add(conn);
+			ssl_cache_count(gnutls_session_is_resumed(conn->session), ssl_ktls_active(conn));
+			ssl_session_save(conn);
 			conn->established = TRUE;
 			conn->func(conn->data, 0, conn, cond);
 		}
@@ -459,7 +532,11 @@ void ssl_disconnect(void *conn_)
 	if (conn->session) {
 		gnutls_deinit(conn->session);
 	}
+	if (conn->creds) {
+		ssl_creds_unref(conn->creds);
+	}
 	g_free(conn->hostname);
+	g_free(conn->cache_key);
 	g_free(conn);
 }
 
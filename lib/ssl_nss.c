@@ -53,6 +53,7 @@ struct scd {
 	gpointer data;
 	int fd;
 	char *hostname;
+	char *cache_key;
 	PRFileDesc *prfd;
 	gboolean established;
 	gboolean verify;
@@ -113,6 +114,11 @@ void ssl_init(void)
 	initialized = TRUE;
 }
 
+/* Nothing to reload, this module doesn't use the CAfile setting. */
+void ssl_reload(void)
+{
+}
+
 void *ssl_connect(char *host, int port, gboolean verify,
                   ssl_input_function func, gpointer data)
 {
@@ -122,9 +128,11 @@ void *ssl_connect(char *host, int port, gboolean verify,
 	conn->func = func;
 	conn->data = data;
 	conn->hostname = g_strdup(host);
+	conn->cache_key = ssl_cache_key(host, port, FALSE);
 
 	if (conn->fd < 0) {
 		g_free(conn->hostname);
+		g_free(conn->cache_key);
 		g_free(conn);
 		return (NULL);
 	}
@@ -159,6 +167,7 @@ void *ssl_starttls(int fd, char *hostname, gboolean verify,
 	   not everyone has this file in the same place and plenty of folks
 	   may not have the cert of their private Jabber server in it. */
 	conn->verify = verify && global.conf->cafile;
+	conn->cache_key = ssl_cache_key(hostname, 0, conn->verify);
 
 	/* This function should be called via a (short) timeout instead of
 	   directly from here, because these SSL calls are *supposed* to be
@@ -174,6 +183,22 @@ void *ssl_starttls(int fd, char *hostname, gboolean verify,
 	return conn;
 }
 
+static gboolean ssl_session_resumed(struct scd *conn)
+{
+	SSLChannelInfo info;
+
+	if (SSL_GetChannelInfo(conn->prfd, &info, sizeof(info)) != SECSuccess) {
+		return FALSE;
+	}
+
+#if NSS_VMAJOR > 3 || (NSS_VMAJOR == 3 && NSS_VMINOR >= 39)
+	return info.resumed;
+#else
+	/* A new session is created during the handshake. */
+	return info.creationTime != info.lastAccessTime;
+#endif
+}
+
 static gboolean ssl_connected(gpointer data, gint source,
                               b_input_condition cond)
 {
@@ -187,6 +212,7 @@ static gboolean ssl_connected(gpointer data, gint source,
 			closesocket(source);
 		}
 		g_free(conn->hostname);
+		g_free(conn->cache_key);
 		g_free(conn);
 
 		return FALSE;
@@ -209,12 +235,16 @@ static gboolean ssl_connected(gpointer data, gint source,
 	SSL_AuthCertificateHook(conn->prfd, (SSLAuthCertificate) nss_auth_cert,
 	                        (void *) CERT_GetDefaultCertDB());
 	SSL_SetURL(conn->prfd, conn->hostname);
+	/* NSS has its own client session cache, it just needs to know
+	   which sessions belong together. */
+	SSL_SetSockPeerID(conn->prfd, conn->cache_key);
 	SSL_ResetHandshake(conn->prfd, PR_FALSE);
 
 	if (SSL_ForceHandshake(conn->prfd)) {
 		goto ssl_connected_failure;
 	}
 
+	ssl_cache_count(ssl_session_resumed(conn), FALSE);
 	conn->established = TRUE;
 	conn->func(conn->data, 0, conn, cond);
 	return FALSE;
@@ -230,6 +260,7 @@ ssl_connected_failure:
 		closesocket(source);
 	}
 	g_free(conn->hostname);
+	g_free(conn->cache_key);
 	g_free(conn);
 
 	return FALSE;
@@ -309,6 +340,7 @@ void ssl_disconnect(void *conn_)
 	}
 
 	g_free(conn->hostname);
+	g_free(conn->cache_key);
 	g_free(conn);
 }
 
@@ -26,6 +26,7 @@
 #include <openssl/crypto.h>
 #include <openssl/rand.h>
 #include <openssl/x509.h>
+#include <openssl/x509v3.h>
 #include <openssl/pem.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -46,9 +47,12 @@ struct scd {
 	gboolean established;
 	gboolean verify;
 	char *hostname;
+	char *cache_key;
 
 	int inpa;
 	int lasterr;            /* Necessary for SSL_get_error */
+	gboolean verify_cached; /* Chain verification skipped, see ssl_verify_chain() */
+	SSL_SESSION *session;   /* Not cached until ssl_verify_result() is happy */
 	SSL *ssl;
 };
 
@@ -58,20 +62,101 @@ static void ssl_conn_free(struct scd *conn);
 static gboolean ssl_connected(gpointer data, gint source, b_input_condition cond);
 static gboolean ssl_starttls_real(gpointer data, gint source, b_input_condition cond);
 static gboolean ssl_handshake(gpointer data, gint source, b_input_condition cond);
+static int ssl_session_new(SSL *ssl, SSL_SESSION *sess);
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define X509_STORE_CTX_get0_cert(store) ((store)->cert)
+#endif
 
-void ssl_init(void)
+static gboolean ssl_fingerprint(X509 *cert, unsigned char *fp, unsigned int *fp_len)
+{
+	return cert && X509_digest(cert, EVP_sha256(), fp, fp_len);
+}
+
+/* Replaces the chain verification OpenSSL does during the handshake.
+   Whether it's good enough gets decided afterwards in ssl_verify_result(),
+   so this never fails the handshake by itself. */
+static int ssl_verify_chain(X509_STORE_CTX *store, void *arg)
+{
+	SSL *ssl = X509_STORE_CTX_get_ex_data(store, SSL_get_ex_data_X509_STORE_CTX_idx());
+	struct scd *conn = SSL_get_app_data(ssl);
+	unsigned char fp[EVP_MAX_MD_SIZE];
+	unsigned int fp_len = 0;
+
+	if (!conn->verify) {
+		/* Nobody's going to look at the result. */
+		X509_STORE_CTX_set_error(store, X509_V_OK);
+		return 1;
+	}
+
+	if (ssl_fingerprint(X509_STORE_CTX_get0_cert(store), fp, &fp_len) &&
+	    ssl_verify_cache_lookup(fp, fp_len, conn->hostname)) {
+		conn->verify_cached = TRUE;
+		X509_STORE_CTX_set_error(store, X509_V_OK);
+		return 1;
+	}
+
+	X509_verify_cert(store);
+	return 1;
+}
+
+/* All connections share one context, so the CA file is only parsed once.
+   Every connection holds a reference to the context it was created with. */
+static SSL_CTX *ssl_ctx_new(void)
 {
-	const SSL_METHOD *meth;
+	SSL_CTX *ctx;
+
+	/* Despite the name, this one negotiates the newest TLS version both
+	   sides support. */
+	if (!(ctx = SSL_CTX_new(SSLv23_client_method()))) {
+		return NULL;
+	}
+
+#ifdef SSL_OP_ENABLE_KTLS
+	/* OpenSSL falls back to doing it all by itself if the kernel can't. */
+	if (global.conf->ktls) {
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	}
+#endif
+
+	if (global.conf->cafile) {
+		SSL_CTX_load_verify_locations(ctx, global.conf->cafile, NULL);
+	}
+	SSL_CTX_set_cert_verify_callback(ctx, ssl_verify_chain, NULL);
 
+	/* TLS 1.3 servers send their tickets after the handshake is done, so
+	   the sessions worth saving only show up through this callback. */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, ssl_session_new);
+
+	return ctx;
+}
+
+void ssl_init(void)
+{
 	SSL_library_init();
 
-	meth = TLSv1_client_method();
-	ssl_ctx = SSL_CTX_new(meth);
+	ssl_ctx = ssl_ctx_new();
 
 	initialized = TRUE;
 }
 
+void ssl_reload(void)
+{
+	SSL_CTX *ctx;
+
+	if (!initialized || !(ctx = ssl_ctx_new())) {
+		return;
+	}
+
+	if (ssl_ctx) {
+		SSL_CTX_free(ssl_ctx);
+	}
+	ssl_ctx = ctx;
+	ssl_cache_flush();
+	ssl_verify_cache_flush();
+}
+
 void *ssl_connect(char *host, int port, gboolean verify, ssl_input_function func, gpointer data)
 {
 	struct scd *conn = g_new0(struct scd, 1);
@@ -85,7 +170,9 @@ void *ssl_connect(char *host, int port, gboolean verify, ssl_input_function func
 	conn->func = func;
 	conn->data = data;
 	conn->inpa = -1;
+	conn->verify = verify && global.conf->cafile;
 	conn->hostname = g_strdup(host);
+	conn->cache_key = ssl_cache_key(host, port, conn->verify);
 
 	return conn;
 }
@@ -100,6 +187,7 @@ void *ssl_starttls(int fd, char *hostname, gboolean verify, ssl_input_function f
 	conn->inpa = -1;
 	conn->verify = verify && global.conf->cafile;
 	conn->hostname = g_strdup(hostname);
+	conn->cache_key = ssl_cache_key(hostname, 0, conn->verify);
 
 	/* This function should be called via a (short) timeout instead of
 	   directly from here, because these SSL calls are *supposed* to be
@@ -122,20 +210,62 @@ static gboolean ssl_starttls_real(gpointer data, gint source, b_input_condition
 	return ssl_connected(conn, conn->fd, B_EV_IO_WRITE);
 }
 
-static gboolean ssl_connected(gpointer data, gint source, b_input_condition cond)
+static void ssl_session_resume(struct scd *conn)
 {
-	struct scd *conn = data;
+	const unsigned char *data;
+	SSL_SESSION *sess;
+	size_t len;
+
+	if ((data = ssl_cache_lookup(conn->cache_key, &len)) &&
+	    (sess = d2i_SSL_SESSION(NULL, &data, len))) {
+		SSL_set_session(conn->ssl, sess);
+		SSL_SESSION_free(sess);
+	}
 
-	if (conn->verify) {
-		/* Right now we don't have any verification functionality for OpenSSL. */
-		conn->func(conn->data, 1, NULL, cond);
-		if (source >= 0) {
-			proxy_disconnect(source);
-		}
-		ssl_conn_free(conn);
+	/* Use it only once (RFC 8446 C.4), ssl_session_new() gets to store
+	   whatever the server hands out this time. */
+	ssl_cache_remove(conn->cache_key);
+}
 
-		return FALSE;
+static void ssl_session_save(struct scd *conn, SSL_SESSION *sess)
+{
+	unsigned char *data, *p;
+	int len;
+
+	if ((len = i2d_SSL_SESSION(sess, NULL)) <= 0) {
+		return;
+	}
+
+	p = data = g_malloc(len);
+	if (i2d_SSL_SESSION(sess, &p) == len) {
+		ssl_cache_store(conn->cache_key, data, len);
+	}
+	g_free(data);
+}
+
+/* Called by OpenSSL for every session the server hands us: during the
+   handshake for TLS 1.2, any time after it for TLS 1.3 tickets. */
+static int ssl_session_new(SSL *ssl, SSL_SESSION *sess)
+{
+	struct scd *conn = SSL_get_app_data(ssl);
+
+	if (conn->established) {
+		ssl_session_save(conn, sess);
+		return 0;
+	}
+
+	/* Resuming this session would skip the certificate check, so hold on
+	   to it until ssl_handshake() knows the certificate is good. */
+	if (conn->session) {
+		SSL_SESSION_free(conn->session);
 	}
+	conn->session = sess;
+	return 1;
+}
+
+static gboolean ssl_connected(gpointer data, gint source, b_input_condition cond)
+{
+	struct scd *conn = data;
 
 	if (source == -1) {
 		goto ssl_connected_failure;
@@ -154,15 +284,20 @@ static gboolean ssl_connected(gpointer data, gint source, b_input_condition cond
 	if (conn->ssl == NULL) {
 		goto ssl_connected_failure;
 	}
+	SSL_set_app_data(conn->ssl, conn);
 
-	/* We can do at least the handshake with non-blocking I/O */
+	/* The socket stays non-blocking. A write that gets SSL_AGAIN may be
+	   retried from a buffer that grew (and moved) in the meantime. */
 	sock_make_nonblocking(conn->fd);
 	SSL_set_fd(conn->ssl, conn->fd);
+	SSL_set_mode(conn->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
 	if (conn->hostname && !g_ascii_isdigit(conn->hostname[0])) {
 		SSL_set_tlsext_host_name(conn->ssl, conn->hostname);
 	}
 
+	ssl_session_resume(conn);
+
 	return ssl_handshake(data, source, cond);
 
 ssl_connected_failure:
@@ -172,14 +307,85 @@ ssl_connected_failure:
 
 }
 
+/* Whether the kernel took over the record layer after the handshake. */
+static gboolean ssl_ktls_active(struct scd *conn)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	return BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) > 0 ||
+	       BIO_get_ktls_recv(SSL_get_rbio(conn->ssl)) > 0;
+#else
+	return FALSE;
+#endif
+}
+
+static int ssl_verify_error(long err)
+{
+	switch (err) {
+	case X509_V_OK:
+		return 0;
+	case X509_V_ERR_CERT_REVOKED:
+		return VERIFY_CERT_INVALID | VERIFY_CERT_REVOKED;
+	case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
+	case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY:
+	case X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT:
+	case X509_V_ERR_SELF_SIGNED_CERT_IN_CHAIN:
+		return VERIFY_CERT_INVALID | VERIFY_CERT_SIGNER_NOT_FOUND;
+	case X509_V_ERR_INVALID_CA:
+		return VERIFY_CERT_INVALID | VERIFY_CERT_SIGNER_NOT_CA;
+	case X509_V_ERR_CERT_NOT_YET_VALID:
+		return VERIFY_CERT_INVALID | VERIFY_CERT_NOT_ACTIVATED;
+	case X509_V_ERR_CERT_HAS_EXPIRED:
+		return VERIFY_CERT_INVALID | VERIFY_CERT_EXPIRED;
+	default:
+		return VERIFY_CERT_INVALID;
+	}
+}
+
+/* Same flags as the GnuTLS module returns. Successful results go into the
+   verification cache. */
+static int ssl_verify_result(struct scd *conn)
+{
+	unsigned char fp[EVP_MAX_MD_SIZE];
+	unsigned int fp_len = 0;
+	X509 *cert;
+	int ret, days, secs;
+
+	if (conn->verify_cached) {
+		return 0;
+	}
+
+	if (!(cert = SSL_get_peer_certificate(conn->ssl))) {
+		return VERIFY_CERT_ERROR;
+	}
+
+	ret = ssl_verify_error(SSL_get_verify_result(conn->ssl));
+
+	if (conn->hostname == NULL ||
+	    (X509_check_host(cert, conn->hostname, 0, 0, NULL) != 1 &&
+	     X509_check_ip_asc(cert, conn->hostname, 0) != 1)) {
+		ret |= VERIFY_CERT_INVALID | VERIFY_CERT_WRONG_HOSTNAME;
+	}
+
+	if (ret == 0 && ssl_fingerprint(cert, fp, &fp_len) &&
+	    ASN1_TIME_diff(&days, &secs, NULL, X509_get_notAfter(cert))) {
+		ssl_verify_cache_store(fp, fp_len, conn->hostname,
+		                       time(NULL) + days * 86400L + secs);
+	}
+
+	X509_free(cert);
+	return ret;
+}
+
 static gboolean ssl_handshake(gpointer data, gint source, b_input_condition cond)
 {
 	struct scd *conn = data;
-	int st;
+	int st, stver;
 
-	if ((st = SSL_connect(conn->ssl)) < 0) {
+	if ((st = SSL_connect(conn->ssl)) <= 0) {
 		conn->lasterr = SSL_get_error(conn->ssl, st);
 		if (conn->lasterr != SSL_ERROR_WANT_READ && conn->lasterr != SSL_ERROR_WANT_WRITE) {
+			/* Maybe it didn't like the session we offered. */
+			ssl_cache_remove(conn->cache_key);
 			conn->func(conn->data, 0, NULL, cond);
 			ssl_disconnect(conn);
 			return FALSE;
@@ -189,8 +395,28 @@ static gboolean ssl_handshake(gpointer data, gint source, b_input_condition cond
 		return FALSE;
 	}
 
+	if (conn->verify && (stver = ssl_verify_result(conn)) != 0) {
+		conn->func(conn->data, stver, NULL, cond);
+		ssl_disconnect(conn);
+		return FALSE;
+	}
+
+	ssl_cache_count(SSL_session_reused(conn->ssl), ssl_ktls_active(conn));
+	if (conn->session) {
+		ssl_session_save(conn, conn->session);
+		SSL_SESSION_free(conn->session);
+		conn->session = NULL;
+#ifdef TLS1_3_VERSION
+	} else if (SSL_session_reused(conn->ssl) && SSL_version(conn->ssl) < TLS1_3_VERSION) {
+#else
+	} else if (SSL_session_reused(conn->ssl)) {
+#endif
+		/* A resumed TLS 1.2 session ID without a new ticket. Unlike
+		   TLS 1.3 tickets, those are meant to be used again. */
+		ssl_session_save(conn, SSL_get_session(conn->ssl));
+	}
+
 	conn->established = TRUE;
-	sock_make_blocking(conn->fd);           /* For now... */
 	conn->func(conn->data, 0, conn, cond);
 	return FALSE;
 }
@@ -257,8 +483,12 @@ int ssl_pending(void *conn)
 
 static void ssl_conn_free(struct scd *conn)
 {
+	if (conn->session) {
+		SSL_SESSION_free(conn->session);
+	}
 	SSL_free(conn->ssl);
 	g_free(conn->hostname);
+	g_free(conn->cache_key);
 	g_free(conn);
 
 }
@@ -292,7 +522,34 @@ b_input_condition ssl_getdirection(void *conn)
 
 char *ssl_verify_strerror(int code)
 {
-	return g_strdup("SSL certificate verification not supported by BitlBee OpenSSL code.");
+	GString *ret = g_string_new("");
+
+	if (code & VERIFY_CERT_REVOKED) {
+		g_string_append(ret, "certificate has been revoked, ");
+	}
+	if (code & VERIFY_CERT_SIGNER_NOT_FOUND) {
+		g_string_append(ret, "certificate hasn't got a known issuer, ");
+	}
+	if (code & VERIFY_CERT_SIGNER_NOT_CA) {
+		g_string_append(ret, "certificate's issuer is not a CA, ");
+	}
+	if (code & VERIFY_CERT_NOT_ACTIVATED) {
+		g_string_append(ret, "certificate has not been activated, ");
+	}
+	if (code & VERIFY_CERT_EXPIRED) {
+		g_string_append(ret, "certificate has expired, ");
+	}
+	if (code & VERIFY_CERT_WRONG_HOSTNAME) {
+		g_string_append(ret, "certificate hostname mismatch, ");
+	}
+
+	if (ret->len == 0) {
+		g_string_free(ret, TRUE);
+		return NULL;
+	} else {
+		g_string_truncate(ret, ret->len - 2);
+		return g_string_free(ret, FALSE);
+	}
 }
 
 size_t ssl_des3_encrypt(const unsigned char *key, size_t key_len, const unsigned char *input, size_t input_len,
@@ -26,47 +26,295 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 
 #include "xmltree.h"
 
 #define g_strcasecmp g_ascii_strcasecmp
 #define g_strncasecmp g_ascii_strncasecmp
 
-static void xt_start_element(GMarkupParseContext *ctx, const gchar *element_name, const gchar **attr_names,
-                             const gchar **attr_values, gpointer data, GError **error)
+/* Element and attribute names are interned, so most lookups can be done by
+   comparing pointers. Every atom knows its lowercase version and (if the
+   name has a namespace prefix) the lowercase version of the part after the
+   colon, which is all xt_find_node() and xt_find_attr() care about. Atoms
+   are refcounted since the names come from the network and we don't want
+   to keep every random tag name some server sends us forever. */
+struct xt_atom {
+	int refs;
+	struct xt_atom *fold;
+	struct xt_atom *local;
+	char str[];
+};
+
+#define XT_ATOM(s) ((struct xt_atom *) ((s) - G_STRUCT_OFFSET(struct xt_atom, str)))
+
+static GHashTable *xt_atoms;
+
+static struct xt_atom *xt_atom_lookup(const char *str)
 {
-	struct xt_parser *xt = data;
-	struct xt_node *node = g_new0(struct xt_node, 1), *nt;
-	int i;
+	return xt_atoms ? g_hash_table_lookup(xt_atoms, str) : NULL;
+}
 
-	node->parent = xt->cur;
-	node->name = g_strdup(element_name);
+/* Finds the lowercase atom for str without creating anything. Returns NULL
+   if it doesn't exist, in which case nothing can have that name. */
+static struct xt_atom *xt_atom_lookup_fold(const char *str)
+{
+	struct xt_atom *atom;
+	char buf[64], *lc;
+	int len;
 
-	/* First count the number of attributes */
-	for (i = 0; attr_names[i]; i++) {
-		;
+	if ((atom = xt_atom_lookup(str))) {
+		return atom->fold;
 	}
 
-	/* Then allocate a NULL-terminated array. */
-	node->attr = g_new0(struct xt_attr, i + 1);
+	len = strlen(str);
+	if (len < sizeof(buf)) {
+		int i;
 
-	/* And fill it, saving one variable by starting at the end. */
-	for (i--; i >= 0; i--) {
-		node->attr[i].key = g_strdup(attr_names[i]);
-		node->attr[i].value = g_strdup(attr_values[i]);
+		for (i = 0; i <= len; i++) {
+			buf[i] = g_ascii_tolower(str[i]);
+		}
+		return xt_atom_lookup(buf);
+	}
+
+	lc = g_ascii_strdown(str, len);
+	atom = xt_atom_lookup(lc);
+	g_free(lc);
+
+	return atom;
+}
+
+static struct xt_atom *xt_atom_ref(const char *str)
+{
+	struct xt_atom *atom;
+	char *s;
+	int len;
+
+	if ((atom = xt_atom_lookup(str))) {
+		atom->refs++;
+		return atom;
+	}
+
+	if (xt_atoms == NULL) {
+		xt_atoms = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+
+	len = strlen(str);
+	atom = g_malloc(sizeof(struct xt_atom) + len + 1);
+	memcpy(atom->str, str, len + 1);
+	atom->refs = 1;
+	atom->local = NULL;
+	g_hash_table_insert(xt_atoms, atom->str, atom);
+
+	/* Only the lowercase version of a name is allowed to point at
+	   itself, the others hold a reference to it. */
+	atom->fold = atom;
+	for (s = atom->str; *s; s++) {
+		if (g_ascii_isupper(*s)) {
+			char *lc = g_ascii_strdown(str, len);
+			atom->fold = xt_atom_ref(lc);
+			g_free(lc);
+			break;
+		}
+	}
+
+	if ((s = strchr(atom->fold->str, ':'))) {
+		atom->local = xt_atom_ref(s + 1);
+	}
+
+	return atom;
+}
+
+static void xt_atom_unref(struct xt_atom *atom)
+{
+	if (--atom->refs > 0) {
+		return;
+	}
+
+	g_hash_table_remove(xt_atoms, atom->str);
+	if (atom->fold != atom) {
+		xt_atom_unref(atom->fold);
+	}
+	if (atom->local) {
+		xt_atom_unref(atom->local);
+	}
+	g_free(atom);
+}
+
+static char *xt_intern(const char *str)
+{
+	return xt_atom_ref(str)->str;
+}
+
+static void xt_unintern(char *str)
+{
+	if (str) {
+		xt_atom_unref(XT_ATOM(str));
+	}
+}
+
+/* The children with one name, in order. Children tend to be removed from
+   the front (like the ones xt_cleanup() is done with), that only moves
+   start. */
+struct xt_index_list {
+	GPtrArray *nodes;
+	guint start;
+};
+
+static void xt_index_list_free(struct xt_index_list *list)
+{
+	g_ptr_array_free(list->nodes, TRUE);
+	g_free(list);
+}
+
+static void xt_index_free(struct xt_node *node)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (node->index == NULL) {
+		return;
+	}
+
+	g_hash_table_iter_init(&iter, node->index);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		xt_index_list_free(value);
+	}
+	g_hash_table_destroy(node->index);
+	node->index = NULL;
+}
+
+static void xt_index_add_key(struct xt_node *node, struct xt_atom *key, struct xt_node *child)
+{
+	struct xt_index_list *list;
+
+	if (!(list = g_hash_table_lookup(node->index, key))) {
+		list = g_new0(struct xt_index_list, 1);
+		list->nodes = g_ptr_array_new();
+		g_hash_table_insert(node->index, key, list);
+	}
+	g_ptr_array_add(list->nodes, child);
+}
+
+/* Children are indexed both by full name and by local name, just like
+   xt_find_node() matches them. */
+static void xt_index_add(struct xt_node *node, struct xt_node *child)
+{
+	struct xt_atom *atom = XT_ATOM(child->name);
+
+	xt_index_add_key(node, atom->fold, child);
+	if (atom->local) {
+		xt_index_add_key(node, atom->local, child);
+	}
+}
+
+static void xt_index_remove_key(struct xt_node *node, struct xt_atom *key, struct xt_node *child)
+{
+	struct xt_index_list *list;
+	guint i;
+
+	if (!(list = g_hash_table_lookup(node->index, key))) {
+		return;
+	}
+
+	for (i = list->start; i < list->nodes->len; i++) {
+		if (g_ptr_array_index(list->nodes, i) == child) {
+			break;
+		}
+	}
+	if (i == list->nodes->len) {
+		return;
+	} else if (i == list->start) {
+		list->start++;
+	} else {
+		g_ptr_array_remove_index(list->nodes, i);
+	}
+
+	if (list->start == list->nodes->len) {
+		g_hash_table_remove(node->index, key);
+		xt_index_list_free(list);
+	} else if (list->start > XT_INDEX_MIN_CHILDREN && list->start * 2 > list->nodes->len) {
+		/* Give the space back once in a while, not for every one. */
+		g_ptr_array_remove_range(list->nodes, 0, list->start);
+		list->start = 0;
+	}
+}
+
+/* Keeps the index (if there is one) up to date when child goes away, the
+   order of the others stays the same. */
+static void xt_index_remove(struct xt_node *node, struct xt_node *child)
+{
+	struct xt_atom *atom = XT_ATOM(child->name);
+
+	if (node->index == NULL) {
+		return;
+	}
+
+	xt_index_remove_key(node, atom->fold, child);
+	if (atom->local) {
+		xt_index_remove_key(node, atom->local, child);
+	}
+}
+
+/* Returns the children of node matching name (lowercase atom) in order,
+   or NULL if the node is too narrow to bother. */
+static struct xt_index_list *xt_index_find(struct xt_node *node, struct xt_atom *name, gboolean *indexed)
+{
+	struct xt_node *c;
+
+	*indexed = FALSE;
+	if (node == NULL || node->children_count < XT_INDEX_MIN_CHILDREN) {
+		return NULL;
+	}
+
+	if (node->index == NULL) {
+		node->index = g_hash_table_new(g_direct_hash, g_direct_equal);
+		for (c = node->children; c; c = c->next) {
+			xt_index_add(node, c);
+		}
+	}
+
+	*indexed = TRUE;
+	return g_hash_table_lookup(node->index, name);
+}
+
+/* Appends a list of (parentless) nodes to parent->children. */
+static void xt_append_children(struct xt_node *parent, struct xt_node *child)
+{
+	struct xt_node *node;
+
+	if (child == NULL) {
+		return;
 	}
 
+	if (parent->children == NULL) {
+		parent->children = child;
+	} else {
+		parent->children_tail->next = child;
+	}
+
+	for (node = child; node; node = node->next) {
+		if (node->parent != NULL) {
+			/* ERROR CONDITION: They seem to have a parent already??? */
+		}
+
+		node->parent = parent;
+		parent->children_tail = node;
+		parent->children_count++;
+		if (parent->index) {
+			xt_index_add(parent, node);
+		}
+	}
+}
+
+/* Add a freshly parsed node to the tree and make it the current one. */
+static void xt_start_node(struct xt_parser *xt, struct xt_node *node)
+{
 	/* Add it to the linked list of children nodes, if we have a current
 	   node yet. */
 	if (xt->cur) {
-		if (xt->cur->children) {
-			for (nt = xt->cur->children; nt->next; nt = nt->next) {
-				;
-			}
-			nt->next = node;
-		} else {
-			xt->cur->children = node;
-		}
+		xt_append_children(xt->cur, node);
 	} else if (xt->root) {
 		/* ERROR situation: A second root-element??? */
 	}
@@ -79,6 +327,32 @@ static void xt_start_element(GMarkupParseContext *ctx, const gchar *element_name
 	}
 }
 
+static void xt_start_element(GMarkupParseContext *ctx, const gchar *element_name, const gchar **attr_names,
+                             const gchar **attr_values, gpointer data, GError **error)
+{
+	struct xt_parser *xt = data;
+	struct xt_node *node = g_new0(struct xt_node, 1);
+	int i;
+
+	node->name = xt_intern(element_name);
+
+	/* First count the number of attributes */
+	for (i = 0; attr_names[i]; i++) {
+		;
+	}
+
+	/* Then allocate a NULL-terminated array. */
+	node->attr = g_new0(struct xt_attr, i + 1);
+
+	/* And fill it, saving one variable by starting at the end. */
+	for (i--; i >= 0; i--) {
+		node->attr[i].key = xt_intern(attr_names[i]);
+		node->attr[i].value = g_strdup(attr_values[i]);
+	}
+
+	xt_start_node(xt, node);
+}
+
 static void xt_text(GMarkupParseContext *ctx, const gchar *text, gsize text_len, gpointer data, GError **error)
 {
 	struct xt_parser *xt = data;
@@ -96,12 +370,38 @@ static void xt_text(GMarkupParseContext *ctx, const gchar *text, gsize text_len,
 	node->text[node->text_len] = 0;
 }
 
+/* Offer a node that was just completed to the stream handlers. One that
+   returns XT_HANDLED takes the node out of the tree, see
+   xt_set_stream_handlers(). */
+static void xt_stream_node(struct xt_parser *xt, struct xt_node *node)
+{
+	const struct xt_handler_entry *h;
+	struct xt_node *parent = node->parent;
+
+	for (h = xt->stream_handlers; h->func; h++) {
+		if ((h->name && g_ascii_strcasecmp(h->name, node->name) != 0) ||
+		    (h->parent && g_ascii_strcasecmp(h->parent, parent->name) != 0)) {
+			continue;
+		}
+
+		if (h->func(node, xt->data) == XT_HANDLED) {
+			xt_remove_child(parent, node);
+			return;
+		}
+	}
+}
+
 static void xt_end_element(GMarkupParseContext *ctx, const gchar *element_name, gpointer data, GError **error)
 {
 	struct xt_parser *xt = data;
+	struct xt_node *node = xt->cur;
+
+	node->flags |= XT_COMPLETE;
+	xt->cur = node->parent;
 
-	xt->cur->flags |= XT_COMPLETE;
-	xt->cur = xt->cur->parent;
+	if (xt->stream_handlers && node->parent) {
+		xt_stream_node(xt, node);
+	}
 }
 
 GMarkupParser xt_parser_funcs =
@@ -113,26 +413,602 @@ GMarkupParser xt_parser_funcs =
 	NULL
 };
 
+/* The builtin tokenizer. It accepts (and rejects) the same documents as
+   GMarkup, but instead of running a state machine over every single byte
+   it copies the input into a buffer it owns, finds the next interesting
+   character with memchr() and works on complete tokens: names get
+   zero-terminated and entities decoded in place, so the only allocations
+   left are the ones for the tree itself. Tokens that aren't complete yet
+   stay in the buffer until the next xt_feed(). */
+
+#define XT_TOK_ERROR -1
+#define XT_TOK_MORE  -2
+
+/* What's next in the buffer. */
+enum {
+	XT_TOK_TEXT,
+	XT_TOK_MARKUP,
+	XT_TOK_ELIDED,          /* <tag/ seen, waiting for the > */
+};
+
+/* Big enough for a full 64 KiB read plus a partial token left over from
+   the previous one, so a busy stream settles on one buffer. Anything bigger
+   (after a huge stanza) is shrunk back to this once it's drained. */
+#define XT_BUF_KEEP (128 * 1024)
+
+struct xt_tok_attr {
+	int name, name_len;
+	int value, value_len;
+};
+
+static int xt_tok_error(struct xt_parser *xt, const char *msg)
+{
+	g_set_error(&xt->gerr, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE, "%s", msg);
+	return XT_TOK_ERROR;
+}
+
+static gboolean xt_isspace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static gboolean xt_is_name_end(char c)
+{
+	return c == '=' || c == '/' || c == '>' || c == ' ';
+}
+
+/* Characters that end a name. */
+static const char xt_name_stop[256] = {
+	[' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\r'] = 1, ['='] = 1, ['/'] = 1, ['>'] = 1,
+};
+
+static int xt_name_span(const char *s, int len)
+{
+	int i;
+
+	for (i = 0; i < len && !xt_name_stop[(unsigned char) s[i]]; i++) {
+		;
+	}
+
+	return i;
+}
+
+static gboolean xt_valid_name(const char *name, int len)
+{
+	const char *s, *end = name + len;
+	gunichar c;
+
+	if (len == 0 || !g_utf8_validate(name, len, NULL)) {
+		return FALSE;
+	}
+
+	for (s = name; s < end; s = g_utf8_next_char(s)) {
+		if (!(*s & 0x80)) {
+			if (!(g_ascii_isalpha(*s) || *s == '_' || *s == ':' ||
+			      (s > name && (g_ascii_isdigit(*s) || *s == '.' || *s == '-')))) {
+				return FALSE;
+			}
+			continue;
+		}
+
+		c = g_utf8_get_char(s);
+		if (!(g_unichar_isalpha(c) || (s > name && g_unichar_isalnum(c)))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Decodes entities and normalizes line breaks (and for attribute values,
+   other whitespace) into out, which may be the same as in. Pass NULL as
+   out to only check whether the text is valid. Returns the new length or
+   -1 on errors. The character after the text must not be a digit, space
+   or semicolon, the quote or < the caller found there is fine. */
+static int xt_unescape(const char *in, int len, gboolean attr, char *out)
+{
+	const char *s, *end = in + len;
+	char *e, utf8[6];
+	gulong l;
+	int o = 0, n;
+
+	if (!g_utf8_validate(in, len, NULL)) {
+		return -1;
+	}
+
+	for (s = in; s < end; s++) {
+		char c = *s;
+
+		if (c == '\r') {
+			c = attr ? ' ' : '\n';
+			if (s + 1 < end && s[1] == '\n') {
+				s++;
+			}
+		} else if (c == '&') {
+			s++;
+			if (s < end && *s == '#') {
+				int base = 10;
+
+				if (++s < end && *s == 'x') {
+					base = 16;
+					s++;
+				}
+				errno = 0;
+				l = strtoul(s, &e, base);
+				if (e == s || errno != 0 || e >= end || *e != ';' ||
+				    !((l > 0 && l <= 0xD7FF) || (l >= 0xE000 && l <= 0xFFFD) ||
+				      (l >= 0x10000 && l <= 0x10FFFF))) {
+					return -1;
+				}
+
+				n = g_unichar_to_utf8(l, utf8);
+				if (out) {
+					memcpy(out + o, utf8, n);
+				}
+				o += n;
+				s = e;
+				continue;
+			} else if (end - s >= 3 && strncmp(s, "lt;", 3) == 0) {
+				c = '<';
+				s += 2;
+			} else if (end - s >= 3 && strncmp(s, "gt;", 3) == 0) {
+				c = '>';
+				s += 2;
+			} else if (end - s >= 4 && strncmp(s, "amp;", 4) == 0) {
+				c = '&';
+				s += 3;
+			} else if (end - s >= 5 && strncmp(s, "quot;", 5) == 0) {
+				c = '"';
+				s += 4;
+			} else if (end - s >= 5 && strncmp(s, "apos;", 5) == 0) {
+				c = '\'';
+				s += 4;
+			} else {
+				return -1;
+			}
+		} else if (attr && (c == '\t' || c == '\n')) {
+			c = ' ';
+		}
+
+		if (out) {
+			out[o] = c;
+		}
+		o++;
+	}
+
+	return o;
+}
+
+/* Character data up to the next tag. Outside the root element, that can
+   only be whitespace. */
+static int xt_tok_text(struct xt_parser *xt, char *s, int len)
+{
+	char *lt = memchr(s + xt->scan, '<', len - xt->scan);
+	int i, end = lt ? lt - s : len;
+
+	if (xt->cur == NULL) {
+		for (i = xt->scan; i < end; i++) {
+			if (!xt_isspace(s[i])) {
+				return xt_tok_error(xt, "Unexpected text outside the root element");
+			}
+		}
+	}
+
+	if (lt == NULL) {
+		xt->scan = len;
+		return XT_TOK_MORE;
+	}
+
+	if (xt->cur) {
+		if ((i = xt_unescape(s, end, FALSE, s)) < 0) {
+			return xt_tok_error(xt, "Invalid character data");
+		}
+		xt_text(NULL, s, i, xt, NULL);
+	}
+
+	xt->state = XT_TOK_MARKUP;
+	return end;
+}
+
+/* Comments, processing instructions, CDATA and DOCTYPE declarations.
+   They're all ignored, but we have to find their end the same way GMarkup
+   does. */
+static int xt_tok_passthrough(struct xt_parser *xt, char *s, int len)
+{
+	int i;
+
+	if (xt->scan == 0) {
+		xt->scan = 1;
+		xt->balance = 1;
+	}
+
+	for (i = xt->scan; i < len; i++) {
+		if (s[i] == '<') {
+			xt->balance++;
+		} else if (s[i] == '>') {
+			xt->balance--;
+			if ((s[1] == '?' && s[i - 1] == '?') ||
+			    (i >= 4 && strncmp(s, "<!--", 4) == 0 && s[i - 2] == '-' && s[i - 1] == '-') ||
+			    (i >= 9 && strncmp(s, "<![CDATA[", 9) == 0 && s[i - 2] == ']' && s[i - 1] == ']') ||
+			    (i >= 9 && strncmp(s, "<!DOCTYPE", 9) == 0 && xt->balance == 0)) {
+				xt->state = XT_TOK_TEXT;
+				return i + 1;
+			}
+		}
+	}
+
+	xt->scan = len;
+	return XT_TOK_MORE;
+}
+
+static int xt_tok_end_tag(struct xt_parser *xt, char *s, int len)
+{
+	int i = 2, name_len;
+
+	if (i == len) {
+		return XT_TOK_MORE;
+	} else if (xt_is_name_end(s[i])) {
+		return xt_tok_error(xt, "Invalid character after </");
+	}
+
+	name_len = xt_name_span(s + i, len - i);
+	for (i += name_len; i < len && xt_isspace(s[i]); i++) {
+		;
+	}
+	if (i == len) {
+		return XT_TOK_MORE;
+	} else if (s[i] != '>') {
+		return xt_tok_error(xt, "Expected > at the end of a closing tag");
+	} else if (xt->cur == NULL || strlen(xt->cur->name) != name_len ||
+	           memcmp(xt->cur->name, s + 2, name_len) != 0) {
+		return xt_tok_error(xt, "Closing tag doesn't match the open element");
+	}
+
+	xt_end_element(NULL, NULL, xt, NULL);
+
+	xt->state = XT_TOK_TEXT;
+	return i + 1;
+}
+
+static int xt_tok_elided(struct xt_parser *xt, char *s, int len)
+{
+	if (s[0] != '>') {
+		return xt_tok_error(xt, "Expected > after /");
+	}
+
+	xt_end_element(NULL, NULL, xt, NULL);
+
+	xt->state = XT_TOK_TEXT;
+	return 1;
+}
+
+/* Start tags are only turned into a node once they're complete, until
+   then they're scanned again after every xt_feed(). Errors are reported
+   as soon as they're visible though, just like GMarkup does it. */
+static int xt_tok_start_tag(struct xt_parser *xt, char *s, int len)
+{
+	struct xt_tok_attr a, *ap;
+	struct xt_node *node;
+	gboolean empty;
+	char *q;
+	int i = 1, j, name_len;
+
+	if (xt_is_name_end(s[i])) {
+		return xt_tok_error(xt, "Invalid character after <");
+	}
+
+	name_len = xt_name_span(s + i, len - i);
+	i += name_len;
+
+	g_array_set_size(xt->tok_attrs, 0);
+	while (TRUE) {
+		for (; i < len && xt_isspace(s[i]); i++) {
+			;
+		}
+		if (i == len) {
+			return XT_TOK_MORE;
+		} else if ((s[i] == '/' || s[i] == '>') && !xt_valid_name(s + 1, name_len)) {
+			/* GMarkup only checks it here, so we do too. */
+			return xt_tok_error(xt, "Invalid element name");
+		} else if (s[i] == '/') {
+			/* GMarkup reports the element as soon as it sees the
+			   slash, the > may come later (see xt_tok_elided()). */
+			if (i + 1 < len && s[i + 1] != '>') {
+				return xt_tok_error(xt, "Expected > after /");
+			}
+			empty = TRUE;
+			i++;
+			break;
+		} else if (s[i] == '>') {
+			empty = FALSE;
+			i++;
+			break;
+		} else if (s[i] == '=') {
+			return xt_tok_error(xt, "Expected an attribute name");
+		}
+
+		a.name = i;
+		a.name_len = xt_name_span(s + i, len - i);
+		for (i += a.name_len; i < len && xt_isspace(s[i]); i++) {
+			;
+		}
+		if (i == len) {
+			return XT_TOK_MORE;
+		} else if (!xt_valid_name(s + a.name, a.name_len)) {
+			return xt_tok_error(xt, "Invalid attribute name");
+		} else if (s[i] != '=') {
+			return xt_tok_error(xt, "Expected = after an attribute name");
+		}
+
+		for (i++; i < len && xt_isspace(s[i]); i++) {
+			;
+		}
+		if (i == len) {
+			return XT_TOK_MORE;
+		} else if (s[i] != '"' && s[i] != '\'') {
+			return xt_tok_error(xt, "Expected a quoted attribute value");
+		} else if (!(q = memchr(s + i + 1, s[i], len - i - 1))) {
+			return XT_TOK_MORE;
+		}
+
+		a.value = i + 1;
+		a.value_len = q - s - a.value;
+		if (xt_unescape(s + a.value, a.value_len, TRUE, NULL) < 0) {
+			return xt_tok_error(xt, "Invalid attribute value");
+		}
+		g_array_append_val(xt->tok_attrs, a);
+		i = q - s + 1;
+	}
+
+	/* Complete, so now it's safe to modify the buffer. */
+	s[1 + name_len] = '\0';
+	node = g_new0(struct xt_node, 1);
+	node->name = xt_intern(s + 1);
+	node->attr = g_new0(struct xt_attr, xt->tok_attrs->len + 1);
+	for (j = 0; j < xt->tok_attrs->len; j++) {
+		ap = &g_array_index(xt->tok_attrs, struct xt_tok_attr, j);
+		s[ap->name + ap->name_len] = '\0';
+		node->attr[j].key = xt_intern(s + ap->name);
+		ap->value_len = xt_unescape(s + ap->value, ap->value_len, TRUE, s + ap->value);
+		node->attr[j].value = g_strndup(s + ap->value, ap->value_len);
+	}
+
+	xt_start_node(xt, node);
+	xt->state = empty ? XT_TOK_ELIDED : XT_TOK_TEXT;
+
+	return i;
+}
+
+static int xt_tok_markup(struct xt_parser *xt, char *s, int len)
+{
+	if (len < 2) {
+		return XT_TOK_MORE;
+	} else if (s[1] == '?' || s[1] == '!') {
+		return xt_tok_passthrough(xt, s, len);
+	} else if (s[1] == '/') {
+		return xt_tok_end_tag(xt, s, len);
+	} else {
+		return xt_tok_start_tag(xt, s, len);
+	}
+}
+
+static int xt_feed_builtin(struct xt_parser *xt, const char *text, int text_len)
+{
+	int st;
+
+	if (xt->gerr) {
+		return -1;
+	}
+
+	if (xt->buf_len + text_len >= xt->buf_size && xt->buf_pos > 0) {
+		xt->buf_len -= xt->buf_pos;
+		memmove(xt->buf, xt->buf + xt->buf_pos, xt->buf_len);
+		xt->buf_pos = 0;
+	}
+	if (xt->buf_len + text_len >= xt->buf_size) {
+		int size = MAX(xt->buf_size, 4096);
+
+		while (size <= xt->buf_len + text_len) {
+			size *= 2;
+		}
+		xt->buf_size = size;
+		xt->buf = g_realloc(xt->buf, xt->buf_size);
+	}
+	memcpy(xt->buf + xt->buf_len, text, text_len);
+	xt->buf_len += text_len;
+	xt->buf[xt->buf_len] = '\0';
+
+	/* Text and markup alternate, even if the text is empty. Every token
+	   function picks the next state. */
+	while (xt->buf_pos < xt->buf_len) {
+		char *s = xt->buf + xt->buf_pos;
+		int len = xt->buf_len - xt->buf_pos;
+
+		if (xt->state == XT_TOK_MARKUP) {
+			st = xt_tok_markup(xt, s, len);
+		} else if (xt->state == XT_TOK_ELIDED) {
+			st = xt_tok_elided(xt, s, len);
+		} else {
+			st = xt_tok_text(xt, s, len);
+		}
+
+		if (st == XT_TOK_ERROR) {
+			return -1;
+		} else if (st == XT_TOK_MORE) {
+			break;
+		}
+
+		xt->buf_pos += st;
+		xt->scan = 0;
+	}
+
+	if (xt->buf_pos == xt->buf_len) {
+		xt->buf_pos = xt->buf_len = 0;
+		if (xt->buf_size > XT_BUF_KEEP) {
+			xt->buf_size = XT_BUF_KEEP;
+			xt->buf = g_realloc(xt->buf, xt->buf_size);
+		}
+	}
+
+	return !(xt->root && xt->root->flags & XT_COMPLETE);
+}
+
+/* Handler tables get compiled into a hash table with the (lowercase,
+   interned) element name as the key and a list of matches as the value,
+   plus one list for handlers that match any element. Both keep the order
+   of the original table, so xt_handle() only has to merge two short lists
+   and compare parent names by pointer. */
+struct xt_handler_match {
+	int order;
+	struct xt_atom *parent;         /* NULL if any parent is fine */
+	gboolean root;                  /* Parent was "<root>" */
+	const struct xt_handler_entry *entry;
+};
+
+static struct xt_atom *xt_atom_ref_fold(const char *str)
+{
+	char *lc = g_ascii_strdown(str, -1);
+	struct xt_atom *atom = xt_atom_ref(lc);
+
+	g_free(lc);
+	return atom;
+}
+
+static void xt_compile_handlers(struct xt_parser *xt)
+{
+	const struct xt_handler_entry *h = xt->handlers;
+	struct xt_handler_match *m;
+	int i, n;
+
+	for (n = 0; h[n].func; n++) {
+		;
+	}
+
+	xt->handler_match = g_new0(struct xt_handler_match, n);
+	xt->handlers_by_name = g_hash_table_new(g_direct_hash, g_direct_equal);
+	xt->handlers_any = g_ptr_array_new();
+
+	for (i = 0; i < n; i++) {
+		m = &xt->handler_match[i];
+		m->order = i;
+		m->entry = &h[i];
+
+		if (h[i].parent == NULL) {
+			/* Any parent will do. */
+		} else if (strcmp(h[i].parent, "<root>") == 0) {
+			m->root = TRUE;
+		} else {
+			m->parent = xt_atom_ref_fold(h[i].parent);
+		}
+
+		if (h[i].name == NULL) {
+			g_ptr_array_add(xt->handlers_any, m);
+		} else {
+			struct xt_atom *name = xt_atom_ref_fold(h[i].name);
+			GPtrArray *list;
+
+			if ((list = g_hash_table_lookup(xt->handlers_by_name, name))) {
+				/* Already referenced by the first handler. */
+				xt_atom_unref(name);
+			} else {
+				list = g_ptr_array_new();
+				g_hash_table_insert(xt->handlers_by_name, name, list);
+			}
+			g_ptr_array_add(list, m);
+		}
+	}
+}
+
+static void xt_free_handlers(struct xt_parser *xt)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	int i;
+
+	if (xt->handler_match == NULL) {
+		return;
+	}
+
+	g_hash_table_iter_init(&iter, xt->handlers_by_name);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		xt_atom_unref(key);
+		g_ptr_array_free(value, TRUE);
+	}
+	g_hash_table_destroy(xt->handlers_by_name);
+	g_ptr_array_free(xt->handlers_any, TRUE);
+
+	for (i = 0; xt->handlers[i].func; i++) {
+		if (xt->handler_match[i].parent) {
+			xt_atom_unref(xt->handler_match[i].parent);
+		}
+	}
+	g_free(xt->handler_match);
+	xt->handler_match = NULL;
+}
+
+static gboolean xt_handler_matches(struct xt_handler_match *m, struct xt_node *node)
+{
+	if (m->root) {
+		return node->parent == NULL;
+	} else if (m->parent) {
+		return node->parent && XT_ATOM(node->parent->name)->fold == m->parent;
+	}
+	return TRUE;
+}
+
 struct xt_parser *xt_new(const struct xt_handler_entry *handlers, gpointer data)
 {
 	struct xt_parser *xt = g_new0(struct xt_parser, 1);
 
 	xt->data = data;
 	xt->handlers = handlers;
+	if (handlers) {
+		xt_compile_handlers(xt);
+	}
+	xt->tokenizer = XT_TOKENIZER_DEFAULT;
+	xt->tok_attrs = g_array_new(FALSE, FALSE, sizeof(struct xt_tok_attr));
 	xt_reset(xt);
 
 	return xt;
 }
 
+/* Stream handlers are called as soon as a matching node is complete, from
+   inside xt_feed(), instead of waiting for xt_handle() to find the whole
+   stanza. Meant for huge stanzas that are just lists of similar items (like
+   a roster): a handler that returns XT_HANDLED gets the node removed from
+   the tree, and from then on the node belongs to the handler. Any other
+   return value leaves it where it is, for the next stream handler and for
+   xt_handle(). Only the name of the parent is matched, there's no "<root>"
+   and a root node is never offered. */
+void xt_set_stream_handlers(struct xt_parser *xt, const struct xt_handler_entry *handlers)
+{
+	xt->stream_handlers = handlers;
+}
+
+/* Switch to another tokenizer. Resets the parser as well. */
+void xt_set_tokenizer(struct xt_parser *xt, xt_tokenizer tokenizer)
+{
+	xt->tokenizer = tokenizer;
+	xt_reset(xt);
+}
+
 /* Reset the parser, flush everything we have so far. For example, we need
    this for XMPP when doing TLS/SASL to restart the stream. */
 void xt_reset(struct xt_parser *xt)
 {
 	if (xt->parser) {
 		g_markup_parse_context_free(xt->parser);
+		xt->parser = NULL;
 	}
 
-	xt->parser = g_markup_parse_context_new(&xt_parser_funcs, 0, xt, NULL);
+	if (xt->tokenizer == XT_TOKENIZER_GMARKUP) {
+		xt->parser = g_markup_parse_context_new(&xt_parser_funcs, 0, xt, NULL);
+	}
+
+	xt->buf_pos = xt->buf_len = 0;
+	xt->state = XT_TOK_TEXT;
+	xt->scan = 0;
+	g_clear_error(&xt->gerr);
 
 	if (xt->root) {
 		xt_free_node(xt->root);
@@ -145,6 +1021,10 @@ void xt_reset(struct xt_parser *xt)
    end-of-stream and 1 otherwise. */
 int xt_feed(struct xt_parser *xt, const char *text, int text_len)
 {
+	if (xt->tokenizer == XT_TOKENIZER_BUILTIN) {
+		return xt_feed_builtin(xt, text, text_len);
+	}
+
 	if (!g_markup_parse_context_parse(xt->parser, text, text_len, &xt->gerr)) {
 		return -1;
 	}
@@ -159,7 +1039,6 @@ int xt_handle(struct xt_parser *xt, struct xt_node *node, int depth)
 {
 	struct xt_node *c;
 	xt_status st;
-	int i;
 
 	if (xt->root == NULL) {
 		return 1;
@@ -178,27 +1057,37 @@ int xt_handle(struct xt_parser *xt, struct xt_node *node, int depth)
 	}
 
 	if (node->flags & XT_COMPLETE && !(node->flags & XT_SEEN)) {
-		if (xt->handlers) {
-			for (i = 0; xt->handlers[i].func; i++) {
-				/* This one is fun! \o/ */
-
-				/* If handler.name == NULL it means it should always match. */
-				if ((xt->handlers[i].name == NULL ||
-				     /* If it's not, compare. There should always be a name. */
-				     g_strcasecmp(xt->handlers[i].name, node->name) == 0) &&
-				    /* If handler.parent == NULL, it's a match. */
-				    (xt->handlers[i].parent == NULL ||
-				     /* If there's a parent node, see if the name matches. */
-				     (node->parent ? g_strcasecmp(xt->handlers[i].parent, node->parent->name) == 0 :
-				      /* If there's no parent, the handler should mention <root> as a parent. */
-				      strcmp(xt->handlers[i].parent, "<root>") == 0))) {
-					st = xt->handlers[i].func(node, xt->data);
-
-					if (st == XT_ABORT) {
-						return 0;
-					} else if (st != XT_NEXT) {
-						break;
-					}
+		if (xt->handler_match) {
+			GPtrArray *named, *any = xt->handlers_any;
+			int a = 0, n = 0;
+
+			named = g_hash_table_lookup(xt->handlers_by_name, XT_ATOM(node->name)->fold);
+
+			/* Walk both lists in the order of the original table. */
+			while ((named && n < named->len) || a < any->len) {
+				struct xt_handler_match *m;
+
+				if (!named || n >= named->len) {
+					m = g_ptr_array_index(any, a++);
+				} else if (a >= any->len) {
+					m = g_ptr_array_index(named, n++);
+				} else if (((struct xt_handler_match *) g_ptr_array_index(any, a))->order <
+				           ((struct xt_handler_match *) g_ptr_array_index(named, n))->order) {
+					m = g_ptr_array_index(any, a++);
+				} else {
+					m = g_ptr_array_index(named, n++);
+				}
+
+				if (!xt_handler_matches(m, node)) {
+					continue;
+				}
+
+				st = m->entry->func(node, xt->data);
+
+				if (st == XT_ABORT) {
+					return 0;
+				} else if (st != XT_NEXT) {
+					break;
 				}
 			}
 		}
@@ -243,6 +1132,11 @@ void xt_cleanup(struct xt_parser *xt, struct xt_node *node, int depth)
 			} else {
 				node->children = c->next;
 			}
+			if (node->children_tail == c) {
+				node->children_tail = prev;
+			}
+			node->children_count--;
+			xt_index_remove(node, c);
 
 			xt_free_node(c);
 
@@ -282,9 +1176,68 @@ struct xt_node *xt_from_string(const char *in, int len)
 	return ret;
 }
 
+/* Bytes that need a closer look when escaping: the XML special characters,
+   control characters (same set as g_markup_escape_text()) and the first
+   byte of the UTF-8 encoding of U+0080..U+00BF (for the C1 controls). */
+static const char xt_escape_special[256] = {
+	['&'] = 1, ['<'] = 1, ['>'] = 1, ['\''] = 1, ['"'] = 1,
+	[0x01] = 1, [0x02] = 1, [0x03] = 1, [0x04] = 1, [0x05] = 1, [0x06] = 1,
+	[0x07] = 1, [0x08] = 1, [0x0b] = 1, [0x0c] = 1, [0x0e] = 1, [0x0f] = 1,
+	[0x10] = 1, [0x11] = 1, [0x12] = 1, [0x13] = 1, [0x14] = 1, [0x15] = 1,
+	[0x16] = 1, [0x17] = 1, [0x18] = 1, [0x19] = 1, [0x1a] = 1, [0x1b] = 1,
+	[0x1c] = 1, [0x1d] = 1, [0x1e] = 1, [0x1f] = 1, [0x7f] = 1, [0xc2] = 1,
+};
+
+/* Appends text to str, escaped like g_markup_escape_text() would do it but
+   without the temporary copy. Runs of harmless characters (usually the
+   whole string) are copied in one go. */
+void xt_escape_append(GString *str, const char *text, int len)
+{
+	const unsigned char *s = (const unsigned char *) text, *end, *run;
+
+	if (len < 0) {
+		len = strlen(text);
+	}
+	end = s + len;
+
+	for (run = s; s < end; s++) {
+		const char *ent;
+		char num[8];
+
+		if (!xt_escape_special[*s]) {
+			continue;
+		}
+
+		switch (*s) {
+		case '&': ent = "&amp;"; break;
+		case '<': ent = "&lt;"; break;
+		case '>': ent = "&gt;"; break;
+		case '\'': ent = "&apos;"; break;
+		case '"': ent = "&quot;"; break;
+		case 0xc2:
+			/* U+0080..U+0084 and U+0086..U+009F. */
+			if (s + 1 < end && s[1] >= 0x80 && s[1] <= 0x9f && s[1] != 0x85) {
+				g_string_append_len(str, (const char *) run, s - run);
+				g_snprintf(num, sizeof(num), "&#x%x;", s[1]);
+				g_string_append(str, num);
+				run = ++s + 1;
+			}
+			continue;
+		default:
+			g_snprintf(num, sizeof(num), "&#x%x;", *s);
+			ent = num;
+		}
+
+		g_string_append_len(str, (const char *) run, s - run);
+		g_string_append(str, ent);
+		run = s + 1;
+	}
+
+	g_string_append_len(str, (const char *) run, s - run);
+}
+
 static void xt_to_string_real(struct xt_node *node, GString *str, int indent)
 {
-	char *buf;
 	struct xt_node *c;
 	int i;
 
@@ -293,24 +1246,25 @@ static void xt_to_string_real(struct xt_node *node, GString *str, int indent)
 		                    indent < 8 ? indent : 8);
 	}
 
-	g_string_append_printf(str, "<%s", node->name);
+	g_string_append_c(str, '<');
+	g_string_append(str, node->name);
 
 	for (i = 0; node->attr[i].key; i++) {
-		buf = g_markup_printf_escaped(" %s=\"%s\"", node->attr[i].key, node->attr[i].value);
-		g_string_append(str, buf);
-		g_free(buf);
+		g_string_append_c(str, ' ');
+		xt_escape_append(str, node->attr[i].key, -1);
+		g_string_append_len(str, "=\"", 2);
+		xt_escape_append(str, node->attr[i].value, -1);
+		g_string_append_c(str, '"');
 	}
 
 	if (node->text == NULL && node->children == NULL) {
-		g_string_append(str, "/>");
+		g_string_append_len(str, "/>", 2);
 		return;
 	}
 
-	g_string_append(str, ">");
+	g_string_append_c(str, '>');
 	if (node->text_len > 0) {
-		buf = g_markup_escape_text(node->text, node->text_len);
-		g_string_append(str, buf);
-		g_free(buf);
+		xt_escape_append(str, node->text, node->text_len);
 	}
 
 	for (c = node->children; c; c = c->next) {
@@ -322,7 +1276,16 @@ static void xt_to_string_real(struct xt_node *node, GString *str, int indent)
 		                    indent < 8 ? indent : 8);
 	}
 
-	g_string_append_printf(str, "</%s>", node->name);
+	g_string_append_len(str, "</", 2);
+	g_string_append(str, node->name);
+	g_string_append_c(str, '>');
+}
+
+/* Appends node to str, for callers that have their own output buffer
+   (like a transmit queue) and don't want another copy. */
+void xt_to_gstring(struct xt_node *node, GString *str)
+{
+	xt_to_string_real(node, str, 0);
 }
 
 char *xt_to_string(struct xt_node *node)
@@ -355,12 +1318,12 @@ void xt_print(struct xt_node *node)
 struct xt_node *xt_dup(struct xt_node *node)
 {
 	struct xt_node *dup = g_new0(struct xt_node, 1);
-	struct xt_node *c, *dc = NULL;
+	struct xt_node *c;
 	int i;
 
 	/* Let's NOT copy the parent element here BTW! Only do it for children. */
 
-	dup->name = g_strdup(node->name);
+	dup->name = xt_intern(node->name);
 	dup->flags = node->flags;
 	if (node->text) {
 		dup->text = g_memdup(node->text, node->text_len + 1);
@@ -375,19 +1338,12 @@ struct xt_node *xt_dup(struct xt_node *node)
 
 	/* Copy them all! */
 	for (i--; i >= 0; i--) {
-		dup->attr[i].key = g_strdup(node->attr[i].key);
+		dup->attr[i].key = xt_intern(node->attr[i].key);
 		dup->attr[i].value = g_strdup(node->attr[i].value);
 	}
 
-	/* This nice mysterious loop takes care of the children. */
 	for (c = node->children; c; c = c->next) {
-		if (dc == NULL) {
-			dc = dup->children = xt_dup(c);
-		} else {
-			dc = (dc->next = xt_dup(c));
-		}
-
-		dc->parent = dup;
+		xt_append_children(dup, xt_dup(c));
 	}
 
 	return dup;
@@ -402,15 +1358,17 @@ void xt_free_node(struct xt_node *node)
 		return;
 	}
 
-	g_free(node->name);
+	xt_unintern(node->name);
 	g_free(node->text);
 
 	for (i = 0; node->attr[i].key; i++) {
-		g_free(node->attr[i].key);
+		xt_unintern(node->attr[i].key);
 		g_free(node->attr[i].value);
 	}
 	g_free(node->attr);
 
+	xt_index_free(node);
+
 	while (node->children) {
 		struct xt_node *next = node->children->next;
 
@@ -431,7 +1389,13 @@ void xt_free(struct xt_parser *xt)
 		xt_free_node(xt->root);
 	}
 
-	g_markup_parse_context_free(xt->parser);
+	if (xt->parser) {
+		g_markup_parse_context_free(xt->parser);
+	}
+	g_free(xt->buf);
+	g_array_free(xt->tok_attrs, TRUE);
+	g_clear_error(&xt->gerr);
+	xt_free_handlers(xt);
 
 	g_free(xt);
 }
@@ -441,12 +1405,25 @@ void xt_free(struct xt_parser *xt)
    that you can also use this function as a find-next. */
 struct xt_node *xt_find_node(struct xt_node *node, const char *name)
 {
+	struct xt_atom *want;
+	struct xt_index_list *list;
+	gboolean indexed;
+
+	if (node == NULL || (want = xt_atom_lookup_fold(name)) == NULL) {
+		return NULL;
+	}
+
+	/* Searching from the start of a wide node's children list? Ask the
+	   index. */
+	if (node->parent && node->parent->children == node &&
+	    (list = xt_index_find(node->parent, want, &indexed), indexed)) {
+		return list ? g_ptr_array_index(list->nodes, list->start) : NULL;
+	}
+
 	while (node) {
-		char *colon;
+		struct xt_atom *atom = XT_ATOM(node->name);
 
-		if (g_strcasecmp(node->name, name) == 0 ||
-		    ((colon = strchr(node->name, ':')) &&
-		     g_strcasecmp(colon + 1, name) == 0)) {
+		if (atom->fold == want || atom->local == want) {
 			break;
 		}
 
@@ -495,16 +1472,23 @@ struct xt_node *xt_find_path(struct xt_node *node, const char *name)
 
 char *xt_find_attr(struct xt_node *node, const char *key)
 {
-	int i;
+	struct xt_atom *want;
+	int i = 0;
 	char *colon;
 
 	if (!node) {
 		return NULL;
 	}
 
-	for (i = 0; node->attr[i].key; i++) {
-		if (g_strcasecmp(node->attr[i].key, key) == 0) {
-			break;
+	if ((want = xt_atom_lookup_fold(key))) {
+		for (i = 0; node->attr[i].key; i++) {
+			if (XT_ATOM(node->attr[i].key)->fold == want) {
+				break;
+			}
+		}
+	} else {
+		while (node->attr[i].key) {
+			i++;
 		}
 	}
 
@@ -514,14 +1498,15 @@ char *xt_find_attr(struct xt_node *node, const char *key)
 	   now and never really missed it): Meh. */
 	if (!node->attr[i].key && strcmp(key, "xmlns") == 0 &&
 	    (colon = strchr(node->name, ':'))) {
-		*colon = '\0';
+		int plen = colon - node->name;
+
 		for (i = 0; node->attr[i].key; i++) {
 			if (strncmp(node->attr[i].key, "xmlns:", 6) == 0 &&
-			    strcmp(node->attr[i].key + 6, node->name) == 0) {
+			    strncmp(node->attr[i].key + 6, node->name, plen) == 0 &&
+			    node->attr[i].key[6 + plen] == '\0') {
 				break;
 			}
 		}
-		*colon = ':';
 	}
 
 	return node->attr[i].value;
@@ -530,7 +1515,23 @@ char *xt_find_attr(struct xt_node *node, const char *key)
 struct xt_node *xt_find_node_by_attr(struct xt_node *xt, const char *tag, const char *key, const char *value)
 {
 	struct xt_node *c;
+	struct xt_atom *want;
+	struct xt_index_list *list;
+	gboolean indexed;
 	char *s;
+	guint i;
+
+	if (xt && xt->parent && xt->parent->children == xt &&
+	    (want = xt_atom_lookup_fold(tag)) &&
+	    (list = xt_index_find(xt->parent, want, &indexed), indexed)) {
+		for (i = list ? list->start : 0; list && i < list->nodes->len; i++) {
+			c = g_ptr_array_index(list->nodes, i);
+			if ((s = xt_find_attr(c, key)) && strcmp(s, value) == 0) {
+				return c;
+			}
+		}
+		return NULL;
+	}
 
 	for (c = xt; (c = xt_find_node(c, tag)); c = c->next) {
 		if ((s = xt_find_attr(c, key)) && strcmp(s, value) == 0) {
@@ -566,11 +1567,10 @@ void xt_strip_text(char *in)
 
 struct xt_node *xt_new_node(char *name, const char *text, struct xt_node *children)
 {
-	struct xt_node *node, *c;
+	struct xt_node *node;
 
 	node = g_new0(struct xt_node, 1);
-	node->name = g_strdup(name);
-	node->children = children;
+	node->name = xt_intern(name);
 	node->attr = g_new0(struct xt_attr, 1);
 
 	if (text) {
@@ -579,39 +1579,16 @@ struct xt_node *xt_new_node(char *name, const char *text, struct xt_node *childr
 		node->text_len = strlen(node->text);
 	}
 
-	for (c = children; c; c = c->next) {
-		if (c->parent != NULL) {
-			/* ERROR CONDITION: They seem to have a parent already??? */
-		}
-
-		c->parent = node;
-	}
+	xt_append_children(node, children);
 
 	return node;
 }
 
 void xt_add_child(struct xt_node *parent, struct xt_node *child)
 {
-	struct xt_node *node;
-
 	/* This function can actually be used to add more than one child, so
 	   do handle this properly. */
-	for (node = child; node; node = node->next) {
-		if (node->parent != NULL) {
-			/* ERROR CONDITION: They seem to have a parent already??? */
-		}
-
-		node->parent = parent;
-	}
-
-	if (parent->children == NULL) {
-		parent->children = child;
-	} else {
-		for (node = parent->children; node->next; node = node->next) {
-			;
-		}
-		node->next = child;
-	}
+	xt_append_children(parent, child);
 }
 
 /* Same, but at the beginning. */
@@ -629,22 +1606,55 @@ void xt_insert_child(struct xt_node *parent, struct xt_node *child)
 		}
 
 		node->parent = parent;
+		parent->children_count++;
 		last = node;
 	}
 
+	if (parent->children == NULL) {
+		parent->children_tail = last;
+	}
 	last->next = parent->children;
 	parent->children = child;
+	xt_index_free(parent);
+}
+
+/* Unlinks (but doesn't free) one child. */
+void xt_remove_child(struct xt_node *parent, struct xt_node *child)
+{
+	struct xt_node *node, *prev = NULL;
+
+	for (node = parent->children; node && node != child; node = node->next) {
+		prev = node;
+	}
+	if (node == NULL) {
+		return; /* BUG */
+	}
+
+	if (prev) {
+		prev->next = child->next;
+	} else {
+		parent->children = child->next;
+	}
+	if (parent->children_tail == child) {
+		parent->children_tail = prev;
+	}
+	parent->children_count--;
+	xt_index_remove(parent, child);
+
+	child->parent = NULL;
+	child->next = NULL;
 }
 
 void xt_add_attr(struct xt_node *node, const char *key, const char *value)
 {
+	struct xt_atom *atom = xt_atom_lookup(key);
 	int i;
 
 	/* Now actually it'd be nice if we can also change existing attributes
 	   (which actually means this function doesn't have the right name).
 	   So let's find out if we have this attribute already... */
 	for (i = 0; node->attr[i].key; i++) {
-		if (strcmp(node->attr[i].key, key) == 0) {
+		if (XT_ATOM(node->attr[i].key) == atom) {
 			break;
 		}
 	}
@@ -652,7 +1662,7 @@ void xt_add_attr(struct xt_node *node, const char *key, const char *value)
 	if (node->attr[i].key == NULL) {
 		/* If not, allocate space for a new attribute. */
 		node->attr = g_renew(struct xt_attr, node->attr, i + 2);
-		node->attr[i].key = g_strdup(key);
+		node->attr[i].key = xt_intern(key);
 		node->attr[i + 1].key = NULL;
 	} else {
 		/* Otherwise, free the old value before setting the new one. */
@@ -664,10 +1674,11 @@ void xt_add_attr(struct xt_node *node, const char *key, const char *value)
 
 int xt_remove_attr(struct xt_node *node, const char *key)
 {
+	struct xt_atom *atom = xt_atom_lookup(key);
 	int i, last;
 
 	for (i = 0; node->attr[i].key; i++) {
-		if (strcmp(node->attr[i].key, key) == 0) {
+		if (XT_ATOM(node->attr[i].key) == atom) {
 			break;
 		}
 	}
@@ -677,7 +1688,7 @@ int xt_remove_attr(struct xt_node *node, const char *key)
 		return 0;
 	}
 
-	g_free(node->attr[i].key);
+	xt_unintern(node->attr[i].key);
 	g_free(node->attr[i].value);
 
 	/* If it's the last, this is easy: */
@@ -35,21 +35,44 @@ typedef enum {
 	XT_NEXT                 /* Try if there's another matching handler */
 } xt_status;
 
+typedef enum {
+	XT_TOKENIZER_BUILTIN,   /* Our own, see xt_feed_builtin() */
+	XT_TOKENIZER_GMARKUP,   /* GLib's GMarkup parser */
+} xt_tokenizer;
+
+/* ./configure --xmlparser=gmarkup switches the default back to GMarkup. */
+#ifdef XT_USE_GMARKUP
+#define XT_TOKENIZER_DEFAULT XT_TOKENIZER_GMARKUP
+#else
+#define XT_TOKENIZER_DEFAULT XT_TOKENIZER_BUILTIN
+#endif
+
+/* Nodes with at least this many children get a name->children index the
+   first time someone searches them. */
+#define XT_INDEX_MIN_CHILDREN 32
+
 struct xt_attr {
-	char *key, *value;
+	char *key;              /* Interned, don't modify or free! */
+	char *value;
 };
 
 struct xt_node {
 	struct xt_node *parent;
 	struct xt_node *children;
 
-	char *name;
+	char *name;             /* Interned, don't modify or free! */
 	struct xt_attr *attr;
 	char *text;
 	int text_len;
 
 	struct xt_node *next;
 	xt_flags flags;
+
+	/* Only maintained by the functions below, so don't mess with the
+	   children list by hand. */
+	struct xt_node *children_tail;
+	int children_count;
+	GHashTable *index;
 };
 
 typedef xt_status (*xt_handler_func) (struct xt_node *node, gpointer data);
@@ -59,23 +82,45 @@ struct xt_handler_entry {
 	xt_handler_func func;
 };
 
+struct xt_handler_match;
+
 struct xt_parser {
+	xt_tokenizer tokenizer;
 	GMarkupParseContext *parser;
+
+	/* Builtin tokenizer state. Input that couldn't be parsed yet is
+	   kept in buf[buf_pos..buf_len). */
+	char *buf;
+	int buf_pos, buf_len, buf_size;
+	int state, scan, balance;
+	GArray *tok_attrs;
+
 	struct xt_node *root;
 	struct xt_node *cur;
 
 	const struct xt_handler_entry *handlers;
 	gpointer data;
 
+	/* handlers[] compiled by xt_new(), see xt_handle(). */
+	struct xt_handler_match *handler_match;
+	GHashTable *handlers_by_name;
+	GPtrArray *handlers_any;
+
+	const struct xt_handler_entry *stream_handlers;
+
 	GError *gerr;
 };
 
 struct xt_parser *xt_new(const struct xt_handler_entry *handlers, gpointer data);
+void xt_set_tokenizer(struct xt_parser *xt, xt_tokenizer tokenizer);
+void xt_set_stream_handlers(struct xt_parser *xt, const struct xt_handler_entry *handlers);
 void xt_reset(struct xt_parser *xt);
 int xt_feed(struct xt_parser *xt, const char *text, int text_len);
 int xt_handle(struct xt_parser *xt, struct xt_node *node, int depth);
 void xt_cleanup(struct xt_parser *xt, struct xt_node *node, int depth);
 struct xt_node *xt_from_string(const char *in, int text_len);
+void xt_escape_append(GString *str, const char *text, int len);
+void xt_to_gstring(struct xt_node *node, GString *str);
 char *xt_to_string(struct xt_node *node);
 char *xt_to_string_i(struct xt_node *node);
 void xt_print(struct xt_node *node);
@@ -90,6 +135,7 @@ struct xt_node *xt_find_node_by_attr(struct xt_node *xt, const char *tag, const
 struct xt_node *xt_new_node(char *name, const char *text, struct xt_node *children);
 void xt_add_child(struct xt_node *parent, struct xt_node *child);
 void xt_insert_child(struct xt_node *parent, struct xt_node *child);
+void xt_remove_child(struct xt_node *parent, struct xt_node *child);
 void xt_add_attr(struct xt_node *node, const char *key, const char *value);
 int xt_remove_attr(struct xt_node *node, const char *key);
 
@@ -78,6 +78,26 @@ void bee_free(bee_t *b)
 	g_free(b);
 }
 
+/* Lets the IM modules know, so they can ask their servers to hold back
+   traffic the user won't look at anytime soon anyway. */
+void bee_set_idle(bee_t *bee, gboolean idle)
+{
+	account_t *a;
+
+	if (bee->idle == idle) {
+		return;
+	}
+	bee->idle = idle;
+
+	for (a = bee->accounts; a; a = a->next) {
+		struct im_connection *ic = a->ic;
+
+		if (ic && ic->flags & OPT_LOGGED_IN && ic->acc->prpl->set_idle) {
+			ic->acc->prpl->set_idle(ic, idle);
+		}
+	}
+}
+
 static char *set_eval_away_status(set_t *set, char *value)
 {
 	bee_t *bee = set->data;
@@ -96,3 +116,13 @@ static char *set_eval_away_status(set_t *set, char *value)
 
 	return value;
 }
+
+/* Returns a path (g_free() it) or NULL, see bee_ui_funcs.data_path. */
+char *bee_data_path(bee_t *bee, const char *name)
+{
+	if (bee->ui->data_path == NULL || strchr(name, '/') || *name == '.') {
+		return NULL;
+	}
+
+	return bee->ui->data_path(bee, name);
+}
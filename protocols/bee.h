@@ -49,10 +49,16 @@ typedef struct bee {
 	/* And this one will be passed to every callback for any state the
 	   UI may want to keep. */
 	void *ui_data;
+
+	/* Set by the UI (using bee_set_idle()) if the user hasn't done
+	   anything for a while. */
+	gboolean idle;
 } bee_t;
 
 bee_t *bee_new();
 void bee_free(bee_t *b);
+void bee_set_idle(bee_t *bee, gboolean idle);
+G_MODULE_EXPORT char *bee_data_path(bee_t *bee, const char *name);
 
 /* TODO(wilmer): Kill at least the OPT_ flags that have an equivalent here. */
 typedef enum {
@@ -130,6 +136,17 @@ typedef struct bee_ui_funcs {
 	void (*ft_finished)(struct im_connection *ic, struct file_transfer *ft);
 
 	void (*log)(bee_t *bee, const char *tag, const char *msg);
+
+	/* Optional: where an IM module can keep a file (called name, which
+	   should be a plain filename) with data for this user. NULL if the UI
+	   has no such place, for example because the user isn't registered.
+	   Use bee_data_path() instead of calling this directly. */
+	char *(*data_path)(bee_t *bee, const char *name);
+
+	/* Optional, same as chat_add_user() for a list of users (when joining
+	   a big room for example). If not set, chat_add_user() is called for
+	   each of them. */
+	gboolean (*chat_add_users)(bee_t *bee, struct groupchat *c, GSList *users);
 } bee_ui_funcs_t;
 
 
@@ -177,6 +194,8 @@ G_MODULE_EXPORT void imcb_chat_log(struct groupchat *c, char *format, ...);
 /* To tell BitlBee 'who' changed the topic of 'c' to 'topic'. */
 G_MODULE_EXPORT void imcb_chat_topic(struct groupchat *c, char *who, char *topic, time_t set_at);
 G_MODULE_EXPORT void imcb_chat_add_buddy(struct groupchat *c, const char *handle);
+/* Same, for a list of handles. Much cheaper when adding lots of them at once. */
+G_MODULE_EXPORT void imcb_chat_add_buddies(struct groupchat *c, GSList *handles);
 /* To remove a handle from a group chat. Reason can be NULL. */
 G_MODULE_EXPORT void imcb_chat_remove_buddy(struct groupchat *c, const char *handle, const char *reason);
 G_MODULE_EXPORT int bee_chat_msg(bee_t *bee, struct groupchat *c, const char *msg, int flags);
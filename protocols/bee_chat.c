@@ -205,6 +205,51 @@ void imcb_chat_add_buddy(struct groupchat *c, const char *handle)
 	}
 }
 
+void imcb_chat_add_buddies(struct groupchat *c, GSList *handles)
+{
+	struct im_connection *ic = c->ic;
+	bee_t *bee = ic->bee;
+	GSList *users = NULL, *l;
+	GList *in_room = NULL;
+	gboolean me = FALSE;
+
+	if (!bee->ui->chat_add_users) {
+		for (l = handles; l; l = l->next) {
+			imcb_chat_add_buddy(c, l->data);
+		}
+		return;
+	}
+
+	for (l = handles; l; l = l->next) {
+		const char *handle = l->data;
+		bee_user_t *bu;
+
+		if (set_getbool(&bee->set, "debug")) {
+			imcb_log(ic, "User %s added to conversation %p", handle, c);
+		}
+
+		if (handle_is_self(ic, handle)) {
+			bu = bee->user;
+			me = TRUE;
+		} else if (!(bu = bee_user_by_handle(bee, ic, handle))) {
+			bu = bee_user_new(bee, ic, handle, BEE_USER_LOCAL);
+		}
+
+		in_room = g_list_prepend(in_room, g_strdup(handle));
+		users = g_slist_prepend(users, bu);
+	}
+
+	c->in_room = g_list_concat(c->in_room, g_list_reverse(in_room));
+
+	users = g_slist_reverse(users);
+	bee->ui->chat_add_users(bee, c, users);
+	g_slist_free(users);
+
+	if (me) {
+		c->joined = 1;
+	}
+}
+
 void imcb_chat_remove_buddy(struct groupchat *c, const char *handle, const char *reason)
 {
 	struct im_connection *ic = c->ic;
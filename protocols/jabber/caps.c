@@ -0,0 +1,578 @@
+/***************************************************************************\
+*                                                                           *
+*  BitlBee - An IRC to IM gateway                                           *
+*  Jabber module - Entity capabilities cache (XEP-0115)                     *
+*                                                                           *
+*  Copyright 2006-2012 Wilmer van der Gaast <wilmer@gaast.net>              *
+*                                                                           *
+*  This program is free software; you can redistribute it and/or modify     *
+*  it under the terms of the GNU General Public License as published by     *
+*  the Free Software Foundation; either version 2 of the License, or        *
+*  (at your option) any later version.                                      *
+*                                                                           *
+*  This program is distributed in the hope that it will be useful,          *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+*  GNU General Public License for more details.                             *
+*                                                                           *
+*  You should have received a copy of the GNU General Public License along  *
+*  with this program; if not, write to the Free Software Foundation, Inc.,  *
+*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.              *
+*                                                                           *
+\***************************************************************************/
+
+/* Every disco#info result we get is stored (once) in a process-wide table,
+   keyed by its XEP-0115 verification string, which we always calculate
+   ourselves. A buddy that advertises a ver= we already know about doesn't
+   need to be asked again, no matter on which account we saw it first, and
+   buddies just point at the shared entry (holding a reference). There are
+   only so many different client versions out there, but to be safe, the
+   ones that weren't used for the longest time are dropped once there are
+   too many. They're saved to disk too, and since the key is a hash of the
+   contents, a corrupted or tampered cache file can't give anyone the wrong
+   features. */
+
+#include "jabber.h"
+#include "sha1.h"
+#include "base64.h"
+
+#define JABBER_CAPS_FILE "xmpp-caps.cache"
+
+/* Don't ask for the same ver= again within this many seconds. */
+#define JABBER_CAPS_QUERY_TIMEOUT 60
+
+/* Write new entries out after this many seconds. */
+#define JABBER_CAPS_SAVE_DELAY 10
+
+struct jabber_caps_query {
+	char *ver;
+	time_t sent;
+	GList *link;                    /* In caps_pending_order */
+};
+
+static GHashTable *caps_cache;          /* ver -> struct jabber_caps */
+static GQueue *caps_cache_order;        /* Least recently used first */
+static GHashTable *caps_pending;        /* ver -> struct jabber_caps_query */
+static GQueue *caps_pending_order;      /* Oldest first */
+static gint caps_save_timer;
+
+static void jabber_caps_load(void);
+static gboolean jabber_caps_save_timeout(gpointer data, gint fd, b_input_condition cond);
+
+struct jabber_caps_identity {
+	char *category, *type, *lang, *name;
+};
+
+struct jabber_caps_form {
+	char *type;
+	struct xt_node *x;
+};
+
+/* qsort() doesn't like NULL, which is what empty arrays have. */
+static void jabber_caps_sort(gpointer base, guint n, gsize size, GCompareFunc cmp)
+{
+	if (n > 1) {
+		qsort(base, n, size, cmp);
+	}
+}
+
+static int jabber_caps_strcmp(const void *a, const void *b)
+{
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+static int jabber_caps_identity_cmp(const void *a_, const void *b_)
+{
+	const struct jabber_caps_identity *a = a_, *b = b_;
+	int st;
+
+	if ((st = strcmp(a->category, b->category)) != 0 ||
+	    (st = strcmp(a->type, b->type)) != 0 ||
+	    (st = strcmp(a->lang, b->lang)) != 0) {
+		return st;
+	}
+	return strcmp(a->name, b->name);
+}
+
+static int jabber_caps_form_cmp(const void *a, const void *b)
+{
+	return strcmp(((struct jabber_caps_form *) a)->type, ((struct jabber_caps_form *) b)->type);
+}
+
+static int jabber_caps_field_cmp(const void *a, const void *b)
+{
+	return strcmp(xt_find_attr(*(struct xt_node **) a, "var"), xt_find_attr(*(struct xt_node **) b, "var"));
+}
+
+static char *jabber_caps_attr(struct xt_node *node, const char *key)
+{
+	char *s = xt_find_attr(node, key);
+
+	return s ? s : "";
+}
+
+/* The FORM_TYPE of a data form, if it's usable for hashing. */
+static char *jabber_caps_form_type(struct xt_node *x)
+{
+	struct xt_node *c;
+
+	if (g_strcmp0(xt_find_attr(x, "xmlns"), XMLNS_XDATA) != 0 ||
+	    !(c = xt_find_node_by_attr(x->children, "field", "var", "FORM_TYPE")) ||
+	    g_strcmp0(xt_find_attr(c, "type"), "hidden") != 0 ||
+	    !(c = xt_find_node(c->children, "value"))) {
+		return NULL;
+	}
+
+	return c->text ? c->text : "";
+}
+
+static void jabber_caps_append_form(GString *s, struct jabber_caps_form *form)
+{
+	GPtrArray *fields = g_ptr_array_new(), *values = g_ptr_array_new();
+	struct xt_node *c, *v;
+	char *var;
+	int i, j;
+
+	g_string_append_printf(s, "%s<", form->type);
+
+	for (c = form->x->children; (c = xt_find_node(c, "field")); c = c->next) {
+		if ((var = xt_find_attr(c, "var")) && strcmp(var, "FORM_TYPE") != 0) {
+			g_ptr_array_add(fields, c);
+		}
+	}
+	jabber_caps_sort(fields->pdata, fields->len, sizeof(gpointer), jabber_caps_field_cmp);
+
+	for (i = 0; i < fields->len; i++) {
+		c = fields->pdata[i];
+		g_string_append_printf(s, "%s<", xt_find_attr(c, "var"));
+
+		g_ptr_array_set_size(values, 0);
+		for (v = c->children; (v = xt_find_node(v, "value")); v = v->next) {
+			g_ptr_array_add(values, v->text ? v->text : "");
+		}
+		jabber_caps_sort(values->pdata, values->len, sizeof(gpointer), jabber_caps_strcmp);
+		for (j = 0; j < values->len; j++) {
+			g_string_append_printf(s, "%s<", (char *) values->pdata[j]);
+		}
+	}
+
+	g_ptr_array_free(fields, TRUE);
+	g_ptr_array_free(values, TRUE);
+}
+
+/* Calculates the XEP-0115 verification string (SHA-1 flavour) of a
+   disco#info <query/>. Returns NULL if the result is not acceptable
+   (duplicate identities, features or forms). */
+char *jabber_caps_hash(struct xt_node *query)
+{
+	GArray *ids = g_array_new(FALSE, FALSE, sizeof(struct jabber_caps_identity));
+	GArray *forms = g_array_new(FALSE, FALSE, sizeof(struct jabber_caps_form));
+	GPtrArray *features = g_ptr_array_new();
+	GString *s = g_string_new("");
+	struct xt_node *c;
+	char *ret = NULL, *var;
+	int i;
+
+	for (c = query->children; c; c = c->next) {
+		if (strcmp(c->name, "identity") == 0) {
+			struct jabber_caps_identity id;
+
+			id.category = jabber_caps_attr(c, "category");
+			id.type = jabber_caps_attr(c, "type");
+			id.lang = jabber_caps_attr(c, "xml:lang");
+			id.name = jabber_caps_attr(c, "name");
+			g_array_append_val(ids, id);
+		} else if (strcmp(c->name, "feature") == 0 && (var = xt_find_attr(c, "var"))) {
+			g_ptr_array_add(features, var);
+		} else if (strcmp(c->name, "x") == 0) {
+			struct jabber_caps_form form;
+
+			/* Forms without a (hidden) FORM_TYPE are ignored. */
+			if ((form.type = jabber_caps_form_type(c))) {
+				form.x = c;
+				g_array_append_val(forms, form);
+			}
+		}
+	}
+
+	jabber_caps_sort(ids->data, ids->len, sizeof(struct jabber_caps_identity), jabber_caps_identity_cmp);
+	jabber_caps_sort(features->pdata, features->len, sizeof(gpointer), jabber_caps_strcmp);
+	jabber_caps_sort(forms->data, forms->len, sizeof(struct jabber_caps_form), jabber_caps_form_cmp);
+
+	for (i = 0; i < ids->len; i++) {
+		struct jabber_caps_identity *id = &g_array_index(ids, struct jabber_caps_identity, i);
+
+		if (i > 0 && jabber_caps_identity_cmp(id - 1, id) == 0) {
+			goto out;
+		}
+		g_string_append_printf(s, "%s/%s/%s/%s<", id->category, id->type, id->lang, id->name);
+	}
+
+	for (i = 0; i < features->len; i++) {
+		if (i > 0 && strcmp(features->pdata[i - 1], features->pdata[i]) == 0) {
+			goto out;
+		}
+		g_string_append_printf(s, "%s<", (char *) features->pdata[i]);
+	}
+
+	for (i = 0; i < forms->len; i++) {
+		struct jabber_caps_form *form = &g_array_index(forms, struct jabber_caps_form, i);
+
+		if (i > 0 && jabber_caps_form_cmp(form - 1, form) == 0) {
+			goto out;
+		}
+		jabber_caps_append_form(s, form);
+	}
+
+	{
+		sha1_state_t sha;
+		guint8 digest[SHA1_HASH_SIZE];
+
+		sha1_init(&sha);
+		sha1_append(&sha, (guint8 *) s->str, s->len);
+		sha1_finish(&sha, digest);
+		ret = base64_encode(digest, SHA1_HASH_SIZE);
+	}
+
+out:
+	g_array_free(ids, TRUE);
+	g_array_free(forms, TRUE);
+	g_ptr_array_free(features, TRUE);
+	g_string_free(s, TRUE);
+
+	return ret;
+}
+
+static struct jabber_caps *jabber_caps_new(char *ver, struct xt_node *query)
+{
+	struct jabber_caps *caps = g_new0(struct jabber_caps, 1);
+	GPtrArray *features = g_ptr_array_new();
+	struct xt_node *c;
+	char *var;
+	int i;
+
+	for (c = query->children; (c = xt_find_node(c, "feature")); c = c->next) {
+		if ((var = xt_find_attr(c, "var"))) {
+			g_ptr_array_add(features, g_strdup(var));
+		}
+	}
+	jabber_caps_sort(features->pdata, features->len, sizeof(gpointer), jabber_caps_strcmp);
+
+	/* Unverifiable results can have duplicates. */
+	for (i = 1; i < features->len; i++) {
+		if (strcmp(features->pdata[i - 1], features->pdata[i]) == 0) {
+			g_free(g_ptr_array_remove_index(features, i--));
+		}
+	}
+
+	caps->ver = ver;
+	caps->features_count = features->len;
+	g_ptr_array_add(features, NULL);
+	caps->features = (char **) g_ptr_array_free(features, FALSE);
+
+	return caps;
+}
+
+static void jabber_caps_unref(struct jabber_caps *caps)
+{
+	if (caps && --caps->ref == 0) {
+		g_strfreev(caps->features);
+		xt_free_node(caps->query);
+		g_free(caps->ver);
+		g_free(caps);
+	}
+}
+
+/* Buddies using it keep their reference. */
+static void jabber_caps_evict(struct jabber_caps *caps)
+{
+	g_hash_table_remove(caps_cache, caps->ver);
+	g_queue_delete_link(caps_cache_order, caps->link);
+	caps->link = NULL;
+	jabber_caps_unref(caps);
+}
+
+static void jabber_caps_touch(struct jabber_caps *caps)
+{
+	g_queue_unlink(caps_cache_order, caps->link);
+	g_queue_push_tail_link(caps_cache_order, caps->link);
+}
+
+static void jabber_caps_query_free(gpointer data)
+{
+	struct jabber_caps_query *q = data;
+
+	g_queue_delete_link(caps_pending_order, q->link);
+	g_free(q->ver);
+	g_free(q);
+}
+
+static void jabber_caps_init(void)
+{
+	if (caps_cache == NULL) {
+		caps_cache = g_hash_table_new(g_str_hash, g_str_equal);
+		caps_cache_order = g_queue_new();
+		caps_pending = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, jabber_caps_query_free);
+		caps_pending_order = g_queue_new();
+		jabber_caps_load();
+	}
+}
+
+/* Entries from the cache file are added as the least recently used ones,
+   and only if there's room for them. */
+static struct jabber_caps *jabber_caps_intern(struct xt_node *query, gboolean from_disk)
+{
+	struct jabber_caps *caps;
+	gboolean save = TRUE;
+	char *ver;
+
+	if ((ver = jabber_caps_hash(query)) == NULL) {
+		/* Broken result, can't be verified, so it's no use to anyone
+		   else. Still keep it (under a key that can't be a base64
+		   hash) so the buddy that sent it has its features. */
+		char *xml = xt_to_string(query);
+		sha1_state_t sha;
+		guint8 digest[SHA1_HASH_SIZE];
+
+		sha1_init(&sha);
+		sha1_append(&sha, (guint8 *) xml, strlen(xml));
+		sha1_finish(&sha, digest);
+		g_free(xml);
+
+		xml = base64_encode(digest, SHA1_HASH_SIZE);
+		ver = g_strdup_printf("x:%s", xml);
+		g_free(xml);
+		save = FALSE;
+	}
+
+	if ((caps = g_hash_table_lookup(caps_cache, ver))) {
+		if (!from_disk) {
+			jabber_caps_touch(caps);
+		}
+		g_free(ver);
+		return caps;
+	}
+
+	if (from_disk && g_hash_table_size(caps_cache) >= JABBER_CAPS_MAX_ENTRIES) {
+		g_free(ver);
+		return NULL;
+	}
+
+	caps = jabber_caps_new(ver, query);
+	caps->ref = 1;
+	g_hash_table_insert(caps_cache, caps->ver, caps);
+	g_hash_table_remove(caps_pending, caps->ver);
+
+	if (from_disk) {
+		g_queue_push_head(caps_cache_order, caps);
+		caps->link = caps_cache_order->head;
+	} else {
+		g_queue_push_tail(caps_cache_order, caps);
+		caps->link = caps_cache_order->tail;
+	}
+
+	while (g_hash_table_size(caps_cache) > JABBER_CAPS_MAX_ENTRIES) {
+		jabber_caps_evict(g_queue_peek_head(caps_cache_order));
+	}
+
+	if (save) {
+		/* Only what we need to calculate the hash again. */
+		struct xt_node *c;
+
+		caps->query = xt_new_node("query", NULL, NULL);
+		xt_add_attr(caps->query, "xmlns", XMLNS_DISCO_INFO);
+		for (c = query->children; c; c = c->next) {
+			if (strcmp(c->name, "identity") == 0 ||
+			    strcmp(c->name, "feature") == 0 ||
+			    strcmp(c->name, "x") == 0) {
+				xt_add_child(caps->query, xt_dup(c));
+			}
+		}
+
+		if (caps_save_timer == 0) {
+			caps_save_timer = b_timeout_add(JABBER_CAPS_SAVE_DELAY * 1000,
+			                                jabber_caps_save_timeout, NULL);
+		}
+	}
+
+	return caps;
+}
+
+/* Interns the features from a disco#info result. */
+struct jabber_caps *jabber_caps_add(struct xt_node *query)
+{
+	jabber_caps_init();
+
+	return jabber_caps_intern(query, FALSE);
+}
+
+struct jabber_caps *jabber_caps_by_ver(const char *ver)
+{
+	struct jabber_caps *caps;
+
+	jabber_caps_init();
+
+	if ((caps = g_hash_table_lookup(caps_cache, ver))) {
+		jabber_caps_touch(caps);
+	}
+
+	return caps;
+}
+
+/* Use this instead of bud->caps directly, the entry may have been added
+   (by another account, for example) after we saw the buddy's presence. */
+struct jabber_caps *jabber_buddy_caps(struct jabber_buddy *bud)
+{
+	if (bud->caps == NULL && bud->caps_ver) {
+		jabber_buddy_set_caps(bud, jabber_caps_by_ver(bud->caps_ver));
+	}
+
+	return bud->caps;
+}
+
+/* NULL to drop the buddy's reference. */
+void jabber_buddy_set_caps(struct jabber_buddy *bud, struct jabber_caps *caps)
+{
+	if (caps) {
+		caps->ref++;
+	}
+	jabber_caps_unref(bud->caps);
+	bud->caps = caps;
+}
+
+static void jabber_caps_pending_add(const char *ver)
+{
+	struct jabber_caps_query *q;
+
+	/* Asking again puts it at the end of the line. */
+	g_hash_table_remove(caps_pending, ver);
+
+	q = g_new0(struct jabber_caps_query, 1);
+	q->ver = g_strdup(ver);
+	q->sent = time(NULL);
+	g_queue_push_tail(caps_pending_order, q);
+	q->link = caps_pending_order->tail;
+	g_hash_table_insert(caps_pending, q->ver, q);
+
+	/* Expired ones are as good as gone anyway. */
+	while ((q = g_queue_peek_head(caps_pending_order)) &&
+	       (g_queue_get_length(caps_pending_order) > JABBER_CAPS_MAX_PENDING ||
+	        time(NULL) - q->sent > JABBER_CAPS_QUERY_TIMEOUT)) {
+		g_hash_table_remove(caps_pending, q->ver);
+	}
+}
+
+gboolean jabber_caps_has_feature(struct jabber_caps *caps, const char *var)
+{
+	return caps && bsearch(&var, caps->features, caps->features_count,
+	                       sizeof(char *), jabber_caps_strcmp) != NULL;
+}
+
+/* The <c/> element from a presence packet. */
+void jabber_caps_presence(struct im_connection *ic, struct jabber_buddy *bud, struct xt_node *c)
+{
+	char *ver = xt_find_attr(c, "ver"), *node = xt_find_attr(c, "node"), *hash = xt_find_attr(c, "hash");
+	struct jabber_caps_query *q;
+
+	/* Legacy caps (without hash=) can't be cached safely, leave those
+	   to jabber_iq_query_features() when we need them. */
+	if (!ver || !node || g_strcmp0(hash, "sha-1") != 0 || !bud->full_jid) {
+		return;
+	}
+
+	if (bud->caps_ver && strcmp(bud->caps_ver, ver) == 0) {
+		return;
+	}
+	g_free(bud->caps_ver);
+	bud->caps_ver = g_strdup(ver);
+	jabber_buddy_set_caps(bud, NULL);
+
+	if (jabber_buddy_caps(bud) == NULL &&
+	    (!(q = g_hash_table_lookup(caps_pending, ver)) ||
+	     time(NULL) - q->sent > JABBER_CAPS_QUERY_TIMEOUT)) {
+		struct xt_node *query, *iq;
+		char *s;
+
+		jabber_caps_pending_add(ver);
+
+		s = g_strdup_printf("%s#%s", node, ver);
+		query = xt_new_node("query", NULL, NULL);
+		xt_add_attr(query, "xmlns", XMLNS_DISCO_INFO);
+		xt_add_attr(query, "node", s);
+		g_free(s);
+
+		iq = jabber_make_packet("iq", "get", bud->full_jid, query);
+		jabber_cache_add_ctx(ic, iq, jabber_iq_parse_features, NULL, NULL);
+		jabber_write_packet(ic, iq);
+		xt_free_node(iq);
+	}
+}
+
+static void jabber_caps_read(const char *path)
+{
+	struct xt_node *root, *c;
+	char *xml;
+	gsize len;
+
+	if (!g_file_get_contents(path, &xml, &len, NULL)) {
+		return;
+	}
+
+	if ((root = xt_from_string(xml, len))) {
+		for (c = root->children; (c = xt_find_node(c, "query")); c = c->next) {
+			jabber_caps_intern(c, TRUE);
+		}
+		xt_free_node(root);
+	}
+
+	g_free(xml);
+}
+
+static void jabber_caps_load(void)
+{
+	char *path = g_strdup_printf("%s%s", global.conf->configdir, JABBER_CAPS_FILE);
+
+	jabber_caps_read(path);
+	g_free(path);
+
+	/* Loading doesn't make anything new. */
+	if (caps_save_timer) {
+		b_event_remove(caps_save_timer);
+		caps_save_timer = 0;
+	}
+}
+
+static gboolean jabber_caps_save_timeout(gpointer data, gint fd, b_input_condition cond)
+{
+	struct xt_node *root;
+	GHashTableIter iter;
+	struct jabber_caps *caps;
+	char *path, *xml;
+
+	caps_save_timer = 0;
+	path = g_strdup_printf("%s%s", global.conf->configdir, JABBER_CAPS_FILE);
+
+	/* Other BitlBee processes may have added entries meanwhile. */
+	jabber_caps_read(path);
+	if (caps_save_timer) {
+		b_event_remove(caps_save_timer);
+		caps_save_timer = 0;
+	}
+
+	root = xt_new_node("caps", NULL, NULL);
+	g_hash_table_iter_init(&iter, caps_cache);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &caps)) {
+		if (caps->query) {
+			xt_add_child(root, xt_dup(caps->query));
+		}
+	}
+
+	xml = xt_to_string(root);
+	write_file_atomic(path, xml, strlen(xml));
+
+	xt_free_node(root);
+	g_free(xml);
+	g_free(path);
+
+	return FALSE;
+}
@@ -0,0 +1,207 @@
+/***************************************************************************\
+*                                                                           *
+*  BitlBee - An IRC to IM gateway                                           *
+*  Jabber module - Stream compression (XEP-0138)                            *
+*                                                                           *
+*  Copyright 2006-2012 Wilmer van der Gaast <wilmer@gaast.net>              *
+*                                                                           *
+*  This program is free software; you can redistribute it and/or modify     *
+*  it under the terms of the GNU General Public License as published by     *
+*  the Free Software Foundation; either version 2 of the License, or        *
+*  (at your option) any later version.                                      *
+*                                                                           *
+*  This program is distributed in the hope that it will be useful,          *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+*  GNU General Public License for more details.                             *
+*                                                                           *
+*  You should have received a copy of the GNU General Public License along  *
+*  with this program; if not, write to the Free Software Foundation, Inc.,  *
+*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.              *
+*                                                                           *
+\***************************************************************************/
+
+/* Once negotiated (after authentication), everything after the stream
+   restart is zlib-compressed in both directions. io.c runs everything it
+   reads through jabber_zlib_inflate() before feeding it to the parser, and
+   compresses the transmit queue right before writing it out. */
+
+#include "jabber.h"
+
+#ifdef WITH_ZLIB
+
+#include <zlib.h>
+
+struct jabber_zlib {
+	z_stream rx, tx;
+};
+
+struct jabber_zlib *jabber_zlib_new(void)
+{
+	struct jabber_zlib *z = g_new0(struct jabber_zlib, 1);
+
+	if (deflateInit(&z->tx, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		g_free(z);
+		return NULL;
+	}
+	if (inflateInit(&z->rx) != Z_OK) {
+		deflateEnd(&z->tx);
+		g_free(z);
+		return NULL;
+	}
+
+	return z;
+}
+
+void jabber_zlib_free(struct jabber_zlib *z)
+{
+	if (z) {
+		deflateEnd(&z->tx);
+		inflateEnd(&z->rx);
+		g_free(z);
+	}
+}
+
+/* Appends the compressed version of in to out. Everything gets flushed
+   (to a byte boundary) so the server can parse it right away. */
+gboolean jabber_zlib_deflate(struct jabber_zlib *z, const char *in, gsize len, GString *out)
+{
+	int st;
+
+	z->tx.next_in = (Bytef *) in;
+	z->tx.avail_in = len;
+
+	do {
+		gsize had = out->len;
+
+		g_string_set_size(out, had + len / 2 + 64);
+		z->tx.next_out = (Bytef *) out->str + had;
+		z->tx.avail_out = out->len - had;
+
+		st = deflate(&z->tx, Z_SYNC_FLUSH);
+		g_string_truncate(out, out->len - z->tx.avail_out);
+
+		if (st != Z_OK && st != Z_BUF_ERROR) {
+			return FALSE;
+		}
+	} while (z->tx.avail_out == 0);
+
+	return TRUE;
+}
+
+void jabber_zlib_input(struct jabber_zlib *z, const char *in, int len)
+{
+	z->rx.next_in = (Bytef *) in;
+	z->rx.avail_in = len;
+}
+
+/* Call this until it returns 0 (out of input) after jabber_zlib_input().
+   Returns the number of bytes stored in out, or -1 on errors. */
+int jabber_zlib_inflate(struct jabber_zlib *z, char *out, int len)
+{
+	int st;
+
+	z->rx.next_out = (Bytef *) out;
+	z->rx.avail_out = len;
+
+	st = inflate(&z->rx, Z_SYNC_FLUSH);
+	if (st != Z_OK && st != Z_BUF_ERROR && st != Z_STREAM_END) {
+		return -1;
+	}
+
+	return len - z->rx.avail_out;
+}
+
+/* Looks for zlib in the (post-authentication) stream features. Returns 1
+   if we asked the server to start compressing, 0 if not, -1 on errors. */
+int jabber_zlib_features(struct im_connection *ic, struct xt_node *features)
+{
+	struct jabber_data *jd = ic->proto_data;
+	struct xt_node *c, *reply;
+	int st;
+
+	if (jd->zlib || !set_getbool(&ic->acc->set, "compression") ||
+	    !(c = xt_find_node(features->children, "compression")) ||
+	    g_strcmp0(xt_find_attr(c, "xmlns"), XMLNS_COMPRESS_FEATURE) != 0) {
+		return 0;
+	}
+
+	for (c = c->children; (c = xt_find_node(c, "method")); c = c->next) {
+		if (c->text && strcmp(c->text, "zlib") == 0) {
+			break;
+		}
+	}
+	if (c == NULL) {
+		return 0;
+	}
+
+	reply = xt_new_node("compress", NULL, xt_new_node("method", "zlib", NULL));
+	xt_add_attr(reply, "xmlns", XMLNS_COMPRESS);
+	st = jabber_write_packet(ic, reply);
+	xt_free_node(reply);
+
+	return st ? 1 : -1;
+}
+
+xt_status jabber_zlib_pkt(struct xt_node *node, gpointer data)
+{
+	struct im_connection *ic = data;
+	struct jabber_data *jd = ic->proto_data;
+
+	/* <failure/> is shared with SASL. */
+	if (g_strcmp0(xt_find_attr(node, "xmlns"), XMLNS_COMPRESS) != 0) {
+		return XT_NEXT;
+	}
+
+	if (strcmp(node->name, "compressed") == 0) {
+		if (!(jd->zlib = jabber_zlib_new())) {
+			imcb_error(ic, "Could not initialize stream compression");
+			imc_logout(ic, TRUE);
+			return XT_ABORT;
+		}
+
+		/* The new stream is the first thing that gets compressed. */
+		jd->flags |= JFLAG_STREAM_RESTART;
+		return XT_HANDLED;
+	}
+
+	imcb_log(ic, "Server refused stream compression, continuing without");
+	return jabber_start_session(ic);
+}
+
+#else
+
+struct jabber_zlib *jabber_zlib_new(void)
+{
+	return NULL;
+}
+
+void jabber_zlib_free(struct jabber_zlib *z)
+{
+}
+
+gboolean jabber_zlib_deflate(struct jabber_zlib *z, const char *in, gsize len, GString *out)
+{
+	return FALSE;
+}
+
+void jabber_zlib_input(struct jabber_zlib *z, const char *in, int len)
+{
+}
+
+int jabber_zlib_inflate(struct jabber_zlib *z, char *out, int len)
+{
+	return -1;
+}
+
+int jabber_zlib_features(struct im_connection *ic, struct xt_node *features)
+{
+	return 0;
+}
+
+xt_status jabber_zlib_pkt(struct xt_node *node, gpointer data)
+{
+	return XT_NEXT;
+}
+
+#endif
@@ -29,6 +29,7 @@ static xt_status jabber_chat_self_message(struct im_connection *ic, struct xt_no
 
 struct groupchat *jabber_chat_join(struct im_connection *ic, const char *room, const char *nick, const char *password)
 {
+	struct jabber_data *jd = ic->proto_data;
 	struct jabber_chat *jc;
 	struct xt_node *node;
 	struct groupchat *c;
@@ -64,6 +65,7 @@ struct groupchat *jabber_chat_join(struct im_connection *ic, const char *room, c
 
 	c = imcb_chat_new(ic, room);
 	c->data = jc;
+	g_hash_table_insert(jd->chats, jc->name, c);
 
 	return c;
 }
@@ -136,31 +138,29 @@ static xt_status jabber_chat_self_message(struct im_connection *ic, struct xt_no
 	return XT_ABORT;
 }
 
+/* Works with the room's full JIDs (occupants) as well. */
 struct groupchat *jabber_chat_by_jid(struct im_connection *ic, const char *name)
 {
-	char *normalized = jabber_normalize(name);
-	GSList *l;
-	struct groupchat *ret;
-	struct jabber_chat *jc;
-
-	for (l = ic->groupchats; l; l = l->next) {
-		ret = l->data;
-		jc = ret->data;
-		if (strcmp(normalized, jc->name) == 0) {
-			break;
-		}
-	}
-	g_free(normalized);
+	struct jabber_data *jd = ic->proto_data;
 
-	return l ? ret : NULL;
+	return jabber_jid_lookup(jd->chats, name);
 }
 
 void jabber_chat_free(struct groupchat *c)
 {
+	struct jabber_data *jd = c->ic->proto_data;
 	struct jabber_chat *jc = c->data;
+	GSList *l;
 
+	if (g_hash_table_lookup(jd->chats, jc->name) == c) {
+		g_hash_table_remove(jd->chats, jc->name);
+	}
 	jabber_buddy_remove_bare(c->ic, jc->name);
 
+	for (l = jc->joining; l; l = l->next) {
+		g_free(l->data);
+	}
+	g_slist_free(jc->joining);
 	g_free(jc->my_full_jid);
 	g_free(jc->name);
 	g_free(jc->invite);
@@ -243,6 +243,44 @@ void jabber_chat_invite(struct groupchat *c, char *who, char *message)
 	xt_free_node(node);
 }
 
+/* The server sends the presence of everyone who's in the room already, and
+   then ours (with status code 110, and maybe with a different nick than we
+   asked for). Instead of adding all those people one by one, wait for that
+   last one and add them all at once. */
+static void jabber_chat_joined(struct groupchat *chat)
+{
+	struct jabber_chat *jc = chat->data;
+	GSList *l;
+
+	jc->joining = g_slist_reverse(jc->joining);
+	imcb_chat_add_buddies(chat, jc->joining);
+	for (l = jc->joining; l; l = l->next) {
+		g_free(l->data);
+	}
+	g_slist_free(jc->joining);
+	jc->joining = NULL;
+}
+
+static gboolean jabber_chat_is_self_presence(struct xt_node *node)
+{
+	struct xt_node *c;
+
+	return (c = xt_find_node_by_attr(node->children, "x", "xmlns", XMLNS_MUC_USER)) &&
+	       xt_find_node_by_attr(c->children, "status", "code", "110");
+}
+
+/* The room picked a different nick for us (status code 210). */
+static void jabber_chat_set_me(struct im_connection *ic, struct jabber_chat *jc, struct jabber_buddy *bud,
+                               const char *full_jid)
+{
+	jabber_buddy_remove(ic, jc->me->full_jid);
+	jc->me = bud;
+
+	/* Leaving (or changing our status) has to go to the new one. */
+	g_free(jc->my_full_jid);
+	jc->my_full_jid = g_strdup(full_jid);
+}
+
 /* Not really the same syntax as the normal pkt_ functions, but this isn't
    called by the xmltree parser directly and this way I can add some extra
    parameters so we won't have to repeat too many things done by the caller
@@ -254,6 +292,7 @@ void jabber_chat_pkt_presence(struct im_connection *ic, struct jabber_buddy *bud
 	char *type = xt_find_attr(node, "type");
 	struct jabber_data *jd = ic->proto_data;
 	struct jabber_chat *jc;
+	GSList *l;
 	char *s;
 
 	if ((chat = jabber_chat_by_jid(ic, bud->bare_jid)) == NULL) {
@@ -264,6 +303,10 @@ void jabber_chat_pkt_presence(struct im_connection *ic, struct jabber_buddy *bud
 
 	jc = chat->data;
 
+	if (type == NULL && !chat->joined && bud != jc->me && jabber_chat_is_self_presence(node)) {
+		jabber_chat_set_me(ic, jc, bud, xt_find_attr(node, "from"));
+	}
+
 	if (type == NULL && !(bud->flags & JBFLAG_IS_CHATROOM)) {
 		bud->flags |= JBFLAG_IS_CHATROOM;
 		/* If this one wasn't set yet, this buddy just joined the chat.
@@ -323,6 +366,15 @@ void jabber_chat_pkt_presence(struct im_connection *ic, struct jabber_buddy *bud
 			jc->invite = NULL;
 		}
 
+		if (!chat->joined) {
+			jc->joining = g_slist_prepend(jc->joining,
+			                              g_strndup(bud->ext_jid, strcspn(bud->ext_jid, "/")));
+			if (bud == jc->me) {
+				jabber_chat_joined(chat);
+			}
+			return;
+		}
+
 		s = strchr(bud->ext_jid, '/');
 		if (s) {
 			*s = 0; /* Should NEVER be NULL, but who knows... */
@@ -378,7 +430,14 @@ void jabber_chat_pkt_presence(struct im_connection *ic, struct jabber_buddy *bud
 			if (s) {
 				*s = 0;
 			}
-			imcb_chat_remove_buddy(chat, bud->ext_jid, reason);
+			if (!chat->joined && (l = g_slist_find_custom(jc->joining, bud->ext_jid,
+			                                              (GCompareFunc) strcmp))) {
+				/* Left before we even got in. */
+				g_free(l->data);
+				jc->joining = g_slist_delete_link(jc->joining, l);
+			} else {
+				imcb_chat_remove_buddy(chat, bud->ext_jid, reason);
+			}
 			if (bud != jc->me && bud->flags & JBFLAG_IS_ANONYMOUS) {
 				imcb_remove_buddy(ic, bud->ext_jid, reason);
 			}
@@ -410,13 +469,8 @@ void jabber_chat_pkt_message(struct im_connection *ic, struct jabber_buddy *bud,
 	from = (bud) ? bud->full_jid : xt_find_attr(node, "from");
 
 	if (from) {
-		nick = strchr(from, '/');
-		if (nick) {
-			*nick = 0;
-		}
 		chat = jabber_chat_by_jid(ic, from);
-		if (nick) {
-			*nick = '/';
+		if ((nick = strchr(from, '/'))) {
 			nick++;
 		}
 	}
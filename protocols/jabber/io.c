@@ -26,28 +26,56 @@
 
 static gboolean jabber_write_callback(gpointer data, gint fd, b_input_condition cond);
 static gboolean jabber_write_queue(struct im_connection *ic);
+static int jabber_write_queued(struct im_connection *ic, gsize start);
+static gboolean jabber_write_pending(struct jabber_data *jd);
+static gboolean jabber_write_wants_read(struct jabber_data *jd);
+static gboolean jabber_read_callback(gpointer data, gint fd, b_input_condition cond);
+
+/* Once the queue is empty again, don't hang on to more memory than this. */
+#define JABBER_TXQ_KEEP 16384
+
+/* Size of the (shared) read buffer, and how much to read from a plain
+   socket in one go before giving the other connections a chance. */
+#define JABBER_READ_SIZE 65536
+#define JABBER_READ_BURST (16 * JABBER_READ_SIZE)
+
+/* How much to inflate at a time before passing it to the parser. */
+#define JABBER_INFLATE_SIZE 16384
 
 int jabber_write_packet(struct im_connection *ic, struct xt_node *node)
 {
-	char *buf;
-	int st;
+	struct jabber_data *jd = ic->proto_data;
+	gsize start = jd->txq->len;
 
-	buf = xt_to_string(node);
-	st = jabber_write(ic, buf, strlen(buf));
-	g_free(buf);
+	/* Serialize straight into the transmit queue. */
+	xt_to_gstring(node, jd->txq);
 
-	return st;
+	if (!jabber_sm_sent(ic, node, start)) {
+		return TRUE;
+	}
+
+	return jabber_write_queued(ic, start);
 }
 
 int jabber_write(struct im_connection *ic, char *buf, int len)
 {
 	struct jabber_data *jd = ic->proto_data;
-	gboolean ret;
+	gsize start = jd->txq->len;
+
+	g_string_append_len(jd->txq, buf, len);
+
+	return jabber_write_queued(ic, start);
+}
+
+/* Something was just appended to the transmit queue at offset start. */
+static int jabber_write_queued(struct im_connection *ic, gsize start)
+{
+	struct jabber_data *jd = ic->proto_data;
 
 	if (jd->flags & JFLAG_XMLCONSOLE && !(ic->flags & OPT_LOGGING_OUT)) {
 		char *msg, *s;
 
-		msg = g_strdup_printf("TX: %s", buf);
+		msg = g_strdup_printf("TX: %s", jd->txq->str + start);
 		/* Don't include auth info in XML logs. */
 		if (strncmp(msg, "TX: <auth ", 10) == 0 && (s = strchr(msg, '>'))) {
 			s++;
@@ -59,32 +87,24 @@ int jabber_write(struct im_connection *ic, char *buf, int len)
 		g_free(msg);
 	}
 
-	if (jd->tx_len == 0) {
-		/* If the queue is empty, allocate a new buffer. */
-		jd->tx_len = len;
-		jd->txq = g_memdup(buf, len);
-
-		/* Try if we can write it immediately so we don't have to do
-		   it via the event handler. If not, add the handler. (In
-		   most cases it probably won't be necessary.) */
-		if ((ret = jabber_write_queue(ic)) && jd->tx_len > 0) {
-			jd->w_inpa = b_input_add(jd->fd, B_EV_IO_WRITE, jabber_write_callback, ic);
-		}
-	} else {
-		/* Just add it to the buffer if it's already filled. The
-		   event handler is already set. */
-		jd->txq = g_renew(char, jd->txq, jd->tx_len + len);
-		memcpy(jd->txq + jd->tx_len, buf, len);
-		jd->tx_len += len;
-
-		/* The return value for write() doesn't necessarily mean
-		   that everything got sent, it mainly means that the
-		   connection (officially) still exists and can still
-		   be accessed without hitting SIGSEGV. IOW: */
-		ret = TRUE;
+	if (jd->fd == -1) {
+		return FALSE;
+	} else if (start == 0 && !(jd->zlib && jd->ztxq->len > 0)) {
+		/* Don't write it right away, but let the event loop call us
+		   once it's done with the current iteration. Whatever else
+		   gets sent until then (presence updates for a bunch of
+		   rooms, for example) goes out in the same write(). */
+		jd->w_inpa = b_input_add(jd->fd, B_EV_IO_WRITE, jabber_write_callback, ic);
 	}
 
-	return ret;
+	/* If the queue was filled already, the event handler is set
+	   already.
+
+	   The return value for write() doesn't necessarily mean that
+	   everything got sent, it mainly means that the connection
+	   (officially) still exists and can still be accessed without
+	   hitting SIGSEGV. */
+	return TRUE;
 }
 
 /* Splitting up in two separate functions: One to use as a callback and one
@@ -101,28 +121,95 @@ static gboolean jabber_write_callback(gpointer data, gint fd, b_input_condition
 
 	return jd->fd != -1 &&
 	       jabber_write_queue(data) &&
-	       jd->tx_len > 0;
+	       jabber_write_pending(jd) &&
+	       !jabber_write_wants_read(jd);
+}
+
+/* TLS may have to read something before it can send more. A writable
+   socket won't help with that, so the read handler retries the write
+   instead of us spinning on the write event. */
+static gboolean jabber_write_wants_read(struct jabber_data *jd)
+{
+	if (jd->ssl && ssl_errno == SSL_AGAIN &&
+	    ssl_getdirection(jd->ssl) == B_EV_IO_READ) {
+		jd->flags |= JFLAG_TX_WANTS_READ;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Is there anything in the transmit queue(s) that didn't go out yet? */
+static gboolean jabber_write_pending(struct jabber_data *jd)
+{
+	return jd->txq->len > 0 || (jd->zlib && jd->ztxq->len > 0);
 }
 
+/* Clears a transmit queue once everything in it was sent. */
+static void jabber_write_done(GString **q, gsize *pos)
+{
+	if ((*q)->allocated_len > JABBER_TXQ_KEEP) {
+		g_string_free(*q, TRUE);
+		*q = g_string_sized_new(1024);
+	} else {
+		g_string_truncate(*q, 0);
+	}
+	*pos = 0;
+}
+
+/* Writes as much of the queue as possible in one go. With SSL, the library
+   splits it up into records. */
 static gboolean jabber_write_queue(struct im_connection *ic)
 {
 	struct jabber_data *jd = ic->proto_data;
-	int st;
+	GString **q = &jd->txq;
+	gsize *pos = &jd->txq_pos;
+	char *buf;
+	int st, len;
+
+	if (jd->zlib) {
+		/* Compress everything that was queued since the last
+		   write as one batch, the socket gets the result. */
+		if (jd->txq->len > 0) {
+			if (!jabber_zlib_deflate(jd->zlib, jd->txq->str, jd->txq->len, jd->ztxq)) {
+				imcb_error(ic, "Stream compression error");
+				imc_logout(ic, TRUE);
+				return FALSE;
+			}
+			jd->tx_xml += jd->txq->len;
+			jabber_write_done(&jd->txq, &jd->txq_pos);
+		}
+
+		q = &jd->ztxq;
+		pos = &jd->ztxq_pos;
+	}
+
+	buf = (*q)->str + *pos;
+	len = (*q)->len - *pos;
 
 	if (jd->ssl) {
-		st = ssl_write(jd->ssl, jd->txq, jd->tx_len);
+		st = ssl_write(jd->ssl, buf, len);
 	} else {
-		st = write(jd->fd, jd->txq, jd->tx_len);
+		st = write(jd->fd, buf, len);
+	}
+
+	if (st > 0) {
+		jd->tx_wire += st;
+		if (!jd->zlib) {
+			jd->tx_xml += st;
+		}
 	}
 
-	if (st == jd->tx_len) {
+	if (st == len) {
 		/* We wrote everything, clear the buffer. */
-		g_free(jd->txq);
-		jd->txq = NULL;
-		jd->tx_len = 0;
+		jabber_write_done(q, pos);
 
 		return TRUE;
 	} else if (st == 0 || (st < 0 && !ssl_sockerr_again(jd->ssl))) {
+		if (jabber_sm_connection_lost(ic)) {
+			return FALSE;
+		}
+
 		/* Set fd to -1 to make sure we won't write to it anymore. */
 		closesocket(jd->fd);    /* Shouldn't be necessary after errors? */
 		jd->fd = -1;
@@ -131,12 +218,13 @@ static gboolean jabber_write_queue(struct im_connection *ic)
 		imc_logout(ic, TRUE);
 		return FALSE;
 	} else if (st > 0) {
-		char *s;
-
-		s = g_memdup(jd->txq + st, jd->tx_len - st);
-		jd->tx_len -= st;
-		g_free(jd->txq);
-		jd->txq = s;
+		/* Only move the rest to the front once that's cheap compared
+		   to what was sent already. */
+		*pos += st;
+		if (*pos >= (*q)->len / 2) {
+			g_string_erase(*q, 0, *pos);
+			*pos = 0;
+		}
 
 		return TRUE;
 	} else {
@@ -146,6 +234,19 @@ static gboolean jabber_write_queue(struct im_connection *ic)
 	}
 }
 
+/* Used once when TLS couldn't finish a read without sending something
+   first, and nothing else was waiting for the socket to become writable. */
+static gboolean jabber_read_resume(gpointer data, gint fd, b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct jabber_data *jd = ic->proto_data;
+
+	jd->rw_inpa = 0;
+	jabber_read_callback(data, fd, cond);
+
+	return FALSE;
+}
+
 static gboolean jabber_feed_input(struct im_connection *ic, char *buf, int size)
 {
 	struct jabber_data *jd = ic->proto_data;
@@ -156,6 +257,33 @@ static gboolean jabber_feed_input(struct im_connection *ic, char *buf, int size)
 		size = strlen(buf);
 	}
 
+	if (jd->zlib) {
+		char out[JABBER_INFLATE_SIZE];
+		int st;
+
+		/* Feed the parser as we go instead of inflating everything
+		   into one big buffer first. */
+		jabber_zlib_input(jd->zlib, buf, size);
+		while ((st = jabber_zlib_inflate(jd->zlib, out, sizeof(out))) > 0) {
+			jd->rx_xml += st;
+			if (xt_feed(jd->xt, out, st) < 0) {
+				imcb_error(ic, "XML stream error");
+				imc_logout(ic, TRUE);
+				return FALSE;
+			}
+		}
+
+		if (st < 0) {
+			imcb_error(ic, "Stream compression error");
+			imc_logout(ic, TRUE);
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	jd->rx_xml += size;
+
 	/* Parse. */
 	if (xt_feed(jd->xt, buf, size) < 0) {
 		imcb_error(ic, "XML stream error");
@@ -163,6 +291,14 @@ static gboolean jabber_feed_input(struct im_connection *ic, char *buf, int size)
 		return FALSE;
 	}
 
+	return TRUE;
+}
+
+/* Runs the handlers for everything jabber_feed_input() parsed so far. */
+static gboolean jabber_handle_input(struct im_connection *ic)
+{
+	struct jabber_data *jd = ic->proto_data;
+
 	/* Execute all handlers. */
 	if (!xt_handle(jd->xt, NULL, 1)) {
 		/* Don't do anything, the handlers should have
@@ -216,28 +352,84 @@ static gboolean jabber_feed_input(struct im_connection *ic, char *buf, int size)
 }
 
 
+/* Reads everything that's available right now and only then runs the
+   handlers, so that a big burst (like a large roster) doesn't cause a tree
+   walk for every few hundred bytes. */
 static gboolean jabber_read_callback(gpointer data, gint fd, b_input_condition cond)
 {
 	struct im_connection *ic = data;
 	struct jabber_data *jd = ic->proto_data;
-	char buf[512];
-	int st;
+	static char buf[JABBER_READ_SIZE];
+	gboolean eof = FALSE;
+	int st, got = 0;
 
 	if (jd->fd == -1) {
 		return FALSE;
 	}
 
-	if (jd->ssl) {
-		st = ssl_read(jd->ssl, buf, sizeof(buf));
-	} else {
-		st = read(jd->fd, buf, sizeof(buf));
+	if (jd->flags & JFLAG_TX_WANTS_READ) {
+		jd->flags &= ~JFLAG_TX_WANTS_READ;
+		if (!jabber_write_queue(ic)) {
+			return FALSE;
+		}
+		if (jabber_write_pending(jd) && !jabber_write_wants_read(jd)) {
+			jd->w_inpa = b_input_add(jd->fd, B_EV_IO_WRITE, jabber_write_callback, ic);
+		}
 	}
 
-	if (st > 0) {
-		if (!jabber_feed_input(ic, buf, st)) {
+	while (TRUE) {
+		if (jd->ssl) {
+			st = ssl_read(jd->ssl, buf, sizeof(buf));
+		} else if (got == 0) {
+			st = read(jd->fd, buf, sizeof(buf));
+		} else {
+			/* proxy_connect() leaves plain sockets blocking, so only
+			   take what's already there. */
+			st = recv(jd->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		}
+
+		if (st > 0) {
+			jd->rx_wire += st;
+			if (!jabber_feed_input(ic, buf, st)) {
+				return FALSE;
+			}
+			got += st;
+		} else if (st == 0 || (st < 0 && !ssl_sockerr_again(jd->ssl))) {
+			eof = TRUE;
+			break;
+		} else {
+			if (jd->ssl && ssl_getdirection(jd->ssl) == B_EV_IO_WRITE &&
+			    !jabber_write_pending(jd) && jd->rw_inpa == 0) {
+				/* TLS has to send something first. If the transmit
+				   queue is busy, that handler takes care of it. */
+				jd->rw_inpa = b_input_add(jd->fd, B_EV_IO_WRITE, jabber_read_resume, ic);
+			}
+			break;
+		}
+
+		if (ssl_pending(jd->ssl)) {
+			/* OpenSSL empties the TCP buffers completely but may keep some
+			   data in its internal buffers. select() won't see that, but
+			   ssl_pending() does. */
+			continue;
+		} else if (got >= JABBER_READ_BURST || (!jd->ssl && st < sizeof(buf))) {
+			/* A short read() means the socket is empty. A short
+			   ssl_read() only means the end of a TLS record, so for
+			   those (non-blocking) sockets keep going until
+			   SSL_AGAIN. */
+			break;
+		}
+	}
+
+	if (got > 0 && !jabber_handle_input(ic)) {
+		return FALSE;
+	}
+
+	if (eof) {
+		if (jabber_sm_connection_lost(ic)) {
 			return FALSE;
 		}
-	} else if (st == 0 || (st < 0 && !ssl_sockerr_again(jd->ssl))) {
+
 		closesocket(jd->fd);
 		jd->fd = -1;
 
@@ -246,14 +438,7 @@ static gboolean jabber_read_callback(gpointer data, gint fd, b_input_condition c
 		return FALSE;
 	}
 
-	if (ssl_pending(jd->ssl)) {
-		/* OpenSSL empties the TCP buffers completely but may keep some
-		   data in its internap buffers. select() won't see that, but
-		   ssl_pending() does. */
-		return jabber_read_callback(data, fd, cond);
-	} else {
-		return TRUE;
-	}
+	return TRUE;
 }
 
 gboolean jabber_connected_plain(gpointer data, gint source, b_input_condition cond)
@@ -390,13 +575,54 @@ static xt_status jabber_pkt_features(struct xt_node *node, gpointer data)
 		jd->flags |= JFLAG_WANT_SESSION;
 	}
 
+	if ((c = xt_find_node(node->children, "sm")) &&
+	    g_strcmp0(xt_find_attr(c, "xmlns"), XMLNS_SM) == 0) {
+		jd->flags |= JFLAG_WANT_SM;
+	}
+
+	if ((c = xt_find_node(node->children, "ver")) &&
+	    g_strcmp0(xt_find_attr(c, "xmlns"), XMLNS_ROSTERVER) == 0) {
+		jd->flags |= JFLAG_ROSTERVER;
+	}
+
+	if ((c = xt_find_node(node->children, "csi")) &&
+	    g_strcmp0(xt_find_attr(c, "xmlns"), XMLNS_CSI) == 0) {
+		jd->flags |= JFLAG_CSI;
+	}
+
 	if (jd->flags & JFLAG_AUTHENTICATED) {
-		return jabber_pkt_bind_sess(ic, NULL, NULL);
+		int st;
+
+		/* Compression goes first, the rest is done on the
+		   compressed stream. */
+		if ((st = jabber_zlib_features(ic, node)) != 0) {
+			return st > 0 ? XT_HANDLED : XT_ABORT;
+		}
+
+		return jabber_start_session(ic);
 	}
 
 	return XT_HANDLED;
 }
 
+/* We're authenticated (and are done negotiating other stream features),
+   either resume the old session or set up a new one. */
+xt_status jabber_start_session(struct im_connection *ic)
+{
+	struct jabber_data *jd = ic->proto_data;
+
+	if (jd->flags & JFLAG_SM_RESUMING) {
+		if (!(jd->flags & JFLAG_WANT_SM)) {
+			imcb_error(ic, "Could not resume session");
+			imc_logout(ic, TRUE);
+			return XT_ABORT;
+		}
+		return jabber_sm_resume(ic) ? XT_HANDLED : XT_ABORT;
+	}
+
+	return jabber_pkt_bind_sess(ic, NULL, NULL);
+}
+
 static xt_status jabber_pkt_proceed_tls(struct xt_node *node, gpointer data)
 {
 	struct im_connection *ic = data;
@@ -414,15 +640,17 @@ static xt_status jabber_pkt_proceed_tls(struct xt_node *node, gpointer data)
 	/* We don't want event handlers to touch our TLS session while it's
 	   still initializing! */
 	b_event_remove(jd->r_inpa);
-	if (jd->tx_len > 0) {
+	if (jd->rw_inpa > 0) {
+		b_event_remove(jd->rw_inpa);
+	}
+	if (jd->txq->len > 0) {
 		/* Actually the write queue should be empty here, but just
 		   to be sure... */
 		b_event_remove(jd->w_inpa);
-		g_free(jd->txq);
-		jd->txq = NULL;
-		jd->tx_len = 0;
+		g_string_truncate(jd->txq, 0);
+		jd->txq_pos = 0;
 	}
-	jd->w_inpa = jd->r_inpa = 0;
+	jd->w_inpa = jd->r_inpa = jd->rw_inpa = 0;
 
 	imcb_log(ic, "Converting stream to TLS");
 
@@ -465,9 +693,14 @@ static xt_status jabber_pkt_stream_error(struct xt_node *node, gpointer data)
 		closesocket(jd->fd);
 		b_event_remove(jd->r_inpa);
 		b_event_remove(jd->w_inpa);
+		if (jd->rw_inpa > 0) {
+			b_event_remove(jd->rw_inpa);
+		}
+		g_string_truncate(jd->txq, 0);
+		jd->txq_pos = 0;
 
 		jd->ssl = NULL;
-		jd->r_inpa = jd->w_inpa = 0;
+		jd->r_inpa = jd->w_inpa = jd->rw_inpa = 0;
 		jd->flags &= JFLAG_XMLCONSOLE;
 
 		s = strchr(host->text, ':');
@@ -531,6 +764,7 @@ static xt_status jabber_xmlconsole(struct xt_node *node, gpointer data)
 
 static const struct xt_handler_entry jabber_handlers[] = {
 	{ NULL,                 "stream:stream",        jabber_xmlconsole },
+	{ NULL,                 "stream:stream",        jabber_sm_received },
 	{ "stream:stream",      "<root>",               jabber_end_of_stream },
 	{ "message",            "stream:stream",        jabber_pkt_message },
 	{ "presence",           "stream:stream",        jabber_pkt_presence },
@@ -540,7 +774,21 @@ static const struct xt_handler_entry jabber_handlers[] = {
 	{ "proceed",            "stream:stream",        jabber_pkt_proceed_tls },
 	{ "challenge",          "stream:stream",        sasl_pkt_challenge },
 	{ "success",            "stream:stream",        sasl_pkt_result },
+	{ "compressed",         "stream:stream",        jabber_zlib_pkt },
+	{ "failure",            "stream:stream",        jabber_zlib_pkt },
 	{ "failure",            "stream:stream",        sasl_pkt_result },
+	{ "enabled",            "stream:stream",        jabber_sm_pkt },
+	{ "resumed",            "stream:stream",        jabber_sm_pkt },
+	{ "failed",             "stream:stream",        jabber_sm_pkt },
+	{ "r",                  "stream:stream",        jabber_sm_pkt },
+	{ "a",                  "stream:stream",        jabber_sm_pkt },
+	{ NULL,                 NULL,                   NULL }
+};
+
+/* Called by the parser as soon as these are complete, see xmltree.c. */
+static const struct xt_handler_entry jabber_stream_handlers[] = {
+	{ "item",               "query",                jabber_roster_stream_item },
+	{ "iq",                 "stream:stream",        jabber_roster_stream_iq },
 	{ NULL,                 NULL,                   NULL }
 };
 
@@ -554,6 +802,7 @@ gboolean jabber_start_stream(struct im_connection *ic)
 	   from the server too. */
 	xt_free(jd->xt);        /* In case we're RE-starting. */
 	jd->xt = xt_new(jabber_handlers, ic);
+	xt_set_stream_handlers(jd->xt, jabber_stream_handlers);
 
 	if (jd->r_inpa <= 0) {
 		jd->r_inpa = b_input_add(jd->fd, B_EV_IO_READ, jabber_read_callback, ic);
@@ -575,9 +824,9 @@ void jabber_end_stream(struct im_connection *ic)
 {
 	struct jabber_data *jd = ic->proto_data;
 
-	/* Let's only do this if the queue is currently empty, otherwise it'd
-	   take too long anyway. */
-	if (jd->tx_len == 0) {
+	/* Let's only do this if the connection isn't backed up already,
+	   otherwise it'd take too long anyway. */
+	if (jd->txq_pos == 0 && jd->ztxq_pos == 0) {
 		char eos[] = "</stream:stream>";
 		struct xt_node *node;
 		int st = 1;
@@ -591,5 +840,11 @@ void jabber_end_stream(struct im_connection *ic)
 		if (st) {
 			jabber_write(ic, eos, strlen(eos));
 		}
+
+		/* We're about to disconnect, so don't wait for the event
+		   loop to flush the queue. */
+		if (jabber_write_pending(jd)) {
+			jabber_write_queue(ic);
+		}
 	}
 }
@@ -25,14 +25,13 @@
 #include "sha1.h"
 
 static xt_status jabber_parse_roster(struct im_connection *ic, struct xt_node *node, struct xt_node *orig);
-static xt_status jabber_iq_display_vcard(struct im_connection *ic, struct xt_node *node, struct xt_node *orig);
+static xt_status jabber_iq_display_vcard(struct im_connection *ic, struct xt_node *node, gpointer data);
 static xt_status jabber_gmail_handle_new(struct im_connection *ic, struct xt_node *node);
 static xt_status jabber_iq_carbons_response(struct im_connection *ic, struct xt_node *node, struct xt_node *orig);
 
 xt_status jabber_pkt_iq(struct xt_node *node, gpointer data)
 {
 	struct im_connection *ic = data;
-	struct jabber_data *jd = ic->proto_data;
 	struct xt_node *c, *reply = NULL;
 	char *type, *s;
 	int st, pack = 1;
@@ -155,17 +154,11 @@ xt_status jabber_pkt_iq(struct xt_node *node, gpointer data)
 		} else if (strcmp(s, XMLNS_ROSTER) == 0) {
 			/* This is a roster push. XMPP servers send this when someone
 			   was added to (or removed from) the buddy list. AFAIK they're
-			   sent even if we added this buddy in our own session. */
-			int bare_len = strlen(jd->me);
-
-			if ((s = xt_find_attr(node, "from")) == NULL ||
-			    (strncmp(s, jd->me, bare_len) == 0 &&
-			     (s[bare_len] == 0 || s[bare_len] == '/'))) {
-				jabber_parse_roster(ic, node, NULL);
-
-				/* Should we generate a reply here? Don't think it's
-				   very important... */
-			} else {
+			   sent even if we added this buddy in our own session.
+			   The items were queued by the stream handlers already,
+			   see roster.c. */
+			if (!jabber_roster_push_valid(ic, node)) {
+				s = xt_find_attr(node, "from");
 				imcb_log(ic, "Warning: %s tried to fake a roster push!", s ? s : "(unknown)");
 
 				xt_free_node(reply);
@@ -354,7 +347,7 @@ xt_status jabber_pkt_bind_sess(struct im_connection *ic, struct xt_node *node, s
 			jabber_iq_query_server(ic, jd->server, XMLNS_DISCO_INFO);
 		}
 	} else if ((jd->flags & (JFLAG_WANT_BIND | JFLAG_WANT_SESSION)) == 0) {
-		if (!jabber_get_roster(ic)) {
+		if (!jabber_sm_enable(ic) || !jabber_get_roster(ic)) {
 			return XT_ABORT;
 		}
 		if (!jabber_iq_disco_server(ic)) {
@@ -367,6 +360,7 @@ xt_status jabber_pkt_bind_sess(struct im_connection *ic, struct xt_node *node, s
 
 int jabber_get_roster(struct im_connection *ic)
 {
+	struct jabber_data *jd = ic->proto_data;
 	struct xt_node *node;
 	int st;
 
@@ -374,9 +368,14 @@ int jabber_get_roster(struct im_connection *ic)
 
 	node = xt_new_node("query", NULL, NULL);
 	xt_add_attr(node, "xmlns", XMLNS_ROSTER);
+	if (jd->flags & JFLAG_ROSTERVER) {
+		xt_add_attr(node, "ver", jabber_roster_cache_load(ic));
+	}
 	node = jabber_make_packet("iq", "get", NULL, node);
 
 	jabber_cache_add(ic, node, jabber_parse_roster);
+	g_free(jd->roster_id);
+	jd->roster_id = g_strdup(xt_find_attr(node, "id"));
 	st = jabber_write_packet(ic, node);
 
 	return st;
@@ -404,47 +403,16 @@ static xt_status jabber_gmail_handle_new(struct im_connection *ic, struct xt_nod
 static xt_status jabber_parse_roster(struct im_connection *ic, struct xt_node *node, struct xt_node *orig)
 {
 	struct jabber_data *jd = ic->proto_data;
-	struct xt_node *query, *c;
-	int initial = (orig != NULL);
-
-	if (!(query = xt_find_node(node->children, "query"))) {
-		imcb_log(ic, "Warning: Received NULL roster packet");
-		return XT_HANDLED;
-	}
-
-	c = query->children;
-	while ((c = xt_find_node(c, "item"))) {
-		struct xt_node *group = xt_find_node(c->children, "group");
-		char *jid = xt_find_attr(c, "jid");
-		char *name = xt_find_attr(c, "name");
-		char *sub = xt_find_attr(c, "subscription");
-		char *mention_name = xt_find_attr(c, "mention_name");
-
-		if (jid && sub) {
-			if ((strcmp(sub, "both") == 0 || strcmp(sub, "to") == 0)) {
-				imcb_add_buddy(ic, jid, (group && group->text_len) ?
-				               group->text : NULL);
-
-				if (name) {
-					imcb_rename_buddy(ic, jid, name);
-				}
-
-				/* This could also be used to set the full name as nick for fb/gtalk,
-				 * but i'm keeping the old (ugly?) default behavior just to be safe */
-				if (mention_name && (jd->flags & JFLAG_HIPCHAT)) {
-					imcb_buddy_nick_hint(ic, jid, mention_name);
-				}
-			} else if (strcmp(sub, "remove") == 0) {
-				jabber_buddy_remove_bare(ic, jid);
-				imcb_remove_buddy(ic, jid, NULL);
-			}
-		}
 
-		c = c->next;
-	}
+	/* The items (if any) were taken out of the stream while it was being
+	   parsed, and are being added to the contact list by now. See
+	   jabber_roster_stream_iq(). */
+	g_free(jd->roster_id);
+	jd->roster_id = NULL;
 
-	if (initial) {
-		imcb_connected(ic);
+	if (g_strcmp0(xt_find_attr(node, "type"), "result") != 0 ||
+	    (!xt_find_node(node->children, "query") && !jd->roster_cache)) {
+		imcb_log(ic, "Warning: Received NULL roster packet");
 	}
 
 	return XT_HANDLED;
@@ -453,6 +421,7 @@ static xt_status jabber_parse_roster(struct im_connection *ic, struct xt_node *n
 int jabber_get_vcard(struct im_connection *ic, char *bare_jid)
 {
 	struct xt_node *node;
+	int st;
 
 	if (strchr(bare_jid, '/')) {
 		return 1;       /* This was an error, but return 0 should only be done if the connection died... */
@@ -462,27 +431,29 @@ int jabber_get_vcard(struct im_connection *ic, char *bare_jid)
 	xt_add_attr(node, "xmlns", XMLNS_VCARD);
 	node = jabber_make_packet("iq", "get", bare_jid, node);
 
-	jabber_cache_add(ic, node, jabber_iq_display_vcard);
-	return jabber_write_packet(ic, node);
+	jabber_cache_add_ctx(ic, node, jabber_iq_display_vcard, g_strdup(bare_jid), g_free);
+	st = jabber_write_packet(ic, node);
+	xt_free_node(node);
+
+	return st;
 }
 
-static xt_status jabber_iq_display_vcard(struct im_connection *ic, struct xt_node *node, struct xt_node *orig)
+static xt_status jabber_iq_display_vcard(struct im_connection *ic, struct xt_node *node, gpointer data)
 {
 	struct xt_node *vc, *c, *sc; /* subchild, ic is already in use ;-) */
+	char *jid = data;
 	GString *reply;
 	char *s;
 
 	if ((s = xt_find_attr(node, "type")) == NULL ||
 	    strcmp(s, "result") != 0 ||
 	    (vc = xt_find_node(node->children, "vCard")) == NULL) {
-		s = xt_find_attr(orig, "to");   /* If this returns NULL something's wrong.. */
-		imcb_log(ic, "Could not retrieve vCard of %s", s ? s : "(NULL)");
+		imcb_log(ic, "Could not retrieve vCard of %s", jid);
 		return XT_HANDLED;
 	}
 
-	s = xt_find_attr(orig, "to");
 	reply = g_string_new("vCard information for ");
-	reply = g_string_append(reply, s ? s : "(NULL)");
+	reply = g_string_append(reply, jid);
 	reply = g_string_append(reply, ":\n");
 
 	/* I hate this format, I really do... */
@@ -678,12 +649,11 @@ int jabber_remove_from_roster(struct im_connection *ic, char *handle)
 	return st;
 }
 
-xt_status jabber_iq_parse_features(struct im_connection *ic, struct xt_node *node, struct xt_node *orig);
-
 xt_status jabber_iq_query_features(struct im_connection *ic, char *bare_jid)
 {
 	struct xt_node *node, *query;
 	struct jabber_buddy *bud;
+	int st;
 
 	if ((bud = jabber_buddy_by_jid(ic, bare_jid, 0)) == NULL) {
 		/* Who cares about the unknown... */
@@ -691,7 +661,7 @@ xt_status jabber_iq_query_features(struct im_connection *ic, char *bare_jid)
 		return XT_HANDLED;
 	}
 
-	if (bud->features) { /* been here already */
+	if (jabber_buddy_caps(bud)) { /* been here already */
 		return XT_HANDLED;
 	}
 
@@ -704,16 +674,25 @@ xt_status jabber_iq_query_features(struct im_connection *ic, char *bare_jid)
 		return XT_HANDLED;
 	}
 
-	jabber_cache_add(ic, query, jabber_iq_parse_features);
+	jabber_cache_add_ctx(ic, query, jabber_iq_parse_features, NULL, NULL);
+	st = jabber_write_packet(ic, query);
+	xt_free_node(query);
 
-	return jabber_write_packet(ic, query) ? XT_HANDLED : XT_ABORT;
+	return st ? XT_HANDLED : XT_ABORT;
 }
 
-xt_status jabber_iq_parse_features(struct im_connection *ic, struct xt_node *node, struct xt_node *orig)
+xt_status jabber_iq_parse_features(struct im_connection *ic, struct xt_node *node, gpointer data)
 {
 	struct xt_node *c;
 	struct jabber_buddy *bud;
-	char *feature, *xmlns, *from;
+	struct jabber_caps *caps;
+	char *xmlns, *from;
+
+	/* Lots of these are sent for caps without anyone waiting for the
+	   answer, no need to complain about errors. */
+	if (g_strcmp0(xt_find_attr(node, "type"), "error") == 0) {
+		return XT_HANDLED;
+	}
 
 	if (!(from = xt_find_attr(node, "from")) ||
 	    !(c = xt_find_node(node->children, "query")) ||
@@ -722,19 +701,17 @@ xt_status jabber_iq_parse_features(struct im_connection *ic, struct xt_node *nod
 		imcb_log(ic, "WARNING: Received incomplete IQ-result packet for discover");
 		return XT_HANDLED;
 	}
+
+	/* Even if the buddy is gone already, others may have the same. */
+	caps = jabber_caps_add(c);
+
 	if ((bud = jabber_buddy_by_jid(ic, from, 0)) == NULL) {
-		/* Who cares about the unknown... */
-		imcb_log(ic, "Couldn't find buddy: %s", from);
 		return XT_HANDLED;
 	}
 
-	c = c->children;
-	while ((c = xt_find_node(c, "feature"))) {
-		feature = xt_find_attr(c, "var");
-		if (feature) {
-			bud->features = g_slist_append(bud->features, g_strdup(feature));
-		}
-		c = c->next;
+	jabber_buddy_set_caps(bud, caps);
+	if (jabber_caps_has_feature(caps, XMLNS_CHATSTATES)) {
+		bud->flags |= JBFLAG_DOES_XEP85;
 	}
 
 	return XT_HANDLED;
@@ -939,7 +916,7 @@ xt_status jabber_iq_parse_server_features(struct im_connection *ic, struct xt_no
 }
 
 static xt_status jabber_iq_version_response(struct im_connection *ic,
-                                            struct xt_node *node, struct xt_node *orig);
+                                            struct xt_node *node, gpointer data);
 
 void jabber_iq_version_send(struct im_connection *ic, struct jabber_buddy *bud, void *data)
 {
@@ -948,13 +925,14 @@ void jabber_iq_version_send(struct im_connection *ic, struct jabber_buddy *bud,
 	node = xt_new_node("query", NULL, NULL);
 	xt_add_attr(node, "xmlns", XMLNS_VERSION);
 	query = jabber_make_packet("iq", "get", bud->full_jid, node);
-	jabber_cache_add(ic, query, jabber_iq_version_response);
+	jabber_cache_add_ctx(ic, query, jabber_iq_version_response, NULL, NULL);
 
 	jabber_write_packet(ic, query);
+	xt_free_node(query);
 }
 
 static xt_status jabber_iq_version_response(struct im_connection *ic,
-                                            struct xt_node *node, struct xt_node *orig)
+                                            struct xt_node *node, gpointer data)
 {
 	struct xt_node *query;
 	GString *rets;
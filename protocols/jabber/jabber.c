@@ -116,11 +116,20 @@ static void jabber_init(account_t *acc)
 	s = set_add(&acc->set, "carbons", "true", set_eval_bool, acc);
 	s->flags |= ACC_SET_OFFLINE_ONLY;
 
+#ifdef WITH_ZLIB
+	s = set_add(&acc->set, "compression", "false", set_eval_bool, acc);
+	s->flags |= ACC_SET_OFFLINE_ONLY;
+#endif
+
+	s = set_add(&acc->set, "stream_management", "true", set_eval_bool, acc);
+	s->flags |= ACC_SET_OFFLINE_ONLY;
+
 	acc->flags |= ACC_FLAG_AWAY_MESSAGE | ACC_FLAG_STATUS_MESSAGE |
 	              ACC_FLAG_HANDLE_DOMAINS;
 }
 
-static void jabber_generate_id_hash(struct jabber_data *jd);
+static void jabber_generate_id_prefix(struct jabber_data *jd);
+static void jabber_connect_to(struct im_connection *ic, char *connect_to, int srv_port);
 
 static void jabber_login(account_t *acc)
 {
@@ -135,6 +144,8 @@ static void jabber_login(account_t *acc)
 
 	jd->ic = ic;
 	ic->proto_data = jd;
+	jd->txq = g_string_sized_new(1024);
+	jd->ztxq = g_string_sized_new(0);
 
 	jabber_set_me(ic, acc->user);
 
@@ -167,7 +178,9 @@ static void jabber_login(account_t *acc)
 	}
 
 	jd->node_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, jabber_cache_entry_free);
-	jd->buddies = g_hash_table_new(g_str_hash, g_str_equal);
+	jd->node_cache_order = g_queue_new();
+	jd->buddies = g_hash_table_new(jabber_jid_hash, jabber_jid_equal);
+	jd->chats = g_hash_table_new(jabber_jid_hash, jabber_jid_equal);
 
 	if (set_getbool(&acc->set, "oauth")) {
 		GSList *p_in = NULL;
@@ -220,35 +233,75 @@ static void jabber_xmlconsole_enable(struct im_connection *ic)
 	}
 }
 
+static void jabber_srv_found(struct im_connection *ic, struct ns_srv_reply **srvl)
+{
+	struct jabber_data *jd = ic->proto_data;
+	struct ns_srv_reply *srv;
+	int i;
+
+	if (srvl == NULL) {
+		jabber_connect_to(ic, jd->server, 0);
+		return;
+	}
+
+	/* Find the lowest-priority one. These usually come
+	   back in random/shuffled order. Not looking at
+	   weights etc for now. */
+	srv = *srvl;
+	for (i = 1; srvl[i]; i++) {
+		if (srvl[i]->prio < srv->prio) {
+			srv = srvl[i];
+		}
+	}
+
+	jabber_connect_to(ic, srv->name, srv->port);
+	srv_free(srvl);
+}
+
+static void jabber_srv_jabber_client(gpointer data, struct ns_srv_reply **srvl)
+{
+	struct im_connection *ic = data;
+	struct jabber_data *jd = ic->proto_data;
+
+	jd->srv_lookup = 0;
+	jabber_srv_found(ic, srvl);
+}
+
+static void jabber_srv_xmpp_client(gpointer data, struct ns_srv_reply **srvl)
+{
+	struct im_connection *ic = data;
+	struct jabber_data *jd = ic->proto_data;
+
+	jd->srv_lookup = 0;
+	if (srvl == NULL) {
+		jd->srv_lookup = dns_lookup_srv("jabber-client", "tcp", jd->server, jabber_srv_jabber_client, ic);
+	} else {
+		jabber_srv_found(ic, srvl);
+	}
+}
+
 /* Separate this from jabber_login() so we can do OAuth first if necessary.
    Putting this in io.c would probably be more correct. */
 void jabber_connect(struct im_connection *ic)
 {
 	account_t *acc = ic->acc;
 	struct jabber_data *jd = ic->proto_data;
-	int i;
-	char *connect_to;
-	struct ns_srv_reply **srvl = NULL, *srv = NULL;
 
-	/* Figure out the hostname to connect to. */
+	/* Figure out the hostname to connect to. The SRV lookups continue
+	   from the event loop, jabber_connect_to() gets called when done. */
 	if (acc->server && *acc->server) {
-		connect_to = acc->server;
-	} else if ((srvl = srv_lookup("xmpp-client", "tcp", jd->server)) ||
-	           (srvl = srv_lookup("jabber-client", "tcp", jd->server))) {
-		/* Find the lowest-priority one. These usually come
-		   back in random/shuffled order. Not looking at
-		   weights etc for now. */
-		srv = *srvl;
-		for (i = 1; srvl[i]; i++) {
-			if (srvl[i]->prio < srv->prio) {
-				srv = srvl[i];
-			}
-		}
-
-		connect_to = srv->name;
+		jabber_connect_to(ic, acc->server, 0);
 	} else {
-		connect_to = jd->server;
+		jd->srv_lookup = dns_lookup_srv("xmpp-client", "tcp", jd->server, jabber_srv_xmpp_client, ic);
 	}
+}
+
+/* srv_port is the port from the SRV record, if there was one. */
+static void jabber_connect_to(struct im_connection *ic, char *connect_to, int srv_port)
+{
+	account_t *acc = ic->acc;
+	struct jabber_data *jd = ic->proto_data;
+	int i;
 
 	imcb_log(ic, "Connecting");
 
@@ -273,10 +326,9 @@ void jabber_connect(struct im_connection *ic)
 		                      ic);
 		jd->fd = jd->ssl ? ssl_getfd(jd->ssl) : -1;
 	} else {
-		jd->fd = proxy_connect(connect_to, srv ? srv->port : set_getint(&acc->set,
-		                                                                "port"), jabber_connected_plain, ic);
+		jd->fd = proxy_connect(connect_to, srv_port ? srv_port : set_getint(&acc->set,
+		                                                                    "port"), jabber_connected_plain, ic);
 	}
-	srv_free(srvl);
 
 	if (jd->fd == -1) {
 		imcb_error(ic, "Could not connect to server");
@@ -285,6 +337,11 @@ void jabber_connect(struct im_connection *ic)
 		return;
 	}
 
+	if (jd->flags & JFLAG_SM_RESUMING) {
+		/* The rest is still there from the first login. */
+		return;
+	}
+
 	if (set_getbool(&acc->set, "xmlconsole")) {
 		jabber_xmlconsole_enable(ic);
 	}
@@ -297,23 +354,20 @@ void jabber_connect(struct im_connection *ic)
 		}
 	}
 
-	jabber_generate_id_hash(jd);
+	jabber_generate_id_prefix(jd);
 }
 
-/* This generates an unfinished md5_state_t variable. Every time we generate
-   an ID, we finish the state by adding a sequence number and take the hash. */
-static void jabber_generate_id_hash(struct jabber_data *jd)
+/* Cached packet IDs are this prefix plus a counter, the prefix only has to
+   be different for every connection. */
+static void jabber_generate_id_prefix(struct jabber_data *jd)
 {
-	md5_byte_t binbuf[4];
-	char *s;
+	unsigned char binbuf[6];
+	int i;
 
-	md5_init(&jd->cached_id_prefix);
-	md5_append(&jd->cached_id_prefix, (unsigned char *) jd->username, strlen(jd->username));
-	md5_append(&jd->cached_id_prefix, (unsigned char *) jd->server, strlen(jd->server));
-	s = set_getstr(&jd->ic->acc->set, "resource");
-	md5_append(&jd->cached_id_prefix, (unsigned char *) s, strlen(s));
-	random_bytes(binbuf, 4);
-	md5_append(&jd->cached_id_prefix, binbuf, 4);
+	random_bytes(binbuf, sizeof(binbuf));
+	for (i = 0; i < sizeof(binbuf); i++) {
+		g_snprintf(jd->cached_id_prefix + i * 2, 3, "%02x", binbuf[i]);
+	}
 }
 
 static void jabber_logout(struct im_connection *ic)
@@ -346,6 +400,12 @@ static void jabber_logout(struct im_connection *ic)
 	if (jd->w_inpa >= 0) {
 		b_event_remove(jd->w_inpa);
 	}
+	if (jd->rw_inpa > 0) {
+		b_event_remove(jd->rw_inpa);
+	}
+	if (jd->srv_lookup) {
+		dns_cancel(jd->srv_lookup);
+	}
 
 	if (jd->ssl) {
 		ssl_disconnect(jd->ssl);
@@ -354,21 +414,32 @@ static void jabber_logout(struct im_connection *ic)
 		proxy_disconnect(jd->fd);
 	}
 
-	if (jd->tx_len) {
-		g_free(jd->txq);
+	if (jd->zlib) {
+		imcb_log(ic, "Stream compression: received %" G_GUINT64_FORMAT " bytes (%" G_GUINT64_FORMAT
+		         " uncompressed), sent %" G_GUINT64_FORMAT " bytes (%" G_GUINT64_FORMAT " uncompressed)",
+		         jd->rx_wire, jd->rx_xml, jd->tx_wire, jd->tx_xml);
+		jabber_zlib_free(jd->zlib);
 	}
 
+	g_string_free(jd->txq, TRUE);
+	g_string_free(jd->ztxq, TRUE);
+
 	if (jd->node_cache) {
 		g_hash_table_destroy(jd->node_cache);
+		g_queue_free(jd->node_cache_order);
 	}
 
 	if (jd->buddies) {
 		jabber_buddy_remove_all(ic);
 	}
+	if (jd->chats) {
+		g_hash_table_destroy(jd->chats);
+	}
 
 	xt_free(jd->xt);
 
-	md5_free(&jd->cached_id_prefix);
+	jabber_roster_cache_free(ic);
+	jabber_sm_logout(ic);
 
 	g_free(jd->oauth2_access_token);
 	g_free(jd->away_message);
@@ -509,6 +580,12 @@ static void jabber_set_away(struct im_connection *ic, char *state_txt, char *mes
 	jd->away_message = (message && *message) ? g_strdup(message) : NULL;
 
 	presence_send_update(ic);
+	presence_send_csi(ic, FALSE);
+}
+
+static void jabber_set_idle(struct im_connection *ic, gboolean idle)
+{
+	presence_send_csi(ic, FALSE);
 }
 
 static void jabber_add_buddy(struct im_connection *ic, char *who, char *group)
@@ -627,11 +704,21 @@ static void jabber_chat_invite_(struct groupchat *c, char *who, char *msg)
 
 static void jabber_keepalive(struct im_connection *ic)
 {
+	struct jabber_data *jd = ic->proto_data;
+
+	/* Nothing to keep alive while we're trying to resume, and we can't
+	   write anything before the new stream is set up. */
+	if (jd->flags & JFLAG_SM_RESUMING) {
+		return;
+	}
+
 	/* Just any whitespace character is enough as a keepalive for XMPP sessions. */
 	if (!jabber_write(ic, "\n", 1)) {
 		return;
 	}
 
+	jabber_sm_request_ack(ic);
+
 	/* This runs the garbage collection every minute, which means every packet
 	   is in the cache for about a minute (which should be enough AFAIK). */
 	jabber_cache_clean(ic);
@@ -748,6 +835,7 @@ void jabber_initmodule()
 	ret->buddy_msg = jabber_buddy_msg;
 	ret->away_states = jabber_away_states;
 	ret->set_away = jabber_set_away;
+	ret->set_idle = jabber_set_idle;
 //	ret->set_info = jabber_set_info;
 	ret->get_info = jabber_get_info;
 	ret->add_buddy = jabber_add_buddy;
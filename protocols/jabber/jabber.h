@@ -46,6 +46,14 @@ typedef enum {
 	JFLAG_XMLCONSOLE = 64,          /* If the user added an xmlconsole buddy. */
 	JFLAG_STARTTLS_DONE = 128,      /* If a plaintext session was converted to TLS. */
 	JFLAG_GMAILNOTIFY = 256,        /* If gmail notification is enabled */
+	JFLAG_ROSTERVER = 512,          /* Server supports roster versioning (XEP-0237) */
+	JFLAG_WANT_SM = 1024,           /* Server offers stream management (XEP-0198) */
+	JFLAG_SM_ENABLED = 2048,        /* We asked for it, count outgoing stanzas. */
+	JFLAG_SM_ACTIVE = 4096,         /* Server agreed, count incoming stanzas too. */
+	JFLAG_SM_RESUMING = 8192,       /* Reconnecting to resume the old session. */
+	JFLAG_CSI = 16384,              /* Server supports client state indication (XEP-0352) */
+	JFLAG_CSI_INACTIVE = 32768,     /* ... and we told it we're inactive. */
+	JFLAG_TX_WANTS_READ = 65536,    /* TLS has to read before the transmit queue can go out. */
 
 	JFLAG_GTALK =  0x100000,        /* Is Google Talk, as confirmed by iq discovery */
 	JFLAG_HIPCHAT = 0x200000,       /* Is hipchat, because prpl->name says so */
@@ -81,9 +89,16 @@ struct jabber_data {
 
 	int fd;
 	void *ssl;
-	char *txq;
-	int tx_len;
+	GString *txq;
+	gsize txq_pos;          /* How much of txq was sent already */
+	struct jabber_zlib *zlib; /* Stream compression, see compress.c */
+	GString *ztxq;          /* txq after compression */
+	gsize ztxq_pos;
+	guint64 rx_wire, rx_xml; /* Bytes read from the socket, and after inflating */
+	guint64 tx_wire, tx_xml;
 	int r_inpa, w_inpa;
+	int rw_inpa;            /* jabber_read_resume(), see io.c */
+	gint srv_lookup;        /* While looking up the server's SRV record */
 
 	struct xt_parser *xt;
 	jabber_flags_t flags;
@@ -103,9 +118,27 @@ struct jabber_data {
 	guint64 gmail_time;
 	char *gmail_tid;
 
-	md5_state_t cached_id_prefix;
-	GHashTable *node_cache;
-	GHashTable *buddies;
+	char cached_id_prefix[16];
+	guint32 cached_id_next;
+	GHashTable *node_cache;         /* ID -> struct jabber_cache_entry */
+	GQueue *node_cache_order;       /* The same entries, oldest first */
+	GHashTable *buddies;            /* Bare JID -> struct jabber_buddy */
+	GHashTable *chats;              /* Room JID -> struct groupchat */
+
+	/* Stream management, see sm.c */
+	char *sm_id;                    /* NULL if the session can't be resumed */
+	guint32 sm_handled;             /* Stanzas received */
+	guint32 sm_acked;               /* Stanzas the server confirmed */
+	GQueue *sm_unacked;             /* The rest of what we sent, serialized */
+	guint32 sm_max;                 /* How long the server keeps it (s), 0 if unknown */
+	gint sm_timer;                  /* To give up on resuming it */
+
+	struct xt_node *roster_cache;   /* See roster.c */
+	gint roster_cache_save;
+	char *roster_id;                /* Of our roster request, until answered */
+	GQueue *roster_queue;           /* Streamed roster items, not added yet */
+	struct xt_node *roster_done;    /* The ones that were, for the cache */
+	gint roster_batch;
 
 	GSList *filetransfers;
 	GSList *streamhosts;
@@ -120,11 +153,17 @@ struct jabber_away_state {
 };
 
 typedef xt_status (*jabber_cache_event) (struct im_connection *ic, struct xt_node *node, struct xt_node *orig);
+typedef xt_status (*jabber_cache_ctx_event) (struct im_connection *ic, struct xt_node *node, gpointer data);
 
 struct jabber_cache_entry {
+	char id[32];
 	time_t saved_at;
+	GList *link;                    /* In jd->node_cache_order */
 	struct xt_node *node;
 	jabber_cache_event func;
+	jabber_cache_ctx_event ctx_func;
+	gpointer data;
+	GDestroyNotify data_free;
 };
 
 /* Somewhat messy data structure: We have a hash table with the bare JID as
@@ -145,12 +184,25 @@ struct jabber_buddy {
 	int priority;
 	struct jabber_away_state *away_state;
 	char *away_message;
-	GSList *features;
+	struct jabber_caps *caps;       /* Use jabber_buddy_caps() */
+	char *caps_ver;                 /* XEP-0115 ver= from the last presence */
 
 	time_t last_msg;
 	jabber_buddy_flags_t flags;
 
-	struct jabber_buddy *next;
+	struct jabber_buddy *next, *prev;
+	GHashTable *resources;          /* Long lists only: resource -> entry,
+	                                   kept in the bare JID's entry. */
+};
+
+/* A disco#info result, shared by everyone who has the same one. See caps.c. */
+struct jabber_caps {
+	char *ver;
+	char **features;                /* Sorted */
+	int features_count;
+	struct xt_node *query;          /* For saving, NULL if not verifiable */
+	int ref;                        /* The cache and every buddy using it */
+	GList *link;                    /* In the cache's LRU list */
 };
 
 struct jabber_chat {
@@ -159,6 +211,7 @@ struct jabber_chat {
 	char *my_full_jid; /* Separate copy because of case sensitivity. */
 	struct jabber_buddy *me;
 	char *invite;
+	GSList *joining;   /* Occupants that were there before we joined */
 };
 
 struct jabber_transfer {
@@ -197,8 +250,8 @@ struct jabber_transfer {
    first one should be used, but when storing a packet in the cache, a
    "special" kind of ID is assigned to make it easier later to figure out
    if we have to do call an event handler for the response packet. Also
-   we'll append a hash to make sure we won't trigger on cached packets from
-   other BitlBee users. :-) */
+   we'll append a random per-connection prefix to make sure we won't trigger
+   on cached packets from other BitlBee users. :-) */
 #define JABBER_PACKET_ID "BeeP"
 #define JABBER_CACHED_ID "BeeC"
 
@@ -206,6 +259,31 @@ struct jabber_transfer {
    them. This gc is done on every keepalive (every minute). */
 #define JABBER_CACHE_MAX_AGE 600
 
+/* Ask the server for an ack after every this many stanzas. */
+#define JABBER_SM_ACK_EVERY 8
+
+/* If more stanzas than this are waiting for an ack (because the server
+   doesn't send any, or because we can't get back in), log in again. */
+#define JABBER_SM_MAX_UNACKED 512
+
+/* How many seconds to keep trying to resume a session, at most. */
+#define JABBER_SM_RESUME_TIMEOUT 120
+
+/* Limits for the disco#info cache and the queries we're waiting for, the
+   oldest entries go first. See caps.c. */
+#define JABBER_CAPS_MAX_ENTRIES 1024
+#define JABBER_CAPS_MAX_PENDING 256
+
+/* Roster pushes are written to the roster cache after this many seconds. */
+#define JABBER_ROSTER_SAVE_DELAY 10
+
+/* Buddies with this many resources (like groupchats with this many
+   participants) get a hash table to find them. */
+#define JABBER_RESOURCE_INDEX_MIN 16
+
+/* Add at most this many roster items per main loop iteration. */
+#define JABBER_ROSTER_BATCH 64
+
 /* RFC 392[01] stuff */
 #define XMLNS_TLS          "urn:ietf:params:xml:ns:xmpp-tls"
 #define XMLNS_SASL         "urn:ietf:params:xml:ns:xmpp-sasl"
@@ -241,6 +319,11 @@ struct jabber_transfer {
 #define XMLNS_FILETRANSFER "http://jabber.org/protocol/si/profile/file-transfer" /* XEP-0096 */
 #define XMLNS_BYTESTREAMS  "http://jabber.org/protocol/bytestreams"              /* XEP-0065 */
 #define XMLNS_IBB          "http://jabber.org/protocol/ibb"                      /* XEP-0047 */
+#define XMLNS_ROSTERVER    "urn:xmpp:features:rosterver"                         /* XEP-0237 */
+#define XMLNS_SM           "urn:xmpp:sm:3"                                       /* XEP-0198 */
+#define XMLNS_CSI          "urn:xmpp:csi:0"                                      /* XEP-0352 */
+#define XMLNS_COMPRESS_FEATURE "http://jabber.org/features/compress"             /* XEP-0138 */
+#define XMLNS_COMPRESS     "http://jabber.org/protocol/compress"                 /* XEP-0138 */
 
 /* Hipchat protocol extensions*/
 #define XMLNS_HIPCHAT         "http://hipchat.com"
@@ -258,10 +341,31 @@ int jabber_get_vcard(struct im_connection *ic, char *bare_jid);
 int jabber_add_to_roster(struct im_connection *ic, const char *handle, const char *name, const char *group);
 int jabber_remove_from_roster(struct im_connection *ic, char *handle);
 xt_status jabber_iq_query_features(struct im_connection *ic, char *bare_jid);
+xt_status jabber_iq_parse_features(struct im_connection *ic, struct xt_node *node, gpointer data);
 xt_status jabber_iq_query_server(struct im_connection *ic, char *jid, char *xmlns);
 void jabber_iq_version_send(struct im_connection *ic, struct jabber_buddy *bud, void *data);
 int jabber_iq_disco_server(struct im_connection *ic);
 
+/* roster.c */
+char *jabber_roster_cache_load(struct im_connection *ic);
+void jabber_roster_cache_replace(struct im_connection *ic, struct xt_node *query);
+void jabber_roster_cache_apply(struct xt_node *cache, struct xt_node *push);
+void jabber_roster_cache_update(struct im_connection *ic, struct xt_node *push);
+void jabber_roster_cache_free(struct im_connection *ic);
+gboolean jabber_roster_push_valid(struct im_connection *ic, struct xt_node *iq);
+xt_status jabber_roster_stream_item(struct xt_node *node, gpointer data);
+xt_status jabber_roster_stream_iq(struct xt_node *node, gpointer data);
+
+/* sm.c */
+int jabber_sm_enable(struct im_connection *ic);
+gboolean jabber_sm_sent(struct im_connection *ic, struct xt_node *node, gsize start);
+void jabber_sm_request_ack(struct im_connection *ic);
+xt_status jabber_sm_received(struct xt_node *node, gpointer data);
+xt_status jabber_sm_pkt(struct xt_node *node, gpointer data);
+int jabber_sm_resume(struct im_connection *ic);
+gboolean jabber_sm_connection_lost(struct im_connection *ic);
+void jabber_sm_logout(struct im_connection *ic);
+
 /* si.c */
 int jabber_si_handle_request(struct im_connection *ic, struct xt_node *node, struct xt_node *sinode);
 void jabber_si_transfer_request(struct im_connection *ic, file_transfer_t *ft, char *who);
@@ -278,6 +382,7 @@ xt_status jabber_pkt_message(struct xt_node *node, gpointer data);
 /* presence.c */
 xt_status jabber_pkt_presence(struct xt_node *node, gpointer data);
 int presence_send_update(struct im_connection *ic);
+int presence_send_csi(struct im_connection *ic, gboolean force);
 int presence_send_request(struct im_connection *ic, char *handle, char *request);
 
 /* jabber_util.c */
@@ -286,7 +391,8 @@ char *set_eval_tls(set_t *set, char *value);
 struct xt_node *jabber_make_packet(char *name, char *type, char *to, struct xt_node *children);
 struct xt_node *jabber_make_error_packet(struct xt_node *orig, char *err_cond, char *err_type, char *err_code);
 void jabber_cache_add(struct im_connection *ic, struct xt_node *node, jabber_cache_event func);
-struct xt_node *jabber_cache_get(struct im_connection *ic, char *id);
+void jabber_cache_add_ctx(struct im_connection *ic, struct xt_node *node, jabber_cache_ctx_event func,
+                          gpointer data, GDestroyNotify data_free);
 void jabber_cache_entry_free(gpointer entry);
 void jabber_cache_clean(struct im_connection *ic);
 xt_status jabber_cache_handle_packet(struct im_connection *ic, struct xt_node *node);
@@ -308,6 +414,9 @@ struct jabber_error {
 	char *code, *text, *type;
 };
 
+guint jabber_jid_hash(gconstpointer key);
+gboolean jabber_jid_equal(gconstpointer a, gconstpointer b);
+gpointer jabber_jid_lookup(GHashTable *table, const char *jid);
 struct jabber_buddy *jabber_buddy_add(struct im_connection *ic, char *full_jid);
 struct jabber_buddy *jabber_buddy_by_jid(struct im_connection *ic, char *jid, get_buddy_flags_t flags);
 struct jabber_buddy *jabber_buddy_by_ext_jid(struct im_connection *ic, char *jid, get_buddy_flags_t flags);
@@ -329,6 +438,25 @@ gboolean jabber_connected_plain(gpointer data, gint source, b_input_condition co
 gboolean jabber_connected_ssl(gpointer data, int returncode, void *source, b_input_condition cond);
 gboolean jabber_start_stream(struct im_connection *ic);
 void jabber_end_stream(struct im_connection *ic);
+xt_status jabber_start_session(struct im_connection *ic);
+
+/* caps.c */
+char *jabber_caps_hash(struct xt_node *query);
+struct jabber_caps *jabber_caps_add(struct xt_node *query);
+struct jabber_caps *jabber_caps_by_ver(const char *ver);
+struct jabber_caps *jabber_buddy_caps(struct jabber_buddy *bud);
+void jabber_buddy_set_caps(struct jabber_buddy *bud, struct jabber_caps *caps);
+gboolean jabber_caps_has_feature(struct jabber_caps *caps, const char *var);
+void jabber_caps_presence(struct im_connection *ic, struct jabber_buddy *bud, struct xt_node *c);
+
+/* compress.c */
+struct jabber_zlib *jabber_zlib_new(void);
+void jabber_zlib_free(struct jabber_zlib *z);
+gboolean jabber_zlib_deflate(struct jabber_zlib *z, const char *in, gsize len, GString *out);
+void jabber_zlib_input(struct jabber_zlib *z, const char *in, int len);
+int jabber_zlib_inflate(struct jabber_zlib *z, char *out, int len);
+int jabber_zlib_features(struct im_connection *ic, struct xt_node *features);
+xt_status jabber_zlib_pkt(struct xt_node *node, gpointer data);
 
 /* sasl.c */
 xt_status sasl_pkt_mechanisms(struct xt_node *node, gpointer data);
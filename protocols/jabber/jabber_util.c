@@ -22,8 +22,6 @@
 \***************************************************************************/
 
 #include "jabber.h"
-#include "md5.h"
-#include "base64.h"
 
 static unsigned int next_id = 1;
 
@@ -133,70 +131,82 @@ struct xt_node *jabber_make_error_packet(struct xt_node *orig, char *err_cond, c
 	return node;
 }
 
-/* Cache a node/packet for later use. Mainly useful for IQ packets if you need
-   them when you receive the response. Use this BEFORE sending the packet so
-   it'll get a new id= tag, and do NOT free() the packet after sending it! */
-void jabber_cache_add(struct im_connection *ic, struct xt_node *node, jabber_cache_event func)
+static struct jabber_cache_entry *jabber_cache_new(struct im_connection *ic, struct xt_node *node)
 {
 	struct jabber_data *jd = ic->proto_data;
 	struct jabber_cache_entry *entry = g_new0(struct jabber_cache_entry, 1);
-	md5_state_t id_hash;
-	md5_byte_t id_sum[16];
-	char *id, *asc_hash;
 
-	next_id++;
+	g_snprintf(entry->id, sizeof(entry->id), "%s%s%x", JABBER_CACHED_ID,
+	           jd->cached_id_prefix, ++jd->cached_id_next);
+	xt_add_attr(node, "id", entry->id);
 
-	id_hash = jd->cached_id_prefix;
-	md5_append(&id_hash, (md5_byte_t *) &next_id, sizeof(next_id));
-	md5_digest_keep(&id_hash, id_sum);
-	asc_hash = base64_encode(id_sum, 12);
+	/* Entries are added in chronological order, so the oldest one is
+	   always at the head of the queue. */
+	entry->saved_at = time(NULL);
+	g_queue_push_tail(jd->node_cache_order, entry);
+	entry->link = jd->node_cache_order->tail;
+	g_hash_table_insert(jd->node_cache, entry->id, entry);
 
-	id = g_strdup_printf("%s%s", JABBER_CACHED_ID, asc_hash);
-	xt_add_attr(node, "id", id);
-	g_free(id);
-	g_free(asc_hash);
+	return entry;
+}
+
+/* Cache a node/packet for later use. Mainly useful for IQ packets if you need
+   them when you receive the response. Use this BEFORE sending the packet so
+   it'll get a new id= tag, and do NOT free() the packet after sending it! */
+void jabber_cache_add(struct im_connection *ic, struct xt_node *node, jabber_cache_event func)
+{
+	struct jabber_cache_entry *entry = jabber_cache_new(ic, node);
 
 	entry->node = node;
 	entry->func = func;
-	entry->saved_at = time(NULL);
-	g_hash_table_insert(jd->node_cache, xt_find_attr(node, "id"), entry);
+}
+
+/* Like jabber_cache_add(), but only remembers data instead of the whole
+   packet, which the caller still has to free after sending it. data_free
+   (if not NULL) is called on data once the entry is gone, whether func
+   was called or not. */
+void jabber_cache_add_ctx(struct im_connection *ic, struct xt_node *node, jabber_cache_ctx_event func,
+                          gpointer data, GDestroyNotify data_free)
+{
+	struct jabber_cache_entry *entry = jabber_cache_new(ic, node);
+
+	entry->ctx_func = func;
+	entry->data = data;
+	entry->data_free = data_free;
 }
 
 void jabber_cache_entry_free(gpointer data)
 {
 	struct jabber_cache_entry *entry = data;
 
+	if (entry->data_free) {
+		entry->data_free(entry->data);
+	}
 	xt_free_node(entry->node);
 	g_free(entry);
 }
 
-gboolean jabber_cache_clean_entry(gpointer key, gpointer entry, gpointer nullpointer);
-
 /* This one should be called from time to time (from keepalive, in this case)
-   to make sure things don't stay in the node cache forever. By marking nodes
-   during the first run and deleting marked nodes during a next run, every
-   node should be available in the cache for at least a minute (assuming the
-   function is indeed called every minute). */
+   to make sure things don't stay in the node cache forever. Only the expired
+   entries (at the head of the queue) are looked at. */
 void jabber_cache_clean(struct im_connection *ic)
 {
 	struct jabber_data *jd = ic->proto_data;
+	struct jabber_cache_entry *entry;
 	time_t threshold = time(NULL) - JABBER_CACHE_MAX_AGE;
 
-	g_hash_table_foreach_remove(jd->node_cache, jabber_cache_clean_entry, &threshold);
-}
-
-gboolean jabber_cache_clean_entry(gpointer key, gpointer entry_, gpointer threshold_)
-{
-	struct jabber_cache_entry *entry = entry_;
-	time_t *threshold = threshold_;
-
-	return entry->saved_at < *threshold;
+	while ((entry = g_queue_peek_head(jd->node_cache_order)) &&
+	       entry->saved_at < threshold) {
+		g_queue_pop_head(jd->node_cache_order);
+		g_hash_table_remove(jd->node_cache, entry->id);
+	}
 }
 
 xt_status jabber_cache_handle_packet(struct im_connection *ic, struct xt_node *node)
 {
 	struct jabber_data *jd = ic->proto_data;
 	struct jabber_cache_entry *entry;
+	xt_status st = XT_HANDLED;
 	char *s;
 
 	if ((s = xt_find_attr(node, "id")) == NULL ||
@@ -218,11 +228,24 @@ xt_status jabber_cache_handle_packet(struct im_connection *ic, struct xt_node *n
 		imcb_log( ic, "Warning: Received %s-%s packet with unknown/expired ID %s!",
 		              node->name, xt_find_attr( node, "type" ) ? : "(no type)", s );
 		*/
-	} else if (entry->func) {
-		return entry->func(ic, node, entry->node);
+		return XT_HANDLED;
 	}
 
-	return XT_HANDLED;
+	/* There's only one response to every request, so the entry can go.
+	   Take it out before calling the handler, which may log out (and
+	   free the whole cache) or add new entries. */
+	g_hash_table_steal(jd->node_cache, entry->id);
+	g_queue_delete_link(jd->node_cache_order, entry->link);
+
+	if (entry->func) {
+		st = entry->func(ic, node, entry->node);
+	} else if (entry->ctx_func) {
+		st = entry->ctx_func(ic, node, entry->data);
+	}
+
+	jabber_cache_entry_free(entry);
+
+	return st;
 }
 
 const struct jabber_away_state jabber_away_state_list[] =
@@ -365,6 +388,87 @@ char *jabber_normalize_ext(const char *orig)
 	return new;
 }
 
+/* Hash table functions for tables keyed by bare JID (jd->buddies and
+   jd->chats). To look something up, the JID doesn't have to be normalized
+   first: the resource (if any) is ignored and the case is folded on the
+   fly. Only works for plain ASCII though, see jabber_jid_lookup(). */
+guint jabber_jid_hash(gconstpointer key)
+{
+	const char *s;
+	guint h = 5381;
+
+	for (s = key; *s && *s != '/'; s++) {
+		h = (h << 5) + h + g_ascii_tolower(*s);
+	}
+
+	return h;
+}
+
+gboolean jabber_jid_equal(gconstpointer a_, gconstpointer b_)
+{
+	const char *a = a_, *b = b_;
+
+	for (; *a && *a != '/'; a++, b++) {
+		if (g_ascii_tolower(*a) != g_ascii_tolower(*b)) {
+			return FALSE;
+		}
+	}
+
+	return *b == 0 || *b == '/';
+}
+
+/* Look up a bare or full JID in one of those tables. */
+gpointer jabber_jid_lookup(GHashTable *table, const char *jid)
+{
+	const char *s;
+	gpointer ret;
+	char *norm;
+
+	for (s = jid; *s && *s != '/'; s++) {
+		if (*s & 0x80) {
+			/* Leave the non-ASCII stuff to GLib. */
+			norm = jabber_normalize(jid);
+			ret = g_hash_table_lookup(table, norm);
+			g_free(norm);
+			return ret;
+		}
+	}
+
+	return g_hash_table_lookup(table, jid);
+}
+
+/* Finds one resource of a bare JID, head being the bare JID's entry in
+   jd->buddies. */
+static struct jabber_buddy *jabber_buddy_resource(struct jabber_buddy *head, const char *resource)
+{
+	struct jabber_buddy *bi;
+
+	if (head->resources) {
+		return g_hash_table_lookup(head->resources, resource);
+	}
+
+	for (bi = head->next; bi; bi = bi->next) {
+		if (strcmp(bi->resource, resource) == 0) {
+			break;
+		}
+	}
+
+	return bi;
+}
+
+static void jabber_buddy_free(struct jabber_buddy *bud)
+{
+	if (bud->resources) {
+		g_hash_table_destroy(bud->resources);
+	}
+	g_free(bud->ext_jid);
+	g_free(bud->full_jid);
+	g_free(bud->away_message);
+	g_free(bud->caps_ver);
+	jabber_buddy_set_caps(bud, NULL);
+	g_free(bud);
+}
+
 /* Adds a buddy/resource to our list. Returns NULL if full_jid is not really a
    FULL jid or if we already have this buddy/resource. XXX: No, great, actually
    buddies from transports don't (usually) have resources. So we'll really have
@@ -373,8 +477,9 @@ char *jabber_normalize_ext(const char *orig)
 struct jabber_buddy *jabber_buddy_add(struct im_connection *ic, char *full_jid_)
 {
 	struct jabber_data *jd = ic->proto_data;
-	struct jabber_buddy *bud, *new, *bi;
+	struct jabber_buddy *head, *bud, *new, *bi;
 	char *s, *full_jid;
+	int n;
 
 	full_jid = jabber_normalize(full_jid_);
 
@@ -384,19 +489,15 @@ struct jabber_buddy *jabber_buddy_add(struct im_connection *ic, char *full_jid_)
 
 	new = g_new0(struct jabber_buddy, 1);
 
-	if ((bud = g_hash_table_lookup(jd->buddies, full_jid))) {
+	if ((head = g_hash_table_lookup(jd->buddies, full_jid))) {
 		/* The first entry is always a bare JID. If there are more, we
 		   should ignore the first one here. */
-		if (bud->next) {
-			bud = bud->next;
-		}
+		bud = head->next ? head->next : head;
 
 		/* If this is a transport buddy or whatever, it can't have more
-		   than one instance, so this is always wrong: */
-		if (s == NULL || bud->resource == NULL) {
-			if (s) {
-				*s = '/';
-			}
+		   than one instance, so this is always wrong. Same for dupes. */
+		if (s == NULL || bud->resource == NULL ||
+		    jabber_buddy_resource(head, s + 1)) {
 			g_free(new);
 			g_free(full_jid);
 			return NULL;
@@ -404,20 +505,30 @@ struct jabber_buddy *jabber_buddy_add(struct im_connection *ic, char *full_jid_)
 
 		new->bare_jid = bud->bare_jid;
 
-		/* We already have another resource for this buddy, add the
-		   new one to the list. */
-		for (bi = bud; bi; bi = bi->next) {
-			/* Check for dupes. */
-			if (strcmp(bi->resource, s + 1) == 0) {
-				*s = '/';
-				g_free(new);
-				g_free(full_jid);
-				return NULL;
+		if (head->resources) {
+			/* Long list (a big groupchat, most likely). The order
+			   doesn't matter that much anymore, so don't walk it,
+			   just keep the first one first. */
+			new->next = bud->next;
+			new->prev = bud;
+			if (bud->next) {
+				bud->next->prev = new;
 			}
-			/* Append the new item to the list. */
-			else if (bi->next == NULL) {
-				bi->next = new;
-				break;
+			bud->next = new;
+		} else {
+			/* We already have another resource for this buddy,
+			   append the new one to the list. */
+			for (bi = bud, n = 1; bi->next; bi = bi->next) {
+				n++;
+			}
+			bi->next = new;
+			new->prev = bi;
+
+			if (n + 1 >= JABBER_RESOURCE_INDEX_MIN) {
+				head->resources = g_hash_table_new(g_str_hash, g_str_equal);
+				for (bi = bud; bi != new; bi = bi->next) {
+					g_hash_table_insert(head->resources, bi->resource, bi);
+				}
 			}
 		}
 	} else {
@@ -425,8 +536,10 @@ struct jabber_buddy *jabber_buddy_add(struct im_connection *ic, char *full_jid_)
 		g_hash_table_insert(jd->buddies, new->bare_jid, new);
 
 		if (s) {
+			head = new;
 			new->next = g_new0(struct jabber_buddy, 1);
 			new->next->bare_jid = new->bare_jid;
+			new->next->prev = new;
 			new = new->next;
 		}
 	}
@@ -435,6 +548,9 @@ struct jabber_buddy *jabber_buddy_add(struct im_connection *ic, char *full_jid_)
 		*s = '/';
 		new->full_jid = full_jid;
 		new->resource = strchr(new->full_jid, '/') + 1;
+		if (head->resources) {
+			g_hash_table_insert(head->resources, new->resource, new);
+		}
 	} else {
 		/* Let's waste some more bytes of RAM instead of to make
 		   memory management a total disaster here. And it saves
@@ -452,60 +568,50 @@ struct jabber_buddy *jabber_buddy_by_jid(struct im_connection *ic, char *jid_, g
 {
 	struct jabber_data *jd = ic->proto_data;
 	struct jabber_buddy *bud, *head;
-	char *s, *jid;
-
-	jid = jabber_normalize(jid_);
-
-	if ((s = strchr(jid, '/'))) {
-		int bare_exists = 0;
+	char *s;
 
-		*s = 0;
-		if ((bud = g_hash_table_lookup(jd->buddies, jid))) {
-			bare_exists = 1;
+	head = jabber_jid_lookup(jd->buddies, jid_);
 
+	if ((s = strchr(jid_, '/'))) {
+		if ((bud = head)) {
 			if (bud->next) {
 				bud = bud->next;
 			}
 
 			/* Just return the first one for this bare JID. */
 			if (flags & GET_BUDDY_FIRST) {
-				*s = '/';
-				g_free(jid);
 				return bud;
 			}
 
 			/* Is this one of those no-resource buddies? */
 			if (bud->resource == NULL) {
-				*s = '/';
-				g_free(jid);
 				return NULL;
 			}
 
 			/* See if there's an exact match. */
-			for (; bud; bud = bud->next) {
-				if (strcmp(bud->resource, s + 1) == 0) {
-					break;
-				}
-			}
+			bud = jabber_buddy_resource(head, s + 1);
 		}
 
-		if (bud == NULL && (flags & GET_BUDDY_CREAT) &&
-		    (bare_exists || bee_user_by_handle(ic->bee, ic, jid))) {
-			*s = '/';
-			bud = jabber_buddy_add(ic, jid);
+		if (bud == NULL && (flags & GET_BUDDY_CREAT)) {
+			gboolean known = head != NULL;
+
+			if (!known) {
+				*s = 0;
+				known = bee_user_by_handle(ic->bee, ic, jid_) != NULL;
+				*s = '/';
+			}
+			if (known) {
+				bud = jabber_buddy_add(ic, jid_);
+			}
 		}
 
-		g_free(jid);
 		return bud;
 	} else {
 		struct jabber_buddy *best_prio, *best_time;
 		char *set;
 
-		head = g_hash_table_lookup(jd->buddies, jid);
 		bud = (head && head->next) ? head->next : head;
 
-		g_free(jid);
-
 		if (bud == NULL) {
 			/* No match. Create it now? */
 			return ((flags & GET_BUDDY_CREAT) &&
@@ -554,6 +660,13 @@ struct jabber_buddy *jabber_buddy_by_jid(struct im_connection *ic, char *jid_, g
 	}
 }
 
+/* Does bud have ext_jid nick=bare_jid? (With nick being len bytes.) */
+static gboolean jabber_buddy_ext_jid_is(struct jabber_buddy *bud, const char *nick, int len)
+{
+	return bud->ext_jid && strncmp(bud->ext_jid, nick, len) == 0 &&
+	       bud->ext_jid[len] == '=' && strcmp(bud->ext_jid + len + 1, bud->bare_jid) == 0;
+}
+
 /* I'm keeping a separate ext_jid attribute to save a JID that makes sense
    to export to BitlBee. This is mainly for groupchats right now. It's
    a bit of a hack, but I just think having the user nickname in the hostname
@@ -563,28 +676,33 @@ struct jabber_buddy *jabber_buddy_by_jid(struct im_connection *ic, char *jid_, g
    allowed in Jabber nicks...). */
 struct jabber_buddy *jabber_buddy_by_ext_jid(struct im_connection *ic, char *jid_, get_buddy_flags_t flags)
 {
-	struct jabber_buddy *bud;
-	char *s, *jid;
-
-	jid = jabber_normalize_ext(jid_);
+	struct jabber_data *jd = ic->proto_data;
+	struct jabber_buddy *head, *bud = NULL;
+	char *s;
 
-	if ((s = strchr(jid, '=')) == NULL) {
-		g_free(jid);
+	if ((s = strchr(jid_, '=')) == NULL ||
+	    (head = jabber_jid_lookup(jd->buddies, s + 1)) == NULL) {
 		return NULL;
 	}
 
-	for (bud = jabber_buddy_by_jid(ic, s + 1, GET_BUDDY_FIRST); bud; bud = bud->next) {
-		/* Hmmm, could happen if not all people in the chat are anonymized? */
-		if (bud->ext_jid == NULL) {
-			continue;
-		}
+	/* Unless the nick had to be stripped, it's the resource. */
+	if (head->resources) {
+		*s = 0;
+		bud = g_hash_table_lookup(head->resources, jid_);
+		*s = '=';
 
-		if (strcmp(bud->ext_jid, jid) == 0) {
-			break;
+		if (bud && !jabber_buddy_ext_jid_is(bud, jid_, s - jid_)) {
+			bud = NULL;
 		}
 	}
 
-	g_free(jid);
+	if (bud == NULL) {
+		for (bud = head->next ? head->next : head; bud; bud = bud->next) {
+			if (jabber_buddy_ext_jid_is(bud, jid_, s - jid_)) {
+				break;
+			}
+		}
+	}
 
 	return bud;
 }
@@ -592,68 +710,46 @@ struct jabber_buddy *jabber_buddy_by_ext_jid(struct im_connection *ic, char *jid
 /* Remove one specific full JID from our list. Use this when a buddy goes
    off-line (because (s)he can still be online from a different location.
    XXX: See above, we should accept bare JIDs too... */
-int jabber_buddy_remove(struct im_connection *ic, char *full_jid_)
+int jabber_buddy_remove(struct im_connection *ic, char *full_jid)
 {
 	struct jabber_data *jd = ic->proto_data;
-	struct jabber_buddy *bud, *prev = NULL, *bi;
-	char *s, *full_jid;
-
-	full_jid = jabber_normalize(full_jid_);
+	struct jabber_buddy *head, *bud, *bi;
+	char *s;
 
-	if ((s = strchr(full_jid, '/'))) {
-		*s = 0;
+	if ((head = jabber_jid_lookup(jd->buddies, full_jid)) == NULL) {
+		return 0;
 	}
 
-	if ((bud = g_hash_table_lookup(jd->buddies, full_jid))) {
-		if (bud->next) {
-			bud = (prev = bud)->next;
-		}
+	s = strchr(full_jid, '/');
+	bud = head->next ? head->next : head;
 
-		/* If there's only one item in the list (and if the resource
-		   matches), removing it is simple. (And the hash reference
-		   should be removed too!) */
-		if (bud->next == NULL &&
-		    ((s == NULL && bud->resource == NULL) ||
-		     (bud->resource && s && strcmp(bud->resource, s + 1) == 0))) {
-			int st = jabber_buddy_remove_bare(ic, full_jid);
-			g_free(full_jid);
-			return st;
-		} else if (s == NULL || bud->resource == NULL) {
-			/* Tried to remove a bare JID while this JID does seem
-			   to have resources... (Or the opposite.) *sigh* */
-			g_free(full_jid);
-			return 0;
-		} else {
-			for (bi = bud; bi; bi = (prev = bi)->next) {
-				if (strcmp(bi->resource, s + 1) == 0) {
-					break;
-				}
-			}
-
-			g_free(full_jid);
+	/* If there's only one item in the list (and if the resource
+	   matches), removing it is simple. (And the hash reference
+	   should be removed too!) */
+	if (bud->next == NULL &&
+	    ((s == NULL && bud->resource == NULL) ||
+	     (bud->resource && s && strcmp(bud->resource, s + 1) == 0))) {
+		return jabber_buddy_remove_bare(ic, head->bare_jid);
+	} else if (s == NULL || bud->resource == NULL) {
+		/* Tried to remove a bare JID while this JID does seem
+		   to have resources... (Or the opposite.) *sigh* */
+		return 0;
+	} else if ((bi = jabber_buddy_resource(head, s + 1)) == NULL) {
+		return 0;
+	}
 
-			if (bi) {
-				if (prev) {
-					prev->next = bi->next;
-				} else {
-					/* Don't think this should ever happen anymore. */
-					g_hash_table_replace(jd->buddies, bi->bare_jid, bi->next);
-				}
+	/* Resources always come after the bare JID, so there's a prev. */
+	bi->prev->next = bi->next;
+	if (bi->next) {
+		bi->next->prev = bi->prev;
+	}
+	if (head->resources) {
+		g_hash_table_remove(head->resources, bi->resource);
+	}
 
-				g_free(bi->ext_jid);
-				g_free(bi->full_jid);
-				g_free(bi->away_message);
-				g_free(bi);
+	jabber_buddy_free(bi);
 
-				return 1;
-			} else {
-				return 0;
-			}
-		}
-	} else {
-		g_free(full_jid);
-		return 0;
-	}
+	return 1;
 }
 
 /* Remove a buddy completely; removes all resources that belong to the
@@ -663,16 +759,17 @@ int jabber_buddy_remove_bare(struct im_connection *ic, char *bare_jid)
 {
 	struct jabber_data *jd = ic->proto_data;
 	struct jabber_buddy *bud, *next;
+	char *bare;
 
 	if (strchr(bare_jid, '/')) {
 		return 0;
 	}
 
-	if ((bud = jabber_buddy_by_jid(ic, bare_jid, GET_BUDDY_FIRST))) {
+	if ((bud = jabber_jid_lookup(jd->buddies, bare_jid))) {
 		/* Most important: Remove the hash reference. We don't know
 		   this buddy anymore. */
-		g_hash_table_remove(jd->buddies, bud->bare_jid);
-		g_free(bud->bare_jid);
+		bare = bud->bare_jid;
+		g_hash_table_remove(jd->buddies, bare);
 
 		/* Deallocate the linked list of resources. */
 		while (bud) {
@@ -685,12 +782,13 @@ int jabber_buddy_remove_bare(struct im_connection *ic, char *bare_jid)
 			}
 
 			next = bud->next;
-			g_free(bud->ext_jid);
-			g_free(bud->full_jid);
-			g_free(bud->away_message);
-			g_free(bud);
+			if (bud->full_jid == bare) {
+				bud->full_jid = NULL;
+			}
+			jabber_buddy_free(bud);
 			bud = next;
 		}
+		g_free(bare);
 
 		return 1;
 	} else {
@@ -708,10 +806,7 @@ static gboolean jabber_buddy_remove_all_cb(gpointer key, gpointer value, gpointe
 	}
 	while (bud) {
 		next = bud->next;
-		g_free(bud->ext_jid);
-		g_free(bud->full_jid);
-		g_free(bud->away_message);
-		g_free(bud);
+		jabber_buddy_free(bud);
 		bud = next;
 	}
 
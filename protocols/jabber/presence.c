@@ -37,12 +37,8 @@ xt_status jabber_pkt_presence(struct xt_node *node, gpointer data)
 		return XT_HANDLED;
 	}
 
-	if ((s = strchr(from, '/'))) {
-		*s = 0;
-		if (jabber_chat_by_jid(ic, from)) {
-			is_chat = 1;
-		}
-		*s = '/';
+	if (strchr(from, '/') && jabber_chat_by_jid(ic, from)) {
+		is_chat = 1;
 	}
 
 	if (type == NULL) {
@@ -82,6 +78,13 @@ xt_status jabber_pkt_presence(struct xt_node *node, gpointer data)
 				bud->flags |= JBFLAG_DOES_XEP85;
 			}
 
+			/* The proper (hashed) way to do it. Usually we know
+			   this ver= already, otherwise this asks for it. */
+			jabber_caps_presence(ic, bud, cap);
+			if (jabber_caps_has_feature(jabber_buddy_caps(bud), XMLNS_CHATSTATES)) {
+				bud->flags |= JBFLAG_DOES_XEP85;
+			}
+
 			/* This field can contain more information like xhtml
 			   support, but we don't support that ourselves.
 			   Officially the ext= tag was deprecated, but enough
@@ -242,6 +245,32 @@ int presence_send_update(struct im_connection *ic)
 	return st;
 }
 
+/* Client State Indication (XEP-0352): while the user is away or idle, the
+   server can hold back (or drop) presence updates and other stuff that
+   isn't urgent. Only sends something if the state changed, unless force
+   is set (because the server may have forgotten). */
+int presence_send_csi(struct im_connection *ic, gboolean force)
+{
+	struct jabber_data *jd = ic->proto_data;
+	gboolean inactive = jd->away_state || ic->bee->idle;
+	char *s;
+
+	if (!(jd->flags & JFLAG_CSI) || (jd->flags & JFLAG_SM_RESUMING) ||
+	    (!force && inactive == !!(jd->flags & JFLAG_CSI_INACTIVE))) {
+		return 1;
+	}
+
+	if (inactive) {
+		jd->flags |= JFLAG_CSI_INACTIVE;
+		s = "<inactive xmlns=\"" XMLNS_CSI "\"/>";
+	} else {
+		jd->flags &= ~JFLAG_CSI_INACTIVE;
+		s = "<active xmlns=\"" XMLNS_CSI "\"/>";
+	}
+
+	return jabber_write(ic, s, strlen(s));
+}
+
 /* Send a subscribe/unsubscribe request to a buddy. */
 int presence_send_request(struct im_connection *ic, char *handle, char *request)
 {
@@ -0,0 +1,416 @@
+/***************************************************************************\
+*                                                                           *
+*  BitlBee - An IRC to IM gateway                                           *
+*  Jabber module - Roster versioning (XEP-0237)                             *
+*                                                                           *
+*  Copyright 2006-2012 Wilmer van der Gaast <wilmer@gaast.net>              *
+*                                                                           *
+*  This program is free software; you can redistribute it and/or modify     *
+*  it under the terms of the GNU General Public License as published by     *
+*  the Free Software Foundation; either version 2 of the License, or        *
+*  (at your option) any later version.                                      *
+*                                                                           *
+*  This program is distributed in the hope that it will be useful,          *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+*  GNU General Public License for more details.                             *
+*                                                                           *
+*  You should have received a copy of the GNU General Public License along  *
+*  with this program; if not, write to the Free Software Foundation, Inc.,  *
+*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.              *
+*                                                                           *
+\***************************************************************************/
+
+/* If the server supports roster versioning, we keep a copy of the last
+   roster we got (a plain <query xmlns="jabber:iq:roster" ver="..."/> node)
+   in a file from bee_data_path() (next to the user's .xml file, with the
+   IRC UI). On the next login we send its
+   version along with the roster request, and unless the server has changes
+   for us, it can reply with an empty result instead of the full roster.
+
+   Rosters can be huge, so the items aren't handled as part of the stanza.
+   The parser hands each one over as soon as it's complete (see
+   jabber_stream_handlers[] in io.c), and they're added to the contact
+   list in small batches, one batch per main loop iteration. */
+
+#include "jabber.h"
+
+static gboolean jabber_roster_cache_save_timeout(gpointer data, gint fd, b_input_condition cond);
+
+/* One file per JID, hashed so it's always a valid filename. The UI decides
+   where it goes, if anywhere. */
+static char *jabber_roster_cache_path(struct im_connection *ic)
+{
+	struct jabber_data *jd = ic->proto_data;
+	char *me, *hash, *name, *path;
+
+	if (!jd->me) {
+		return NULL;
+	}
+
+	me = g_ascii_strdown(jd->me, -1);
+	hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, me, -1);
+	name = g_strdup_printf("xmpp-%s.roster", hash);
+	path = bee_data_path(ic->bee, name);
+
+	g_free(me);
+	g_free(hash);
+	g_free(name);
+
+	return path;
+}
+
+/* Returns the version string to send with our roster request. */
+char *jabber_roster_cache_load(struct im_connection *ic)
+{
+	struct jabber_data *jd = ic->proto_data;
+	struct xt_node *query;
+	char *path, *s, *xml = NULL;
+	gsize len;
+
+	if (jd->roster_cache == NULL && (path = jabber_roster_cache_path(ic))) {
+		if (g_file_get_contents(path, &xml, &len, NULL) &&
+		    (query = xt_from_string(xml, len))) {
+			if (strcmp(query->name, "query") == 0 &&
+			    (s = xt_find_attr(query, "xmlns")) && strcmp(s, XMLNS_ROSTER) == 0 &&
+			    xt_find_attr(query, "ver")) {
+				jd->roster_cache = query;
+			} else {
+				xt_free_node(query);
+			}
+		}
+		g_free(xml);
+		g_free(path);
+	}
+
+	return jd->roster_cache ? xt_find_attr(jd->roster_cache, "ver") : "";
+}
+
+static void jabber_roster_cache_changed(struct im_connection *ic)
+{
+	struct jabber_data *jd = ic->proto_data;
+
+	/* Pushes tend to come in bursts, write them out in one go. */
+	if (jd->roster_cache_save == 0) {
+		jd->roster_cache_save = b_timeout_add(JABBER_ROSTER_SAVE_DELAY * 1000,
+		                                      jabber_roster_cache_save_timeout, ic);
+	}
+}
+
+/* A full roster (reply to our request). Takes over query. */
+void jabber_roster_cache_replace(struct im_connection *ic, struct xt_node *query)
+{
+	struct jabber_data *jd = ic->proto_data;
+
+	xt_free_node(jd->roster_cache);
+	jd->roster_cache = NULL;
+
+	if (!(jd->flags & JFLAG_ROSTERVER) || !xt_find_attr(query, "ver")) {
+		xt_free_node(query);
+		return;
+	}
+
+	jd->roster_cache = query;
+	jabber_roster_cache_changed(ic);
+}
+
+/* Merge the items of a roster push into the cached roster query. */
+void jabber_roster_cache_apply(struct xt_node *cache, struct xt_node *push)
+{
+	struct xt_node *c, *old;
+	char *jid, *sub, *ver;
+
+	for (c = push->children; (c = xt_find_node(c, "item")); c = c->next) {
+		if (!(jid = xt_find_attr(c, "jid"))) {
+			continue;
+		}
+
+		if ((old = xt_find_node_by_attr(cache->children, "item", "jid", jid))) {
+			xt_remove_child(cache, old);
+			xt_free_node(old);
+		}
+
+		if (!(sub = xt_find_attr(c, "subscription")) || strcmp(sub, "remove") != 0) {
+			xt_add_child(cache, xt_dup(c));
+		}
+	}
+
+	/* Every push carries the version of the roster it results in. */
+	if ((ver = xt_find_attr(push, "ver"))) {
+		xt_add_attr(cache, "ver", ver);
+	}
+}
+
+void jabber_roster_cache_update(struct im_connection *ic, struct xt_node *push)
+{
+	struct jabber_data *jd = ic->proto_data;
+
+	if (jd->roster_cache) {
+		jabber_roster_cache_apply(jd->roster_cache, push);
+		jabber_roster_cache_changed(ic);
+	}
+}
+
+static void jabber_roster_cache_save(struct im_connection *ic)
+{
+	struct jabber_data *jd = ic->proto_data;
+	char *path, *xml;
+
+	if (!jd->roster_cache || !(path = jabber_roster_cache_path(ic))) {
+		return;
+	}
+
+	xml = xt_to_string(jd->roster_cache);
+	write_file_atomic(path, xml, strlen(xml));
+
+	g_free(xml);
+	g_free(path);
+}
+
+static gboolean jabber_roster_cache_save_timeout(gpointer data, gint fd, b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct jabber_data *jd = ic->proto_data;
+
+	jd->roster_cache_save = 0;
+	jabber_roster_cache_save(ic);
+
+	return FALSE;
+}
+
+/* Called on logout, writes out any pending changes. */
+void jabber_roster_cache_free(struct im_connection *ic)
+{
+	struct jabber_data *jd = ic->proto_data;
+	struct xt_node *node;
+
+	if (jd->roster_batch) {
+		b_event_remove(jd->roster_batch);
+		jd->roster_batch = 0;
+	}
+	if (jd->roster_queue) {
+		while ((node = g_queue_pop_head(jd->roster_queue))) {
+			xt_free_node(node);
+		}
+		g_queue_free(jd->roster_queue);
+		jd->roster_queue = NULL;
+	}
+	xt_free_node(jd->roster_done);
+	jd->roster_done = NULL;
+	g_free(jd->roster_id);
+	jd->roster_id = NULL;
+
+	if (jd->roster_cache_save) {
+		b_event_remove(jd->roster_cache_save);
+		jd->roster_cache_save = 0;
+		jabber_roster_cache_save(ic);
+	}
+
+	xt_free_node(jd->roster_cache);
+	jd->roster_cache = NULL;
+}
+
+/* Roster pushes are only accepted from our own server. */
+gboolean jabber_roster_push_valid(struct im_connection *ic, struct xt_node *iq)
+{
+	struct jabber_data *jd = ic->proto_data;
+	int bare_len = strlen(jd->me);
+	char *s;
+
+	return (s = xt_find_attr(iq, "from")) == NULL ||
+	       (strncmp(s, jd->me, bare_len) == 0 &&
+	        (s[bare_len] == 0 || s[bare_len] == '/'));
+}
+
+/* Can we trust roster data in this (maybe still incomplete) <iq>? */
+static gboolean jabber_roster_stream_ok(struct im_connection *ic, struct xt_node *iq)
+{
+	struct jabber_data *jd = ic->proto_data;
+	char *type;
+
+	if (iq == NULL || strcmp(iq->name, "iq") != 0 ||
+	    !(type = xt_find_attr(iq, "type"))) {
+		return FALSE;
+	}
+
+	if (strcmp(type, "result") == 0) {
+		return jd->roster_id && g_strcmp0(xt_find_attr(iq, "id"), jd->roster_id) == 0;
+	} else if (strcmp(type, "set") == 0) {
+		return jd->me && jabber_roster_push_valid(ic, iq);
+	}
+
+	return FALSE;
+}
+
+static void jabber_roster_item(struct im_connection *ic, struct xt_node *c)
+{
+	struct jabber_data *jd = ic->proto_data;
+	struct xt_node *group = xt_find_node(c->children, "group");
+	char *jid = xt_find_attr(c, "jid");
+	char *name = xt_find_attr(c, "name");
+	char *sub = xt_find_attr(c, "subscription");
+	char *mention_name = xt_find_attr(c, "mention_name");
+
+	if (jid && sub) {
+		if ((strcmp(sub, "both") == 0 || strcmp(sub, "to") == 0)) {
+			imcb_add_buddy(ic, jid, (group && group->text_len) ?
+			               group->text : NULL);
+
+			if (name) {
+				imcb_rename_buddy(ic, jid, name);
+			}
+
+			/* This could also be used to set the full name as nick for fb/gtalk,
+			 * but i'm keeping the old (ugly?) default behavior just to be safe */
+			if (mention_name && (jd->flags & JFLAG_HIPCHAT)) {
+				imcb_buddy_nick_hint(ic, jid, mention_name);
+			}
+		} else if (strcmp(sub, "remove") == 0) {
+			jabber_buddy_remove_bare(ic, jid);
+			imcb_remove_buddy(ic, jid, NULL);
+		}
+	}
+
+	/* Keep it for the cache, if there will be one. */
+	if (jd->flags & JFLAG_ROSTERVER) {
+		if (jd->roster_done == NULL) {
+			jd->roster_done = xt_new_node("query", NULL, NULL);
+		}
+		xt_add_child(jd->roster_done, c);
+	} else {
+		xt_free_node(c);
+	}
+}
+
+/* All items of a roster reply or push were added, iq is what's left of
+   the stanza. */
+static void jabber_roster_done(struct im_connection *ic, struct xt_node *iq)
+{
+	struct jabber_data *jd = ic->proto_data;
+	struct xt_node *query = xt_find_node(iq->children, "query");
+	struct xt_node *items = jd->roster_done;
+	char *ver;
+
+	jd->roster_done = NULL;
+	if (items == NULL) {
+		items = xt_new_node("query", NULL, NULL);
+	}
+	xt_add_attr(items, "xmlns", XMLNS_ROSTER);
+
+	if (query) {
+		if ((ver = xt_find_attr(query, "ver"))) {
+			xt_add_attr(items, "ver", ver);
+		}
+	} else if (jd->roster_cache) {
+		/* These came from the cache in the first place. */
+		xt_add_attr(items, "ver", xt_find_attr(jd->roster_cache, "ver"));
+	}
+
+	if (strcmp(xt_find_attr(iq, "type"), "set") == 0) {
+		jabber_roster_cache_update(ic, items);
+		xt_free_node(items);
+		return;
+	}
+
+	if (query) {
+		jabber_roster_cache_replace(ic, items);
+	} else if (jd->roster_cache && (jd->flags & JFLAG_ROSTERVER)) {
+		/* Same contents, no need to write it out again. */
+		xt_free_node(jd->roster_cache);
+		jd->roster_cache = items;
+	} else {
+		xt_free_node(items);
+	}
+
+	imcb_connected(ic);
+}
+
+static gboolean jabber_roster_batch(gpointer data, gint fd, b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct jabber_data *jd = ic->proto_data;
+	struct xt_node *node;
+	int n;
+
+	for (n = 0; n < JABBER_ROSTER_BATCH && (node = g_queue_pop_head(jd->roster_queue)); n++) {
+		if (strcmp(node->name, "iq") == 0) {
+			jabber_roster_done(ic, node);
+			xt_free_node(node);
+		} else {
+			jabber_roster_item(ic, node);
+		}
+	}
+
+	if (g_queue_is_empty(jd->roster_queue)) {
+		jd->roster_batch = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void jabber_roster_queue(struct im_connection *ic, struct xt_node *node)
+{
+	struct jabber_data *jd = ic->proto_data;
+
+	if (jd->roster_queue == NULL) {
+		jd->roster_queue = g_queue_new();
+	}
+	g_queue_push_tail(jd->roster_queue, node);
+
+	if (jd->roster_batch == 0) {
+		jd->roster_batch = b_timeout_add(0, jabber_roster_batch, ic);
+	}
+}
+
+/* Stream handler: takes each <item> out of a roster query as soon as it's
+   parsed, so the stanza never holds more than one of them. */
+xt_status jabber_roster_stream_item(struct xt_node *node, gpointer data)
+{
+	struct im_connection *ic = data;
+	struct xt_node *query = node->parent;
+
+	if (g_strcmp0(xt_find_attr(query, "xmlns"), XMLNS_ROSTER) != 0 ||
+	    !jabber_roster_stream_ok(ic, query->parent)) {
+		return XT_NEXT;
+	}
+
+	jabber_roster_queue(ic, node);
+	return XT_HANDLED;
+}
+
+/* Stream handler: once a roster reply or push is complete, queue what's
+   left of it (without the items) to mark the end of the list. The stanza
+   itself stays, for the normal IQ handling. */
+xt_status jabber_roster_stream_iq(struct xt_node *node, gpointer data)
+{
+	struct im_connection *ic = data;
+	struct jabber_data *jd = ic->proto_data;
+	struct xt_node *query, *c;
+
+	if (!jabber_roster_stream_ok(ic, node)) {
+		return XT_NEXT;
+	}
+
+	query = xt_find_node(node->children, "query");
+	if (query && g_strcmp0(xt_find_attr(query, "xmlns"), XMLNS_ROSTER) != 0) {
+		query = NULL;
+	}
+
+	if (query == NULL) {
+		if (strcmp(xt_find_attr(node, "type"), "result") != 0 || jd->roster_cache == NULL) {
+			return XT_NEXT;
+		}
+
+		/* Empty result: Our cached copy is still up-to-date, changes
+		   (if any) will follow as roster pushes. The items go back
+		   into the cache when they're done. */
+		while ((c = jd->roster_cache->children)) {
+			xt_remove_child(jd->roster_cache, c);
+			jabber_roster_queue(ic, c);
+		}
+	}
+
+	jabber_roster_queue(ic, xt_dup(node));
+	return XT_NEXT;
+}
@@ -43,6 +43,7 @@ struct bs_transfer {
 	char *pseudoaddr;
 
 	gint connect_timeout;
+	gint dns;
 
 	char peek_buf[64];
 	int peek_buf_len;
@@ -95,6 +96,7 @@ void jabber_bs_recv_answer_request(struct bs_transfer *bt);
 gboolean jabber_bs_recv_read(gpointer data, gint fd, b_input_condition cond);
 gboolean jabber_bs_recv_write_request(file_transfer_t *ft);
 gboolean jabber_bs_recv_handshake(gpointer data, gint fd, b_input_condition cond);
+void jabber_bs_recv_resolved(gpointer data, struct addrinfo *rp);
 gboolean jabber_bs_recv_handshake_abort(struct bs_transfer *bt, char *error);
 int jabber_bs_recv_request(struct im_connection *ic, struct xt_node *node, struct xt_node *qnode);
 
@@ -118,6 +120,11 @@ void jabber_bs_free_transfer(file_transfer_t *ft)
 		bt->connect_timeout = 0;
 	}
 
+	if (bt->dns) {
+		dns_cancel(bt->dns);
+		bt->dns = 0;
+	}
+
 	if (tf->watch_in) {
 		b_event_remove(tf->watch_in);
 		tf->watch_in = 0;
@@ -275,6 +282,11 @@ void jabber_bs_remove_events(struct bs_transfer *bt)
 		b_event_remove(bt->connect_timeout);
 		bt->connect_timeout = 0;
 	}
+
+	if (bt->dns) {
+		dns_cancel(bt->dns);
+		bt->dns = 0;
+	}
 }
 
 /* Bad luck */
@@ -387,59 +399,73 @@ int jabber_bs_recv_request(struct im_connection *ic, struct xt_node *node, struc
 }
 
 /*
- * This is what a protocol handshake can look like in cooperative multitasking :)
- * Might be confusing at first because it's called from different places and is recursing.
- * (places being the event thread, bs_request, bs_handshake_abort, and itself)
- *
- * All in all, it turned out quite nice :)
+ * Called when the streamhost's address is known, connects to it.
  */
-gboolean jabber_bs_recv_handshake(gpointer data, gint fd, b_input_condition cond)
+void jabber_bs_recv_resolved(gpointer data, struct addrinfo *rp)
 {
-
 	struct bs_transfer *bt = data;
-	short revents;
-	int gret;
+	int fd;
 
-	if ((fd != -1) && !jabber_bs_poll(bt, fd, &revents)) {
-		return FALSE;
+	bt->dns = 0;
+
+	if (rp == NULL) {
+		jabber_bs_abort(bt, "can't resolve %s", bt->sh->host);
+		return;
 	}
 
-	switch (bt->phase) {
-	case BS_PHASE_CONNECT:
-	{
-		struct addrinfo hints, *rp;
+	if ((fd = socket(rp->ai_family, rp->ai_socktype, 0)) == -1) {
+		dns_freeaddrinfo(rp);
+		jabber_bs_abort(bt, "Opening socket: %s", strerror(errno));
+		return;
+	}
+	bt->tf->fd = fd;
 
-		memset(&hints, 0, sizeof(struct addrinfo));
-		hints.ai_socktype = SOCK_STREAM;
+	sock_make_nonblocking(fd);
 
-		if ((gret = getaddrinfo(bt->sh->host, bt->sh->port, &hints, &rp)) != 0) {
-			return jabber_bs_abort(bt, "getaddrinfo() failed: %s", gai_strerror(gret));
-		}
+	imcb_log(bt->tf->ic, "File %s: Connecting to streamhost %s:%s", bt->tf->ft->file_name, bt->sh->host,
+	         bt->sh->port);
 
-		ASSERTSOCKOP(bt->tf->fd = fd = socket(rp->ai_family, rp->ai_socktype, 0), "Opening socket");
+	if ((connect(fd, rp->ai_addr, rp->ai_addrlen) == -1) &&
+	    (errno != EINPROGRESS)) {
+		dns_freeaddrinfo(rp);
+		jabber_bs_abort(bt, "connect() failed: %s", strerror(errno));
+		return;
+	}
 
-		sock_make_nonblocking(fd);
+	dns_freeaddrinfo(rp);
 
-		imcb_log(bt->tf->ic, "File %s: Connecting to streamhost %s:%s", bt->tf->ft->file_name, bt->sh->host,
-		         bt->sh->port);
+	bt->phase = BS_PHASE_CONNECTED;
 
-		if ((connect(fd, rp->ai_addr, rp->ai_addrlen) == -1) &&
-		    (errno != EINPROGRESS)) {
-			return jabber_bs_abort(bt, "connect() failed: %s", strerror(errno));
-		}
+	bt->tf->watch_out = b_input_add(fd, B_EV_IO_WRITE, jabber_bs_recv_handshake, bt);
 
-		freeaddrinfo(rp);
+	/* since it takes forever(3mins?) till connect() fails on itself we schedule a timeout */
+	bt->connect_timeout = b_timeout_add(JABBER_BS_CONTIMEOUT * 1000, jabber_bs_connect_timeout, bt);
 
-		bt->phase = BS_PHASE_CONNECTED;
+	bt->tf->watch_in = 0;
+}
 
-		bt->tf->watch_out = b_input_add(fd, B_EV_IO_WRITE, jabber_bs_recv_handshake, bt);
+/*
+ * This is what a protocol handshake can look like in cooperative multitasking :)
+ * Might be confusing at first because it's called from different places and is recursing.
+ * (places being the event thread, bs_request, bs_handshake_abort, and itself)
+ *
+ * All in all, it turned out quite nice :)
+ */
+gboolean jabber_bs_recv_handshake(gpointer data, gint fd, b_input_condition cond)
+{
 
-		/* since it takes forever(3mins?) till connect() fails on itself we schedule a timeout */
-		bt->connect_timeout = b_timeout_add(JABBER_BS_CONTIMEOUT * 1000, jabber_bs_connect_timeout, bt);
+	struct bs_transfer *bt = data;
+	short revents;
 
-		bt->tf->watch_in = 0;
+	if ((fd != -1) && !jabber_bs_poll(bt, fd, &revents)) {
 		return FALSE;
 	}
+
+	switch (bt->phase) {
+	case BS_PHASE_CONNECT:
+		/* Continues in jabber_bs_recv_resolved(). */
+		bt->dns = dns_lookup(bt->sh->host, atoi(bt->sh->port), AF_UNSPEC, jabber_bs_recv_resolved, bt);
+		return FALSE;
 	case BS_PHASE_CONNECTED:
 	{
 		struct {
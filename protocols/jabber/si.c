@@ -78,23 +78,11 @@ void jabber_si_canceled(file_transfer_t *ft, char *reason)
 
 }
 
-int jabber_si_check_features(struct jabber_transfer *tf, GSList *features)
+int jabber_si_check_features(struct jabber_transfer *tf, struct jabber_caps *caps)
 {
-	int foundft = FALSE, foundbt = FALSE, foundsi = FALSE;
-
-	while (features) {
-		if (!strcmp(features->data, XMLNS_FILETRANSFER)) {
-			foundft = TRUE;
-		}
-		if (!strcmp(features->data, XMLNS_BYTESTREAMS)) {
-			foundbt = TRUE;
-		}
-		if (!strcmp(features->data, XMLNS_SI)) {
-			foundsi = TRUE;
-		}
-
-		features = g_slist_next(features);
-	}
+	int foundft = jabber_caps_has_feature(caps, XMLNS_FILETRANSFER);
+	int foundbt = jabber_caps_has_feature(caps, XMLNS_BYTESTREAMS);
+	int foundsi = jabber_caps_has_feature(caps, XMLNS_SI);
 
 	if (!foundft) {
 		imcb_file_canceled(tf->ic, tf->ft, "Buddy's client doesn't feature file transfers");
@@ -110,7 +98,7 @@ int jabber_si_check_features(struct jabber_transfer *tf, GSList *features)
 void jabber_si_transfer_start(struct jabber_transfer *tf)
 {
 
-	if (!jabber_si_check_features(tf, tf->bud->features)) {
+	if (!jabber_si_check_features(tf, jabber_buddy_caps(tf->bud))) {
 		return;
 	}
 
@@ -129,7 +117,7 @@ gboolean jabber_si_waitfor_disco(gpointer data, gint fd, b_input_condition cond)
 
 	tf->disco_timeout_fired++;
 
-	if (tf->bud->features && jd->have_streamhosts == 1) {
+	if (jabber_buddy_caps(tf->bud) && jd->have_streamhosts == 1) {
 		tf->disco_timeout = 0;
 		jabber_si_transfer_start(tf);
 		return FALSE;
@@ -140,9 +128,9 @@ gboolean jabber_si_waitfor_disco(gpointer data, gint fd, b_input_condition cond)
 		return TRUE;
 	}
 
-	if (!tf->bud->features && jd->have_streamhosts != 1) {
+	if (!jabber_buddy_caps(tf->bud) && jd->have_streamhosts != 1) {
 		imcb_log(tf->ic, "Couldn't get buddy's features nor discover all services of the server");
-	} else if (!tf->bud->features) {
+	} else if (!jabber_buddy_caps(tf->bud)) {
 		imcb_log(tf->ic, "Couldn't get buddy's features");
 	} else {
 		imcb_log(tf->ic, "Couldn't discover some of the server's services");
@@ -187,7 +175,7 @@ void jabber_si_transfer_request(struct im_connection *ic, file_transfer_t *ft, c
 
 	/* query buddy's features and server's streaming proxies if necessary */
 
-	if (!tf->bud->features) {
+	if (!jabber_buddy_caps(tf->bud)) {
 		jabber_iq_query_features(ic, bud->full_jid);
 	}
 
@@ -202,7 +190,7 @@ void jabber_si_transfer_request(struct im_connection *ic, file_transfer_t *ft, c
 
 	/* if we had to do a query, wait for the result.
 	 * Otherwise fire away. */
-	if (!tf->bud->features || jd->have_streamhosts != 1) {
+	if (!jabber_buddy_caps(tf->bud) || jd->have_streamhosts != 1) {
 		tf->disco_timeout = b_timeout_add(500, jabber_si_waitfor_disco, tf);
 	} else {
 		jabber_si_transfer_start(tf);
@@ -0,0 +1,355 @@
+/***************************************************************************\
+*                                                                           *
+*  BitlBee - An IRC to IM gateway                                           *
+*  Jabber module - Stream Management (XEP-0198)                             *
+*                                                                           *
+*  Copyright 2006-2012 Wilmer van der Gaast <wilmer@gaast.net>              *
+*                                                                           *
+*  This program is free software; you can redistribute it and/or modify     *
+*  it under the terms of the GNU General Public License as published by     *
+*  the Free Software Foundation; either version 2 of the License, or        *
+*  (at your option) any later version.                                      *
+*                                                                           *
+*  This program is distributed in the hope that it will be useful,          *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+*  GNU General Public License for more details.                             *
+*                                                                           *
+*  You should have received a copy of the GNU General Public License along  *
+*  with this program; if not, write to the Free Software Foundation, Inc.,  *
+*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.              *
+*                                                                           *
+\***************************************************************************/
+
+/* Both sides count the stanzas they receive and tell each other the count
+   every now and then (<a h="..."/>). Everything we sent that wasn't acked
+   yet is kept around, so if the TCP connection dies we can log in again,
+   ask the server to resume the old session instead of binding a new one,
+   and resend whatever may have been lost. The IM connection (and with it
+   all IRC state) stays up while that happens. */
+
+#include "jabber.h"
+#include "ssl_client.h"
+
+static gboolean jabber_sm_is_stanza(const char *name)
+{
+	return strcmp(name, "message") == 0 ||
+	       strcmp(name, "presence") == 0 ||
+	       strcmp(name, "iq") == 0;
+}
+
+/* Called after resource binding, if the server offered <sm/>. */
+int jabber_sm_enable(struct im_connection *ic)
+{
+	struct jabber_data *jd = ic->proto_data;
+	struct xt_node *node;
+	int st;
+
+	if (!(jd->flags & JFLAG_WANT_SM) || !set_getbool(&ic->acc->set, "stream_management")) {
+		return 1;
+	}
+
+	node = xt_new_node("enable", NULL, NULL);
+	xt_add_attr(node, "xmlns", XMLNS_SM);
+	xt_add_attr(node, "resume", "true");
+	st = jabber_write_packet(ic, node);
+	xt_free_node(node);
+
+	/* The server starts counting our stanzas once it gets this. */
+	jd->flags |= JFLAG_SM_ENABLED;
+	jd->sm_acked = 0;
+	if (jd->sm_unacked == NULL) {
+		jd->sm_unacked = g_queue_new();
+	}
+
+	return st;
+}
+
+/* Logs in again from scratch, when resuming takes too long or too much is
+   waiting for an ack. Always called from a timer since jabber_sm_sent()
+   can't log out from under jabber_write_packet()'s caller. */
+static gboolean jabber_sm_give_up(gpointer data, gint fd, b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct jabber_data *jd = ic->proto_data;
+
+	jd->sm_timer = 0;
+	if (jd->flags & JFLAG_SM_RESUMING) {
+		imcb_error(ic, "Could not resume session");
+	} else {
+		imcb_error(ic, "Server is not acknowledging anything");
+	}
+	imc_logout(ic, TRUE);
+
+	return FALSE;
+}
+
+static void jabber_sm_give_up_after(struct im_connection *ic, int seconds)
+{
+	struct jabber_data *jd = ic->proto_data;
+
+	if (jd->sm_timer > 0) {
+		b_event_remove(jd->sm_timer);
+	}
+	jd->sm_timer = b_timeout_add(seconds * 1000, jabber_sm_give_up, ic);
+}
+
+/* Called from jabber_write_packet() for everything that went into the
+   transmit queue at offset start. Returns FALSE if the stanza should not
+   go out right now (because we're trying to resume). */
+gboolean jabber_sm_sent(struct im_connection *ic, struct xt_node *node, gsize start)
+{
+	struct jabber_data *jd = ic->proto_data;
+	guint len;
+	char *s;
+
+	if (!(jd->flags & JFLAG_SM_ENABLED) || !jabber_sm_is_stanza(node->name)) {
+		return TRUE;
+	}
+
+	s = g_strndup(jd->txq->str + start, jd->txq->len - start);
+	g_queue_push_tail(jd->sm_unacked, s);
+	len = g_queue_get_length(jd->sm_unacked);
+
+	if (len > JABBER_SM_MAX_UNACKED) {
+		jabber_sm_give_up_after(ic, 0);
+	}
+
+	if (jd->flags & JFLAG_SM_RESUMING) {
+		/* Goes out once the session is back. */
+		g_string_truncate(jd->txq, start);
+		return FALSE;
+	}
+
+	if (len % JABBER_SM_ACK_EVERY == 0) {
+		jabber_sm_request_ack(ic);
+	}
+
+	return TRUE;
+}
+
+void jabber_sm_request_ack(struct im_connection *ic)
+{
+	struct jabber_data *jd = ic->proto_data;
+	char *r = "<r xmlns=\"" XMLNS_SM "\"/>";
+
+	if ((jd->flags & JFLAG_SM_ACTIVE) && !(jd->flags & JFLAG_SM_RESUMING) &&
+	    !g_queue_is_empty(jd->sm_unacked)) {
+		jabber_write(ic, r, strlen(r));
+	}
+}
+
+/* Handler for all incoming stanzas, just counts them. */
+xt_status jabber_sm_received(struct xt_node *node, gpointer data)
+{
+	struct im_connection *ic = data;
+	struct jabber_data *jd = ic->proto_data;
+
+	if ((jd->flags & JFLAG_SM_ACTIVE) && jabber_sm_is_stanza(node->name)) {
+		jd->sm_handled++;
+	}
+
+	return XT_NEXT;
+}
+
+/* The server got everything up to and including stanza number h. */
+static void jabber_sm_acked(struct im_connection *ic, struct xt_node *node)
+{
+	struct jabber_data *jd = ic->proto_data;
+	guint32 h;
+	char *s;
+
+	if (!(s = xt_find_attr(node, "h")) || sscanf(s, "%" G_GUINT32_FORMAT, &h) != 1) {
+		return;
+	}
+
+	/* It's a 32-bit counter that's allowed to wrap. */
+	while (jd->sm_acked != h && (s = g_queue_pop_head(jd->sm_unacked))) {
+		g_free(s);
+		jd->sm_acked++;
+	}
+	jd->sm_acked = h;
+}
+
+static void jabber_sm_free(struct jabber_data *jd)
+{
+	char *s;
+
+	if (jd->sm_unacked) {
+		while ((s = g_queue_pop_head(jd->sm_unacked))) {
+			g_free(s);
+		}
+		g_queue_free(jd->sm_unacked);
+		jd->sm_unacked = NULL;
+	}
+
+	if (jd->sm_timer > 0) {
+		b_event_remove(jd->sm_timer);
+		jd->sm_timer = 0;
+	}
+
+	g_free(jd->sm_id);
+	jd->sm_id = NULL;
+	jd->flags &= ~(JFLAG_SM_ENABLED | JFLAG_SM_ACTIVE | JFLAG_SM_RESUMING);
+}
+
+xt_status jabber_sm_pkt(struct xt_node *node, gpointer data)
+{
+	struct im_connection *ic = data;
+	struct jabber_data *jd = ic->proto_data;
+	char *s;
+
+	if (!(s = xt_find_attr(node, "xmlns")) || strcmp(s, XMLNS_SM) != 0) {
+		return XT_HANDLED;
+	}
+
+	if (strcmp(node->name, "r") == 0) {
+		char h[32];
+
+		g_snprintf(h, sizeof(h), "%" G_GUINT32_FORMAT, jd->sm_handled);
+		node = xt_new_node("a", NULL, NULL);
+		xt_add_attr(node, "xmlns", XMLNS_SM);
+		xt_add_attr(node, "h", h);
+		s = xt_to_string(node);
+		xt_free_node(node);
+
+		/* Not jabber_write_packet(), this is not a stanza and may
+		   be sent while we're resuming. */
+		jabber_write(ic, s, strlen(s));
+		g_free(s);
+	} else if (!(jd->flags & JFLAG_SM_ENABLED)) {
+		/* Nothing else makes sense if we didn't ask for it. */
+	} else if (strcmp(node->name, "a") == 0) {
+		jabber_sm_acked(ic, node);
+	} else if (strcmp(node->name, "enabled") == 0) {
+		jd->flags |= JFLAG_SM_ACTIVE;
+		jd->sm_handled = 0;
+
+		s = xt_find_attr(node, "resume");
+		if (s && (strcmp(s, "true") == 0 || strcmp(s, "1") == 0)) {
+			g_free(jd->sm_id);
+			jd->sm_id = g_strdup(xt_find_attr(node, "id"));
+		}
+
+		if (!(s = xt_find_attr(node, "max")) ||
+		    sscanf(s, "%" G_GUINT32_FORMAT, &jd->sm_max) != 1) {
+			jd->sm_max = 0;
+		}
+	} else if (strcmp(node->name, "resumed") == 0 && (jd->flags & JFLAG_SM_RESUMING)) {
+		GList *l;
+
+		jabber_sm_acked(ic, node);
+		jd->flags &= ~JFLAG_SM_RESUMING;
+		if (jd->sm_timer > 0) {
+			b_event_remove(jd->sm_timer);
+			jd->sm_timer = 0;
+		}
+
+		/* Whatever the server didn't get yet (including things we
+		   tried to send while disconnected) goes out again. */
+		for (l = jd->sm_unacked->head; l; l = l->next) {
+			jabber_write(ic, l->data, strlen(l->data));
+		}
+		jabber_sm_request_ack(ic);
+
+		/* Not sure if the server remembers this, so just repeat it. */
+		presence_send_csi(ic, TRUE);
+
+		imcb_log(ic, "Session resumed");
+	} else if (strcmp(node->name, "failed") == 0) {
+		if (jd->flags & JFLAG_SM_RESUMING) {
+			/* Too late, have to start over the usual way. */
+			imcb_error(ic, "Could not resume session");
+			imc_logout(ic, TRUE);
+			return XT_ABORT;
+		}
+
+		jabber_sm_free(jd);
+	}
+
+	return XT_HANDLED;
+}
+
+/* After authenticating on a new connection, use this instead of binding a
+   resource if we're resuming. */
+int jabber_sm_resume(struct im_connection *ic)
+{
+	struct jabber_data *jd = ic->proto_data;
+	struct xt_node *node;
+	char h[32];
+	int st;
+
+	g_snprintf(h, sizeof(h), "%" G_GUINT32_FORMAT, jd->sm_handled);
+	node = xt_new_node("resume", NULL, NULL);
+	xt_add_attr(node, "xmlns", XMLNS_SM);
+	xt_add_attr(node, "previd", jd->sm_id);
+	xt_add_attr(node, "h", h);
+	st = jabber_write_packet(ic, node);
+	xt_free_node(node);
+
+	return st;
+}
+
+/* Called when the connection to the server died. If the session can be
+   resumed, this closes the old connection and starts a new one, returning
+   TRUE. Otherwise the caller should log out. */
+gboolean jabber_sm_connection_lost(struct im_connection *ic)
+{
+	struct jabber_data *jd = ic->proto_data;
+
+	if (!(jd->flags & JFLAG_SM_ACTIVE) || jd->sm_id == NULL ||
+	    (jd->flags & JFLAG_SM_RESUMING) || !(ic->flags & OPT_LOGGED_IN) ||
+	    (ic->flags & OPT_LOGGING_OUT)) {
+		return FALSE;
+	}
+
+	if (jd->ssl) {
+		ssl_disconnect(jd->ssl);
+	}
+	if (jd->fd >= 0) {
+		closesocket(jd->fd);
+	}
+	if (jd->r_inpa >= 0) {
+		b_event_remove(jd->r_inpa);
+	}
+	if (jd->w_inpa >= 0) {
+		b_event_remove(jd->w_inpa);
+	}
+	if (jd->rw_inpa > 0) {
+		b_event_remove(jd->rw_inpa);
+	}
+	g_string_truncate(jd->txq, 0);
+	jd->txq_pos = 0;
+	g_string_truncate(jd->ztxq, 0);
+	jd->ztxq_pos = 0;
+
+	/* Compression starts from scratch on the new stream, if at all. */
+	jabber_zlib_free(jd->zlib);
+	jd->zlib = NULL;
+
+	jd->ssl = NULL;
+	jd->fd = jd->r_inpa = jd->w_inpa = -1;
+	jd->rw_inpa = 0;
+
+	/* Forget about the old stream, but not about the session. */
+	jd->flags &= ~(JFLAG_STREAM_STARTED | JFLAG_AUTHENTICATED | JFLAG_STREAM_RESTART |
+	               JFLAG_WANT_SESSION | JFLAG_WANT_BIND | JFLAG_STARTTLS_DONE |
+	               JFLAG_WANT_SM | JFLAG_CSI | JFLAG_CSI_INACTIVE |
+	               JFLAG_TX_WANTS_READ);
+	jd->flags |= JFLAG_SM_RESUMING;
+
+	/* No point in trying for longer than the server keeps the session
+	   around. After that, log in the normal way. */
+	jabber_sm_give_up_after(ic, jd->sm_max > 0 && jd->sm_max < JABBER_SM_RESUME_TIMEOUT ?
+	                        jd->sm_max : JABBER_SM_RESUME_TIMEOUT);
+
+	imcb_log(ic, "Connection lost, trying to resume the session");
+	jabber_connect(ic);
+
+	return TRUE;
+}
+
+void jabber_sm_logout(struct im_connection *ic)
+{
+	jabber_sm_free(ic->proto_data);
+}
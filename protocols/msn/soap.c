@@ -113,6 +113,9 @@ static int msn_soap_send_request(struct msn_soap_req_data *soap_req)
 
 	soap_req->http_req = http_dorequest(url.host, url.port, url.proto == PROTO_HTTPS,
 	                                    http_req, msn_soap_handle_response, soap_req);
+	if (soap_req->http_req) {
+		soap_req->http_req->flags |= HTTPC_COMPRESS;
+	}
 
 	g_free(http_req);
 	g_free(soap_action);
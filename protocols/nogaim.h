@@ -262,8 +262,11 @@ struct prpl {
 	/* If null, equivalent to handle_cmp( ic->acc->user, who ) */
 	gboolean (* handle_is_self) (struct im_connection *, const char *who);
 
+	/* Called when the user goes idle (or comes back), see bee_set_idle().
+	 * Implementing this function is optional. */
+	void (* set_idle)       (struct im_connection *, gboolean idle);
+
 	/* Some placeholders so eventually older plugins may cooperate with newer BitlBees. */
-	void *resv1;
 	void *resv2;
 	void *resv3;
 	void *resv4;
@@ -20,7 +20,6 @@
  */
 
 #define _XOPEN_SOURCE
-#include <poll.h>
 #include <stdio.h>
 #include <bitlbee.h>
 #include <ssl_client.h>
@@ -64,6 +63,12 @@ struct skype_data {
 	int bfd;
 	/* ssl_getfd() uses this to get the file desciptor. */
 	void *ssl;
+	/* What ssl_write() didn't take yet, and the event handler that sends
+	 * it once the connection is ready for more. */
+	GString *txq;
+	int w_inpa;
+	/* TLS has to read something before the rest of txq can go out. */
+	int tx_wants_read;
 	/* When we receive a new message id, we query the properties, finally
 	 * the chatname. Store the properties here so that we can use
 	 * imcb_buddy_msg() when we got the chatname. */
@@ -156,26 +161,74 @@ const struct skype_away_state skype_away_state_list[] = {
  * Functions
  */
 
+/* Sends as much of the transmit queue as the connection takes right now.
+ * Returns FALSE if the connection is broken, the read handler will notice
+ * that as well and log out. */
+static gboolean skype_write_queue(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+	int st;
+
+	sd->tx_wants_read = FALSE;
+	st = ssl_write(sd->ssl, sd->txq->str, sd->txq->len);
+	if (st > 0) {
+		g_string_erase(sd->txq, 0, st);
+	} else if (st == 0 || !ssl_sockerr_again(sd->ssl)) {
+		g_string_truncate(sd->txq, 0);
+		return FALSE;
+	} else if (ssl_getdirection(sd->ssl) == B_EV_IO_READ) {
+		/* Waiting for a writable socket won't help, the read
+		 * handler will try again. */
+		sd->tx_wants_read = TRUE;
+	}
+
+	return TRUE;
+}
+
+static gboolean skype_write_callback(gpointer data, gint fd,
+                                     b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct skype_data *sd = ic->proto_data;
+
+	if (sd->fd != -1 && skype_write_queue(ic) &&
+	    sd->txq->len > 0 && !sd->tx_wants_read) {
+		return TRUE;
+	}
+
+	sd->w_inpa = 0;
+	return FALSE;
+}
+
+/* Sets up the write handler if something is left in the queue. */
+static void skype_write_arm(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+
+	if (sd->txq->len > 0 && !sd->tx_wants_read && sd->w_inpa <= 0) {
+		sd->w_inpa = b_input_add(sd->fd, B_EV_IO_WRITE,
+		                         skype_write_callback, ic);
+	}
+}
+
 int skype_write(struct im_connection *ic, char *buf, int len)
 {
 	struct skype_data *sd = ic->proto_data;
-	struct pollfd pfd[1];
 
 	if (!sd->ssl) {
 		return FALSE;
 	}
 
-	pfd[0].fd = sd->fd;
-	pfd[0].events = POLLOUT;
+	g_string_append_len(sd->txq, buf, len);
+	if (sd->w_inpa > 0 || sd->tx_wants_read) {
+		/* Goes out after what's queued already. */
+		return TRUE;
+	}
 
-	/* This poll is necessary or we'll get a SIGPIPE when we write() to
-	 * sd->fd. */
-	poll(pfd, 1, 1000);
-	if (pfd[0].revents & POLLHUP) {
-		imc_logout(ic, TRUE);
+	if (!skype_write_queue(ic)) {
 		return FALSE;
 	}
-	ssl_write(sd->ssl, buf, len);
+	skype_write_arm(ic);
 
 	return TRUE;
 }
@@ -1198,6 +1251,26 @@ static void skype_parse_alter_group(struct im_connection *ic, char *line)
 
 typedef void (*skype_parser)(struct im_connection *ic, char *line);
 
+static gboolean skype_read_callback(gpointer data, gint fd,
+                                    b_input_condition cond);
+
+/* One-shot write handler for a read that couldn't finish without sending
+ * something first. */
+static gboolean skype_read_resume(gpointer data, gint fd,
+                                  b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct skype_data *sd = ic->proto_data;
+
+	sd->w_inpa = 0;
+	if (skype_read_callback(data, fd, cond)) {
+		/* skype_write() only queued while this was pending. */
+		skype_write_arm(ic);
+	}
+
+	return FALSE;
+}
+
 static gboolean skype_read_callback(gpointer data, gint fd,
                                     b_input_condition cond)
 {
@@ -1232,6 +1305,11 @@ static gboolean skype_read_callback(gpointer data, gint fd,
 	if (!sd || sd->fd == -1) {
 		return FALSE;
 	}
+	if (sd->tx_wants_read) {
+		if (skype_write_queue(ic)) {
+			skype_write_arm(ic);
+		}
+	}
 	/* Read the whole data. */
 	st = ssl_read(sd->ssl, buf, sizeof(buf));
 	if (st >= IRC_LINE_SIZE - 1) {
@@ -1271,6 +1349,11 @@ static gboolean skype_read_callback(gpointer data, gint fd,
 		imcb_error(ic, "Error while reading from server");
 		imc_logout(ic, TRUE);
 		return FALSE;
+	} else if (st < 0 && ssl_getdirection(sd->ssl) == B_EV_IO_WRITE &&
+	           sd->w_inpa <= 0) {
+		/* TLS has to send something before we can read on. */
+		sd->w_inpa = b_input_add(sd->fd, B_EV_IO_WRITE,
+		                         skype_read_resume, ic);
 	}
 	return TRUE;
 }
@@ -1340,6 +1423,7 @@ static void skype_login(account_t *acc)
 	                      set_getint(&acc->set, "port"), FALSE, skype_connected, ic);
 	sd->fd = sd->ssl ? ssl_getfd(sd->ssl) : -1;
 	sd->username = g_strdup(acc->user);
+	sd->txq = g_string_new("");
 
 	sd->ic = ic;
 
@@ -1364,10 +1448,14 @@ static void skype_logout(struct im_connection *ic)
 		skype_group_free(sg, FALSE);
 	}
 
+	if (sd->w_inpa > 0) {
+		b_event_remove(sd->w_inpa);
+	}
 	if (sd->ssl) {
 		ssl_disconnect(sd->ssl);
 	}
 
+	g_string_free(sd->txq, TRUE);
 	g_free(sd->username);
 	g_free(sd->handle);
 	g_free(sd);
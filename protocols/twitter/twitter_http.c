@@ -52,7 +52,7 @@ struct http_request *twitter_http(struct im_connection *ic, char *url_string, ht
 	struct twitter_data *td = ic->proto_data;
 	char *tmp;
 	GString *request = g_string_new("");
-	void *ret = NULL;
+	struct http_request *ret = NULL;
 	char *url_arguments;
 	url_t *base_url = NULL;
 
@@ -130,6 +130,10 @@ struct http_request *twitter_http(struct im_connection *ic, char *url_string, ht
 		ret = http_dorequest(td->url_host, td->url_port, td->url_ssl, request->str, func, data);
 	}
 
+	if (ret) {
+		ret->flags |= HTTPC_COMPRESS;
+	}
+
 error:
 	g_free(url_arguments);
 	g_string_free(request, TRUE);
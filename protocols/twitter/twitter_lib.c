@@ -1021,6 +1021,7 @@ gboolean twitter_open_stream(struct im_connection *ic)
 		/* This flag must be enabled or we'll get no data until EOF
 		   (which err, kind of, defeats the purpose of a streaming API). */
 		td->stream->flags |= HTTPC_STREAMING;
+		td->stream->body_max = TWITTER_STREAM_MAX_BUFFER;
 		return TRUE;
 	}
 
@@ -1076,6 +1077,7 @@ static gboolean twitter_filter_stream(struct im_connection *ic)
 		/* This flag must be enabled or we'll get no data until EOF
 		   (which err, kind of, defeats the purpose of a streaming API). */
 		td->filter_stream->flags |= HTTPC_STREAMING;
+		td->filter_stream->body_max = TWITTER_STREAM_MAX_BUFFER;
 		ret = TRUE;
 	}
 
@@ -82,6 +82,9 @@
 #define TWITTER_USER_STREAM_URL "https://userstream.twitter.com/1.1/user.json"
 #define TWITTER_FILTER_STREAM_URL "https://stream.twitter.com/1.1/statuses/filter.json"
 
+/* No single message on the streams should ever be this big. */
+#define TWITTER_STREAM_MAX_BUFFER (1024 * 1024)
+
 gboolean twitter_open_stream(struct im_connection *ic);
 gboolean twitter_open_filter_stream(struct im_connection *ic);
 gboolean twitter_get_timeline(struct im_connection *ic, gint64 next_cursor);
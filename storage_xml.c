@@ -421,6 +421,31 @@ finish:
 }
 
 
+/* Other files kept for this user, like the Jabber roster cache. They're
+   all called "nick.something", see bee_irc_data_path(). */
+static void xml_remove_data(const char *lc)
+{
+	char *prefix, *path;
+	const char *name;
+	GDir *dir;
+
+	if (!(dir = g_dir_open(global.conf->configdir, 0, NULL))) {
+		return;
+	}
+
+	prefix = g_strdup_printf("%s.", lc);
+	while ((name = g_dir_read_name(dir))) {
+		if (g_str_has_prefix(name, prefix)) {
+			path = g_strdup_printf("%s%s", global.conf->configdir, name);
+			unlink(path);
+			g_free(path);
+		}
+	}
+
+	g_free(prefix);
+	g_dir_close(dir);
+}
+
 static storage_status_t xml_remove(const char *nick, const char *password)
 {
 	char s[512], *lc;
@@ -434,12 +459,15 @@ static storage_status_t xml_remove(const char *nick, const char *password)
 	lc = g_strdup(nick);
 	nick_lc(NULL, lc);
 	g_snprintf(s, 511, "%s%s%s", global.conf->configdir, lc, ".xml");
-	g_free(lc);
 
 	if (unlink(s) == -1) {
+		g_free(lc);
 		return STORAGE_OTHER_ERROR;
 	}
 
+	xml_remove_data(lc);
+	g_free(lc);
+
 	return STORAGE_OK;
 }
 
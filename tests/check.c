@@ -78,6 +78,24 @@ Suite *jabber_sasl_suite(void);
 /* From check_jabber_sasl.c */
 Suite *jabber_util_suite(void);
 
+/* From check_jabber_sm.c */
+Suite *jabber_sm_suite(void);
+
+/* From check_xmltree.c */
+Suite *xmltree_suite(void);
+
+/* From check_ssl_cache.c */
+Suite *ssl_cache_suite(void);
+
+/* From check_ssl_nonblock.c */
+Suite *ssl_nonblock_suite(void);
+
+/* From check_dns.c */
+Suite *dns_suite(void);
+
+/* From check_http.c */
+Suite *http_suite(void);
+
 int main(int argc, char **argv)
 {
 	int nf;
@@ -126,6 +144,14 @@ int main(int argc, char **argv)
 	srunner_add_suite(sr, set_suite());
 	srunner_add_suite(sr, jabber_sasl_suite());
 	srunner_add_suite(sr, jabber_util_suite());
+	srunner_add_suite(sr, jabber_sm_suite());
+	srunner_add_suite(sr, xmltree_suite());
+	srunner_add_suite(sr, ssl_cache_suite());
+	srunner_add_suite(sr, dns_suite());
+	srunner_add_suite(sr, http_suite());
+#ifdef CHECK_SSL_NONBLOCK
+	srunner_add_suite(sr, ssl_nonblock_suite());
+#endif
 	if (no_fork) {
 		srunner_set_fork_status(sr, CK_NOFORK);
 	}
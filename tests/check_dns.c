@@ -0,0 +1,403 @@
+#include <stdlib.h>
+#include <glib.h>
+#include <gmodule.h>
+#include <check.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "bitlbee.h"
+#include "dns.h"
+#include "proxy.h"
+
+/* A nameserver stand-in on a local UDP port, answering from the table
+   below and counting how many questions it gets. Anything not in there
+   doesn't exist. */
+
+struct stub_record {
+	const char *name;
+	int type;
+	int ttl;
+	int len;
+	const char *data;
+};
+
+static const struct stub_record stub_records[] = {
+	{ "a.test", 1, 300, 4, "\xc0\x00\x02\x01" },
+	{ "a.test", 28, 300, 16, "\x20\x01\x0d\xb8\0\0\0\0\0\0\0\0\0\0\0\x01" },
+	{ "b.test", 1, 300, 4, "\xc0\x00\x02\x02" },
+	{ "b.test", 1, 300, 4, "\xc0\x00\x02\x03" },
+	{ "zero.test", 1, 0, 4, "\xc0\x00\x02\x04" },
+	{ "race.test", 1, 300, 4, "\x7f\x00\x00\x01" },
+	{ "race.test", 1, 300, 4, "\x7f\x00\x00\x02" },
+	{ "_xmpp-client._tcp.srv.test", 33, 300, 21,
+	  "\x00\x0a\x00\x05\x14\x66" "\x04xmpp\x03srv\x04test\x00" },
+	{ NULL }
+};
+
+static int stub_fd, stub_inpa, stub_questions;
+
+static gboolean stub_read(gpointer data, gint fd, b_input_condition cond)
+{
+	unsigned char buf[512];
+	struct sockaddr_storage from;
+	socklen_t fromlen = sizeof(from);
+	char name[256];
+	int len, pos = 12, n = 0, type, answers = 0;
+	const struct stub_record *r;
+
+	if ((len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromlen)) < 17) {
+		return TRUE;
+	}
+	stub_questions++;
+
+	while (buf[pos] && pos + buf[pos] < len) {
+		if (n > 0) {
+			name[n++] = '.';
+		}
+		memcpy(name + n, buf + pos + 1, buf[pos]);
+		n += buf[pos];
+		pos += buf[pos] + 1;
+	}
+	name[n] = '\0';
+	type = (buf[pos + 1] << 8) | buf[pos + 2];
+	len = pos + 5;
+
+	buf[2] = 0x81;
+	buf[3] = 0x80;
+	if (strcmp(name, "servfail.test") == 0) {
+		buf[3] |= 2;
+	}
+	if (strcmp(name, "tc.test") == 0) {
+		buf[2] |= 2;
+	}
+
+	for (r = stub_records; r->name; r++) {
+		if (strcmp(r->name, name) != 0 || r->type != type) {
+			continue;
+		}
+		buf[len++] = 0xc0;      /* Pointer to the question */
+		buf[len++] = 12;
+		buf[len++] = 0;
+		buf[len++] = r->type;
+		buf[len++] = 0;
+		buf[len++] = 1;
+		buf[len++] = 0;
+		buf[len++] = 0;
+		buf[len++] = r->ttl >> 8;
+		buf[len++] = r->ttl & 0xff;
+		buf[len++] = 0;
+		buf[len++] = r->len;
+		memcpy(buf + len, r->data, r->len);
+		len += r->len;
+		answers++;
+	}
+	buf[7] = answers;
+
+	if (answers == 0 && !g_str_has_suffix(name, ".test")) {
+		buf[3] |= 3;            /* NXDOMAIN */
+	}
+
+	sendto(fd, buf, len, 0, (struct sockaddr *) &from, fromlen);
+
+	return TRUE;
+}
+
+static void stub_start(void)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	char servers[32];
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fail_unless((stub_fd = socket(AF_INET, SOCK_DGRAM, 0)) >= 0);
+	fail_unless(bind(stub_fd, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+	fail_unless(getsockname(stub_fd, (struct sockaddr *) &sin, &len) == 0);
+	stub_inpa = b_input_add(stub_fd, B_EV_IO_READ, stub_read, NULL);
+
+	g_snprintf(servers, sizeof(servers), "127.0.0.1:%d", ntohs(sin.sin_port));
+	dns_set_servers(servers);
+	stub_questions = 0;
+}
+
+static void stub_stop(void)
+{
+	dns_set_servers(NULL);
+	b_event_remove(stub_inpa);
+	close(stub_fd);
+}
+
+struct result {
+	gboolean done;
+	struct addrinfo *res;
+	struct ns_srv_reply **srv;
+};
+
+static void got_addr(gpointer data, struct addrinfo *res)
+{
+	struct result *r = data;
+
+	r->res = res;
+	r->done = TRUE;
+}
+
+static void got_srv(gpointer data, struct ns_srv_reply **srv)
+{
+	struct result *r = data;
+
+	r->srv = srv;
+	r->done = TRUE;
+}
+
+static struct addrinfo *lookup(const char *host, int port, int family)
+{
+	struct result r = { FALSE };
+
+	dns_lookup(host, port, family, got_addr, &r);
+	fail_if(r.done);
+	while (!r.done) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+
+	return r.res;
+}
+
+static gboolean check_address(struct addrinfo *ai, const char *addr, int port)
+{
+	char buf[64];
+	void *a;
+	int p;
+
+	if (ai == NULL) {
+		return FALSE;
+	}
+
+	if (ai->ai_family == AF_INET) {
+		a = &((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+		p = ((struct sockaddr_in *) ai->ai_addr)->sin_port;
+	} else {
+		a = &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+		p = ((struct sockaddr_in6 *) ai->ai_addr)->sin6_port;
+	}
+
+	return inet_ntop(ai->ai_family, a, buf, sizeof(buf)) &&
+	       strcmp(buf, addr) == 0 && ntohs(p) == port;
+}
+
+static void check_lookup(int l)
+{
+	struct addrinfo *res;
+	struct dns_stats st;
+
+	stub_start();
+
+	res = lookup("a.test", 5222, AF_UNSPEC);
+	fail_unless(check_address(res, "2001:db8::1", 5222));
+	fail_unless(check_address(res->ai_next, "192.0.2.1", 5222));
+	fail_unless(res->ai_next->ai_next == NULL);
+	dns_freeaddrinfo(res);
+	fail_unless(stub_questions == 2);
+
+	/* From the cache this time. */
+	res = lookup("A.TEST", 443, AF_INET);
+	fail_unless(check_address(res, "192.0.2.1", 443));
+	fail_unless(res->ai_next == NULL);
+	dns_freeaddrinfo(res);
+	fail_unless(stub_questions == 2);
+
+	dns_stats(&st);
+	fail_unless(st.entries == 2);
+	fail_unless(st.hits >= 1);
+
+	/* A TTL of 0 means it can't be remembered. */
+	dns_freeaddrinfo(lookup("zero.test", 1, AF_INET));
+	res = lookup("zero.test", 1, AF_INET);
+	fail_unless(check_address(res, "192.0.2.4", 1));
+	dns_freeaddrinfo(res);
+	fail_unless(stub_questions == 4);
+
+	stub_stop();
+}
+
+static void check_negative(int l)
+{
+	stub_start();
+
+	/* Doesn't exist, which is worth remembering. */
+	fail_unless(lookup("nx.example", 80, AF_UNSPEC) == NULL);
+	fail_unless(stub_questions == 2);
+	fail_unless(lookup("nx.example", 80, AF_UNSPEC) == NULL);
+	fail_unless(stub_questions == 2);
+
+	/* Exists, but no AAAA record. */
+	fail_unless(lookup("b.test", 80, AF_INET6) == NULL);
+	fail_unless(stub_questions == 3);
+
+	/* The server is broken, that's not cached and not a negative
+	   answer. It's asked again DNS_ATTEMPTS times. */
+	fail_unless(lookup("servfail.test", 80, AF_INET) == NULL);
+	fail_unless(stub_questions == 3 + DNS_ATTEMPTS);
+	fail_unless(lookup("servfail.test", 80, AF_INET) == NULL);
+	fail_unless(stub_questions == 3 + DNS_ATTEMPTS * 2);
+
+	/* Doesn't fit in a packet, so that's for getaddrinfo(), which doesn't
+	   know either. Only asked once, the answer won't get any smaller. */
+	fail_unless(lookup("tc.test", 80, AF_INET) == NULL);
+	fail_unless(stub_questions == 4 + DNS_ATTEMPTS * 2);
+
+	stub_stop();
+}
+
+static void check_shared(int l)
+{
+	struct result r1 = { FALSE }, r2 = { FALSE }, r3 = { FALSE };
+
+	stub_start();
+
+	/* The same question only goes out once, and a cancelled lookup
+	   doesn't get in the way. */
+	dns_lookup("b.test", 1, AF_INET, got_addr, &r1);
+	dns_cancel(dns_lookup("b.test", 2, AF_INET, got_addr, &r2));
+	dns_lookup("b.test", 3, AF_INET, got_addr, &r3);
+	while (!r1.done || !r3.done) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+	fail_if(r2.done);
+	fail_unless(stub_questions == 1);
+
+	fail_unless(check_address(r1.res, "192.0.2.2", 1));
+	fail_unless(check_address(r1.res->ai_next, "192.0.2.3", 1));
+	fail_unless(check_address(r3.res, "192.0.2.2", 3));
+	dns_freeaddrinfo(r1.res);
+	dns_freeaddrinfo(r3.res);
+
+	stub_stop();
+}
+
+static void check_srv(int l)
+{
+	struct result r = { FALSE };
+
+	stub_start();
+
+	dns_lookup_srv("xmpp-client", "tcp", "srv.test", got_srv, &r);
+	while (!r.done) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+	fail_unless(r.srv && r.srv[0] && r.srv[1] == NULL);
+	fail_unless(r.srv[0]->prio == 10 && r.srv[0]->weight == 5 && r.srv[0]->port == 5222);
+	fail_unless(strcmp(r.srv[0]->name, "xmpp.srv.test") == 0);
+	srv_free(r.srv);
+
+	r.done = FALSE;
+	dns_lookup_srv("jabber-client", "tcp", "srv.test", got_srv, &r);
+	while (!r.done) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+	fail_unless(r.srv == NULL);
+	fail_unless(stub_questions == 2);
+
+	stub_stop();
+}
+
+static void check_numeric(int l)
+{
+	struct addrinfo *res;
+
+	stub_start();
+
+	res = lookup("192.0.2.9", 80, AF_UNSPEC);
+	fail_unless(check_address(res, "192.0.2.9", 80));
+	dns_freeaddrinfo(res);
+	res = lookup("2001:db8::9", 80, AF_INET6);
+	fail_unless(check_address(res, "2001:db8::9", 80));
+	dns_freeaddrinfo(res);
+	fail_unless(lookup("2001:db8::9", 80, AF_INET) == NULL);
+	fail_unless(lookup("", 80, AF_UNSPEC) == NULL);
+	fail_unless(stub_questions == 0);
+
+	stub_stop();
+}
+
+struct connected {
+	int calls;
+	int fd;
+};
+
+static gboolean got_connected(gpointer data, gint fd, b_input_condition cond)
+{
+	struct connected *c = data;
+
+	c->calls++;
+	c->fd = fd;
+
+	return FALSE;
+}
+
+static gboolean stop_waiting(gpointer data, gint fd, b_input_condition cond)
+{
+	*(gboolean *) data = TRUE;
+
+	return FALSE;
+}
+
+/* race.test has two addresses, only the second one is listening. */
+static void check_proxy_race(int l)
+{
+	struct connected c = { 0, -1 };
+	struct sockaddr_in sin, peer;
+	socklen_t len = sizeof(sin);
+	gboolean done = FALSE;
+	int lfd, fd;
+
+	stub_start();
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = inet_addr("127.0.0.2");
+	fail_unless((lfd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+	fail_unless(bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+	fail_unless(listen(lfd, 1) == 0);
+	fail_unless(getsockname(lfd, (struct sockaddr *) &sin, &len) == 0);
+
+	fd = proxy_connect("race.test", ntohs(sin.sin_port), got_connected, &c);
+	fail_unless(fd >= 0);
+	while (c.calls == 0) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+	fail_unless(c.fd == fd);
+
+	/* Long enough for any attempt still around to have called back. */
+	b_timeout_add(500, stop_waiting, &done);
+	while (!done) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+	fail_unless(c.calls == 1);
+
+	len = sizeof(peer);
+	fail_unless(getpeername(fd, (struct sockaddr *) &peer, &len) == 0);
+	fail_unless(peer.sin_addr.s_addr == sin.sin_addr.s_addr && peer.sin_port == sin.sin_port);
+
+	closesocket(fd);
+	close(lfd);
+	stub_stop();
+}
+
+Suite *dns_suite(void)
+{
+	Suite *s = suite_create("DNS");
+	TCase *tc_core = tcase_create("Core");
+
+	suite_add_tcase(s, tc_core);
+	tcase_add_test(tc_core, check_lookup);
+	tcase_add_test(tc_core, check_negative);
+	tcase_add_test(tc_core, check_shared);
+	tcase_add_test(tc_core, check_srv);
+	tcase_add_test(tc_core, check_numeric);
+	tcase_add_test(tc_core, check_proxy_race);
+	return s;
+}
@@ -0,0 +1,436 @@
+#include <stdlib.h>
+#include <glib.h>
+#include <gmodule.h>
+#include <check.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#include "bitlbee.h"
+#include "http_client.h"
+
+/* A webserver stand-in on a local TCP port. For every request it gets it
+   sends the response pieces set up by the test, each one in its own write()
+   a little while after the previous one, so that the client really gets
+   them in separate reads. */
+
+#define STUB_MAX_PIECES 16
+
+struct stub_piece {
+	const char *data;
+	int len;
+};
+
+struct stub_conn {
+	int fd;
+	int inpa;
+	int timeout;
+	int next;               /* Piece to send next */
+	GString *in;
+};
+
+static struct stub_piece stub_pieces[STUB_MAX_PIECES];
+static int stub_npieces;
+static int stub_fd, stub_inpa, stub_port;
+static int stub_accepts, stub_requests;
+static gboolean stub_close;     /* Close the connection after each response */
+static gboolean stub_drop;      /* Close it right after reading the request */
+static GSList *stub_conns;
+
+static void stub_conn_free(struct stub_conn *sc)
+{
+	if (sc->inpa > 0) {
+		b_event_remove(sc->inpa);
+	}
+	if (sc->timeout > 0) {
+		b_event_remove(sc->timeout);
+	}
+	close(sc->fd);
+	g_string_free(sc->in, TRUE);
+	stub_conns = g_slist_remove(stub_conns, sc);
+	g_free(sc);
+}
+
+static gboolean stub_conn_read(gpointer data, gint fd, b_input_condition cond);
+
+static gboolean stub_conn_send(gpointer data, gint fd, b_input_condition cond)
+{
+	struct stub_conn *sc = data;
+	struct stub_piece *p = &stub_pieces[sc->next++];
+
+	sc->timeout = 0;
+	fail_unless(write(sc->fd, p->data, p->len) == p->len);
+
+	if (sc->next < stub_npieces) {
+		sc->timeout = b_timeout_add(5, stub_conn_send, sc);
+	} else if (stub_close) {
+		stub_conn_free(sc);
+	} else {
+		sc->inpa = b_input_add(sc->fd, B_EV_IO_READ, stub_conn_read, sc);
+	}
+
+	return FALSE;
+}
+
+static gboolean stub_conn_read(gpointer data, gint fd, b_input_condition cond)
+{
+	struct stub_conn *sc = data;
+	char buf[1024];
+	int st;
+
+	if ((st = read(fd, buf, sizeof(buf))) <= 0) {
+		sc->inpa = 0;
+		stub_conn_free(sc);
+		return FALSE;
+	}
+	g_string_append_len(sc->in, buf, st);
+
+	/* None of the requests in here have a body we care about. */
+	if (!strstr(sc->in->str, "\r\n\r\n")) {
+		return TRUE;
+	}
+	stub_requests++;
+	g_string_truncate(sc->in, 0);
+
+	sc->inpa = 0;
+	if (stub_drop) {
+		stub_conn_free(sc);
+	} else {
+		sc->next = 0;
+		stub_conn_send(sc, fd, cond);
+	}
+
+	return FALSE;
+}
+
+static gboolean stub_accept(gpointer data, gint fd, b_input_condition cond)
+{
+	struct stub_conn *sc = g_new0(struct stub_conn, 1);
+
+	fail_unless((sc->fd = accept(fd, NULL, NULL)) >= 0);
+	sc->in = g_string_new("");
+	sc->inpa = b_input_add(sc->fd, B_EV_IO_READ, stub_conn_read, sc);
+	stub_conns = g_slist_prepend(stub_conns, sc);
+	stub_accepts++;
+
+	return TRUE;
+}
+
+static void stub_start(void)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fail_unless((stub_fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+	fail_unless(bind(stub_fd, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+	fail_unless(listen(stub_fd, 8) == 0);
+	fail_unless(getsockname(stub_fd, (struct sockaddr *) &sin, &len) == 0);
+	stub_port = ntohs(sin.sin_port);
+	stub_inpa = b_input_add(stub_fd, B_EV_IO_READ, stub_accept, NULL);
+
+	stub_npieces = stub_accepts = stub_requests = 0;
+	stub_close = stub_drop = FALSE;
+}
+
+static void stub_stop(void)
+{
+	while (stub_conns) {
+		stub_conn_free(stub_conns->data);
+	}
+	b_event_remove(stub_inpa);
+	close(stub_fd);
+}
+
+static void stub_piece(const char *data, int len)
+{
+	fail_unless(stub_npieces < STUB_MAX_PIECES);
+	stub_pieces[stub_npieces].data = data;
+	stub_pieces[stub_npieces].len = len < 0 ? strlen(data) : len;
+	stub_npieces++;
+}
+
+struct result {
+	gboolean done;
+	int status_code;
+	GString *body;
+};
+
+static void got_reply(struct http_request *req)
+{
+	struct result *r = req->data;
+
+	r->status_code = req->status_code;
+	r->body = g_string_new_len(req->reply_body, req->body_size);
+	r->done = TRUE;
+}
+
+static struct http_request *request(const char *method, struct result *r)
+{
+	struct http_request *req;
+	char *s;
+
+	memset(r, 0, sizeof(*r));
+	s = g_strdup_printf("%s / HTTP/1.1\r\nHost: test\r\n\r\n", method);
+	req = http_dorequest("127.0.0.1", stub_port, 0, s, got_reply, r);
+	g_free(s);
+	fail_unless(req != NULL);
+
+	return req;
+}
+
+static void wait_for(struct result *r)
+{
+	while (!r->done) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+}
+
+/* Run the event loop for a bit, for things that don't have a callback. */
+static void settle(void)
+{
+	int i;
+
+	for (i = 0; i < 20; i++) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+}
+
+static void check_chunked(int l)
+{
+	struct result r;
+
+	stub_start();
+
+	/* Chunk sizes, CRLFs and data split up in all the wrong places,
+	   and a trailer at the end. */
+	stub_piece("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r", -1);
+	stub_piece("\n\r\n", -1);
+	stub_piece("5\r\nhel", -1);
+	stub_piece("lo\r", -1);
+	stub_piece("\n1", -1);
+	stub_piece("0;ext=1\r\n, chunked world!", -1);
+	stub_piece("\r\n0\r\nX-Trailer: 1\r", -1);
+	stub_piece("\n\r\n", -1);
+
+	request("GET", &r);
+	wait_for(&r);
+	fail_unless(r.status_code == 200);
+	fail_unless(strcmp(r.body->str, "hello, chunked world!") == 0);
+	g_string_free(r.body, TRUE);
+
+	stub_stop();
+}
+
+static void check_empty(int l)
+{
+	struct result r;
+
+	stub_start();
+
+	stub_piece("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", -1);
+
+	request("GET", &r);
+	wait_for(&r);
+	fail_unless(r.status_code == 200);
+	fail_unless(r.body->len == 0);
+	g_string_free(r.body, TRUE);
+
+	/* And the connection can be used again right away. */
+	request("GET", &r);
+	wait_for(&r);
+	fail_unless(r.status_code == 200);
+	g_string_free(r.body, TRUE);
+	fail_unless(stub_accepts == 1);
+	fail_unless(stub_requests == 2);
+
+	stub_stop();
+}
+
+static void check_body_max(int l)
+{
+	struct http_request *req;
+	struct result r;
+
+	stub_start();
+
+	stub_piece("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n", -1);
+	stub_piece("8\r\n12345678\r\n", -1);
+	stub_piece("8\r\n12345678\r\n", -1);
+	stub_piece("0\r\n\r\n", -1);
+
+	req = request("GET", &r);
+	req->body_max = 12;
+	wait_for(&r);
+	fail_unless(r.status_code == -1);
+	g_string_free(r.body, TRUE);
+
+	/* That connection was given up on, so this needs a new one. */
+	req = request("GET", &r);
+	req->body_max = 16;
+	wait_for(&r);
+	fail_unless(r.status_code == 200);
+	fail_unless(strcmp(r.body->str, "1234567812345678") == 0);
+	g_string_free(r.body, TRUE);
+	fail_unless(stub_accepts == 2);
+
+	stub_stop();
+}
+
+static void check_gzip(int l)
+{
+#ifdef WITH_ZLIB
+	static const char text[] = "Compressed, and split up over a bunch of reads. "
+	                           "Compressed, and split up over a bunch of reads.";
+	static char gz[256], headers[128];
+	struct http_request *req;
+	struct result r;
+	z_stream z;
+	int len, i;
+
+	memset(&z, 0, sizeof(z));
+	fail_unless(deflateInit2(&z, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+	z.next_in = (Bytef *) text;
+	z.avail_in = sizeof(text) - 1;
+	z.next_out = (Bytef *) gz;
+	z.avail_out = sizeof(gz);
+	fail_unless(deflate(&z, Z_FINISH) == Z_STREAM_END);
+	len = sizeof(gz) - z.avail_out;
+	deflateEnd(&z);
+
+	stub_start();
+
+	g_snprintf(headers, sizeof(headers), "HTTP/1.1 200 OK\r\n"
+	           "Content-Encoding: gzip\r\nContent-Length: %d\r\n\r\n", len);
+	stub_piece(headers, -1);
+	for (i = 0; i < len; i += 7) {
+		stub_piece(gz + i, MIN(7, len - i));
+	}
+
+	req = request("GET", &r);
+	req->flags |= HTTPC_COMPRESS;
+	wait_for(&r);
+	fail_unless(r.status_code == 200);
+	fail_unless(strcmp(r.body->str, text) == 0);
+	g_string_free(r.body, TRUE);
+
+	/* No body at all, gzip or not. */
+	stub_npieces = 0;
+	stub_piece("HTTP/1.1 204 No Content\r\nContent-Encoding: gzip\r\n\r\n", -1);
+	req = request("GET", &r);
+	req->flags |= HTTPC_COMPRESS;
+	wait_for(&r);
+	fail_unless(r.status_code == 204);
+	g_string_free(r.body, TRUE);
+
+	stub_stop();
+#endif
+}
+
+static void check_pool(int l)
+{
+	struct result r1, r2;
+
+	stub_start();
+
+	stub_piece("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok", -1);
+
+	/* Two at once need two connections, after that they're reused. */
+	request("GET", &r1);
+	request("GET", &r2);
+	wait_for(&r1);
+	wait_for(&r2);
+	g_string_free(r1.body, TRUE);
+	g_string_free(r2.body, TRUE);
+	fail_unless(stub_accepts == 2);
+
+	request("GET", &r1);
+	wait_for(&r1);
+	fail_unless(strcmp(r1.body->str, "ok") == 0);
+	g_string_free(r1.body, TRUE);
+	fail_unless(stub_accepts == 2);
+	fail_unless(stub_requests == 3);
+
+	/* The server closing idle connections makes them go away. */
+	while (stub_conns) {
+		stub_conn_free(stub_conns->data);
+	}
+	settle();
+	request("GET", &r1);
+	wait_for(&r1);
+	fail_unless(r1.status_code == 200);
+	g_string_free(r1.body, TRUE);
+	fail_unless(stub_accepts == 3);
+
+	/* Connection: close means it can't go back in the pool. */
+	stub_npieces = 0;
+	stub_piece("HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 2\r\n\r\nok", -1);
+	stub_close = TRUE;
+	request("GET", &r1);
+	wait_for(&r1);
+	g_string_free(r1.body, TRUE);
+	request("GET", &r1);
+	wait_for(&r1);
+	g_string_free(r1.body, TRUE);
+	fail_unless(stub_accepts == 4);
+
+	stub_stop();
+}
+
+static void check_retry(int l)
+{
+	struct result r;
+
+	stub_start();
+
+	stub_piece("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok", -1);
+	request("GET", &r);
+	wait_for(&r);
+	g_string_free(r.body, TRUE);
+
+	/* The pooled connection dies without an answer. A GET can be sent
+	   again on a new one, */
+	stub_drop = TRUE;
+	request("GET", &r);
+	while (stub_requests < 2) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+	stub_drop = FALSE;
+	wait_for(&r);
+	fail_unless(r.status_code == 200);
+	g_string_free(r.body, TRUE);
+	fail_unless(stub_requests == 3);
+
+	/* but a POST may have done something already. */
+	stub_drop = TRUE;
+	request("POST", &r);
+	wait_for(&r);
+	fail_unless(r.status_code != 200);
+	g_string_free(r.body, TRUE);
+	fail_unless(stub_requests == 4);
+
+	stub_stop();
+}
+
+Suite *http_suite(void)
+{
+	Suite *s = suite_create("HTTP");
+	TCase *tc_core = tcase_create("Core");
+
+	suite_add_tcase(s, tc_core);
+	tcase_add_test(tc_core, check_chunked);
+	tcase_add_test(tc_core, check_empty);
+	tcase_add_test(tc_core, check_body_max);
+	tcase_add_test(tc_core, check_gzip);
+	tcase_add_test(tc_core, check_pool);
+	tcase_add_test(tc_core, check_retry);
+	return s;
+}
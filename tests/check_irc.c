@@ -53,6 +53,114 @@ fail_unless(strstr(raw, "005") != NULL);
 g_free(raw);
 END_TEST
 
+START_TEST(test_channel_add_users)
+GIOChannel * ch1, *ch2;
+irc_t *irc;
+irc_channel_t *ic;
+irc_user_t *a, *b, *c;
+GSList *users = NULL;
+char *raw, *s;
+fail_unless(g_io_channel_pair(&ch1, &ch2));
+
+g_io_channel_set_flags(ch1, G_IO_FLAG_NONBLOCK, NULL);
+g_io_channel_set_flags(ch2, G_IO_FLAG_NONBLOCK, NULL);
+
+irc = irc_new(g_io_channel_unix_get_fd(ch1));
+
+fail_unless(g_io_channel_write_chars(ch2, "NICK bla\r\n"
+                                     "USER a a a a\r\n", -1, NULL, NULL) == G_IO_STATUS_NORMAL);
+fail_unless(g_io_channel_flush(ch2, NULL) == G_IO_STATUS_NORMAL);
+
+g_main_iteration(FALSE);
+
+ic = irc_channel_new(irc, "#test");
+b = irc_user_new(irc, "bob");
+a = irc_user_new(irc, "alice");
+
+/* Duplicates and users already in the channel are skipped. */
+users = g_slist_append(users, b);
+users = g_slist_append(users, irc->user);
+users = g_slist_append(users, a);
+users = g_slist_append(users, b);
+fail_unless(irc_channel_add_users(ic, users) == 3);
+fail_unless(irc_channel_add_users(ic, users) == 0);
+g_slist_free(users);
+
+fail_unless(g_slist_length(ic->users) == 4);
+fail_unless(((irc_channel_user_t *) ic->users->data)->iu == a);
+fail_unless(((irc_channel_user_t *) ic->users->next->data)->iu == b);
+fail_unless(ic->flags & IRC_CHANNEL_JOINED);
+
+/* A rename leaves the user list out of order, that shouldn't let anyone
+   in twice. */
+fail_unless(irc_user_set_nick(a, "zed"));
+c = irc_user_new(irc, "carol");
+users = g_slist_append(NULL, a);
+users = g_slist_append(users, c);
+fail_unless(irc_channel_add_users(ic, users) == 1);
+fail_unless(irc_channel_add_users(ic, users) == 0);
+g_slist_free(users);
+fail_unless(g_slist_length(ic->users) == 5);
+
+irc_free(irc);
+
+fail_unless(g_io_channel_read_to_end(ch2, &raw, NULL, NULL) == G_IO_STATUS_NORMAL);
+
+/* Only our own JOIN, everybody else is in the NAMES reply. */
+fail_unless((s = strstr(raw, "JOIN :#test")) != NULL);
+fail_if(strstr(s + 1, "JOIN :#test"));
+fail_unless((s = strstr(raw, "353 bla = #test :")) != NULL);
+fail_unless(strstr(s, "alice") && strstr(s, "bob"));
+
+g_free(raw);
+END_TEST
+
+START_TEST(test_idle)
+GIOChannel * ch1, *ch2;
+irc_t *irc;
+fail_unless(g_io_channel_pair(&ch1, &ch2));
+
+g_io_channel_set_flags(ch1, G_IO_FLAG_NONBLOCK, NULL);
+g_io_channel_set_flags(ch2, G_IO_FLAG_NONBLOCK, NULL);
+
+irc = irc_new(g_io_channel_unix_get_fd(ch1));
+
+fail_unless(g_io_channel_write_chars(ch2, "NICK bla\r\n"
+                                     "USER a a a a\r\n", -1, NULL, NULL) == G_IO_STATUS_NORMAL);
+fail_unless(g_io_channel_flush(ch2, NULL) == G_IO_STATUS_NORMAL);
+g_main_iteration(FALSE);
+fail_unless(irc->idle_source_id > 0);
+fail_if(irc->b->idle);
+
+/* The timer goes off by itself, without any pings. */
+fail_unless(set_setstr(&irc->b->set, "idle_timeout", "1"));
+irc->last_input -= 1;
+while (!irc->b->idle) {
+	g_main_iteration(TRUE);
+}
+fail_unless(irc->idle_source_id == 0);
+
+/* Clients poll with these all the time, that's not the user. */
+irc->last_input = 0;
+fail_unless(g_io_channel_write_chars(ch2, "PING :x\r\n"
+                                     "WHO #bitlbee\r\n"
+                                     "ISON bla root\r\n", -1, NULL, NULL) == G_IO_STATUS_NORMAL);
+fail_unless(g_io_channel_flush(ch2, NULL) == G_IO_STATUS_NORMAL);
+g_main_iteration(FALSE);
+fail_unless(irc->last_input == 0);
+fail_unless(irc->b->idle);
+fail_unless(irc->idle_source_id == 0);
+
+fail_unless(g_io_channel_write_chars(ch2, "PRIVMSG root :help\r\n", -1, NULL, NULL) == G_IO_STATUS_NORMAL);
+fail_unless(g_io_channel_flush(ch2, NULL) == G_IO_STATUS_NORMAL);
+g_main_iteration(FALSE);
+fail_unless(irc->last_input > 0);
+fail_if(irc->b->idle);
+fail_unless(irc->idle_source_id > 0);
+
+irc_free(irc);
+END_TEST
+
 Suite *irc_suite(void)
 {
 	Suite *s = suite_create("IRC");
@@ -61,5 +169,7 @@ Suite *irc_suite(void)
 	suite_add_tcase(s, tc_core);
 	tcase_add_test(tc_core, test_connect);
 	tcase_add_test(tc_core, test_login);
+	tcase_add_test(tc_core, test_channel_add_users);
+	tcase_add_test(tc_core, test_idle);
 	return s;
 }
@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <glib.h>
+#include <gmodule.h>
+#include <check.h>
+#include <string.h>
+#include <stdio.h>
+#include "jabber/jabber.h"
+
+static struct im_connection *ic;
+static struct jabber_data *jd;
+
+static const struct bee_ui_funcs check_sm_ui;
+
+static void check_sm_pkt(const char *xml)
+{
+	struct xt_node *node = xt_from_string(xml, 0);
+
+	if (strcmp(node->name, "message") == 0) {
+		jabber_sm_received(node, ic);
+	} else {
+		jabber_sm_pkt(node, ic);
+	}
+	xt_free_node(node);
+}
+
+static void check_sm_send(const char *body)
+{
+	struct xt_node *node;
+
+	node = jabber_make_packet("message", "chat", "a@example.com", xt_new_node("body", body, NULL));
+	jabber_write_packet(ic, node);
+	xt_free_node(node);
+}
+
+/* Starts a fresh session with the server, with nothing in the queue. */
+static void check_sm_start(void)
+{
+	jabber_sm_logout(ic);
+	jd->flags = JFLAG_WANT_SM;
+	jd->sm_handled = 0;
+	g_string_truncate(jd->txq, 0);
+
+	jabber_sm_enable(ic);
+	fail_unless(strcmp(jd->txq->str, "<enable xmlns=\"" XMLNS_SM "\" resume=\"true\"/>") == 0,
+	            "Got: %s", jd->txq->str);
+	check_sm_pkt("<enabled xmlns=\"" XMLNS_SM "\" id=\"abc\" resume=\"true\" max=\"60\"/>");
+	fail_unless(jd->flags & JFLAG_SM_ACTIVE);
+	fail_unless(g_strcmp0(jd->sm_id, "abc") == 0);
+	fail_unless(jd->sm_max == 60);
+
+	g_string_truncate(jd->txq, 0);
+}
+
+static void check_ack(int l)
+{
+	int i;
+
+	check_sm_start();
+
+	check_sm_send("1");
+	check_sm_send("2");
+	check_sm_send("3");
+	fail_unless(g_queue_get_length(jd->sm_unacked) == 3);
+
+	check_sm_pkt("<a xmlns=\"" XMLNS_SM "\" h=\"2\"/>");
+	fail_unless(jd->sm_acked == 2);
+	fail_unless(g_queue_get_length(jd->sm_unacked) == 1);
+	fail_unless(strstr(g_queue_peek_head(jd->sm_unacked), "<body>3</body>") != NULL);
+
+	/* Every JABBER_SM_ACK_EVERY stanzas, we ask for an ack. */
+	for (i = 1; i < JABBER_SM_ACK_EVERY; i++) {
+		fail_if(strstr(jd->txq->str, "<r xmlns"));
+		check_sm_send("x");
+	}
+	fail_unless(g_str_has_suffix(jd->txq->str, "<r xmlns=\"" XMLNS_SM "\"/>"), "Got: %s", jd->txq->str);
+
+	/* And the other way around, only stanzas count. */
+	g_string_truncate(jd->txq, 0);
+	check_sm_pkt("<message from=\"b@example.com\"><body>hi</body></message>");
+	check_sm_pkt("<message from=\"b@example.com\"><body>hi</body></message>");
+	check_sm_pkt("<a xmlns=\"" XMLNS_SM "\" h=\"3\"/>");
+	check_sm_pkt("<r xmlns=\"" XMLNS_SM "\"/>");
+	fail_unless(strcmp(jd->txq->str, "<a xmlns=\"" XMLNS_SM "\" h=\"2\"/>") == 0, "Got: %s", jd->txq->str);
+}
+
+static void check_resume(int l)
+{
+	char *s;
+
+	check_sm_start();
+
+	check_sm_send("1");
+	check_sm_send("2");
+	check_sm_send("3");
+	check_sm_send("4");
+	check_sm_pkt("<a xmlns=\"" XMLNS_SM "\" h=\"1\"/>");
+	check_sm_pkt("<message from=\"b@example.com\"><body>hi</body></message>");
+
+	/* What jabber_sm_connection_lost() does, minus the reconnecting. */
+	jd->flags |= JFLAG_SM_RESUMING;
+	g_string_truncate(jd->txq, 0);
+
+	/* Kept, but not sent yet. */
+	check_sm_send("5");
+	fail_unless(jd->txq->len == 0);
+	fail_unless(g_queue_get_length(jd->sm_unacked) == 4);
+
+	jabber_sm_resume(ic);
+	fail_unless(strcmp(jd->txq->str, "<resume xmlns=\"" XMLNS_SM "\" previd=\"abc\" h=\"1\"/>") == 0,
+	            "Got: %s", jd->txq->str);
+	g_string_truncate(jd->txq, 0);
+
+	/* The server got one more than we knew about, the rest goes out
+	   again in the original order. */
+	check_sm_pkt("<resumed xmlns=\"" XMLNS_SM "\" previd=\"abc\" h=\"2\"/>");
+	fail_if(jd->flags & JFLAG_SM_RESUMING);
+	fail_unless(jd->sm_acked == 2);
+	fail_unless(g_queue_get_length(jd->sm_unacked) == 3);
+
+	s = jd->txq->str;
+	fail_if(strstr(s, "<body>2</body>"));
+	fail_unless((s = strstr(s, "<body>3</body>")) != NULL, "Got: %s", jd->txq->str);
+	fail_unless((s = strstr(s, "<body>4</body>")) != NULL, "Got: %s", jd->txq->str);
+	fail_unless((s = strstr(s, "<body>5</body>")) != NULL, "Got: %s", jd->txq->str);
+	fail_unless(strstr(s, "<r xmlns") != NULL, "Got: %s", jd->txq->str);
+}
+
+/* Both counters are 32 bits and wrap around. */
+static void check_wrap(int l)
+{
+	check_sm_start();
+
+	jd->sm_acked = G_MAXUINT32 - 1;
+	check_sm_send("1");
+	check_sm_send("2");
+	check_sm_send("3");
+	check_sm_send("4");
+	check_sm_pkt("<a xmlns=\"" XMLNS_SM "\" h=\"1\"/>");
+	fail_unless(jd->sm_acked == 1);
+	fail_unless(g_queue_get_length(jd->sm_unacked) == 1);
+	fail_unless(strstr(g_queue_peek_head(jd->sm_unacked), "<body>4</body>") != NULL);
+
+	jd->sm_handled = G_MAXUINT32;
+	check_sm_pkt("<message from=\"b@example.com\"><body>hi</body></message>");
+	g_string_truncate(jd->txq, 0);
+	check_sm_pkt("<r xmlns=\"" XMLNS_SM "\"/>");
+	fail_unless(strcmp(jd->txq->str, "<a xmlns=\"" XMLNS_SM "\" h=\"0\"/>") == 0, "Got: %s", jd->txq->str);
+}
+
+/* Too much waiting for an ack means logging in again. */
+static void check_unacked_max(int l)
+{
+	int i;
+
+	check_sm_start();
+
+	for (i = 0; i < JABBER_SM_MAX_UNACKED; i++) {
+		check_sm_send("x");
+	}
+	fail_unless(jd->sm_timer == 0);
+	check_sm_send("x");
+	fail_unless(jd->sm_timer > 0);
+
+	/* Same while resuming, where nothing can be acked at all. */
+	check_sm_start();
+	jd->flags |= JFLAG_SM_RESUMING;
+	for (i = 0; i <= JABBER_SM_MAX_UNACKED; i++) {
+		check_sm_send("x");
+	}
+	fail_unless(jd->sm_timer > 0);
+	fail_unless(jd->txq->len == 0);
+
+	jabber_sm_logout(ic);
+	fail_unless(jd->sm_timer == 0);
+	fail_if(jd->sm_unacked);
+}
+
+Suite *jabber_sm_suite(void)
+{
+	Suite *s = suite_create("jabber/sm");
+	TCase *tc_core = tcase_create("Core");
+
+	ic = g_new0(struct im_connection, 1);
+	ic->acc = g_new0(account_t, 1);
+	ic->bee = bee_new();
+	ic->bee->ui = &check_sm_ui;
+	ic->proto_data = jd = g_new0(struct jabber_data, 1);
+	jd->fd = -1;
+	jd->txq = g_string_new("");
+	set_add(&ic->acc->set, "stream_management", "true", set_eval_bool, ic->acc);
+
+	suite_add_tcase(s, tc_core);
+	tcase_add_test(tc_core, check_ack);
+	tcase_add_test(tc_core, check_resume);
+	tcase_add_test(tc_core, check_wrap);
+	tcase_add_test(tc_core, check_unacked_max);
+	return s;
+}
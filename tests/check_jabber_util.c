@@ -4,6 +4,7 @@
 #include <check.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 #include "jabber/jabber.h"
 
 static struct im_connection *ic;
@@ -94,6 +95,48 @@ static void check_buddy_add(int l)
 	fail_unless(jabber_buddy_remove(ic, "bugtest@google.com/C"));
 }
 
+/* Lots of resources (groupchat participants) get a hash table. */
+static void check_buddy_many(int l)
+{
+	struct jabber_buddy *bud[40], *bi;
+	char jid[64];
+	int i, n;
+
+	for (i = 0; i < 40; i++) {
+		g_snprintf(jid, sizeof(jid), "Room@conference.example.com/Nick%d", i);
+		fail_unless((bud[i] = jabber_buddy_add(ic, jid)) != NULL);
+		bud[i]->ext_jid = g_strdup_printf("nick%d=room@conference.example.com", i);
+	}
+	fail_if(jabber_buddy_add(ic, "room@CONFERENCE.example.com/Nick23"));
+
+	for (i = 0; i < 40; i++) {
+		g_snprintf(jid, sizeof(jid), "ROOM@conference.example.com/Nick%d", i);
+		fail_unless(jabber_buddy_by_jid(ic, jid, 0) == bud[i]);
+		g_snprintf(jid, sizeof(jid), "nick%d=room@conference.EXAMPLE.com", i);
+		fail_unless(jabber_buddy_by_ext_jid(ic, jid, 0) == bud[i]);
+	}
+	fail_if(jabber_buddy_by_jid(ic, "room@conference.example.com/nick1", 0));
+	strcpy(jid, "nick40=room@conference.example.com");
+	fail_if(jabber_buddy_by_ext_jid(ic, jid, 0));
+	fail_unless(jabber_buddy_by_jid(ic, "room@conference.example.com", GET_BUDDY_FIRST) == bud[0]);
+
+	fail_unless(jabber_buddy_remove(ic, "room@conference.example.com/Nick0"));
+	fail_unless(jabber_buddy_remove(ic, "room@conference.example.com/Nick39"));
+	fail_unless(jabber_buddy_remove(ic, "room@conference.example.com/Nick20"));
+	fail_if(jabber_buddy_remove(ic, "room@conference.example.com/Nick20"));
+	fail_if(jabber_buddy_by_jid(ic, "room@conference.example.com/Nick20", 0));
+
+	/* The list itself has to be intact too. */
+	bi = jabber_buddy_by_jid(ic, "room@conference.example.com", GET_BUDDY_FIRST);
+	for (n = 0; bi; bi = bi->next, n++) {
+		fail_unless(bi->prev->next == bi);
+	}
+	fail_unless(n == 37);
+
+	fail_unless(jabber_buddy_remove_bare(ic, "room@conference.example.com"));
+	fail_if(jabber_buddy_by_jid(ic, "room@conference.example.com/Nick1", 0));
+}
+
 static void check_compareJID(int l)
 {
 	fail_unless(jabber_compare_jid("bugtest@google.com/B", "bugtest@google.com/A"));
@@ -123,6 +166,287 @@ static void check_hipchat_slug(int l)
 	}
 }
 
+static void check_roster_cache_apply(int l)
+{
+	struct xt_node *cache, *push;
+	char *s;
+
+	cache = xt_from_string("<query xmlns=\"jabber:iq:roster\" ver=\"1\">"
+	                       "<item jid=\"a@x\" subscription=\"both\"/>"
+	                       "<item jid=\"b@x\" subscription=\"both\"/>"
+	                       "<item jid=\"c@x\" subscription=\"to\"/></query>", 0);
+	push = xt_from_string("<query xmlns=\"jabber:iq:roster\" ver=\"2\">"
+	                      "<item jid=\"a@x\" subscription=\"remove\"/>"
+	                      "<item jid=\"c@x\" subscription=\"both\" name=\"C\"/>"
+	                      "<item jid=\"d@x\" subscription=\"both\"/></query>", 0);
+
+	jabber_roster_cache_apply(cache, push);
+	s = xt_to_string(cache);
+	fail_unless(strcmp(s, "<query xmlns=\"jabber:iq:roster\" ver=\"2\">"
+	                      "<item jid=\"b@x\" subscription=\"both\"/>"
+	                      "<item jid=\"c@x\" subscription=\"both\" name=\"C\"/>"
+	                      "<item jid=\"d@x\" subscription=\"both\"/></query>") == 0, "Got: %s", s);
+	fail_unless(cache->children_count == 3);
+	fail_unless(strcmp(xt_find_attr(cache->children_tail, "jid"), "d@x") == 0);
+
+	g_free(s);
+	xt_free_node(push);
+	xt_free_node(cache);
+}
+
+/* The examples from XEP-0115, section 5. */
+static void check_caps_hash(int l)
+{
+	struct xt_node *query;
+	char *ver;
+
+	query = xt_from_string("<query xmlns=\"http://jabber.org/protocol/disco#info\">"
+	                       "<identity category=\"client\" name=\"Exodus 0.9.1\" type=\"pc\"/>"
+	                       "<feature var=\"http://jabber.org/protocol/disco#info\"/>"
+	                       "<feature var=\"http://jabber.org/protocol/caps\"/>"
+	                       "<feature var=\"http://jabber.org/protocol/muc\"/>"
+	                       "<feature var=\"http://jabber.org/protocol/disco#items\"/></query>", 0);
+	ver = jabber_caps_hash(query);
+	fail_unless(g_strcmp0(ver, "QgayPKawpkPSDYmwT/WM94uAlu0=") == 0, "Got: %s", ver);
+	g_free(ver);
+
+	/* Duplicate features aren't allowed. */
+	xt_add_child(query, xt_from_string("<feature var=\"http://jabber.org/protocol/muc\"/>", 0));
+	fail_if(jabber_caps_hash(query));
+	xt_free_node(query);
+
+	query = xt_from_string("<query xmlns=\"http://jabber.org/protocol/disco#info\">"
+	                       "<identity xml:lang=\"en\" category=\"client\" name=\"Psi 0.11\" type=\"pc\"/>"
+	                       "<identity xml:lang=\"el\" category=\"client\" name=\"\xce\xa8 0.11\" type=\"pc\"/>"
+	                       "<feature var=\"http://jabber.org/protocol/caps\"/>"
+	                       "<feature var=\"http://jabber.org/protocol/disco#info\"/>"
+	                       "<feature var=\"http://jabber.org/protocol/disco#items\"/>"
+	                       "<feature var=\"http://jabber.org/protocol/muc\"/>"
+	                       "<x xmlns=\"jabber:x:data\" type=\"result\">"
+	                       "<field var=\"FORM_TYPE\" type=\"hidden\"><value>urn:xmpp:dataforms:softwareinfo</value></field>"
+	                       "<field var=\"ip_version\"><value>ipv4</value><value>ipv6</value></field>"
+	                       "<field var=\"os\"><value>Mac</value></field>"
+	                       "<field var=\"os_version\"><value>10.5.1</value></field>"
+	                       "<field var=\"software\"><value>Psi</value></field>"
+	                       "<field var=\"software_version\"><value>0.11</value></field>"
+	                       "</x></query>", 0);
+	ver = jabber_caps_hash(query);
+	fail_unless(g_strcmp0(ver, "q07IKJEyjvHSyhy//CH0CxmKi8w=") == 0, "Got: %s", ver);
+	g_free(ver);
+	xt_free_node(query);
+}
+
+static struct jabber_caps *check_caps_add(int i)
+{
+	struct xt_node *query, *c;
+	struct jabber_caps *caps;
+	char var[32];
+
+	g_snprintf(var, sizeof(var), "urn:check:%d", i);
+	c = xt_new_node("feature", NULL, NULL);
+	xt_add_attr(c, "var", var);
+	query = xt_new_node("query", NULL, c);
+	xt_add_attr(query, "xmlns", XMLNS_DISCO_INFO);
+
+	caps = jabber_caps_add(query);
+	xt_free_node(query);
+
+	return caps;
+}
+
+static int check_caps_presence(char *jid, int i)
+{
+	struct jabber_data *jd = ic->proto_data;
+	struct jabber_buddy *bud;
+	struct xt_node *c;
+	gsize len = jd->txq->len;
+	char ver[32];
+
+	g_snprintf(ver, sizeof(ver), "ver%d", i);
+	c = xt_new_node("c", NULL, NULL);
+	xt_add_attr(c, "xmlns", XMLNS_CAPS);
+	xt_add_attr(c, "hash", "sha-1");
+	xt_add_attr(c, "node", "http://example.com/");
+	xt_add_attr(c, "ver", ver);
+
+	if (!(bud = jabber_buddy_by_jid(ic, jid, 0))) {
+		bud = jabber_buddy_add(ic, jid);
+	}
+	jabber_caps_presence(ic, bud, c);
+	xt_free_node(c);
+
+	/* Did it send a query? */
+	return jd->txq->len > len;
+}
+
+/* The least recently used entries go first, but buddies keep theirs. */
+static void check_caps_cache(int l)
+{
+	struct jabber_data *jd = ic->proto_data;
+	struct jabber_buddy *bud;
+	struct jabber_caps *first, *second;
+	char *first_ver, *second_ver, dir[] = "/tmp/bitlbee-check-XXXXXX";
+	char jid[64];
+	int i;
+
+	/* Don't use (or write) a real cache file. */
+	fail_unless(mkdtemp(dir) != NULL);
+	g_free(global.conf->configdir);
+	global.conf->configdir = g_strdup_printf("%s/", dir);
+
+	first = check_caps_add(0);
+	first_ver = g_strdup(first->ver);
+	bud = jabber_buddy_add(ic, "caps@example.com/a");
+	jabber_buddy_set_caps(bud, first);
+	second = check_caps_add(1);
+	second_ver = g_strdup(second->ver);
+	for (i = 2; i < JABBER_CAPS_MAX_ENTRIES; i++) {
+		check_caps_add(i);
+	}
+
+	fail_unless(jabber_caps_by_ver(second_ver) == second);
+	check_caps_add(i);
+	fail_if(jabber_caps_by_ver(first_ver));
+	fail_unless(jabber_caps_by_ver(second_ver) == second);
+	fail_unless(jabber_caps_has_feature(jabber_buddy_caps(bud), "urn:check:0"));
+	fail_unless(jabber_buddy_remove(ic, "caps@example.com/a"));
+
+	first = check_caps_add(0);
+	fail_unless(strcmp(first->ver, first_ver) == 0);
+	fail_unless(jabber_caps_by_ver(first_ver) == first);
+
+	/* Unanswered queries are forgotten too, the oldest first. */
+	jd->fd = -1;
+	jd->txq = g_string_new("");
+	for (i = 0; i <= JABBER_CAPS_MAX_PENDING; i++) {
+		g_snprintf(jid, sizeof(jid), "pending%d@example.com/a", i);
+		fail_unless(check_caps_presence(jid, i));
+	}
+	fail_unless(check_caps_presence("pending@example.com/a", 0));
+	fail_if(check_caps_presence("pending@example.com/b", JABBER_CAPS_MAX_PENDING));
+
+	g_free(first_ver);
+	g_free(second_ver);
+	rmdir(dir);
+}
+
+static xt_status check_cache_event(struct im_connection *ic, struct xt_node *node, gpointer data)
+{
+	(*(int *) data)++;
+	return XT_HANDLED;
+}
+
+static int check_cache_freed;
+
+static void check_cache_free(gpointer data)
+{
+	check_cache_freed++;
+}
+
+static void check_cache(int l)
+{
+	struct jabber_data *jd = ic->proto_data;
+	struct xt_node *a, *b, *reply;
+	int called = 0;
+
+	a = jabber_make_packet("iq", "get", "a@example.com", NULL);
+	b = jabber_make_packet("iq", "get", "b@example.com", NULL);
+	jabber_cache_add_ctx(ic, a, check_cache_event, &called, check_cache_free);
+	jabber_cache_add_ctx(ic, b, check_cache_event, &called, check_cache_free);
+	fail_unless(strncmp(xt_find_attr(a, "id"), JABBER_CACHED_ID, strlen(JABBER_CACHED_ID)) == 0);
+	fail_if(strcmp(xt_find_attr(a, "id"), xt_find_attr(b, "id")) == 0);
+	fail_unless(g_hash_table_size(jd->node_cache) == 2);
+
+	/* Every response is handled only once. */
+	reply = jabber_make_packet("iq", "result", NULL, NULL);
+	xt_add_attr(reply, "id", xt_find_attr(a, "id"));
+	jabber_cache_handle_packet(ic, reply);
+	jabber_cache_handle_packet(ic, reply);
+	fail_unless(called == 1);
+	fail_unless(check_cache_freed == 1);
+	fail_unless(g_hash_table_size(jd->node_cache) == 1);
+	fail_unless(g_queue_get_length(jd->node_cache_order) == 1);
+	xt_free_node(reply);
+
+	/* Nothing expired yet. */
+	jabber_cache_clean(ic);
+	fail_unless(g_hash_table_size(jd->node_cache) == 1);
+
+	((struct jabber_cache_entry *) g_queue_peek_head(jd->node_cache_order))->saved_at -= JABBER_CACHE_MAX_AGE + 1;
+	jabber_cache_clean(ic);
+	fail_unless(g_hash_table_size(jd->node_cache) == 0);
+	fail_unless(g_queue_is_empty(jd->node_cache_order));
+	fail_unless(check_cache_freed == 2);
+	fail_unless(called == 1);
+
+	xt_free_node(a);
+	xt_free_node(b);
+}
+
+static int check_chat_added;
+
+static gboolean check_chat_add_users(bee_t *bee, struct groupchat *c, GSList *users)
+{
+	check_chat_added += g_slist_length(users);
+	return TRUE;
+}
+
+static const struct bee_ui_funcs check_chat_ui = {
+	.chat_add_users = check_chat_add_users,
+};
+
+static void check_chat_presence(const char *xml)
+{
+	struct xt_node *node = xt_from_string(xml, 0);
+
+	jabber_pkt_presence(node, ic);
+	xt_free_node(node);
+}
+
+/* Occupants are only added once our own presence (status 110) is in, even
+   if the room changed our nick (status 210). */
+static void check_chat_join(int l)
+{
+	struct jabber_data *jd = ic->proto_data;
+	struct jabber_chat *jc;
+	struct groupchat *c;
+
+	ic->bee = bee_new();
+	ic->bee->ui = &check_chat_ui;
+	ic->acc->user = "me@example.com";
+	ic->acc->prpl = g_new0(struct prpl, 1);
+	ic->acc->prpl->handle_cmp = g_strcasecmp;
+	jd->me = g_strdup("me@example.com");
+	jd->chats = g_hash_table_new(jabber_jid_hash, jabber_jid_equal);
+
+	jc = g_new0(struct jabber_chat, 1);
+	jc->name = g_strdup("room@muc.example.com");
+	jc->me = jabber_buddy_add(ic, "room@muc.example.com/Me");
+	jc->my_full_jid = g_strdup("room@muc.example.com/Me");
+	c = imcb_chat_new(ic, "room@muc.example.com");
+	c->data = jc;
+	g_hash_table_insert(jd->chats, jc->name, c);
+
+	check_chat_presence("<presence from=\"room@muc.example.com/alice\">"
+	                    "<x xmlns=\"" XMLNS_MUC_USER "\"><item role=\"participant\"/></x></presence>");
+	check_chat_presence("<presence from=\"room@muc.example.com/bob\">"
+	                    "<x xmlns=\"" XMLNS_MUC_USER "\"><item role=\"participant\"/></x></presence>");
+	fail_if(c->joined);
+	fail_unless(check_chat_added == 0);
+
+	check_chat_presence("<presence from=\"room@muc.example.com/Me (2)\">"
+	                    "<x xmlns=\"" XMLNS_MUC_USER "\"><item role=\"participant\"/>"
+	                    "<status code=\"110\"/><status code=\"210\"/></x></presence>");
+	fail_unless(c->joined);
+	fail_unless(check_chat_added == 3);
+	fail_unless(jc->me == jabber_buddy_by_jid(ic, "room@muc.example.com/Me (2)", GET_BUDDY_EXACT));
+	fail_unless(strcmp(jc->my_full_jid, "room@muc.example.com/Me (2)") == 0);
+	fail_if(jabber_buddy_by_jid(ic, "room@muc.example.com/Me", GET_BUDDY_EXACT));
+	fail_if(jc->joining);
+
+	jabber_chat_free(c);
+}
+
 Suite *jabber_util_suite(void)
 {
 	Suite *s = suite_create("jabber/util");
@@ -132,13 +456,21 @@ Suite *jabber_util_suite(void)
 	ic = g_new0(struct im_connection, 1);
 	ic->acc = g_new0(account_t, 1);
 	ic->proto_data = jd = g_new0(struct jabber_data, 1);
-	jd->buddies = g_hash_table_new(g_str_hash, g_str_equal);
+	jd->buddies = g_hash_table_new(jabber_jid_hash, jabber_jid_equal);
+	jd->node_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, jabber_cache_entry_free);
+	jd->node_cache_order = g_queue_new();
 	set_add(&ic->acc->set, "resource_select", "priority", NULL, ic->acc);
 	set_add(&ic->acc->set, "activity_timeout", "120", NULL, ic->acc);
 
 	suite_add_tcase(s, tc_core);
 	tcase_add_test(tc_core, check_buddy_add);
+	tcase_add_test(tc_core, check_buddy_many);
 	tcase_add_test(tc_core, check_compareJID);
 	tcase_add_test(tc_core, check_hipchat_slug);
+	tcase_add_test(tc_core, check_roster_cache_apply);
+	tcase_add_test(tc_core, check_caps_hash);
+	tcase_add_test(tc_core, check_cache);
+	tcase_add_test(tc_core, check_caps_cache);
+	tcase_add_test(tc_core, check_chat_join);
 	return s;
 }
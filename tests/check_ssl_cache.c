@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <glib.h>
+#include <gmodule.h>
+#include <check.h>
+#include <string.h>
+#include <stdio.h>
+#include "ssl_client.h"
+
+static void check_key(int l)
+{
+	char *key;
+
+	key = ssl_cache_key("example.com", 443, TRUE);
+	fail_unless(strcmp(key, "example.com:443:1") == 0);
+	g_free(key);
+
+	key = ssl_cache_key("example.com", 0, FALSE);
+	fail_unless(strcmp(key, "example.com:0:0") == 0);
+	g_free(key);
+
+	fail_unless(ssl_cache_key(NULL, 443, FALSE) == NULL);
+}
+
+static void check_store(int l)
+{
+	struct ssl_cache_stats st1, st2;
+	const char *data;
+	size_t len;
+	char key[32];
+	int i;
+
+	ssl_cache_store("a:443:0", "first", 5);
+	ssl_cache_store("a:443:0", "second", 6);
+	data = ssl_cache_lookup("a:443:0", &len);
+	fail_unless(data && len == 6 && memcmp(data, "second", 6) == 0);
+
+	fail_unless(ssl_cache_lookup("b:443:0", &len) == NULL);
+	fail_unless(ssl_cache_lookup(NULL, &len) == NULL);
+
+	ssl_cache_remove("a:443:0");
+	fail_unless(ssl_cache_lookup("a:443:0", &len) == NULL);
+
+	/* A new trust store only affects sessions that were verified. */
+	ssl_cache_store("a:443:0", "plain", 5);
+	ssl_cache_store("a:443:1", "verified", 8);
+	ssl_cache_flush();
+	fail_unless(ssl_cache_lookup("a:443:0", &len) != NULL);
+	fail_unless(ssl_cache_lookup("a:443:1", &len) == NULL);
+	ssl_cache_remove("a:443:0");
+
+	/* Oldest ones go first. */
+	for (i = 0; i <= SSL_CACHE_MAX_ENTRIES; i++) {
+		g_snprintf(key, sizeof(key), "host%d:443:0", i);
+		ssl_cache_store(key, key, strlen(key));
+	}
+	fail_unless(ssl_cache_lookup("host0:443:0", &len) == NULL);
+	fail_unless(ssl_cache_lookup("host1:443:0", &len) != NULL);
+	g_snprintf(key, sizeof(key), "host%d:443:0", SSL_CACHE_MAX_ENTRIES);
+	fail_unless(ssl_cache_lookup(key, &len) != NULL);
+
+	ssl_cache_stats(&st1);
+	fail_unless(st1.entries == SSL_CACHE_MAX_ENTRIES);
+	ssl_cache_count(TRUE, FALSE);
+	ssl_cache_count(FALSE, TRUE);
+	ssl_cache_stats(&st2);
+	fail_unless(st2.handshakes == st1.handshakes + 2);
+	fail_unless(st2.resumed == st1.resumed + 1);
+	fail_unless(st2.ktls == st1.ktls + 1);
+}
+
+static void check_verify(int l)
+{
+	const unsigned char fp1[] = { 0x01, 0x02, 0x03 }, fp2[] = { 0x01, 0x02, 0x04 };
+	struct ssl_cache_stats st1, st2;
+	time_t later = time(NULL) + 600;
+
+	ssl_cache_stats(&st1);
+
+	ssl_verify_cache_store(fp1, sizeof(fp1), "Example.com", later);
+	fail_unless(ssl_verify_cache_lookup(fp1, sizeof(fp1), "example.com"));
+	fail_unless(ssl_verify_cache_lookup(fp1, sizeof(fp1), "EXAMPLE.COM"));
+	fail_if(ssl_verify_cache_lookup(fp1, sizeof(fp1), "example.org"));
+	fail_if(ssl_verify_cache_lookup(fp2, sizeof(fp2), "example.com"));
+	fail_if(ssl_verify_cache_lookup(fp1, 0, "example.com"));
+
+	/* Already expired, so not worth remembering. */
+	ssl_verify_cache_store(fp2, sizeof(fp2), "example.com", time(NULL) - 1);
+	fail_if(ssl_verify_cache_lookup(fp2, sizeof(fp2), "example.com"));
+
+	ssl_cache_stats(&st2);
+	fail_unless(st2.verified == st1.verified + 1);
+	fail_unless(st2.verify_hits == st1.verify_hits + 2);
+
+	ssl_verify_cache_flush();
+	fail_if(ssl_verify_cache_lookup(fp1, sizeof(fp1), "example.com"));
+	ssl_cache_stats(&st2);
+	fail_unless(st2.verified == 0);
+}
+
+Suite *ssl_cache_suite(void)
+{
+	Suite *s = suite_create("SSL cache");
+	TCase *tc_core = tcase_create("Core");
+
+	suite_add_tcase(s, tc_core);
+	tcase_add_test(tc_core, check_key);
+	tcase_add_test(tc_core, check_store);
+	tcase_add_test(tc_core, check_verify);
+	return s;
+}
@@ -3,6 +3,7 @@
 #include <gmodule.h>
 #include <check.h>
 #include <string.h>
+#include <unistd.h>
 #include "irc.h"
 #include "set.h"
 #include "misc.h"
@@ -209,6 +210,31 @@ for (i = 0; split_tests[i].command; i++) {
 }
 END_TEST
 
+START_TEST(test_write_file_atomic)
+char *dir = g_strdup("/tmp/bitlbee-check-XXXXXX");
+char *path, *data;
+gsize len;
+
+fail_unless(mkdtemp(dir) != NULL);
+path = g_strdup_printf("%s/file", dir);
+
+fail_unless(write_file_atomic(path, "first", 5));
+fail_unless(write_file_atomic(path, "second", 6));
+fail_unless(g_file_get_contents(path, &data, &len, NULL));
+fail_unless(len == 6 && strcmp(data, "second") == 0);
+g_free(data);
+unlink(path);
+
+/* Nothing left behind if it can't be written. */
+g_free(path);
+path = g_strdup_printf("%s/nonexistent/file", dir);
+fail_if(write_file_atomic(path, "x", 1));
+
+fail_unless(rmdir(dir) == 0);
+g_free(path);
+g_free(dir);
+END_TEST
+
 Suite *util_suite(void)
 {
 	Suite *s = suite_create("Util");
@@ -225,5 +251,6 @@ Suite *util_suite(void)
 	tcase_add_test(tc_core, test_word_wrap);
 	tcase_add_test(tc_core, test_http_encode);
 	tcase_add_test(tc_core, test_split_command_parts);
+	tcase_add_test(tc_core, test_write_file_atomic);
 	return s;
 }
@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <glib.h>
+#include <gmodule.h>
+#include <check.h>
+#include <string.h>
+#include "xmltree.h"
+
+START_TEST(test_parse_simple_xml)
+{
+	struct xt_node *node = xt_from_string("<foo bar=\"1\"><bar/><ns:baz xmlns:ns=\"urn:x\"/></foo>", 0);
+
+	fail_if(node == NULL);
+	fail_unless(strcmp(node->name, "foo") == 0);
+	fail_unless(node->children_count == 2);
+	fail_unless(strcmp(node->children_tail->name, "ns:baz") == 0);
+	xt_free_node(node);
+}
+END_TEST
+
+START_TEST(test_find_case_insensitive)
+{
+	struct xt_node *node = xt_from_string("<foo Bar=\"1\"><Bar/><ns:baz xmlns:ns=\"urn:x\"/></foo>", 0);
+
+	fail_unless(xt_find_node(node->children, "bar") == node->children);
+	fail_unless(xt_find_node(node->children, "BAZ") == node->children->next);
+	fail_unless(strcmp(xt_find_attr(node, "bar"), "1") == 0);
+	fail_unless(strcmp(xt_find_attr(node->children->next, "xmlns"), "urn:x") == 0);
+	fail_if(xt_find_node(node->children, "nonexistent"));
+	fail_if(xt_find_attr(node, "nonexistent"));
+	xt_free_node(node);
+}
+END_TEST
+
+START_TEST(test_wide_node)
+{
+	struct xt_node *query = xt_new_node("query", NULL, NULL), *c, *last;
+	char jid[16];
+	int i, n;
+
+	for (i = 0; i < XT_INDEX_MIN_CHILDREN * 4; i++) {
+		c = xt_new_node(i % 2 ? "item" : "group", NULL, NULL);
+		g_snprintf(jid, sizeof(jid), "%d", i);
+		xt_add_attr(c, "jid", jid);
+		xt_add_child(query, c);
+	}
+	fail_unless(query->children_count == XT_INDEX_MIN_CHILDREN * 4);
+
+	c = xt_find_node(query->children, "item");
+	fail_unless(c && strcmp(xt_find_attr(c, "jid"), "1") == 0);
+	fail_if(query->index == NULL);
+
+	g_snprintf(jid, sizeof(jid), "%d", XT_INDEX_MIN_CHILDREN * 4 - 1);
+	c = xt_find_node_by_attr(query->children, "item", "jid", jid);
+	fail_unless(c == query->children_tail);
+	fail_if(xt_find_node_by_attr(query->children, "item", "jid", "0"));
+
+	/* Appends have to show up in the index too. */
+	xt_add_child(query, last = xt_new_node("last", NULL, NULL));
+	fail_unless(xt_find_node(query->children, "last") == last);
+
+	xt_insert_child(query, xt_new_node("first", NULL, NULL));
+	fail_unless(xt_find_node(query->children, "last") == last);
+	fail_unless(xt_find_node(query->children, "first") == query->children);
+
+	for (n = 0, c = query->children; (c = xt_find_node(c, "item")); c = c->next) {
+		n++;
+	}
+	fail_unless(n == XT_INDEX_MIN_CHILDREN * 2);
+
+	/* And removals, without starting over. */
+	c = xt_find_node(query->children, "item");
+	xt_remove_child(query, c);
+	xt_free_node(c);
+	xt_remove_child(query, last);
+	xt_free_node(last);
+	fail_if(query->index == NULL);
+	c = xt_find_node(query->children, "item");
+	fail_unless(c && strcmp(xt_find_attr(c, "jid"), "3") == 0);
+	fail_if(xt_find_node(query->children, "last"));
+	fail_unless(xt_find_node(query->children, "group") == query->children->next);
+
+	/* Emptying it from the front, like jabber_roster_stream_iq() does. */
+	while ((c = query->children)) {
+		xt_remove_child(query, c);
+		xt_free_node(c);
+		for (last = query->children; last && strcmp(last->name, "item") != 0; last = last->next) {
+			;
+		}
+		fail_unless(xt_find_node(query->children, "item") == last);
+	}
+	fail_unless(query->children_count == 0);
+
+	xt_free_node(query);
+}
+END_TEST
+
+static GString *handled;
+
+static xt_status handle_any(struct xt_node *node, gpointer data)
+{
+	g_string_append_printf(handled, "any:%s ", node->name);
+	return XT_NEXT;
+}
+
+static xt_status handle_item(struct xt_node *node, gpointer data)
+{
+	g_string_append_printf(handled, "item:%s ", node->parent ? node->parent->name : "-");
+	return XT_HANDLED;
+}
+
+static xt_status handle_root(struct xt_node *node, gpointer data)
+{
+	g_string_append(handled, "root ");
+	return XT_HANDLED;
+}
+
+static const struct xt_handler_entry test_handlers[] = {
+	{ NULL,         "stream",       handle_any },
+	{ "Item",       "stream",       handle_item },
+	{ "item",       NULL,           handle_item },
+	{ "stream",     "<root>",       handle_root },
+	{ NULL,         NULL,           NULL }
+};
+
+START_TEST(test_handler_dispatch)
+{
+	struct xt_parser *xt = xt_new(test_handlers, NULL);
+	const char *in = "<stream><item/><other><ITEM/></other><foo/></stream>";
+
+	handled = g_string_new("");
+	fail_unless(xt_feed(xt, in, strlen(in)) == 0);
+	fail_unless(xt_handle(xt, NULL, -1) == 1);
+	fail_unless(strcmp(handled->str, "any:item item:stream item:other any:other any:foo root ") == 0);
+
+	g_string_free(handled, TRUE);
+	xt_free(xt);
+}
+END_TEST
+
+static GSList *streamed;
+
+static xt_status stream_item(struct xt_node *node, gpointer data)
+{
+	if (xt_find_attr(node, "keep")) {
+		return XT_NEXT;
+	}
+
+	/* The tree must not have grown while we weren't looking. */
+	fail_unless(node->parent->children_count == 1);
+	streamed = g_slist_append(streamed, node);
+	return XT_HANDLED;
+}
+
+static const struct xt_handler_entry stream_handlers[] = {
+	{ "item",       "query",        stream_item },
+	{ NULL,         NULL,           NULL }
+};
+
+START_TEST(test_stream_handlers)
+{
+	struct xt_parser *xt = xt_new(NULL, NULL);
+	const char *in = "<iq><query><item n='1'><group>a</group></item><item n='2'/>"
+	                 "<item n='3' keep='1'/><other><item n='4'/></other></query></iq>";
+	struct xt_node *query;
+	GSList *l;
+	int i;
+
+	xt_set_stream_handlers(xt, stream_handlers);
+	streamed = NULL;
+
+	/* One byte at a time, so every item completes in a separate call. */
+	for (i = 0; in[i]; i++) {
+		fail_unless(xt_feed(xt, in + i, 1) == (in[i + 1] != 0));
+	}
+
+	fail_unless(g_slist_length(streamed) == 2);
+	fail_unless(strcmp(xt_find_attr(streamed->data, "n"), "1") == 0);
+	fail_unless(strcmp(xt_find_attr(streamed->next->data, "n"), "2") == 0);
+	fail_unless(xt_find_node(((struct xt_node *) streamed->data)->children, "group") != NULL);
+
+	query = xt_find_node(xt->root->children, "query");
+	fail_unless(query->children_count == 2);
+	fail_unless(strcmp(xt_find_attr(query->children, "n"), "3") == 0);
+	fail_unless(xt_find_node(query->children_tail->children, "item") != NULL);
+
+	for (l = streamed; l; l = l->next) {
+		fail_unless(((struct xt_node *) l->data)->parent == NULL);
+		xt_free_node(l->data);
+	}
+	g_slist_free(streamed);
+	xt_free(xt);
+}
+END_TEST
+
+/* Differential test: the builtin tokenizer has to accept (and reject)
+   exactly what GMarkup does, and build the same tree, no matter how the
+   input is chopped up. */
+static const char *fuzz_seeds[] = {
+	"<?xml version='1.0'?><stream:stream xmlns='jabber:client' "
+	"xmlns:stream=\"http://etherx.jabber.org/streams\" id=\"x1\" version='1.0'>"
+	"<message from=\"a@b/c\" to='d@e' type=\"chat\"><body>Hi &amp; &lt;there&gt; "
+	"&#233;&#x1F600;\r\nbye</body></message><presence/>"
+	"<iq type=\"result\" id=\"1\"><query xmlns=\"jabber:iq:roster\">"
+	"<item jid=\"x@y\" name=\"&quot;X&apos;\r\n\tY\"><group>G</group></item></query></iq>"
+	"<!-- comment --><![CDATA[<x>]]></stream:stream>",
+	"<!DOCTYPE a [<!ENTITY x \"y\">]>\n<a b = '1'>t<?pi x?>u<b\n/></a>\n",
+	"<\xc3\xa9 \xc3\xbc=\"\xc3\xb6\">\xc3\xb1\xe2\x82\xac</\xc3\xa9>",
+	NULL
+};
+
+static const char *fuzz_bits[] = {
+	"<", ">", "/", "=", "\"", "'", "&", ";", "#", "x", "!", "?", "-", "[", "]", ":",
+	".", " ", "\t", "\r", "\n", "a", "Z", "0", "_", "\xc3\xa9", "\xe2\x82\xac", "\xff",
+	"&amp;", "&#10;", "&#x41;", "<!--", "-->", "</a>", "<a>", "<a/>",
+};
+
+static int fuzz_feed(struct xt_parser *xt, GRand *r, const char *in, int len)
+{
+	int st = 1, n;
+
+	while (len > 0 && st >= 0) {
+		n = g_rand_int_range(r, 1, 17);
+		n = MIN(n, len);
+		st = xt_feed(xt, in, n);
+		in += n;
+		len -= n;
+	}
+
+	return st;
+}
+
+START_TEST(test_tokenizer_differential)
+{
+	GRand *r = g_rand_new_with_seed(1);
+	GString *in = g_string_new("");
+	int i, j;
+
+	for (i = 0; i < 5000; i++) {
+		struct xt_parser *builtin = xt_new(NULL, NULL), *gmarkup = xt_new(NULL, NULL);
+		int st_b, st_g;
+
+		xt_set_tokenizer(builtin, XT_TOKENIZER_BUILTIN);
+		xt_set_tokenizer(gmarkup, XT_TOKENIZER_GMARKUP);
+
+		g_string_assign(in, fuzz_seeds[i % (G_N_ELEMENTS(fuzz_seeds) - 1)]);
+		for (j = g_rand_int_range(r, 0, 5); j > 0; j--) {
+			int pos = g_rand_int_range(r, 0, in->len + 1);
+			int n = g_rand_int_range(r, 0, 32), from;
+			const char *bit = fuzz_bits[g_rand_int_range(r, 0, G_N_ELEMENTS(fuzz_bits))];
+
+			switch (g_rand_int_range(r, 0, 4)) {
+			case 0:
+				g_string_insert(in, pos, bit);
+				break;
+			case 1:
+				g_string_erase(in, pos, MIN(in->len - pos, n / 4 + 1));
+				break;
+			case 2:
+				from = g_rand_int_range(r, 0, pos + 1);
+				g_string_insert_len(in, pos, in->str + from, MIN(in->len - from, n));
+				break;
+			case 3:
+				g_string_truncate(in, pos);
+				break;
+			}
+		}
+
+		st_b = fuzz_feed(builtin, r, in->str, in->len);
+		st_g = fuzz_feed(gmarkup, r, in->str, in->len);
+
+		if ((st_b < 0) != (st_g < 0)) {
+			fail("Tokenizers disagree (%s vs %s) on: %s",
+			     builtin->gerr ? builtin->gerr->message : "OK",
+			     gmarkup->gerr ? gmarkup->gerr->message : "OK", in->str);
+		} else if (st_b >= 0) {
+			char *xml_b = builtin->root ? xt_to_string(builtin->root) : NULL;
+			char *xml_g = gmarkup->root ? xt_to_string(gmarkup->root) : NULL;
+
+			fail_unless(st_b == st_g && (builtin->cur == NULL) == (gmarkup->cur == NULL) &&
+			            g_strcmp0(xml_b, xml_g) == 0,
+			            "Tokenizers build different trees from: %s", in->str);
+			g_free(xml_b);
+			g_free(xml_g);
+		}
+
+		xt_free(builtin);
+		xt_free(gmarkup);
+	}
+
+	g_string_free(in, TRUE);
+	g_rand_free(r);
+}
+END_TEST
+
+/* Reads from the Jabber code are up to 64 KiB, usually ending in the middle
+   of a stanza. The buffer has to settle instead of being reallocated for
+   every read. */
+START_TEST(test_big_reads)
+{
+	struct xt_parser *xt = xt_new(NULL, NULL);
+	const char *msg = "<message><body>Lorem ipsum dolor sit amet</body></message>";
+	GString *in = g_string_new("<stream>");
+	char *buf = NULL;
+	int i, size = 0, pos = 0;
+
+	xt_set_tokenizer(xt, XT_TOKENIZER_BUILTIN);
+	while (in->len < 16 * 65536) {
+		g_string_append(in, msg);
+	}
+
+	for (i = 0; pos + 65536 <= in->len; i++, pos += 65536) {
+		fail_unless(xt_feed(xt, in->str + pos, 65536) == 1);
+		fail_unless(xt->buf_len - xt->buf_pos < strlen(msg));
+		if (i == 1) {
+			buf = xt->buf;
+			size = xt->buf_size;
+		} else if (i > 1) {
+			fail_unless(xt->buf == buf && xt->buf_size == size);
+		}
+		xt_handle(xt, NULL, 1);
+		xt_cleanup(xt, NULL, 1);
+	}
+	fail_unless(xt_feed(xt, in->str + pos, in->len - pos) == 1);
+	fail_unless(xt->root->children_count < 4);
+
+	/* One huge stanza doesn't get to keep its buffer. */
+	g_string_truncate(in, 0);
+	g_string_append(in, "<message id='");
+	while (in->len < 1024 * 1024) {
+		g_string_append(in, "Lorem ipsum ");
+	}
+	g_string_append(in, "'/>");
+	fail_unless(xt_feed(xt, in->str, in->len) == 1);
+	fail_unless(xt->buf_len == 0 && xt->buf_size == size);
+
+	g_string_free(in, TRUE);
+	xt_free(xt);
+}
+END_TEST
+
+Suite *xmltree_suite(void)
+{
+	Suite *s = suite_create("XMLTree");
+	TCase *tc_core = tcase_create("Core");
+
+	suite_add_tcase(s, tc_core);
+	tcase_add_test(tc_core, test_parse_simple_xml);
+	tcase_add_test(tc_core, test_find_case_insensitive);
+	tcase_add_test(tc_core, test_wide_node);
+	tcase_add_test(tc_core, test_handler_dispatch);
+	tcase_add_test(tc_core, test_stream_handlers);
+	tcase_add_test(tc_core, test_tokenizer_differential);
+	tcase_add_test(tc_core, test_big_reads);
+	return s;
+}